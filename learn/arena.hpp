@@ -0,0 +1,282 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+
+/**
+ * Huge-page, NUMA-local arenas
+ * ============================
+ *
+ * A hash table or ring of a few GB spread over 4KB pages needs a million
+ * page-table entries; random access misses the TLB almost every time and
+ * each miss is a page walk of up to four more memory loads. On a machine
+ * with several NUMA nodes, pages also land on whichever node first touched
+ * them, so a structure filled by one thread and used by another may be
+ * remote for all of its life.
+ *
+ * An arena reserves one region up front and hands out pieces of it with a
+ * lock-free bump pointer. Nothing is freed individually; the whole region
+ * goes away with the arena. That fits the structures it is meant for -
+ * tables, rings, buffer pools - which are sized once and live long.
+ *
+ * Backing, best first:
+ *  1. MAP_HUGETLB: explicit 2MB pages. Needs pages reserved in
+ *     /proc/sys/vm/nr_hugepages; the mmap fails cleanly if there aren't
+ *     enough.
+ *  2. madvise(MADV_HUGEPAGE): transparent huge pages. The region is aligned
+ *     to 2MB so the kernel can use huge pages for all of it. Works unless THP
+ *     is set to "never".
+ *  3. Plain 4KB pages.
+ *
+ * NUMA: the region is mbind()ed with MPOL_PREFERRED to the node of the
+ * thread creating the arena (or a node given explicitly) before anything
+ * touches it. Preferred rather than strict so that a full node spills over
+ * instead of failing. On a single-node machine, or where mbind isn't allowed
+ * (containers often block it), the arena just skips this step.
+*/
+
+struct arena_options
+{
+    bool huge_pages;
+    bool numa_local;
+    // -1: the node of the thread constructing the arena
+    int node;
+
+    arena_options():
+        huge_pages(true),numa_local(true),node(-1)
+    {}
+};
+
+class arena
+{
+public:
+    enum backing_kind { hugetlb_pages, transparent_huge_pages, normal_pages };
+
+    static std::size_t const huge_page_size=std::size_t(2)<<20;
+
+private:
+    char* base;
+    std::size_t mapped;
+    std::size_t const capacity_;
+    std::atomic<std::size_t> offset;
+    backing_kind backing_;
+    int bound_node;
+
+    static std::size_t round_up(std::size_t n,std::size_t to)
+    {
+        return (n+to-1)/to*to;
+    }
+
+    void map(std::size_t bytes,bool huge_pages)
+    {
+        if(huge_pages)
+        {
+            mapped=round_up(bytes,huge_page_size);
+            void* const p=mmap(nullptr,mapped,PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+            if(p!=MAP_FAILED)
+            {
+                base=static_cast<char*>(p);
+                backing_=hugetlb_pages;
+                return;
+            }
+        }
+
+        // Over-map by one huge page and trim, so the region starts on a 2MB
+        // boundary and THP can back all of it
+        mapped=round_up(bytes,huge_page_size);
+        std::size_t const padded=mapped+huge_page_size;
+        void* const p=mmap(nullptr,padded,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(p==MAP_FAILED)
+            throw std::bad_alloc();
+        char* const raw=static_cast<char*>(p);
+        char* const aligned=reinterpret_cast<char*>(
+            round_up(reinterpret_cast<std::uintptr_t>(raw),huge_page_size));
+        if(aligned>raw)
+            munmap(raw,aligned-raw);
+        if(raw+padded>aligned+mapped)
+            munmap(aligned+mapped,raw+padded-(aligned+mapped));
+        base=aligned;
+
+        // Ask for the baseline explicitly too, so THP=always doesn't blur it
+        if(huge_pages && madvise(base,mapped,MADV_HUGEPAGE)==0)
+            backing_=transparent_huge_pages;
+        else
+        {
+            madvise(base,mapped,MADV_NOHUGEPAGE);
+            backing_=normal_pages;
+        }
+    }
+
+    void bind(int node)
+    {
+        if(node<0)
+        {
+            unsigned cpu=0,current=0;
+            if(syscall(SYS_getcpu,&cpu,&current,nullptr)!=0)
+                return;
+            node=static_cast<int>(current);
+        }
+        if(node>=64)
+            return;
+        unsigned long const mask=1UL<<node;
+        int const mpol_preferred=1;
+        if(syscall(SYS_mbind,base,mapped,mpol_preferred,&mask,sizeof(mask)*8,0)==0)
+            bound_node=node;
+    }
+
+public:
+    /**
+     * Number of NUMA nodes with memory, from sysfs. 1 if that can't be read.
+    */
+    static unsigned numa_nodes()
+    {
+        DIR* const dir=opendir("/sys/devices/system/node");
+        if(!dir)
+            return 1;
+        unsigned n=0;
+        while(dirent* const e=readdir(dir))
+        {
+            if(std::strncmp(e->d_name,"node",4)==0 && e->d_name[4]>='0' && e->d_name[4]<='9')
+                ++n;
+        }
+        closedir(dir);
+        return n?n:1;
+    }
+
+    explicit arena(std::size_t capacity,arena_options const& options=arena_options()):
+        base(nullptr),mapped(0),capacity_(capacity),offset(0),
+        backing_(normal_pages),bound_node(-1)
+    {
+        map(capacity,options.huge_pages);
+        if(options.numa_local && (options.node>=0 || numa_nodes()>1))
+            bind(options.node);
+    }
+
+    ~arena()
+    {
+        munmap(base,mapped);
+    }
+
+    arena(arena const&)=delete;
+    arena& operator=(arena const&)=delete;
+
+    /**
+     * Lock-free bump allocation. Throws std::bad_alloc once the arena is
+     * full.
+    */
+    void* allocate(std::size_t bytes,std::size_t align=alignof(std::max_align_t))
+    {
+        std::size_t current=offset.load(std::memory_order_relaxed);
+        std::size_t start;
+        do
+        {
+            start=round_up(current,align);
+            if(start+bytes>capacity_ || start+bytes<start)
+                throw std::bad_alloc();
+        }
+        while(!offset.compare_exchange_weak(current,start+bytes,std::memory_order_relaxed));
+        return base+start;
+    }
+
+    /**
+     * Memory goes back when the arena is destroyed.
+    */
+    void deallocate(void*,std::size_t)
+    {}
+
+    std::size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    std::size_t used() const
+    {
+        return offset.load(std::memory_order_relaxed);
+    }
+
+    backing_kind backing() const
+    {
+        return backing_;
+    }
+
+    /**
+     * The node the region is bound to, or -1 if it wasn't bound.
+    */
+    int node() const
+    {
+        return bound_node;
+    }
+
+    std::string describe() const
+    {
+        std::string s=backing_==hugetlb_pages?"MAP_HUGETLB 2MB pages":
+                      backing_==transparent_huge_pages?"transparent huge pages":"4KB pages";
+        if(bound_node>=0)
+            s+=", bound to node "+std::to_string(bound_node);
+        else
+            s+=", not NUMA-bound";
+        return s;
+    }
+};
+
+/**
+ * STL allocator drawing from an arena, for containers that should live in
+ * one (concurrent_vector, std::vector of buffers, ...). deallocate() is a
+ * no-op; the arena must outlive the container.
+*/
+template<typename T>
+class arena_allocator
+{
+    template<typename U> friend class arena_allocator;
+    arena* a;
+public:
+    typedef T value_type;
+
+    explicit arena_allocator(arena& a_):
+        a(&a_)
+    {}
+
+    template<typename U>
+    arena_allocator(arena_allocator<U> const& other):
+        a(other.a)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(a->allocate(n*sizeof(T),alignof(T)));
+    }
+
+    void deallocate(T* p,std::size_t n)
+    {
+        a->deallocate(p,n*sizeof(T));
+    }
+
+    arena& get_arena() const
+    {
+        return *a;
+    }
+
+    template<typename U>
+    bool operator==(arena_allocator<U> const& other) const
+    {
+        return a==other.a;
+    }
+
+    template<typename U>
+    bool operator!=(arena_allocator<U> const& other) const
+    {
+        return a!=other.a;
+    }
+};
+
+#endif
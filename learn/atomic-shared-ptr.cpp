@@ -0,0 +1,159 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "atomic-shared-ptr.hpp"
+
+/**
+ * Many readers, few writers
+ * =========================
+ *
+ * Readers repeatedly take a reference to the current config object and read
+ * from it; writers occasionally publish a new one. Compares
+ * atomic_shared_ptr<T> with std::atomic_load/std::atomic_store on a
+ * std::shared_ptr<T>, which libstdc++ guards with a spinlock pool.
+*/
+
+std::atomic<long> live_objects(0);
+
+struct config
+{
+    unsigned long version;
+    unsigned long checksum;
+    explicit config(unsigned long v):
+        version(v),checksum(v*7)
+    {
+        ++live_objects;
+    }
+    ~config()
+    {
+        --live_objects;
+    }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct split_count_policy
+{
+    atomic_shared_ptr<config> current;
+    split_count_policy():
+        current(make_counted<config>(0))
+    {}
+    bool read()
+    {
+        counted_ptr<config> const p=current.load();
+        return p->checksum==p->version*7;
+    }
+    void write(unsigned long v)
+    {
+        current.store(make_counted<config>(v));
+    }
+};
+
+struct std_shared_ptr_policy
+{
+    std::shared_ptr<config> current;
+    std_shared_ptr_policy():
+        current(std::make_shared<config>(0))
+    {}
+    bool read()
+    {
+        std::shared_ptr<config> const p=std::atomic_load(&current);
+        return p->checksum==p->version*7;
+    }
+    void write(unsigned long v)
+    {
+        std::atomic_store(&current,std::make_shared<config>(v));
+    }
+};
+
+template<typename Policy>
+double reads_per_second(unsigned readers,unsigned writers,unsigned long reads)
+{
+    Policy shared;
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long> bad(0);
+    std::vector<std::thread> threads;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned r=0;r<readers;++r)
+    {
+        threads.push_back(std::thread([&]{
+            for(unsigned long i=0;i<reads;++i)
+            {
+                if(!shared.read())
+                    ++bad;
+            }
+        }));
+    }
+    std::vector<std::thread> writer_threads;
+    for(unsigned w=0;w<writers;++w)
+    {
+        writer_threads.push_back(std::thread([&,w]{
+            unsigned long v=w;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                shared.write(v+=writers);
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }));
+    }
+    for(unsigned r=0;r<readers;++r)
+        threads[r].join();
+    double const seconds=std::chrono::duration<double>(bench_clock::now()-start).count();
+    done=true;
+    for(unsigned w=0;w<writers;++w)
+        writer_threads[w].join();
+    if(bad)
+        std::cout << "  torn reads: " << bad << std::endl;
+    return readers*reads/seconds;
+}
+
+/**
+ * compare_exchange_strong/exchange must keep the counts balanced:
+ * once everything goes out of scope no config may be left alive.
+*/
+bool counts_balance()
+{
+    {
+        atomic_shared_ptr<config> a(make_counted<config>(1));
+        std::vector<std::thread> threads;
+        for(unsigned t=0;t<4;++t)
+        {
+            threads.push_back(std::thread([&,t]{
+                for(unsigned i=0;i<20000;++i)
+                {
+                    counted_ptr<config> seen=a.load();
+                    counted_ptr<config> next=make_counted<config>(seen->version+1);
+                    while(!a.compare_exchange_strong(seen,next));
+                    if(i%100==0)
+                        a.exchange(make_counted<config>(t));
+                }
+            }));
+        }
+        for(unsigned t=0;t<4;++t)
+            threads[t].join();
+    }
+    return live_objects==0;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const readers=argc>1?std::atoi(argv[1]):8;
+    unsigned const writers=argc>2?std::atoi(argv[2]):2;
+    unsigned long const reads=argc>3?std::strtoul(argv[3],nullptr,10):1000000;
+
+    atomic_shared_ptr<config> probe;
+    std::cout << "atomic_shared_ptr lock-free: " << (probe.is_lock_free()?"yes":"no") << std::endl;
+    std::cout << "reference counts balance:    " << (counts_balance()?"ok":"FAILED") << std::endl;
+
+    std::cout << std::endl << readers << " readers, " << writers << " writers, "
+              << reads << " loads per reader (loads/s)" << std::endl;
+    std::cout << "  atomic_shared_ptr:           "
+              << reads_per_second<split_count_policy>(readers,writers,reads) << std::endl;
+    std::cout << "  std::atomic_load(shared_ptr): "
+              << reads_per_second<std_shared_ptr_policy>(readers,writers,reads) << std::endl;
+    return 0;
+}
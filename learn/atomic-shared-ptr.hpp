@@ -0,0 +1,329 @@
+#ifndef ATOMIC_SHARED_PTR_HPP
+#define ATOMIC_SHARED_PTR_HPP
+
+#include <atomic>
+#include <utility>
+#include <cstring>
+
+/**
+ * Split reference counts
+ * ======================
+ *
+ * threadsafe_queue, threadsafe_stack::pop() and threadsafe_list::find_first_if()
+ * all hand out std::shared_ptr<T>. Sharing one of those between threads
+ * through std::atomic_load()/std::atomic_store() works, but libstdc++
+ * implements it with a global pool of spinlocks hashed by address, so every
+ * reader takes a lock.
+ *
+ * The trick from chapter 7's lock-free stack is to split the count in two:
+ *  - an *external* count that lives next to the pointer, in the same word,
+ *    so a reader can take a reference with a single compare-exchange on that
+ *    word without ever touching the object;
+ *  - an *internal* count inside the control block for everything else.
+ *
+ * Here the external part is a reservation: when a pointer is stored, a large
+ * batch of references is added to the internal count up front and the word
+ * records how many of them are still unclaimed. load() claims one by
+ * decrementing the word - one double-width CAS, no write to the control
+ * block - and when the pointer is replaced, the unclaimed remainder is
+ * handed back to the internal count. Readers therefore never contend on the
+ * object's refcount cache line, only on the atomic word itself.
+ *
+ * Invariant: internal count == unclaimed reservation + live counted_ptrs.
+ *
+ * A loader that sees the reservation running low tops it up by another batch
+ * (it already holds a reference, so the control block can't vanish while it
+ * does so). Running dry would need ~2^39 loads to race one top-up.
+*/
+
+template<typename T>
+struct counted_control_block
+{
+    std::atomic<long long> count;
+    T value;
+
+    template<typename... Args>
+    explicit counted_control_block(Args&&... args):
+        count(1),value(std::forward<Args>(args)...)
+    {}
+};
+
+template<typename T>
+class atomic_shared_ptr;
+
+/**
+ * Plain (non-atomic) owning handle, the equivalent of std::shared_ptr<T>.
+ * Copying it is thread-safe; the same instance must not be modified
+ * concurrently, which is what atomic_shared_ptr is for.
+*/
+template<typename T>
+class counted_ptr
+{
+    typedef counted_control_block<T> control_block;
+    control_block* cb;
+
+    explicit counted_ptr(control_block* cb_):
+        cb(cb_)
+    {}
+
+    control_block* release()
+    {
+        control_block* const p=cb;
+        cb=nullptr;
+        return p;
+    }
+
+    template<typename U> friend class atomic_shared_ptr;
+    template<typename U,typename... Args> friend counted_ptr<U> make_counted(Args&&...);
+public:
+    counted_ptr():
+        cb(nullptr)
+    {}
+
+    counted_ptr(counted_ptr const& other):
+        cb(other.cb)
+    {
+        if(cb)
+            cb->count.fetch_add(1,std::memory_order_relaxed);
+    }
+
+    counted_ptr(counted_ptr&& other):
+        cb(other.release())
+    {}
+
+    counted_ptr& operator=(counted_ptr other)
+    {
+        std::swap(cb,other.cb);
+        return *this;
+    }
+
+    ~counted_ptr()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if(cb && cb->count.fetch_sub(1,std::memory_order_acq_rel)==1)
+            delete cb;
+        cb=nullptr;
+    }
+
+    T* get() const
+    {
+        return cb?&cb->value:nullptr;
+    }
+
+    T& operator*() const
+    {
+        return cb->value;
+    }
+
+    T* operator->() const
+    {
+        return &cb->value;
+    }
+
+    explicit operator bool() const
+    {
+        return cb!=nullptr;
+    }
+
+    long long use_count() const
+    {
+        return cb?cb->count.load(std::memory_order_relaxed):0;
+    }
+};
+
+template<typename T,typename... Args>
+counted_ptr<T> make_counted(Args&&... args)
+{
+    return counted_ptr<T>(new counted_control_block<T>(std::forward<Args>(args)...));
+}
+
+template<typename T>
+class atomic_shared_ptr
+{
+    typedef counted_control_block<T> control_block;
+
+    struct alignas(16) split_count
+    {
+        control_block* ptr;
+        long long reserved;
+    };
+
+    static long long const batch=1LL<<40;
+    static long long const refill_below=batch/2;
+
+    split_count word;
+
+    /**
+     * Torn reads are fine here: the value is only used as the expected
+     * value of the next CAS, which fails and returns the real one if it
+     * was wrong. Each half is read atomically so ptr is never garbage.
+    */
+    split_count peek() const
+    {
+        split_count s;
+        s.ptr=__atomic_load_n(&word.ptr,__ATOMIC_RELAXED);
+        s.reserved=__atomic_load_n(&word.reserved,__ATOMIC_RELAXED);
+        return s;
+    }
+
+    /**
+     * Double-width compare-exchange. With -mcx16 GCC inlines this as
+     * lock cmpxchg16b; otherwise it goes through libatomic.
+    */
+    bool cas(split_count& expected,split_count const& desired)
+    {
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+        unsigned __int128 e,d;
+        std::memcpy(&e,&expected,sizeof(e));
+        std::memcpy(&d,&desired,sizeof(d));
+        unsigned __int128 const prev=__sync_val_compare_and_swap(
+            reinterpret_cast<unsigned __int128*>(&word),e,d);
+        if(prev==e)
+            return true;
+        std::memcpy(&expected,&prev,sizeof(prev));
+        return false;
+#else
+        return __atomic_compare_exchange(&word,&expected,const_cast<split_count*>(&desired),
+                                         false,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+#endif
+    }
+
+    static void drop(control_block* cb,long long refs)
+    {
+        if(cb && refs && cb->count.fetch_sub(refs,std::memory_order_acq_rel)==refs)
+            delete cb;
+    }
+
+    /**
+     * Turn the single reference held by `desired` into a full reservation.
+    */
+    static split_count reserve(counted_ptr<T>& desired)
+    {
+        split_count s;
+        s.ptr=desired.release();
+        s.reserved=0;
+        if(s.ptr)
+        {
+            s.ptr->count.fetch_add(batch-1,std::memory_order_relaxed);
+            s.reserved=batch;
+        }
+        return s;
+    }
+
+    void refill(control_block* cb,long long seen)
+    {
+        cb->count.fetch_add(batch,std::memory_order_relaxed);
+        split_count expected={cb,seen};
+        for(;;)
+        {
+            if(expected.ptr!=cb || expected.reserved>=refill_below)
+            {
+                // Replaced, or someone else topped it up already
+                drop(cb,batch);
+                return;
+            }
+            split_count const desired={cb,expected.reserved+batch};
+            if(cas(expected,desired))
+                return;
+        }
+    }
+
+public:
+    atomic_shared_ptr()
+    {
+        word.ptr=nullptr;
+        word.reserved=0;
+    }
+
+    explicit atomic_shared_ptr(counted_ptr<T> desired)
+    {
+        word=reserve(desired);
+    }
+
+    ~atomic_shared_ptr()
+    {
+        drop(word.ptr,word.reserved);
+    }
+
+    atomic_shared_ptr(atomic_shared_ptr const&)=delete;
+    atomic_shared_ptr& operator=(atomic_shared_ptr const&)=delete;
+
+    bool is_lock_free() const
+    {
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+        return true;
+#else
+        return __atomic_is_lock_free(sizeof(split_count),&word);
+#endif
+    }
+
+    counted_ptr<T> load()
+    {
+        split_count cur=peek();
+        for(;;)
+        {
+            if(!cur.ptr)
+                return counted_ptr<T>();
+            split_count const next={cur.ptr,cur.reserved-1};
+            if(cas(cur,next))
+                break;
+        }
+        if(cur.reserved-1<refill_below)
+            refill(cur.ptr,cur.reserved-1);
+        return counted_ptr<T>(cur.ptr);
+    }
+
+    counted_ptr<T> exchange(counted_ptr<T> desired)
+    {
+        split_count const next=reserve(desired);
+        split_count cur=peek();
+        while(!cas(cur,next));
+        // Keep one of the old reservation for the handle we return
+        drop(cur.ptr,cur.reserved-1);
+        return counted_ptr<T>(cur.ptr);
+    }
+
+    void store(counted_ptr<T> desired)
+    {
+        exchange(std::move(desired));
+    }
+
+    /**
+     * Compares the stored pointer only; the reservation count is not
+     * part of the value. On failure `expected` is updated like
+     * std::atomic::compare_exchange_strong.
+    */
+    bool compare_exchange_strong(counted_ptr<T>& expected,counted_ptr<T> desired)
+    {
+        split_count cur=peek();
+        for(;;)
+        {
+            if(cur.ptr!=expected.cb)
+            {
+                expected=load();
+                return false;
+            }
+            // Only build a reservation once we're about to publish
+            split_count reserved={desired.cb,0};
+            if(desired.cb)
+            {
+                desired.cb->count.fetch_add(batch-1,std::memory_order_relaxed);
+                reserved.reserved=batch;
+            }
+            if(cas(cur,reserved))
+            {
+                desired.release();
+                drop(cur.ptr,cur.reserved);
+                return true;
+            }
+            if(desired.cb)
+                desired.cb->count.fetch_sub(batch-1,std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include "barrier.hpp"
+
+/**
+ * Phase synchronization cost
+ * ==========================
+ *
+ * N threads run a number of empty phases, synchronizing at the end of each,
+ * first on barrier and then on a mutex + std::condition_variable barrier
+ * as the baseline. The time per phase is the cost of getting every thread
+ * from "I'm done" to "everyone's done, go", from 2 to 64 threads.
+ *
+ * Also checks that the completion function runs once per phase and sees
+ * all of the phase's work, that flex_barrier's count changes take effect,
+ * and that arrive_and_drop() participants stop being waited for.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+class cv_barrier
+{
+    std::mutex m;
+    std::condition_variable cond;
+    unsigned const count;
+    unsigned waiting;
+    unsigned long generation;
+public:
+    explicit cv_barrier(unsigned count_):
+        count(count_),waiting(0),generation(0)
+    {}
+
+    void arrive_and_wait()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        unsigned long const gen=generation;
+        if(++waiting==count)
+        {
+            waiting=0;
+            ++generation;
+            cond.notify_all();
+            return;
+        }
+        cond.wait(lk,[&]{ return generation!=gen; });
+    }
+};
+
+template<typename Barrier>
+double ns_per_phase(Barrier& b,unsigned threads,unsigned phases)
+{
+    latch start(threads+1);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            start.arrive_and_wait();
+            for(unsigned p=0;p<phases;++p)
+                b.arrive_and_wait();
+        }));
+    }
+    start.count_down();
+    bench_clock::time_point const begin=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-begin).count()/phases;
+}
+
+bool check_completion()
+{
+    unsigned const threads=8;
+    unsigned const phases=1000;
+    std::atomic<unsigned> work(0);
+    unsigned completions=0;
+    bool ok=true;
+    barrier b(threads,[&]{
+        ++completions;
+        ok=ok && work.load(std::memory_order_relaxed)==completions*threads;
+    });
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            for(unsigned p=0;p<phases;++p)
+            {
+                work.fetch_add(1,std::memory_order_relaxed);
+                b.arrive_and_wait();
+            }
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return ok && completions==phases;
+}
+
+bool check_flex()
+{
+    // Thread t takes part in phases 0..t, dropping out in phase t, so
+    // phase p should see threads-p arrivals
+    unsigned const threads=8;
+    std::atomic<unsigned> arrivals(0);
+    std::vector<unsigned> per_phase;
+    flex_barrier b(threads,[&]() -> std::ptrdiff_t {
+        per_phase.push_back(arrivals.exchange(0,std::memory_order_relaxed));
+        return -1;
+    });
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(unsigned p=0;p<t;++p)
+            {
+                arrivals.fetch_add(1,std::memory_order_relaxed);
+                b.arrive_and_wait();
+            }
+            arrivals.fetch_add(1,std::memory_order_relaxed);
+            b.arrive_and_drop();
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    bool ok=per_phase.size()==threads;
+    for(unsigned p=0;ok && p<threads;++p)
+        ok=per_phase[p]==threads-p;
+
+    // Grow the count from the completion: the main thread joins from the
+    // second phase on
+    std::atomic<unsigned> phase_count(0);
+    flex_barrier grow(2,[&]() -> std::ptrdiff_t {
+        return ++phase_count==1?3:-1;
+    });
+    std::thread a([&]{ for(int p=0;p<3;++p) grow.arrive_and_wait(); });
+    std::thread c([&]{ for(int p=0;p<3;++p) grow.arrive_and_wait(); });
+    while(phase_count.load()<1)
+        std::this_thread::yield();
+    grow.arrive_and_wait();
+    grow.arrive_and_wait();
+    a.join();
+    c.join();
+    return ok && phase_count==3;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const phases=argc>1?std::strtoul(argv[1],nullptr,10):2000;
+    std::cout << "completion sees every phase's work: " << (check_completion()?"yes":"NO") << std::endl
+              << "flex_barrier drops and count changes: " << (check_flex()?"yes":"NO") << std::endl
+              << std::endl << std::thread::hardware_concurrency() << " CPUs, " << phases << " phases" << std::endl
+              << "threads\tbarrier ns/phase\tcondvar ns/phase" << std::endl;
+    for(unsigned threads=2;threads<=64;threads*=2)
+    {
+        barrier b(threads);
+        cv_barrier cv(threads);
+        double const fast=ns_per_phase(b,threads,phases);
+        double const slow=ns_per_phase(cv,threads,phases);
+        std::cout << threads << "\t" << fast << "\t\t\t" << slow << std::endl;
+    }
+    return 0;
+}
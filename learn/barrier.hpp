@@ -0,0 +1,245 @@
+#ifndef BARRIER_HPP
+#define BARRIER_HPP
+
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include "futex.hpp"
+
+/**
+ * Latch and barriers
+ * ==================
+ *
+ * latch: a single-use countdown. Threads count_down(); wait() returns once
+ * the count reaches zero.
+ *
+ * flex_barrier: a reusable barrier for phased algorithms. Each phase, every
+ * participant calls arrive_and_wait(); the last one to arrive runs the
+ * completion function, which may return the participant count for the
+ * next phase (or -1 to keep it), then releases everyone. A participant
+ * that is finished calls arrive_and_drop() instead and is not waited for
+ * again.
+ *
+ * barrier: the same with a completion function that returns nothing, so the
+ * count only changes through arrive_and_drop().
+ *
+ * The barrier is sense-reversing, generalized: instead of one flag bit
+ * that flips each phase, a 32-bit phase counter is bumped. A waiter
+ * remembers the phase it arrived in and waits for the counter to move, so
+ * a fast thread that is already arriving for the next phase can't confuse
+ * a slow one still leaving the last. The counter is also the futex word.
+ * Waiters spin briefly, then sleep on it; the thread completing a phase
+ * makes the wake syscall only if someone actually went to sleep.
+ *
+ * All arrivals decrement one counter, so at high thread counts that line
+ * is contended; a combining tree would spread it, at the cost of every
+ * participant needing a fixed index, which these interfaces don't have.
+ *
+ * If the completion function throws, the phase is still completed and the
+ * waiters released; the exception comes out of the arrival that ran it.
+*/
+
+class latch
+{
+    std::atomic<std::ptrdiff_t> counter;
+    // 0 closed, 1 open, 2 closed and somebody is asleep on it
+    std::atomic<std::uint32_t> state;
+
+    void open()
+    {
+        if(state.exchange(1,std::memory_order_release)==2)
+            futex_wake(state);
+    }
+
+public:
+    explicit latch(std::ptrdiff_t expected):
+        counter(expected),state(expected>0?0:1)
+    {
+        if(expected<0)
+            throw std::invalid_argument("latch count must not be negative");
+    }
+
+    latch(latch const&)=delete;
+    latch& operator=(latch const&)=delete;
+
+    void count_down(std::ptrdiff_t n=1)
+    {
+        std::ptrdiff_t const left=counter.fetch_sub(n,std::memory_order_acq_rel)-n;
+        if(left<0)
+            throw std::logic_error("latch counted down past zero");
+        if(!left)
+            open();
+    }
+
+    bool try_wait() const
+    {
+        return state.load(std::memory_order_acquire)==1;
+    }
+
+    void wait()
+    {
+        if(spin_until([this]{ return try_wait(); }))
+            return;
+        for(;;)
+        {
+            std::uint32_t s=state.load(std::memory_order_acquire);
+            if(s==1)
+                return;
+            if(s==0 && !state.compare_exchange_strong(s,2,std::memory_order_acquire))
+                continue;
+            futex_wait(state,2);
+        }
+    }
+
+    void arrive_and_wait(std::ptrdiff_t n=1)
+    {
+        count_down(n);
+        wait();
+    }
+};
+
+class flex_barrier
+{
+public:
+    typedef std::uint32_t arrival_token;
+    typedef std::function<std::ptrdiff_t()> completion_function;
+
+private:
+    // Only read and written by the thread completing a phase
+    std::ptrdiff_t expected;
+    completion_function completion;
+
+    std::atomic<std::ptrdiff_t> remaining;
+    std::atomic<std::ptrdiff_t> dropped;
+    std::atomic<std::uint32_t> phase;
+    std::atomic<std::uint32_t> sleepers;
+
+    void complete()
+    {
+        std::ptrdiff_t next=-1;
+        std::exception_ptr error;
+        if(completion)
+        {
+            try
+            {
+                next=completion();
+            }
+            catch(...)
+            {
+                error=std::current_exception();
+            }
+        }
+        expected-=dropped.exchange(0,std::memory_order_relaxed);
+        if(next>=0)
+            expected=next;
+        remaining.store(expected,std::memory_order_relaxed);
+        // Release: the waiters see the completion's writes and the reset
+        // count. seq_cst pairs with the sleepers increment in wait()
+        phase.fetch_add(1,std::memory_order_seq_cst);
+        if(sleepers.load(std::memory_order_seq_cst))
+            futex_wake(phase);
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+    arrival_token arrive_impl(bool drop)
+    {
+        // The phase can't move before this thread arrives, so this is the
+        // phase the arrival counts towards
+        arrival_token const token=phase.load(std::memory_order_acquire);
+        if(drop)
+            dropped.fetch_add(1,std::memory_order_relaxed);
+        if(remaining.fetch_sub(1,std::memory_order_acq_rel)==1)
+            complete();
+        return token;
+    }
+
+public:
+    explicit flex_barrier(std::ptrdiff_t count,completion_function completion_=completion_function()):
+        expected(count),completion(std::move(completion_)),
+        remaining(count),dropped(0),phase(0),sleepers(0)
+    {
+        if(count<=0)
+            throw std::invalid_argument("barrier needs at least one participant");
+    }
+
+    flex_barrier(flex_barrier const&)=delete;
+    flex_barrier& operator=(flex_barrier const&)=delete;
+
+    /**
+     * Split-phase use: arrive, do something else, then wait(token).
+    */
+    arrival_token arrive()
+    {
+        return arrive_impl(false);
+    }
+
+    void wait(arrival_token token)
+    {
+        auto passed=[&]{ return phase.load(std::memory_order_acquire)!=token; };
+        if(spin_until(passed))
+            return;
+        sleepers.fetch_add(1,std::memory_order_seq_cst);
+        while(phase.load(std::memory_order_seq_cst)==token)
+            futex_wait(phase,token);
+        sleepers.fetch_sub(1,std::memory_order_relaxed);
+    }
+
+    void arrive_and_wait()
+    {
+        wait(arrive());
+    }
+
+    void arrive_and_drop()
+    {
+        arrive_impl(true);
+    }
+};
+
+class barrier
+{
+    flex_barrier impl;
+
+    static flex_barrier::completion_function wrap(std::function<void()> f)
+    {
+        if(!f)
+            return flex_barrier::completion_function();
+        return [f]() -> std::ptrdiff_t {
+            f();
+            return -1;
+        };
+    }
+
+public:
+    typedef flex_barrier::arrival_token arrival_token;
+
+    explicit barrier(std::ptrdiff_t count,std::function<void()> completion=std::function<void()>()):
+        impl(count,wrap(std::move(completion)))
+    {}
+
+    arrival_token arrive()
+    {
+        return impl.arrive();
+    }
+
+    void wait(arrival_token token)
+    {
+        impl.wait(token);
+    }
+
+    void arrive_and_wait()
+    {
+        impl.arrive_and_wait();
+    }
+
+    void arrive_and_drop()
+    {
+        impl.arrive_and_drop();
+    }
+};
+
+#endif
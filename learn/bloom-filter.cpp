@@ -0,0 +1,234 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <list>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include "bloom-filter.hpp"
+
+/**
+ * Bloom filter prefilters
+ * =======================
+ *
+ * 1. blocked_bloom_filter and counting_bloom_filter at 12 bits per key
+ *    with 10M and 100M keys: insert ns, lookup ns for misses and hits, and
+ *    the measured false-positive rate next to that of a classic Bloom
+ *    filter of the same size. For the counting one, also after removing
+ *    half the keys. Keys and misses are disjoint ranges of integers.
+ *
+ * 2. While one thread inserts, readers check that every key it has
+ *    published as inserted is found: no false negatives under concurrency.
+ *
+ * 3. list_contains() from chapter 3 (global mutex, std::find over a list)
+ *    with 95% misses, with and without a filter in front; and
+ *    prefiltered_set against the same mutex + unordered_set without the
+ *    filter, from several threads.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+double ns_since(bench_clock::time_point start,double n)
+{
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/n;
+}
+
+double classic_false_positive_rate(double bits_per_key,unsigned k)
+{
+    return std::pow(1-std::exp(-(k/bits_per_key)),k);
+}
+
+template<typename Filter>
+void lookups(Filter const& filter,std::uint64_t n,double& miss_ns,double& hit_ns,double& fp_rate)
+{
+    std::uint64_t const probes=std::min<std::uint64_t>(n,10000000);
+    std::uint64_t positives=0;
+    bench_clock::time_point start=bench_clock::now();
+    for(std::uint64_t i=0;i<probes;++i)
+        positives+=filter.may_contain(n+i);
+    miss_ns=ns_since(start,probes);
+    fp_rate=static_cast<double>(positives)/probes;
+    std::uint64_t hits=0;
+    start=bench_clock::now();
+    // Consecutive keys hash to unrelated blocks, so this is random access
+    for(std::uint64_t i=0;i<probes;++i)
+        hits+=filter.may_contain(i*(n/probes));
+    hit_ns=ns_since(start,probes);
+    if(hits!=probes)
+        std::cout << "  FALSE NEGATIVES: " << probes-hits << std::endl;
+}
+
+void bench_filters(std::uint64_t n)
+{
+    double const bits_per_key=12;
+    double miss_ns,hit_ns,fp_rate;
+    std::cout << std::endl << n/1000000 << "M keys, " << bits_per_key << " bits per key; classic Bloom filter false positives "
+              << 100*classic_false_positive_rate(bits_per_key,8) << "%" << std::endl
+              << "filter\t\tMB\tinsert ns\tmiss ns\thit ns\tfalse positives" << std::endl;
+    {
+        blocked_bloom_filter<std::uint64_t> filter(n,bits_per_key);
+        bench_clock::time_point const start=bench_clock::now();
+        for(std::uint64_t i=0;i<n;++i)
+            filter.insert(i);
+        double const insert_ns=ns_since(start,n);
+        lookups(filter,n,miss_ns,hit_ns,fp_rate);
+        std::cout << "blocked\t\t" << filter.memory_bytes()/1000000 << "\t" << insert_ns << "\t\t"
+                  << miss_ns << "\t" << hit_ns << "\t" << 100*fp_rate << "%" << std::endl;
+    }
+    {
+        counting_bloom_filter<std::uint64_t> filter(n,bits_per_key);
+        bench_clock::time_point start=bench_clock::now();
+        for(std::uint64_t i=0;i<n;++i)
+            filter.insert(i);
+        double const insert_ns=ns_since(start,n);
+        lookups(filter,n,miss_ns,hit_ns,fp_rate);
+        std::cout << "counting\t" << filter.memory_bytes()/1000000 << "\t" << insert_ns << "\t\t"
+                  << miss_ns << "\t" << hit_ns << "\t" << 100*fp_rate << "%" << std::endl;
+        start=bench_clock::now();
+        for(std::uint64_t i=0;i<n;i+=2)
+            filter.remove(i);
+        double const remove_ns=ns_since(start,n/2);
+        std::uint64_t missing=0;
+        for(std::uint64_t i=1;i<n;i+=2)
+            missing+=!filter.may_contain(i);
+        std::uint64_t const probes=std::min<std::uint64_t>(n,10000000);
+        std::uint64_t positives=0;
+        for(std::uint64_t i=0;i<probes;++i)
+            positives+=filter.may_contain(n+i);
+        std::cout << "  removed every other key at " << remove_ns << " ns each: false positives "
+                  << 100.0*positives/probes << "%, remaining keys missing: " << missing << std::endl;
+    }
+}
+
+bool check_concurrent(unsigned readers)
+{
+    std::uint64_t const n=2000000;
+    blocked_bloom_filter<std::uint64_t> filter(n);
+    std::atomic<std::uint64_t> inserted(0);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> threads;
+    for(unsigned r=0;r<readers;++r)
+    {
+        threads.push_back(std::thread([&,r]{
+            std::uint64_t x=r+1;
+            std::uint64_t done;
+            do
+            {
+                done=inserted.load(std::memory_order_acquire);
+                for(unsigned i=0;i<1000 && done;++i)
+                {
+                    x=x*6364136223846793005ULL+1442695040888963407ULL;
+                    if(!filter.may_contain((x>>11)%done))
+                        ok=false;
+                }
+            }
+            while(done<n);
+        }));
+    }
+    for(std::uint64_t i=0;i<n;++i)
+    {
+        filter.insert(i);
+        if(i%1024==1023 || i==n-1)
+            inserted.store(i+1,std::memory_order_release);
+    }
+    for(unsigned r=0;r<readers;++r)
+        threads[r].join();
+    return ok;
+}
+
+std::list<int> some_list;
+std::mutex some_mutex;
+blocked_bloom_filter<int> some_filter(10000);
+
+void add_to_list(int new_value)
+{
+    std::lock_guard<std::mutex> guard(some_mutex);
+    some_filter.insert(new_value);
+    some_list.push_back(new_value);
+}
+
+bool list_contains(int val)
+{
+    std::lock_guard<std::mutex> guard(some_mutex);
+    return std::find(some_list.begin(),some_list.end(),val)!=some_list.end();
+}
+
+bool filtered_list_contains(int val)
+{
+    if(!some_filter.may_contain(val))
+        return false;
+    return list_contains(val);
+}
+
+template<typename Contains>
+double mlookups_per_s(unsigned threads,unsigned per_thread,int keys,Contains contains)
+{
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> found(0);
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            unsigned f=0;
+            std::uint64_t x=t+1;
+            for(unsigned i=0;i<per_thread;++i)
+            {
+                x=x*6364136223846793005ULL+1442695040888963407ULL;
+                // 1 in 20 a key that is there
+                int const key=static_cast<int>((x>>33)%(20*static_cast<std::uint64_t>(keys)));
+                f+=contains(key);
+            }
+            found+=f;
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return static_cast<double>(threads)*per_thread/
+        std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+int main(int argc,char* argv[])
+{
+    std::uint64_t const max_keys=argc>1?std::strtoull(argv[1],nullptr,10):100000000;
+
+    for(std::uint64_t n=10000000;n<=max_keys;n*=10)
+        bench_filters(n);
+
+    std::cout << std::endl << "no false negatives while inserting concurrently: "
+              << (check_concurrent(4)?"yes":"NO") << std::endl;
+
+    int const list_keys=10000;
+    for(int i=0;i<list_keys;++i)
+        add_to_list(i);
+    unsigned const threads=4;
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << threads
+              << " threads, 95% misses, Mlookups/s" << std::endl
+              << "  list_contains, " << list_keys << " items          "
+              << mlookups_per_s(threads,2000,list_keys,list_contains) << std::endl
+              << "  with the filter in front              "
+              << mlookups_per_s(threads,2000000,list_keys,filtered_list_contains) << std::endl;
+
+    int const set_keys=1000000;
+    std::unordered_set<int> plain;
+    std::mutex plain_mutex;
+    prefiltered_set<int> filtered(set_keys);
+    for(int i=0;i<set_keys;++i)
+    {
+        plain.insert(i);
+        filtered.insert(i);
+    }
+    std::cout << "  mutex + unordered_set, " << set_keys << " keys   "
+              << mlookups_per_s(threads,2000000,set_keys,[&](int key){
+                     std::lock_guard<std::mutex> lk(plain_mutex);
+                     return plain.count(key)!=0;
+                 }) << std::endl
+              << "  prefiltered_set                       "
+              << mlookups_per_s(threads,2000000,set_keys,[&](int key){ return filtered.contains(key); })
+              << std::endl;
+    return 0;
+}
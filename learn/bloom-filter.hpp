@@ -0,0 +1,291 @@
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include "cache-line.hpp"
+#include "hash-mix.hpp"
+
+/**
+ * Bloom filters
+ * =============
+ *
+ * list_contains() in chapter 3 takes the global mutex and scans the whole
+ * list, and when most lookups are misses that is all wasted. A Bloom
+ * filter in front answers "definitely not there" for almost all of them
+ * without touching the container or its lock; only "maybe" goes through.
+ *
+ * blocked_bloom_filter is split into 64-byte blocks, one cache line each.
+ * A key hashes to one block and sets one bit in each of the block's eight
+ * 64-bit words (the split block layout of Parquet and Impala), so an
+ * insert or a lookup touches one cache line, not k scattered ones. That
+ * costs a little accuracy against a classic Bloom filter of the same size.
+ *
+ *  - insert() sets the bits with atomic fetch_or, skipping words where the
+ *    bit is already set so that re-inserting doesn't dirty the line.
+ *  - may_contain() is eight relaxed loads and no lock. A key whose insert()
+ *    has returned (happened-before) is always found; one being inserted
+ *    concurrently may or may not be.
+ *
+ * counting_bloom_filter has the same layout with 4-bit counters, 16 to a
+ * word, and four times as many blocks (so four times the memory), which
+ * lets it support remove() and still touch one cache line per key. A
+ * block then holds 128 counters rather than 512 bits, so keys spread less
+ * evenly and false positives run at about twice the plain filter's rate.
+ * Counters are bumped with a compare-exchange on their word and stick at
+ * 15: a counter that overflowed is never decremented again, which can only
+ * leave extra false positives, never a false negative. remove() must only
+ * be called for keys that were inserted.
+*/
+
+namespace bloom_detail
+{
+    // One odd multiplier per word, from the Parquet split block filter
+    static std::uint32_t const salt[8]={
+        0x47b6137bU,0x44974d91U,0x8824ad5bU,0xa2b7289dU,
+        0x705495c7U,0x2df1424bU,0x9efc4947U,0x5c6bfb31U
+    };
+
+    struct alignas(cache_line_size) block
+    {
+        std::atomic<std::uint64_t> words[8];
+
+        block()
+        {
+            for(unsigned i=0;i<8;++i)
+                words[i].store(0,std::memory_order_relaxed);
+        }
+    };
+
+    inline std::size_t blocks_for(std::size_t expected_keys,double bits_per_key)
+    {
+        double const bits=std::ceil(expected_keys*bits_per_key);
+        std::size_t const n=static_cast<std::size_t>(bits/512)+1;
+        return n;
+    }
+
+    /**
+     * Maps the high half of the hash onto [0, n) without a division.
+    */
+    inline std::size_t block_index(std::uint64_t h,std::size_t n)
+    {
+        return static_cast<std::size_t>((static_cast<unsigned __int128>(h)*n)>>64);
+    }
+}
+
+template<typename Key,typename Hash=std::hash<Key> >
+class blocked_bloom_filter
+{
+    std::size_t const block_count;
+    bloom_detail::block* const blocks;
+    Hash hasher;
+
+public:
+    explicit blocked_bloom_filter(std::size_t expected_keys,double bits_per_key=12):
+        block_count(bloom_detail::blocks_for(expected_keys,bits_per_key)),
+        blocks(allocate_cache_aligned<bloom_detail::block>(block_count))
+    {}
+
+    ~blocked_bloom_filter()
+    {
+        free_cache_aligned(blocks,block_count);
+    }
+
+    blocked_bloom_filter(blocked_bloom_filter const&)=delete;
+    blocked_bloom_filter& operator=(blocked_bloom_filter const&)=delete;
+
+    void insert(Key const& key)
+    {
+        std::uint64_t const h=mix_hash(hasher(key));
+        bloom_detail::block& b=blocks[bloom_detail::block_index(h,block_count)];
+        std::uint32_t const low=static_cast<std::uint32_t>(h);
+        for(unsigned i=0;i<8;++i)
+        {
+            std::uint64_t const bit=std::uint64_t(1)<<((low*bloom_detail::salt[i])>>26);
+            if(!(b.words[i].load(std::memory_order_relaxed)&bit))
+                b.words[i].fetch_or(bit,std::memory_order_relaxed);
+        }
+    }
+
+    bool may_contain(Key const& key) const
+    {
+        std::uint64_t const h=mix_hash(hasher(key));
+        bloom_detail::block const& b=blocks[bloom_detail::block_index(h,block_count)];
+        std::uint32_t const low=static_cast<std::uint32_t>(h);
+        bool all=true;
+        // No early exit: the eight loads are independent and hit one line
+        for(unsigned i=0;i<8;++i)
+        {
+            std::uint64_t const bit=std::uint64_t(1)<<((low*bloom_detail::salt[i])>>26);
+            all&=(b.words[i].load(std::memory_order_relaxed)&bit)!=0;
+        }
+        return all;
+    }
+
+    std::size_t memory_bytes() const
+    {
+        return block_count*sizeof(bloom_detail::block);
+    }
+};
+
+template<typename Key,typename Hash=std::hash<Key> >
+class counting_bloom_filter
+{
+    // Four times as many blocks as the plain filter, for the same number of
+    // counters as it has bits
+    std::size_t const block_count;
+    bloom_detail::block* const blocks;
+    Hash hasher;
+
+    template<typename Update>
+    void update(Key const& key,Update change)
+    {
+        std::uint64_t const h=mix_hash(hasher(key));
+        bloom_detail::block& b=blocks[bloom_detail::block_index(h,block_count)];
+        std::uint32_t const low=static_cast<std::uint32_t>(h);
+        for(unsigned i=0;i<8;++i)
+        {
+            std::atomic<std::uint64_t>& word=b.words[i];
+            unsigned const shift=((low*bloom_detail::salt[i])>>28)*4;
+            std::uint64_t w=word.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                unsigned const c=(w>>shift)&15;
+                unsigned const next=change(c);
+                if(next==c)
+                    break;
+                std::uint64_t const replacement=(w&~(std::uint64_t(15)<<shift))|(std::uint64_t(next)<<shift);
+                if(word.compare_exchange_weak(w,replacement,std::memory_order_relaxed))
+                    break;
+            }
+        }
+    }
+
+    static unsigned increment(unsigned c)
+    {
+        return c==15?15:c+1;
+    }
+
+    static unsigned decrement(unsigned c)
+    {
+        return c==15 || c==0?c:c-1;
+    }
+
+public:
+    explicit counting_bloom_filter(std::size_t expected_keys,double bits_per_key=12):
+        block_count(4*bloom_detail::blocks_for(expected_keys,bits_per_key)),
+        blocks(allocate_cache_aligned<bloom_detail::block>(block_count))
+    {}
+
+    ~counting_bloom_filter()
+    {
+        free_cache_aligned(blocks,block_count);
+    }
+
+    counting_bloom_filter(counting_bloom_filter const&)=delete;
+    counting_bloom_filter& operator=(counting_bloom_filter const&)=delete;
+
+    void insert(Key const& key)
+    {
+        update(key,&counting_bloom_filter::increment);
+    }
+
+    void remove(Key const& key)
+    {
+        update(key,&counting_bloom_filter::decrement);
+    }
+
+    bool may_contain(Key const& key) const
+    {
+        std::uint64_t const h=mix_hash(hasher(key));
+        bloom_detail::block const& b=blocks[bloom_detail::block_index(h,block_count)];
+        std::uint32_t const low=static_cast<std::uint32_t>(h);
+        bool all=true;
+        for(unsigned i=0;i<8;++i)
+        {
+            unsigned const shift=((low*bloom_detail::salt[i])>>28)*4;
+            all&=((b.words[i].load(std::memory_order_relaxed)>>shift)&15)!=0;
+        }
+        return all;
+    }
+
+    std::size_t memory_bytes() const
+    {
+        return block_count*sizeof(bloom_detail::block);
+    }
+};
+
+/**
+ * What a filter should do when a key leaves the container: a counting
+ * filter forgets it, a plain one can't and keeps a stale hit.
+*/
+template<typename Key,typename Hash>
+void bloom_forget(blocked_bloom_filter<Key,Hash>&,Key const&)
+{}
+
+template<typename Key,typename Hash>
+void bloom_forget(counting_bloom_filter<Key,Hash>& filter,Key const& key)
+{
+    filter.remove(key);
+}
+
+/**
+ * A mutex-protected set with a Bloom filter in front: contains() for a key
+ * the filter rules out returns without taking the lock.
+ *
+ * The filter is updated under the set's mutex, before the set on insert
+ * and after it on erase, so any key a locked lookup could find is in the
+ * filter.
+*/
+template<typename Key,typename Filter=counting_bloom_filter<Key>,
+         typename Set=std::unordered_set<Key>,typename Mutex=std::mutex>
+class prefiltered_set
+{
+    Filter filter;
+    mutable Mutex m;
+    Set set;
+
+public:
+    explicit prefiltered_set(std::size_t expected_keys,double bits_per_key=12):
+        filter(expected_keys,bits_per_key)
+    {}
+
+    bool insert(Key const& key)
+    {
+        std::lock_guard<Mutex> lk(m);
+        filter.insert(key);
+        if(set.insert(key).second)
+            return true;
+        // Already there: undo the extra count
+        bloom_forget(filter,key);
+        return false;
+    }
+
+    bool erase(Key const& key)
+    {
+        std::lock_guard<Mutex> lk(m);
+        if(!set.erase(key))
+            return false;
+        bloom_forget(filter,key);
+        return true;
+    }
+
+    bool contains(Key const& key) const
+    {
+        if(!filter.may_contain(key))
+            return false;
+        std::lock_guard<Mutex> lk(m);
+        return set.find(key)!=set.end();
+    }
+
+    Filter const& prefilter() const
+    {
+        return filter;
+    }
+};
+
+#endif
@@ -0,0 +1,249 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include "broadcast-ring.hpp"
+#include "threadsafe-queue.hpp"
+
+/**
+ * Broadcast fan-out
+ * =================
+ *
+ * 1. Checks: with the block policy every subscriber sees every item, in
+ *    order, also with four publishers; with the lap policy every
+ *    subscriber sees increasing items and what it read plus what it lost
+ *    adds up to what was published.
+ *
+ * 2. One publisher fanning quotes out to 1, 8 and 32 subscribers: the
+ *    broadcast ring with each policy against a threadsafe_queue per
+ *    subscriber, where the publisher pushes a copy into each (run with a
+ *    tenth of the quotes; it's that slow). Time until every subscriber is
+ *    done, and for lap how much was delivered.
+ *
+ * 3. One slow subscriber among fast ones, with the lap policy and a paced
+ *    publisher: the slow one is the one that gets lapped, and the
+ *    publisher never waits for it.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct quote
+{
+    std::uint64_t seq;
+    unsigned publisher;
+    double bid;
+    double ask;
+    char symbol[8];
+};
+
+quote make_quote(std::uint64_t seq,unsigned publisher=0)
+{
+    quote q={seq,publisher,100.0+seq%100,100.5+seq%100,{'A','C','M','E',0,0,0,0}};
+    return q;
+}
+
+bool check_block(unsigned publishers,unsigned subscribers,std::uint64_t per_publisher)
+{
+    broadcast_ring<quote,overrun_policy::block> ring(256);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> readers;
+    std::vector<broadcast_ring<quote,overrun_policy::block>::subscriber> subs;
+    for(unsigned s=0;s<subscribers;++s)
+        subs.push_back(ring.subscribe());
+    for(unsigned s=0;s<subscribers;++s)
+    {
+        readers.push_back(std::thread([&,s]{
+            std::vector<std::uint64_t> next(publishers,0);
+            std::uint64_t total=0;
+            while(subs[s].read([&](quote const& q){
+                if(q.seq!=next[q.publisher]++)
+                    ok=false;
+                ++total;
+            }))
+                ;
+            if(total!=publishers*per_publisher)
+                ok=false;
+        }));
+    }
+    std::vector<std::thread> writers;
+    for(unsigned p=0;p<publishers;++p)
+    {
+        writers.push_back(std::thread([&,p]{
+            for(std::uint64_t i=0;i<per_publisher;++i)
+                ring.publish(make_quote(i,p));
+        }));
+    }
+    for(unsigned p=0;p<publishers;++p)
+        writers[p].join();
+    ring.close();
+    for(unsigned s=0;s<subscribers;++s)
+        readers[s].join();
+    return ok;
+}
+
+bool check_lap(unsigned subscribers,std::uint64_t items)
+{
+    broadcast_ring<quote,overrun_policy::lap> ring(64);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> readers;
+    std::vector<broadcast_ring<quote,overrun_policy::lap>::subscriber> subs;
+    for(unsigned s=0;s<subscribers;++s)
+        subs.push_back(ring.subscribe());
+    for(unsigned s=0;s<subscribers;++s)
+    {
+        readers.push_back(std::thread([&,s]{
+            std::uint64_t last=0,read=0;
+            bool first=true;
+            while(subs[s].read([&](quote const& q){
+                if(!first && q.seq<=last)
+                    ok=false;
+                first=false;
+                last=q.seq;
+                ++read;
+            }))
+                ;
+            if(read+subs[s].lost()!=items || subs[s].position()!=items)
+                ok=false;
+        }));
+    }
+    for(std::uint64_t i=0;i<items;++i)
+        ring.publish(make_quote(i));
+    ring.close();
+    for(unsigned s=0;s<subscribers;++s)
+        readers[s].join();
+    return ok;
+}
+
+template<overrun_policy Policy>
+void fan_out_ring(unsigned subscribers,std::uint64_t items,double& mquotes,double& delivered)
+{
+    broadcast_ring<quote,Policy> ring(4096);
+    std::vector<typename broadcast_ring<quote,Policy>::subscriber> subs;
+    for(unsigned s=0;s<subscribers;++s)
+        subs.push_back(ring.subscribe());
+    std::atomic<std::uint64_t> reads(0);
+    std::vector<std::thread> readers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned s=0;s<subscribers;++s)
+    {
+        readers.push_back(std::thread([&,s]{
+            double spread=0;
+            std::uint64_t n=0;
+            while(subs[s].read([&](quote const& q){ spread+=q.ask-q.bid; ++n; }))
+                ;
+            reads+=n;
+        }));
+    }
+    for(std::uint64_t i=0;i<items;++i)
+        ring.publish(make_quote(i));
+    ring.close();
+    for(unsigned s=0;s<subscribers;++s)
+        readers[s].join();
+    mquotes=items/std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+    delivered=static_cast<double>(reads.load())/(static_cast<double>(items)*subscribers);
+}
+
+double fan_out_queues(unsigned subscribers,std::uint64_t items)
+{
+    std::vector<std::unique_ptr<threadsafe_queue<quote> > > queues;
+    for(unsigned s=0;s<subscribers;++s)
+        queues.push_back(std::unique_ptr<threadsafe_queue<quote> >(new threadsafe_queue<quote>));
+    std::vector<std::thread> readers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned s=0;s<subscribers;++s)
+    {
+        readers.push_back(std::thread([&,s]{
+            double spread=0;
+            quote q;
+            for(;;)
+            {
+                queues[s]->wait_and_pop(q);
+                if(q.seq==~std::uint64_t(0))
+                    break;
+                spread+=q.ask-q.bid;
+            }
+        }));
+    }
+    for(std::uint64_t i=0;i<items;++i)
+    {
+        quote const q=make_quote(i);
+        for(unsigned s=0;s<subscribers;++s)
+            queues[s]->push(q);
+    }
+    for(unsigned s=0;s<subscribers;++s)
+        queues[s]->push(make_quote(~std::uint64_t(0)));
+    for(unsigned s=0;s<subscribers;++s)
+        readers[s].join();
+    return items/std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+void slow_subscriber(unsigned fast,std::uint64_t items)
+{
+    broadcast_ring<quote,overrun_policy::lap> ring(1024);
+    std::vector<broadcast_ring<quote,overrun_policy::lap>::subscriber> subs;
+    for(unsigned s=0;s<=fast;++s)
+        subs.push_back(ring.subscribe());
+    std::vector<std::thread> readers;
+    for(unsigned s=0;s<=fast;++s)
+    {
+        readers.push_back(std::thread([&,s]{
+            bool const slow=s==fast;
+            while(subs[s].read([&](quote const&){
+                if(slow)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }))
+                ;
+        }));
+    }
+    // Paced at about 100k quotes/s, which the fast ones keep up with
+    double longest_us=0;
+    for(std::uint64_t i=0;i<items;++i)
+    {
+        bench_clock::time_point const start=bench_clock::now();
+        ring.publish(make_quote(i));
+        double const us=std::chrono::duration<double,std::micro>(bench_clock::now()-start).count();
+        if(us>longest_us)
+            longest_us=us;
+        if(i%100==99)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ring.close();
+    for(unsigned s=0;s<=fast;++s)
+        readers[s].join();
+    std::uint64_t fast_lost=0;
+    for(unsigned s=0;s<fast;++s)
+        fast_lost+=subs[s].lost();
+    std::cout << std::endl << "lap policy, " << fast << " fast subscribers and one that sleeps 50us per quote" << std::endl
+              << "  longest publish      " << longest_us << " us" << std::endl
+              << "  fast subscribers     " << 100.0*fast_lost/(static_cast<double>(items)*fast) << "% lost" << std::endl
+              << "  slow subscriber      " << 100.0*subs[fast].lost()/items << "% lost" << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    std::uint64_t const items=argc>1?std::strtoull(argv[1],nullptr,10):1000000;
+
+    std::cout << "block: everyone sees everything in order: "
+              << (check_block(1,8,100000) && check_block(4,4,50000)?"yes":"NO") << std::endl
+              << "lap: increasing, read + lost = published: "
+              << (check_lap(8,200000)?"yes":"NO") << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << items
+              << " quotes of " << sizeof(quote) << " bytes" << std::endl
+              << "subscribers\tblock Mq/s\tlap Mq/s (delivered)\tqueue per subscriber Mq/s" << std::endl;
+    for(unsigned subscribers=1;subscribers<=32;subscribers*=subscribers==1?8:4)
+    {
+        double block_rate,lap_rate,block_delivered,lap_delivered;
+        fan_out_ring<overrun_policy::block>(subscribers,items,block_rate,block_delivered);
+        fan_out_ring<overrun_policy::lap>(subscribers,items,lap_rate,lap_delivered);
+        std::cout << subscribers << "\t\t" << block_rate << "\t\t" << lap_rate << " ("
+                  << 100*lap_delivered << "%)\t\t" << fan_out_queues(subscribers,items/10) << std::endl;
+    }
+
+    slow_subscriber(7,100000);
+    return 0;
+}
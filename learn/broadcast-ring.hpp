@@ -0,0 +1,413 @@
+#ifndef BROADCAST_RING_HPP
+#define BROADCAST_RING_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "reclamation.hpp"
+#include "eventcount.hpp"
+#include "stop-token.hpp"
+#include "cache-line.hpp"
+
+/**
+ * Broadcast ring
+ * ==============
+ *
+ * threadsafe_queue hands each item to exactly one consumer. Here every
+ * subscriber sees every item: publishers write into a ring of capacity
+ * slots (a power of two), and each subscriber keeps its own read cursor.
+ * The payload is stored once, in a node the slot points to, and readers
+ * get a T const& to it; nothing is copied per subscriber.
+ *
+ * Publishing claims a sequence number with one fetch_add, so any number of
+ * threads can publish. A publisher that laps a slot waits for the one
+ * that had claimed the sequence number a ring earlier to finish, so each
+ * slot's items go in in order.
+ *
+ * What happens to a subscriber that falls a whole ring behind is the
+ * overrun_policy:
+ *
+ *  - lap: publishers never wait. A subscriber that finds its next slot
+ *    already overwritten skips ahead to the middle of the ring and counts
+ *    what it missed in lost(). Nodes replaced under a reader are retired
+ *    through the Reclaimer (epoch-based by default), so a reader's T const&
+ *    stays valid until it returns, even if it was lapped meanwhile.
+ *  - block: publishers wait until every subscriber has read the item a
+ *    slot holds before reusing it (backpressure). The slowest subscriber
+ *    sets the pace, nothing is lost, and no reclamation is needed: a
+ *    replaced node has been read by everyone.
+ *
+ * Publishers check a cached minimum of the cursors and only rescan them
+ * when that says the slot may still be in use, so backpressure costs one
+ * load per publish until the ring is actually full. A publisher that does
+ * have to wait waits for half a ring of room, and subscribers only notify
+ * as they pass each quarter of the ring, not on every read.
+ *
+ * A new subscriber starts at the next item to be published. Subscribers
+ * sleep on an eventcount when they've caught up; a publish with nobody
+ * asleep costs a fence and a load on top of the write.
+*/
+
+enum class overrun_policy
+{
+    lap,
+    block
+};
+
+namespace broadcast_detail
+{
+    /**
+     * Stands in for a reclamation guard when nothing needs reclaiming.
+    */
+    struct no_guard
+    {
+        template<typename T>
+        T* protect(std::atomic<T*> const& src)
+        {
+            return src.load(std::memory_order_acquire);
+        }
+    };
+}
+
+template<typename T,overrun_policy Policy=overrun_policy::lap,typename Reclaimer=epoch_reclaimer>
+class broadcast_ring
+{
+    struct node
+    {
+        std::uint64_t seq;
+        T value;
+
+        node(std::uint64_t seq_,T&& value_):
+            seq(seq_),value(std::move(value_))
+        {}
+    };
+
+    // One slot per cache line, so the publisher writing one slot doesn't
+    // keep invalidating the line readers are reading the one before from
+    struct alignas(cache_line_size) slot
+    {
+        std::atomic<node*> item;
+        // Sequence number of the item in the slot plus one; 0 for none
+        std::atomic<std::uint64_t> published;
+
+        slot():
+            item(nullptr),published(0)
+        {}
+    };
+
+    struct alignas(cache_line_size) cursor
+    {
+        std::atomic<std::uint64_t> position;
+        std::atomic<bool> active;
+
+        cursor():
+            position(0),active(false)
+        {}
+    };
+
+    typedef typename std::conditional<Policy==overrun_policy::lap,
+                                      typename Reclaimer::guard,
+                                      broadcast_detail::no_guard>::type guard;
+
+    std::size_t const capacity;
+    std::uint64_t const mask;
+    unsigned const max_subscribers;
+    slot* const slots;
+    cursor* const cursors;
+    std::mutex subscribe_mutex;
+    alignas(cache_line_size) std::atomic<std::uint64_t> head;
+    // Block policy: no cursor is below this
+    alignas(cache_line_size) std::atomic<std::uint64_t> gate;
+    std::atomic<bool> closed;
+    eventcount published_event;
+    eventcount space_event;
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t c=1;
+        while(c<n)
+            c<<=1;
+        return c;
+    }
+
+    std::uint64_t min_cursor()
+    {
+        std::lock_guard<std::mutex> lk(subscribe_mutex);
+        std::uint64_t m=head.load(std::memory_order_seq_cst);
+        for(unsigned i=0;i<max_subscribers;++i)
+        {
+            if(!cursors[i].active.load(std::memory_order_relaxed))
+                continue;
+            std::uint64_t const p=cursors[i].position.load(std::memory_order_acquire);
+            if(p<m)
+                m=p;
+        }
+        std::uint64_t g=gate.load(std::memory_order_relaxed);
+        while(g<m && !gate.compare_exchange_weak(g,m,std::memory_order_release))
+            ;
+        return m;
+    }
+
+    void wait_for_space(std::uint64_t seq)
+    {
+        if(seq<gate.load(std::memory_order_acquire)+capacity)
+            return;
+        if(seq<min_cursor()+capacity)
+            return;
+        // Having to wait at all, wait for half a ring of room, so the
+        // publishes that follow don't each wait for one more slot
+        std::uint64_t const target=seq-capacity/2+1;
+        for(;;)
+        {
+            eventcount::key const k=space_event.prepare_wait();
+            if(min_cursor()>=target)
+            {
+                space_event.cancel_wait();
+                return;
+            }
+            space_event.commit_wait(k);
+        }
+    }
+
+    void retire(node* old)
+    {
+        if(Policy==overrun_policy::lap)
+            Reclaimer::retire(old);
+        else
+            delete old;
+    }
+
+public:
+    class subscriber
+    {
+        friend class broadcast_ring;
+
+        broadcast_ring* ring;
+        unsigned index;
+        std::uint64_t next;
+        std::uint64_t missed;
+
+        subscriber(broadcast_ring& ring_,unsigned index_,std::uint64_t next_):
+            ring(&ring_),index(index_),next(next_),missed(0)
+        {}
+
+        void advance()
+        {
+            if(Policy==overrun_policy::lap)
+            {
+                ring->cursors[index].position.store(++next,std::memory_order_release);
+                return;
+            }
+            // Publishers waiting for room only need to hear about progress
+            // now and then: every quarter of a ring
+            ring->cursors[index].position.store(++next,std::memory_order_seq_cst);
+            if(!(next&(ring->capacity/4-1)))
+                ring->space_event.notify_all();
+        }
+
+        // 1 if it read an item, 0 if there is none yet
+        template<typename F>
+        unsigned read_one(guard& g,F& f)
+        {
+            for(;;)
+            {
+                slot& s=ring->slots[next&ring->mask];
+                std::uint64_t const published=s.published.load(std::memory_order_acquire);
+                if(published<=next)
+                    return 0;
+                if(published==next+1)
+                {
+                    node* const n=g.protect(s.item);
+                    // Can only differ if a publisher has just replaced it
+                    if(n->seq==next)
+                    {
+                        f(static_cast<T const&>(n->value));
+                        advance();
+                        return 1;
+                    }
+                }
+                // Lapped: skip ahead, leaving half a ring of slack
+                std::uint64_t const resume=ring->head.load(std::memory_order_acquire)-ring->capacity/2;
+                if(resume>next)
+                {
+                    missed+=resume-next;
+                    next=resume;
+                    ring->cursors[index].position.store(next,std::memory_order_release);
+                }
+            }
+        }
+
+    public:
+        subscriber(subscriber&& other):
+            ring(other.ring),index(other.index),next(other.next),missed(other.missed)
+        {
+            other.ring=nullptr;
+        }
+
+        ~subscriber()
+        {
+            if(ring)
+                ring->unsubscribe(index);
+        }
+
+        subscriber(subscriber const&)=delete;
+        subscriber& operator=(subscriber const&)=delete;
+        subscriber& operator=(subscriber&&)=delete;
+
+        /**
+         * Calls f(T const&) with up to max items that are ready, oldest
+         * first, without blocking. Returns how many.
+        */
+        template<typename F>
+        std::size_t poll(F f,std::size_t max=~std::size_t(0))
+        {
+            guard g;
+            std::size_t count=0;
+            while(count<max && read_one(g,f))
+                ++count;
+            return count;
+        }
+
+        template<typename F>
+        bool try_read(F f)
+        {
+            return poll(f,1)==1;
+        }
+
+        /**
+         * Waits for the next item and calls f(T const&) with it. False
+         * once the ring is closed and everything published has been read,
+         * or when a stop is requested on token.
+        */
+        template<typename F>
+        bool read(F f,stop_token const& token=stop_token())
+        {
+            for(;;)
+            {
+                bool const was_closed=ring->closed.load(std::memory_order_acquire);
+                if(try_read(f))
+                    return true;
+                if(was_closed)
+                    return false;
+                eventcount::key const k=ring->published_event.prepare_wait();
+                if(try_read(f))
+                {
+                    ring->published_event.cancel_wait();
+                    return true;
+                }
+                if(ring->closed.load(std::memory_order_acquire))
+                {
+                    ring->published_event.cancel_wait();
+                    continue;
+                }
+                if(!ring->published_event.commit_wait(k,token))
+                    return false;
+            }
+        }
+
+        /**
+         * Items skipped because a publisher lapped this subscriber.
+        */
+        std::uint64_t lost() const
+        {
+            return missed;
+        }
+
+        std::uint64_t position() const
+        {
+            return next;
+        }
+    };
+
+    explicit broadcast_ring(std::size_t capacity_=1024,unsigned max_subscribers_=64):
+        capacity(round_up(capacity_<8?8:capacity_)),mask(capacity-1),
+        max_subscribers(max_subscribers_),
+        slots(allocate_cache_aligned<slot>(capacity)),
+        cursors(allocate_cache_aligned<cursor>(max_subscribers)),
+        head(0),gate(0),closed(false)
+    {}
+
+    ~broadcast_ring()
+    {
+        for(std::size_t i=0;i<capacity;++i)
+            delete slots[i].item.load(std::memory_order_relaxed);
+        free_cache_aligned(slots,capacity);
+        free_cache_aligned(cursors,max_subscribers);
+    }
+
+    broadcast_ring(broadcast_ring const&)=delete;
+    broadcast_ring& operator=(broadcast_ring const&)=delete;
+
+    /**
+     * A subscriber that will see everything published from now on. Throws
+     * std::length_error if max_subscribers are already subscribed.
+    */
+    subscriber subscribe()
+    {
+        std::lock_guard<std::mutex> lk(subscribe_mutex);
+        for(unsigned i=0;i<max_subscribers;++i)
+        {
+            if(cursors[i].active.load(std::memory_order_relaxed))
+                continue;
+            std::uint64_t const start=head.load(std::memory_order_seq_cst);
+            cursors[i].position.store(start,std::memory_order_relaxed);
+            cursors[i].active.store(true,std::memory_order_release);
+            return subscriber(*this,i,start);
+        }
+        throw std::length_error("broadcast_ring: too many subscribers");
+    }
+
+    void publish(T value)
+    {
+        std::uint64_t const seq=head.fetch_add(1,std::memory_order_acq_rel);
+        if(Policy==overrun_policy::block)
+            wait_for_space(seq);
+        slot& s=slots[seq&mask];
+        // The publisher a ring ahead of us has to be done with this slot
+        std::uint64_t const previous=seq<capacity?0:seq-capacity+1;
+        while(s.published.load(std::memory_order_acquire)!=previous)
+            std::this_thread::yield();
+        node* const old=s.item.exchange(new node(seq,std::move(value)),std::memory_order_acq_rel);
+        s.published.store(seq+1,std::memory_order_release);
+        if(old)
+            retire(old);
+        published_event.notify_all();
+    }
+
+    /**
+     * End of stream: readers return false from read() once they have read
+     * everything published before this.
+    */
+    void close()
+    {
+        closed.store(true,std::memory_order_release);
+        published_event.notify_all();
+    }
+
+    std::size_t size() const
+    {
+        return capacity;
+    }
+
+    std::uint64_t published_count() const
+    {
+        return head.load(std::memory_order_acquire);
+    }
+
+private:
+    void unsubscribe(unsigned index)
+    {
+        {
+            std::lock_guard<std::mutex> lk(subscribe_mutex);
+            cursors[index].active.store(false,std::memory_order_release);
+        }
+        if(Policy==overrun_policy::block)
+            space_event.notify_all();
+    }
+};
+
+#endif
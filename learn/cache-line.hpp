@@ -0,0 +1,146 @@
+#ifndef CACHE_LINE_HPP
+#define CACHE_LINE_HPP
+
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Cache-line layout
+ * =================
+ *
+ * Two variables that different threads write, sitting on the same 64-byte
+ * line, make those threads take turns owning the line even though they
+ * never touch each other's data: false sharing. chapter 6's fine-grained
+ * queue is the textbook case. It has a head_mutex and a tail_mutex so that
+ * push() and try_pop() don't contend, but with head_mutex, head,
+ * tail_mutex and tail declared next to each other every push still
+ * invalidates the line the consumer is spinning on.
+ *
+ * The helpers here are what the containers use to keep such members apart:
+ *
+ *  - cache_line_size plays the part of C++17's
+ *    std::hardware_destructive_interference_size. It is fixed at 64: the
+ *    library constant changes with -mtune, and since it ends up in the
+ *    layout of every class here, two translation units built with
+ *    different flags would disagree about those layouts.
+ *  - cache_padded<T> gives a T its own lines: aligned to a line boundary,
+ *    with a size that is a multiple of the line. cache_packed<T> has the
+ *    same interface and no padding, and cache_slot<T, Layout> picks one of
+ *    the two, so a container can be built either way and benchmarked
+ *    against itself.
+ *  - on_separate_cache_lines() is for static_asserts on member offsets, so
+ *    a later edit that moves a member back next to another fails to build.
+ *  - new in C++11 ignores alignment above alignof(max_align_t), so
+ *    cache_aligned_new gives a class an operator new that honours it, and
+ *    allocate_cache_aligned() does the same for arrays.
+*/
+
+static std::size_t const cache_line_size=64;
+
+enum class cache_layout
+{
+    packed,
+    padded
+};
+
+template<typename T>
+struct alignas(cache_line_size) cache_padded
+{
+    T value;
+
+    template<typename... Args>
+    explicit cache_padded(Args&&... args):
+        value(std::forward<Args>(args)...)
+    {}
+
+    T& operator*() { return value; }
+    T const& operator*() const { return value; }
+    T* operator->() { return &value; }
+    T const* operator->() const { return &value; }
+};
+
+template<typename T>
+struct cache_packed
+{
+    T value;
+
+    template<typename... Args>
+    explicit cache_packed(Args&&... args):
+        value(std::forward<Args>(args)...)
+    {}
+
+    T& operator*() { return value; }
+    T const& operator*() const { return value; }
+    T* operator->() { return &value; }
+    T const* operator->() const { return &value; }
+};
+
+template<typename T,cache_layout Layout>
+using cache_slot=typename std::conditional<Layout==cache_layout::padded,
+                                           cache_padded<T>,cache_packed<T> >::type;
+
+/**
+ * True if bytes [first_offset, first_offset+first_size) and
+ * [second_offset, second_offset+second_size) of a line-aligned object
+ * share no cache line.
+*/
+constexpr bool on_separate_cache_lines(std::size_t first_offset,std::size_t first_size,
+                                       std::size_t second_offset,std::size_t second_size)
+{
+    return (first_offset+first_size-1)/cache_line_size<second_offset/cache_line_size ||
+           (second_offset+second_size-1)/cache_line_size<first_offset/cache_line_size;
+}
+
+/**
+ * Base class for objects with cache-line-aligned members that get
+ * allocated with new.
+*/
+struct cache_aligned_new
+{
+    static void* operator new(std::size_t size)
+    {
+        void* p=nullptr;
+        if(posix_memalign(&p,cache_line_size,size))
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void operator delete(void* p)
+    {
+        std::free(p);
+    }
+
+    // Declaring the above hides placement new
+    static void* operator new(std::size_t,void* where)
+    {
+        return where;
+    }
+
+    static void operator delete(void*,void*)
+    {}
+};
+
+template<typename T>
+T* allocate_cache_aligned(std::size_t n)
+{
+    void* p=nullptr;
+    if(posix_memalign(&p,cache_line_size,n*sizeof(T)))
+        throw std::bad_alloc();
+    T* const array=static_cast<T*>(p);
+    for(std::size_t i=0;i<n;++i)
+        ::new(static_cast<void*>(array+i)) T();
+    return array;
+}
+
+template<typename T>
+void free_cache_aligned(T* array,std::size_t n)
+{
+    for(std::size_t i=0;i<n;++i)
+        array[i].~T();
+    std::free(array);
+}
+
+#endif
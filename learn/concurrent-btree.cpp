@@ -0,0 +1,560 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <cstdint>
+#include <cstdlib>
+#include "concurrent-btree.hpp"
+#include "reclamation.hpp"
+
+/**
+ * Ordered indexes: B+tree with optimistic lock coupling
+ * =====================================================
+ *
+ * 1. Checks, for concurrent_btree and the skip list alike: random inserts,
+ *    erases, lookups and range scans in a small key space against
+ *    std::map; four threads inserting disjoint keys while a reader checks
+ *    the values it finds and a scanner checks every scan comes out sorted;
+ *    erasing half the keys while readers look for the other half.
+ *
+ * 2. One million random 64-bit keys loaded into concurrent_btree, a lazy
+ *    skip list (below) and std::map behind a mutex, then four threads
+ *    doing lookups (half of them missing), a 90% lookup / 5% insert / 5%
+ *    erase mix, and scans of about 100 keys. Then lookups in B+trees with
+ *    nodes of two, four and eight cache lines.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * The lazy skip list of Herlihy, Lev, Luchangco and Shavit: lookups and
+ * scans take no locks, writers lock the predecessors they relink. A node
+ * is erased by marking it, then unlinking it, then retiring it through
+ * epoch_reclaimer.
+*/
+class skip_list
+{
+    static int const max_level=24;
+
+    struct node
+    {
+        std::uint64_t const key;
+        std::atomic<std::uint64_t> value;
+        int const top;
+        std::mutex m;
+        std::atomic<bool> marked;
+        std::atomic<bool> fully_linked;
+        std::atomic<node*> next[max_level];
+
+        node(std::uint64_t key_,std::uint64_t value_,int top_):
+            key(key_),value(value_),top(top_),marked(false),fully_linked(false)
+        {
+            for(int i=0;i<max_level;++i)
+                next[i].store(nullptr,std::memory_order_relaxed);
+        }
+    };
+
+    node head;
+    std::atomic<std::uint64_t> seed;
+
+    int random_level()
+    {
+        std::uint64_t x=seed.fetch_add(0x9e3779b97f4a7c15ULL,std::memory_order_relaxed);
+        x^=x>>31;
+        x*=0xbf58476d1ce4e5b9ULL;
+        x^=x>>29;
+        int const level=__builtin_ctzll(x|(std::uint64_t(1)<<(max_level-1)));
+        return level;
+    }
+
+    int find(std::uint64_t key,node** preds,node** succs)
+    {
+        int found=-1;
+        node* pred=&head;
+        for(int level=max_level-1;level>=0;--level)
+        {
+            node* curr=pred->next[level].load(std::memory_order_acquire);
+            while(curr && curr->key<key)
+            {
+                pred=curr;
+                curr=pred->next[level].load(std::memory_order_acquire);
+            }
+            if(found==-1 && curr && curr->key==key)
+                found=level;
+            preds[level]=pred;
+            succs[level]=curr;
+        }
+        return found;
+    }
+
+public:
+    skip_list():
+        head(0,0,max_level-1),seed(1)
+    {}
+
+    ~skip_list()
+    {
+        node* n=head.next[0].load(std::memory_order_relaxed);
+        while(n)
+        {
+            node* const next=n->next[0].load(std::memory_order_relaxed);
+            delete n;
+            n=next;
+        }
+    }
+
+    bool find(std::uint64_t key,std::uint64_t& value)
+    {
+        epoch_reclaimer::guard g;
+        node* pred=&head;
+        node* curr=nullptr;
+        for(int level=max_level-1;level>=0;--level)
+        {
+            curr=pred->next[level].load(std::memory_order_acquire);
+            while(curr && curr->key<key)
+            {
+                pred=curr;
+                curr=pred->next[level].load(std::memory_order_acquire);
+            }
+            if(curr && curr->key==key)
+                break;
+        }
+        if(!curr || curr->key!=key || !curr->fully_linked.load(std::memory_order_acquire) ||
+           curr->marked.load(std::memory_order_acquire))
+            return false;
+        value=curr->value.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    bool insert_or_assign(std::uint64_t key,std::uint64_t value)
+    {
+        epoch_reclaimer::guard g;
+        int const top=random_level();
+        node* preds[max_level];
+        node* succs[max_level];
+        for(;;)
+        {
+            int const found=find(key,preds,succs);
+            if(found!=-1)
+            {
+                node* const n=succs[found];
+                if(!n->marked.load(std::memory_order_acquire))
+                {
+                    while(!n->fully_linked.load(std::memory_order_acquire))
+                        std::this_thread::yield();
+                    n->value.store(value,std::memory_order_relaxed);
+                    return false;
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> locks[max_level];
+            node* locked=nullptr;
+            bool valid=true;
+            for(int level=0;valid && level<=top;++level)
+            {
+                node* const pred=preds[level];
+                node* const succ=succs[level];
+                if(pred!=locked)
+                {
+                    locks[level]=std::unique_lock<std::mutex>(pred->m);
+                    locked=pred;
+                }
+                valid=!pred->marked.load(std::memory_order_acquire) &&
+                    (!succ || !succ->marked.load(std::memory_order_acquire)) &&
+                    pred->next[level].load(std::memory_order_acquire)==succ;
+            }
+            if(!valid)
+                continue;
+            node* const n=new node(key,value,top);
+            for(int level=0;level<=top;++level)
+                n->next[level].store(succs[level],std::memory_order_relaxed);
+            for(int level=0;level<=top;++level)
+                preds[level]->next[level].store(n,std::memory_order_release);
+            n->fully_linked.store(true,std::memory_order_release);
+            return true;
+        }
+    }
+
+    bool erase(std::uint64_t key)
+    {
+        epoch_reclaimer::guard g;
+        node* preds[max_level];
+        node* succs[max_level];
+        node* victim=nullptr;
+        std::unique_lock<std::mutex> victim_lock;
+        for(;;)
+        {
+            int const found=find(key,preds,succs);
+            if(!victim)
+            {
+                if(found==-1)
+                    return false;
+                node* const n=succs[found];
+                if(!n->fully_linked.load(std::memory_order_acquire) || n->top!=found ||
+                   n->marked.load(std::memory_order_acquire))
+                    return false;
+                victim_lock=std::unique_lock<std::mutex>(n->m);
+                if(n->marked.load(std::memory_order_relaxed))
+                    return false;
+                n->marked.store(true,std::memory_order_release);
+                victim=n;
+            }
+            std::unique_lock<std::mutex> locks[max_level];
+            node* locked=nullptr;
+            bool valid=true;
+            for(int level=0;valid && level<=victim->top;++level)
+            {
+                node* const pred=preds[level];
+                if(pred!=locked)
+                {
+                    locks[level]=std::unique_lock<std::mutex>(pred->m);
+                    locked=pred;
+                }
+                valid=!pred->marked.load(std::memory_order_acquire) &&
+                    pred->next[level].load(std::memory_order_acquire)==victim;
+            }
+            if(!valid)
+                continue;
+            for(int level=victim->top;level>=0;--level)
+                preds[level]->next[level].store(victim->next[level].load(std::memory_order_relaxed),
+                                                std::memory_order_release);
+            victim_lock.unlock();
+            epoch_reclaimer::retire(victim);
+            return true;
+        }
+    }
+
+    template<typename F>
+    std::size_t scan(std::uint64_t from,std::uint64_t to,F fn)
+    {
+        epoch_reclaimer::guard g;
+        node* preds[max_level];
+        node* succs[max_level];
+        find(from,preds,succs);
+        std::size_t visited=0;
+        for(node* n=succs[0];n && n->key<=to;n=n->next[0].load(std::memory_order_acquire))
+        {
+            if(n->marked.load(std::memory_order_acquire) || !n->fully_linked.load(std::memory_order_acquire))
+                continue;
+            fn(n->key,n->value.load(std::memory_order_relaxed));
+            ++visited;
+        }
+        return visited;
+    }
+};
+
+class locked_map
+{
+    std::mutex m;
+    std::map<std::uint64_t,std::uint64_t> map;
+public:
+    bool find(std::uint64_t key,std::uint64_t& value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::map<std::uint64_t,std::uint64_t>::const_iterator const it=map.find(key);
+        if(it==map.end())
+            return false;
+        value=it->second;
+        return true;
+    }
+
+    bool insert_or_assign(std::uint64_t key,std::uint64_t value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::pair<std::map<std::uint64_t,std::uint64_t>::iterator,bool> const r=map.insert(std::make_pair(key,value));
+        if(!r.second)
+            r.first->second=value;
+        return r.second;
+    }
+
+    bool erase(std::uint64_t key)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return map.erase(key)==1;
+    }
+
+    template<typename F>
+    std::size_t scan(std::uint64_t from,std::uint64_t to,F fn)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::size_t visited=0;
+        for(std::map<std::uint64_t,std::uint64_t>::const_iterator it=map.lower_bound(from);
+            it!=map.end() && it->first<=to;++it,++visited)
+            fn(it->first,it->second);
+        return visited;
+    }
+};
+
+std::uint64_t mix(std::uint64_t x)
+{
+    x^=x>>33;
+    x*=0xff51afd7ed558ccdULL;
+    x^=x>>33;
+    x*=0xc4ceb9fe1a85ec53ULL;
+    x^=x>>33;
+    return x;
+}
+
+struct collect
+{
+    std::vector<std::pair<std::uint64_t,std::uint64_t> >& out;
+
+    void operator()(std::uint64_t key,std::uint64_t value) const
+    {
+        out.push_back(std::make_pair(key,value));
+    }
+};
+
+template<typename Index>
+bool check_against_map()
+{
+    Index index;
+    std::map<std::uint64_t,std::uint64_t> model;
+    std::uint64_t x=1;
+    std::vector<std::pair<std::uint64_t,std::uint64_t> > got;
+    for(unsigned i=0;i<300000;++i)
+    {
+        x=x*6364136223846793005ULL+1442695040888963407ULL;
+        std::uint64_t const key=(x>>33)%5000;
+        std::uint64_t value=0;
+        switch((x>>20)%4)
+        {
+        case 0:
+            if(index.insert_or_assign(key,i)!=(model.count(key)==0))
+                return false;
+            model[key]=i;
+            break;
+        case 1:
+            if(index.erase(key)!=(model.erase(key)==1))
+                return false;
+            break;
+        case 2:
+            if(index.find(key,value)!=(model.count(key)==1) || (model.count(key) && value!=model[key]))
+                return false;
+            break;
+        default:
+        {
+            std::uint64_t const to=key+(x>>40)%200;
+            got.clear();
+            collect c={got};
+            index.scan(key,to,c);
+            std::map<std::uint64_t,std::uint64_t>::const_iterator it=model.lower_bound(key);
+            for(std::size_t j=0;j<got.size();++j,++it)
+            {
+                if(it==model.end() || it->first!=got[j].first || it->second!=got[j].second)
+                    return false;
+            }
+            if(it!=model.end() && it->first<=to)
+                return false;
+        }
+        }
+    }
+    return true;
+}
+
+struct check_sorted
+{
+    std::uint64_t& last;
+    bool& sorted;
+
+    void operator()(std::uint64_t key,std::uint64_t value) const
+    {
+        if((last!=0 && key<=last) || value!=key*3)
+            sorted=false;
+        last=key;
+    }
+};
+
+template<typename Index>
+bool check_concurrent(unsigned threads,std::uint64_t per_thread)
+{
+    Index index;
+    std::atomic<bool> done(false);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(std::uint64_t i=0;i<per_thread;++i)
+            {
+                std::uint64_t const key=mix(i*threads+t)|1;
+                index.insert_or_assign(key,key*3);
+            }
+        }));
+    }
+    std::thread reader([&]{
+        std::uint64_t x=1,v;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::uint64_t const key=mix((x>>33)%(threads*per_thread))|1;
+            if(index.find(key,v) && v!=key*3)
+                ok=false;
+        }
+    });
+    std::thread scanner([&]{
+        std::uint64_t x=7;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::uint64_t last=0;
+            bool sorted=true;
+            check_sorted c={last,sorted};
+            index.scan(x,x+(std::uint64_t(1)<<52),c);
+            if(!sorted)
+                ok=false;
+        }
+    });
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    done=true;
+    reader.join();
+    scanner.join();
+    std::uint64_t last=0;
+    bool sorted=true;
+    check_sorted c={last,sorted};
+    std::size_t const all=index.scan(0,~std::uint64_t(0),c);
+    if(!ok || !sorted || all!=threads*per_thread)
+        return false;
+    workers.clear();
+    // Erase keys from even i while readers look for the ones from odd i
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(std::uint64_t i=2*t;i<threads*per_thread;i+=2*threads)
+            {
+                if(!index.erase(mix(i)|1))
+                    ok=false;
+            }
+        }));
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t v;
+            for(std::uint64_t i=2*t+1;i<threads*per_thread;i+=2*threads)
+            {
+                std::uint64_t const key=mix(i)|1;
+                if(!index.find(key,v) || v!=key*3)
+                    ok=false;
+            }
+        }));
+    }
+    for(std::size_t i=0;i<workers.size();++i)
+        workers[i].join();
+    last=0;
+    return ok && index.scan(0,~std::uint64_t(0),c)==threads*per_thread/2 && sorted;
+}
+
+template<typename Index>
+bool checks()
+{
+    return check_against_map<Index>() && check_concurrent<Index>(4,50000);
+}
+
+struct sum_values
+{
+    std::uint64_t& sum;
+
+    void operator()(std::uint64_t,std::uint64_t value) const
+    {
+        sum+=value;
+    }
+};
+
+// What the operations found, so that none of them can be optimised away
+std::atomic<std::uint64_t> sink(0);
+
+template<typename Index,typename Op>
+double run(Index& index,unsigned threads,unsigned ops,Op op)
+{
+    std::vector<std::thread> workers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t x=t+1,found=0;
+            for(unsigned i=0;i<ops;++i)
+            {
+                x=x*6364136223846793005ULL+1442695040888963407ULL;
+                found+=op(index,x);
+            }
+            sink+=found;
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return static_cast<double>(threads)*ops/
+        std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+template<typename Index>
+void bench(char const* name,std::uint64_t keys,unsigned threads,unsigned ops)
+{
+    Index index;
+    bench_clock::time_point const start=bench_clock::now();
+    for(std::uint64_t i=0;i<keys;++i)
+        index.insert_or_assign(mix(i),i);
+    double const load_ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/keys;
+
+    // Keys from 0 to 2*keys-1 through mix: half were loaded
+    double const lookups=run(index,threads,ops,[keys](Index& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t v=0;
+        return ix.find(mix((x>>33)%(2*keys)),v)+v;
+    });
+    double const mixed=run(index,threads,ops,[keys](Index& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t const key=mix((x>>33)%(2*keys));
+        unsigned const dice=(x>>20)%100;
+        std::uint64_t v=0;
+        if(dice<5)
+            return ix.insert_or_assign(key,x);
+        if(dice<10)
+            return ix.erase(key);
+        return ix.find(key,v)+v;
+    });
+    std::uint64_t const span=~std::uint64_t(0)/keys*100;
+    double const scans=run(index,threads,ops/20,[span](Index& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t sum=0;
+        sum_values s={sum};
+        ix.scan(x,x>~std::uint64_t(0)-span?~std::uint64_t(0):x+span,s);
+        return sum;
+    });
+    std::cout << name << "\t" << load_ns << "\t\t" << lookups << "\t" << mixed << "\t"
+              << scans*1000 << std::endl;
+}
+
+template<unsigned Lines>
+void bench_node_size(std::uint64_t keys,unsigned threads,unsigned ops)
+{
+    concurrent_btree<std::uint64_t,Lines> index;
+    for(std::uint64_t i=0;i<keys;++i)
+        index.insert_or_assign(mix(i),i);
+    double const lookups=run(index,threads,ops,[keys](concurrent_btree<std::uint64_t,Lines>& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t v=0;
+        return ix.find(mix((x>>33)%(2*keys)),v)+v;
+    });
+    std::cout << Lines << " lines\t" << concurrent_btree<std::uint64_t,Lines>::slots << "\t" << lookups << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    std::uint64_t const keys=argc>1?std::strtoull(argv[1],nullptr,10):1000000;
+    unsigned const threads=4;
+    unsigned const ops=1000000;
+
+    std::cout << "concurrent_btree checks: " << (checks<concurrent_btree<> >()?"ok":"FAILED") << std::endl
+              << "skip_list checks:        " << (checks<skip_list>()?"ok":"FAILED") << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << keys << " keys, "
+              << threads << " threads" << std::endl
+              << "index\tload ns/key\tMlookups/s\tMops/s 90/5/5\tKscans/s (~100 keys)" << std::endl;
+    bench<concurrent_btree<> >("btree",keys,threads,ops);
+    bench<skip_list>("skiplist",keys,threads,ops);
+    bench<locked_map>("map",keys,threads,ops);
+
+    std::cout << std::endl << "node size\tkeys\tMlookups/s" << std::endl;
+    bench_node_size<2>(keys,threads,ops);
+    bench_node_size<4>(keys,threads,ops);
+    bench_node_size<8>(keys,threads,ops);
+    return 0;
+}
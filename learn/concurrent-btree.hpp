@@ -0,0 +1,495 @@
+#ifndef CONCURRENT_BTREE_HPP
+#define CONCURRENT_BTREE_HPP
+
+#include <atomic>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "cache-line.hpp"
+#include "optimistic-lock.hpp"
+#include "sharded-counter.hpp"
+
+/**
+ * Concurrent B+tree with optimistic lock coupling
+ * ===============================================
+ *
+ * chapter 6's threadsafe_list walks hand over hand: lock the next node,
+ * then drop the one behind. That keeps a writer from overtaking a reader,
+ * but every reader writes two lock words per node, and on a list the walk
+ * is as long as the list. This is the same coupling on a B+tree, where a
+ * walk is a handful of nodes, and done optimistically (Leis et al.):
+ *
+ *  - Every node has a version word, odd while a writer holds it. A reader
+ *    notes a node's version, reads what it needs (the child to go to, or
+ *    the value), and checks the version is still the same. If not, or if
+ *    it was odd, the reader starts again from the root. Readers write
+ *    nothing shared, so they don't bounce cache lines between cores.
+ *  - The coupling is in the order of the checks: a child's version is
+ *    read before the parent's is checked again, so no split can slip in
+ *    between.
+ *  - Writers descend the same way and lock only the nodes they change: the
+ *    leaf for an insert or erase. A full node is split on the way down, so
+ *    a split locks that node and its parent, which has room because it was
+ *    split first if it didn't; then the writer starts again.
+ *
+ * Keys are 8-byte integers. Inner nodes and leaves are Lines cache lines
+ * each, aligned to them, and hold as many keys as fit: 14 for the default
+ * of four lines. Leaves are linked left to right for range scans.
+ *
+ * Nodes are read while a writer may be changing them, so keys, children
+ * and values are relaxed atomics (values must be trivially copyable and at
+ * most 8 bytes); what a torn read returns is thrown away when the version
+ * doesn't match. Erasing removes a key from its leaf but never merges
+ * nodes, so no node is freed before the tree is, and an optimistic reader
+ * can't land on freed memory. A tree that shrinks keeps its nodes.
+*/
+
+template<typename Value=std::uint64_t,unsigned Lines=4>
+class concurrent_btree
+{
+    static_assert(std::is_trivially_copyable<Value>::value && sizeof(Value)<=8,
+                  "concurrent_btree: values are read optimistically and must be trivially copyable words");
+
+public:
+    typedef std::uint64_t key_type;
+
+    // version, count and leaf flag, then one more word: next or the extra child
+    static unsigned const slots=(Lines*cache_line_size-24)/16;
+    static_assert(slots>=3,"concurrent_btree: nodes need room for at least three keys");
+
+private:
+    struct node:
+        cache_aligned_new,
+        optimistic_lock
+    {
+        std::atomic<std::uint32_t> count;
+        bool const leaf;
+
+        explicit node(bool leaf_):
+            count(0),leaf(leaf_)
+        {}
+
+        std::uint32_t size() const
+        {
+            // A torn read can claim anything; keep the index in bounds
+            std::uint32_t const n=count.load(std::memory_order_relaxed);
+            return n<slots?n:slots;
+        }
+
+        bool full() const
+        {
+            return count.load(std::memory_order_relaxed)==slots;
+        }
+    };
+
+    struct alignas(cache_line_size) leaf_node:
+        node
+    {
+        std::atomic<leaf_node*> next;
+        std::atomic<std::uint64_t> keys[slots];
+        std::atomic<std::uint64_t> values[slots];
+
+        leaf_node():
+            node(true),next(nullptr)
+        {}
+    };
+
+    struct alignas(cache_line_size) inner_node:
+        node
+    {
+        // children[i] holds the keys in (keys[i-1], keys[i]]
+        std::atomic<std::uint64_t> keys[slots];
+        std::atomic<node*> children[slots+1];
+
+        // Readers may load a slot before validating, so no slot is ever
+        // left uninitialised
+        inner_node():
+            node(false)
+        {
+            for(unsigned i=0;i<slots;++i)
+                keys[i].store(0,std::memory_order_relaxed);
+            for(unsigned i=0;i<=slots;++i)
+                children[i].store(nullptr,std::memory_order_relaxed);
+        }
+    };
+
+    static_assert(sizeof(leaf_node)==Lines*cache_line_size && sizeof(inner_node)==Lines*cache_line_size,
+                  "concurrent_btree: nodes should fill their cache lines exactly");
+
+    std::atomic<node*> root;
+    sharded_counter entries;
+
+    static std::uint64_t word_of(Value const& value)
+    {
+        std::uint64_t word=0;
+        std::memcpy(&word,&value,sizeof(Value));
+        return word;
+    }
+
+    static Value value_of(std::uint64_t word)
+    {
+        Value value;
+        std::memcpy(&value,&word,sizeof(Value));
+        return value;
+    }
+
+    /**
+     * The first position whose key is >= key, among the node's first n.
+    */
+    static unsigned lower_bound(std::atomic<std::uint64_t> const* keys,unsigned n,key_type key)
+    {
+        unsigned lo=0;
+        while(lo<n)
+        {
+            unsigned const mid=(lo+n)/2;
+            if(keys[mid].load(std::memory_order_relaxed)<key)
+                lo=mid+1;
+            else
+                n=mid;
+        }
+        return lo;
+    }
+
+    static unsigned child_index(inner_node const* in,key_type key)
+    {
+        return lower_bound(in->keys,in->size(),key);
+    }
+
+    /**
+     * Descends to the leaf that covers key and read-locks it. False if
+     * something changed on the way and the caller should start again.
+    */
+    bool find_leaf(key_type key,leaf_node*& leaf,std::uint64_t& seen) const
+    {
+        node* n=root.load(std::memory_order_acquire);
+        std::uint64_t v;
+        if(!n->read_lock(v) || n!=root.load(std::memory_order_acquire))
+            return false;
+        while(!n->leaf)
+        {
+            inner_node const* const in=static_cast<inner_node const*>(n);
+            node* const child=in->children[child_index(in,key)].load(std::memory_order_relaxed);
+            std::uint64_t child_seen;
+            // A null child means we read a slot a writer hadn't filled yet
+            if(!child || !n->validate(v) || !child->read_lock(child_seen) || !n->validate(v))
+                return false;
+            n=child;
+            v=child_seen;
+        }
+        leaf=static_cast<leaf_node*>(n);
+        seen=v;
+        return true;
+    }
+
+    /**
+     * Splits full, which the caller has locked, moving its upper half to a
+     * new node, and returns that with the key that now separates them.
+    */
+    static node* split(node* full,key_type& separator)
+    {
+        if(full->leaf)
+        {
+            leaf_node* const left=static_cast<leaf_node*>(full);
+            leaf_node* const right=new leaf_node;
+            unsigned const keep=slots/2;
+            for(unsigned i=keep;i<slots;++i)
+            {
+                right->keys[i-keep].store(left->keys[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+                right->values[i-keep].store(left->values[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+            }
+            right->count.store(slots-keep,std::memory_order_relaxed);
+            right->next.store(left->next.load(std::memory_order_relaxed),std::memory_order_relaxed);
+            // Published by the unlock of left
+            left->next.store(right,std::memory_order_relaxed);
+            left->count.store(keep,std::memory_order_relaxed);
+            separator=left->keys[keep-1].load(std::memory_order_relaxed);
+            return right;
+        }
+        inner_node* const left=static_cast<inner_node*>(full);
+        inner_node* const right=new inner_node;
+        unsigned const mid=slots/2;
+        separator=left->keys[mid].load(std::memory_order_relaxed);
+        for(unsigned i=mid+1;i<slots;++i)
+            right->keys[i-mid-1].store(left->keys[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+        for(unsigned i=mid+1;i<=slots;++i)
+            right->children[i-mid-1].store(left->children[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+        right->count.store(slots-mid-1,std::memory_order_relaxed);
+        left->count.store(mid,std::memory_order_relaxed);
+        return right;
+    }
+
+    // With parent locked and not full: right goes after the child that split
+    static void insert_child(inner_node* parent,key_type separator,node* right)
+    {
+        unsigned const n=parent->count.load(std::memory_order_relaxed);
+        unsigned const pos=lower_bound(parent->keys,n,separator);
+        for(unsigned i=n;i>pos;--i)
+        {
+            parent->keys[i].store(parent->keys[i-1].load(std::memory_order_relaxed),std::memory_order_relaxed);
+            parent->children[i+1].store(parent->children[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+        }
+        parent->keys[pos].store(separator,std::memory_order_relaxed);
+        parent->children[pos+1].store(right,std::memory_order_relaxed);
+        parent->count.store(n+1,std::memory_order_relaxed);
+    }
+
+    /**
+     * Splits n, which the walk reached at version seen under parent (null
+     * for the root) at parent_seen. Either way the caller starts again.
+    */
+    void split_on_the_way(node* n,std::uint64_t seen,inner_node* parent,std::uint64_t parent_seen)
+    {
+        if(parent && !parent->upgrade(parent_seen))
+            return;
+        if(!n->upgrade(seen))
+        {
+            if(parent)
+                parent->unlock();
+            return;
+        }
+        // Without a parent, n must still be the root it was
+        if(!parent && n!=root.load(std::memory_order_relaxed))
+        {
+            n->unlock();
+            return;
+        }
+        key_type separator;
+        node* const right=split(n,separator);
+        if(parent)
+            insert_child(parent,separator,right);
+        else
+        {
+            inner_node* const new_root=new inner_node;
+            new_root->keys[0].store(separator,std::memory_order_relaxed);
+            new_root->children[0].store(n,std::memory_order_relaxed);
+            new_root->children[1].store(right,std::memory_order_relaxed);
+            new_root->count.store(1,std::memory_order_relaxed);
+            root.store(new_root,std::memory_order_release);
+        }
+        n->unlock();
+        if(parent)
+            parent->unlock();
+    }
+
+    enum class insert_result{inserted,assigned,retry};
+
+    insert_result try_insert(key_type key,std::uint64_t word)
+    {
+        node* n=root.load(std::memory_order_acquire);
+        std::uint64_t v;
+        if(!n->read_lock(v) || n!=root.load(std::memory_order_acquire))
+            return insert_result::retry;
+        inner_node* parent=nullptr;
+        std::uint64_t parent_seen=0;
+        for(;;)
+        {
+            if(n->leaf)
+                break;
+            inner_node* const in=static_cast<inner_node*>(n);
+            if(in->full())
+            {
+                split_on_the_way(n,v,parent,parent_seen);
+                return insert_result::retry;
+            }
+            node* const child=in->children[child_index(in,key)].load(std::memory_order_relaxed);
+            std::uint64_t child_seen;
+            if(!child || !n->validate(v) || !child->read_lock(child_seen) || !n->validate(v))
+                return insert_result::retry;
+            parent=in;
+            parent_seen=v;
+            n=child;
+            v=child_seen;
+        }
+        leaf_node* const leaf=static_cast<leaf_node*>(n);
+        unsigned const count=leaf->size();
+        unsigned const pos=lower_bound(leaf->keys,count,key);
+        bool const present=pos<count && leaf->keys[pos].load(std::memory_order_relaxed)==key;
+        if(!present && count==slots)
+        {
+            split_on_the_way(n,v,parent,parent_seen);
+            return insert_result::retry;
+        }
+        // A leaf's key range only changes when it splits, which changes its
+        // version, so holding it at v is enough; the parent needn't stay
+        if(!leaf->upgrade(v))
+            return insert_result::retry;
+        if(present)
+            leaf->values[pos].store(word,std::memory_order_relaxed);
+        else
+        {
+            for(unsigned i=count;i>pos;--i)
+            {
+                leaf->keys[i].store(leaf->keys[i-1].load(std::memory_order_relaxed),std::memory_order_relaxed);
+                leaf->values[i].store(leaf->values[i-1].load(std::memory_order_relaxed),std::memory_order_relaxed);
+            }
+            leaf->keys[pos].store(key,std::memory_order_relaxed);
+            leaf->values[pos].store(word,std::memory_order_relaxed);
+            leaf->count.store(count+1,std::memory_order_relaxed);
+        }
+        leaf->unlock();
+        if(present)
+            return insert_result::assigned;
+        entries.add(1);
+        return insert_result::inserted;
+    }
+
+    static void destroy(node* n)
+    {
+        if(n->leaf)
+        {
+            delete static_cast<leaf_node*>(n);
+            return;
+        }
+        inner_node* const in=static_cast<inner_node*>(n);
+        for(unsigned i=0;i<=in->count.load(std::memory_order_relaxed);++i)
+            destroy(in->children[i].load(std::memory_order_relaxed));
+        delete in;
+    }
+
+public:
+    concurrent_btree():
+        root(new leaf_node)
+    {}
+
+    ~concurrent_btree()
+    {
+        destroy(root.load(std::memory_order_relaxed));
+    }
+
+    concurrent_btree(concurrent_btree const&)=delete;
+    concurrent_btree& operator=(concurrent_btree const&)=delete;
+
+    bool find(key_type key,Value& value) const
+    {
+        for(;;)
+        {
+            leaf_node* leaf;
+            std::uint64_t seen;
+            if(!find_leaf(key,leaf,seen))
+                continue;
+            unsigned const count=leaf->size();
+            unsigned const pos=lower_bound(leaf->keys,count,key);
+            bool const found=pos<count && leaf->keys[pos].load(std::memory_order_relaxed)==key;
+            std::uint64_t const word=found?leaf->values[pos].load(std::memory_order_relaxed):0;
+            if(!leaf->validate(seen))
+                continue;
+            if(found)
+                value=value_of(word);
+            return found;
+        }
+    }
+
+    bool contains(key_type key) const
+    {
+        Value ignored;
+        return find(key,ignored);
+    }
+
+    /**
+     * True if key was new.
+    */
+    bool insert_or_assign(key_type key,Value const& value)
+    {
+        std::uint64_t const word=word_of(value);
+        for(;;)
+        {
+            insert_result const r=try_insert(key,word);
+            if(r!=insert_result::retry)
+                return r==insert_result::inserted;
+        }
+    }
+
+    bool erase(key_type key)
+    {
+        for(;;)
+        {
+            leaf_node* leaf;
+            std::uint64_t seen;
+            if(!find_leaf(key,leaf,seen))
+                continue;
+            unsigned const count=leaf->size();
+            unsigned const pos=lower_bound(leaf->keys,count,key);
+            if(!(pos<count && leaf->keys[pos].load(std::memory_order_relaxed)==key))
+            {
+                if(!leaf->validate(seen))
+                    continue;
+                return false;
+            }
+            if(!leaf->upgrade(seen))
+                continue;
+            for(unsigned i=pos+1;i<count;++i)
+            {
+                leaf->keys[i-1].store(leaf->keys[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+                leaf->values[i-1].store(leaf->values[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+            }
+            leaf->count.store(count-1,std::memory_order_relaxed);
+            leaf->unlock();
+            entries.add(-1);
+            return true;
+        }
+    }
+
+    /**
+     * Calls fn(key,value) for every key in [from,to], in order, and returns
+     * how many that was. Each leaf is read consistently and fn runs outside
+     * it, but the scan as a whole isn't a snapshot: keys added or erased
+     * while it runs may or may not be seen.
+    */
+    template<typename F>
+    std::size_t scan(key_type from,key_type to,F fn) const
+    {
+        if(from>to)
+            return 0;
+        leaf_node* leaf;
+        std::uint64_t seen;
+        while(!find_leaf(from,leaf,seen))
+            ;
+        std::size_t visited=0;
+        key_type copied_keys[slots];
+        std::uint64_t copied_values[slots];
+        for(;;)
+        {
+            unsigned const count=leaf->size();
+            unsigned n=0;
+            for(unsigned i=0;i<count;++i)
+            {
+                copied_keys[n]=leaf->keys[i].load(std::memory_order_relaxed);
+                copied_values[n]=leaf->values[i].load(std::memory_order_relaxed);
+                n+=copied_keys[n]>=from;
+            }
+            leaf_node* const next=leaf->next.load(std::memory_order_relaxed);
+            if(!leaf->validate(seen))
+            {
+                // If it split, what moved right is linked after it: read it again
+                while(!leaf->read_lock(seen))
+                    ;
+                continue;
+            }
+            for(unsigned i=0;i<n;++i)
+            {
+                if(copied_keys[i]>to)
+                    return visited;
+                fn(copied_keys[i],value_of(copied_values[i]));
+                ++visited;
+            }
+            if(!next || (n && copied_keys[n-1]==to))
+                return visited;
+            if(n)
+                from=copied_keys[n-1]+1;
+            leaf=next;
+            while(!leaf->read_lock(seen))
+                ;
+        }
+    }
+
+    /**
+     * Exact only when nothing is changing the tree.
+    */
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(entries.value());
+    }
+};
+
+#endif
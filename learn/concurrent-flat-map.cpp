@@ -0,0 +1,240 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+#include "concurrent-flat-map.hpp"
+#include "striped-hash-map.hpp"
+
+/**
+ * Flat vs chained concurrent hash maps
+ * ====================================
+ *
+ * 1. Checks, for concurrent_flat_map and striped_hash_map alike: random
+ *    operations in a small table against std::unordered_map; four threads
+ *    upserting counters on shared keys; readers running during inserts and
+ *    erases never see a value that wasn't stored for that key. And the
+ *    striped map growing from 16 buckets under concurrent inserts and
+ *    lookups.
+ *
+ * 2. 2^22 slots filled to 50% and 90% load: memory per entry (heap in
+ *    use, from mallinfo2, so malloc's overhead per node is counted), ns
+ *    per insert, and lookups/s from four threads with half the keys
+ *    looked up missing. The striped map gets as many buckets as the flat
+ *    map has slots, so its chains are as long as the load factor.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+std::size_t heap_in_use()
+{
+    struct mallinfo2 const m=mallinfo2();
+    return m.uordblks+m.hblkhd;
+}
+
+template<typename Map>
+bool check_against_unordered_map()
+{
+    Map map(4096);
+    std::unordered_map<std::uint64_t,std::uint64_t> model;
+    std::uint64_t x=1;
+    for(unsigned i=0;i<200000;++i)
+    {
+        x=x*6364136223846793005ULL+1442695040888963407ULL;
+        std::uint64_t const key=(x>>33)%3000;
+        std::uint64_t value=0;
+        switch((x>>20)%3)
+        {
+        case 0:
+            if(map.insert_or_assign(key,i)!=(model.count(key)==0))
+                return false;
+            model[key]=i;
+            break;
+        case 1:
+            if(map.erase(key)!=(model.erase(key)==1))
+                return false;
+            break;
+        default:
+            if(map.find(key,value)!=(model.count(key)==1) || (model.count(key) && value!=model[key]))
+                return false;
+        }
+    }
+    return map.size()==model.size();
+}
+
+template<typename Map>
+bool check_concurrent_upserts(unsigned threads,unsigned per_thread)
+{
+    Map map(4096);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            for(unsigned i=0;i<per_thread;++i)
+                map.upsert(i%1000,[](std::uint64_t& v){ ++v; });
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    std::uint64_t total=0;
+    for(std::uint64_t k=0;k<1000;++k)
+    {
+        std::uint64_t v=0;
+        map.find(k,v);
+        total+=v;
+    }
+    return total==static_cast<std::uint64_t>(threads)*per_thread && map.size()==1000;
+}
+
+template<typename Map>
+bool check_readers_during_writes(unsigned readers)
+{
+    std::uint64_t const keys=20000;
+    Map map(2*keys);
+    std::atomic<bool> done(false);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> threads;
+    for(unsigned r=0;r<readers;++r)
+    {
+        threads.push_back(std::thread([&,r]{
+            std::uint64_t x=r+1;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                x=x*6364136223846793005ULL+1442695040888963407ULL;
+                std::uint64_t const key=(x>>33)%keys;
+                std::uint64_t value;
+                if(map.find(key,value) && value!=key*3 && value!=key*5)
+                    ok=false;
+            }
+        }));
+    }
+    for(unsigned round=0;round<10;++round)
+    {
+        for(std::uint64_t k=0;k<keys;++k)
+            map.insert_or_assign(k,round%2?k*5:k*3);
+        for(std::uint64_t k=round%2;k<keys;k+=2)
+            map.erase(k);
+    }
+    done=true;
+    for(unsigned r=0;r<readers;++r)
+        threads[r].join();
+    return ok;
+}
+
+bool check_growth(unsigned threads,std::uint64_t per_thread)
+{
+    striped_hash_map<std::uint64_t,std::uint64_t> map(16);
+    std::atomic<bool> done(false);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(std::uint64_t i=0;i<per_thread;++i)
+                map.insert_or_assign(t*per_thread+i,i);
+        }));
+    }
+    // Keys found while the table drains into a bigger one must be right
+    std::thread reader([&]{
+        std::uint64_t x=1,v;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::uint64_t const key=(x>>33)%(threads*per_thread);
+            if(map.find(key,v) && v!=key%per_thread)
+                ok=false;
+        }
+    });
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    done=true;
+    reader.join();
+    if(!ok)
+        return false;
+    for(std::uint64_t k=0;k<threads*per_thread;++k)
+    {
+        std::uint64_t v;
+        if(!map.find(k,v) || v!=k%per_thread)
+            return false;
+    }
+    return map.size()==threads*per_thread && map.bucket_count()>=threads*per_thread;
+}
+
+template<typename Map>
+bool checks()
+{
+    return check_against_unordered_map<Map>() && check_concurrent_upserts<Map>(4,100000) &&
+        check_readers_during_writes<Map>(3);
+}
+
+template<typename Map>
+void bench(char const* name,std::size_t slots,double load,unsigned threads,unsigned lookups,
+           std::size_t table_size)
+{
+    std::uint64_t const entries=static_cast<std::uint64_t>(slots*load);
+    std::size_t const heap_before=heap_in_use();
+    Map map(table_size);
+    bench_clock::time_point start=bench_clock::now();
+    for(std::uint64_t k=0;k<entries;++k)
+        map.insert_or_assign(k,k);
+    double const insert_ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/entries;
+    double const bytes_per_entry=static_cast<double>(heap_in_use()-heap_before)/entries;
+
+    std::vector<std::thread> workers;
+    std::atomic<std::uint64_t> found(0);
+    start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t x=t+1,f=0,value;
+            for(unsigned i=0;i<lookups;++i)
+            {
+                x=x*6364136223846793005ULL+1442695040888963407ULL;
+                f+=map.find((x>>33)%(2*entries),value);
+            }
+            found+=f;
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    double const mlookups=static_cast<double>(threads)*lookups/
+        std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+    std::cout << name << "\t" << 100*load << "%\t" << bytes_per_entry << "\t\t" << insert_ns << "\t\t" << mlookups
+              << "\t(" << 100.0*found/(static_cast<double>(threads)*lookups) << "% hits)" << std::endl;
+}
+
+struct striped_map:
+    striped_hash_map<std::uint64_t,std::uint64_t>
+{
+    // As many buckets as requested and no growing
+    explicit striped_map(std::size_t buckets):
+        striped_hash_map<std::uint64_t,std::uint64_t>(buckets,2.0f)
+    {}
+};
+
+typedef concurrent_flat_map<std::uint64_t,std::uint64_t> flat_map;
+
+int main(int argc,char* argv[])
+{
+    std::size_t const slots=argc>1?std::strtoull(argv[1],nullptr,10):std::size_t(1)<<22;
+    unsigned const threads=4;
+    unsigned const lookups=2000000;
+
+    std::cout << "concurrent_flat_map checks: " << (checks<flat_map>()?"ok":"FAILED") << std::endl
+              << "striped_hash_map checks:    "
+              << (checks<striped_map>() && check_growth(4,50000)?"ok":"FAILED") << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << slots << " slots, "
+              << threads << " threads looking up" << std::endl
+              << "map\tload\tbytes/entry\tinsert ns\tMlookups/s" << std::endl;
+    for(double load=0.5;load<1;load+=0.4)
+    {
+        bench<flat_map>("flat",slots,load,threads,lookups,slots);
+        bench<striped_map>("striped",slots,load,threads,lookups,slots);
+    }
+    return 0;
+}
@@ -0,0 +1,441 @@
+#ifndef CONCURRENT_FLAT_MAP_HPP
+#define CONCURRENT_FLAT_MAP_HPP
+
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "cache-line.hpp"
+#include "optimistic-lock.hpp"
+#include "hash-mix.hpp"
+#include "sharded-counter.hpp"
+
+/**
+ * Concurrent flat map
+ * ===================
+ *
+ * A chained table (striped_hash_map, or buckets of chapter 6's
+ * threadsafe_list) pays a lock and a pointer chase per node it visits.
+ * This one stores entries in place, Swiss-table style: slots come in
+ * groups of 16, and each group has 16 one-byte tags next to each other.
+ * A tag is 0x80 for an empty slot, 0xfe for a deleted one, or the low 7
+ * bits of the key's hash. A lookup hashes to a home group, compares all
+ * 16 tags against its 7 bits with one SSE2 compare (a byte loop where
+ * there is no SSE2), and compares keys only where a tag matched. If the
+ * group has an empty slot the key isn't further along; otherwise it goes
+ * on to the next group in a triangular probe sequence.
+ *
+ * Synchronisation
+ * ---------------
+ *  - Every group has a version. Writers make it odd while they change the
+ *    group and even again after, like a seqlock; that is the only lock a
+ *    writer holds on a group, and never on two at once.
+ *  - Readers take no lock and write nothing shared. They read a group's
+ *    version, tags, keys and value, then check the version: if it is odd
+ *    or has moved they read the group again.
+ *  - Writers for keys with the same home group are serialised by a spin
+ *    lock in the home group, so that two inserts of one key can't both
+ *    find it missing and both add it. Home locks are never nested. Holding
+ *    it, a writer knows no one else can add, move or remove its key, so it
+ *    searches the way readers do and only locks the group it changes.
+ *
+ * Keys and values are read while a writer may be changing them, so they
+ * must be trivially copyable. They are stored as arrays of relaxed atomic
+ * words, which keeps those racing reads well defined; what a torn read
+ * returns is thrown away when the version doesn't match.
+ *
+ * A slot that is erased becomes empty if its group has another empty
+ * slot, since no probe went past such a group, and deleted otherwise.
+ * Inserts reuse deleted slots. The capacity is fixed at construction:
+ * there is no rehash, and insert_or_assign() throws std::length_error when
+ * no slot is left. Above 7/8 full, probe sequences get long.
+*/
+
+namespace flat_map_detail
+{
+    static std::uint8_t const empty_tag=0x80;
+    static std::uint8_t const deleted_tag=0xfe;
+    static std::uint64_t const all_empty=0x8080808080808080ULL;
+
+    /**
+     * Empty or deleted: the tags with the top bit set.
+    */
+    inline unsigned match_free(std::uint64_t low,std::uint64_t high)
+    {
+#if defined(__SSE2__)
+        __m128i const tags=_mm_set_epi64x(static_cast<long long>(high),static_cast<long long>(low));
+        return static_cast<unsigned>(_mm_movemask_epi8(tags));
+#else
+        unsigned m=0;
+        for(unsigned i=0;i<8;++i)
+        {
+            m|=static_cast<unsigned>((low>>(8*i+7))&1)<<i;
+            m|=static_cast<unsigned>((high>>(8*i+7))&1)<<(i+8);
+        }
+        return m;
+#endif
+    }
+
+    /**
+     * A trivially copyable T kept in relaxed atomic words.
+    */
+    template<typename T>
+    struct atomic_words
+    {
+        static std::size_t const count=(sizeof(T)+7)/8;
+        std::atomic<std::uint64_t> words[count];
+
+        atomic_words()
+        {
+            for(std::size_t i=0;i<count;++i)
+                words[i].store(0,std::memory_order_relaxed);
+        }
+
+        void store(T const& value)
+        {
+            std::uint64_t buffer[count]={};
+            std::memcpy(buffer,&value,sizeof(T));
+            for(std::size_t i=0;i<count;++i)
+                words[i].store(buffer[i],std::memory_order_relaxed);
+        }
+
+        T load() const
+        {
+            std::uint64_t buffer[count];
+            for(std::size_t i=0;i<count;++i)
+                buffer[i]=words[i].load(std::memory_order_relaxed);
+            T value;
+            std::memcpy(&value,buffer,sizeof(T));
+            return value;
+        }
+    };
+
+    /**
+     * Makes an even lock word odd.
+    */
+    inline void spin_lock(std::atomic<std::uint32_t>& lock_word)
+    {
+        for(;;)
+        {
+            std::uint32_t v=lock_word.load(std::memory_order_relaxed);
+            if(!(v&1) && lock_word.compare_exchange_weak(v,v+1,std::memory_order_acquire))
+                return;
+            std::this_thread::yield();
+        }
+    }
+}
+
+template<typename Key,typename Value,typename Hash=std::hash<Key> >
+class concurrent_flat_map
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "concurrent_flat_map: keys and values are read optimistically and must be trivially copyable");
+
+    struct lookup
+    {
+        int slot;
+        unsigned free;
+        // The group has an empty slot, so the key isn't further along
+        bool end;
+    };
+
+    struct alignas(cache_line_size) group
+    {
+        // Held while a writer is changing the group
+        optimistic_lock version;
+        // Odd while a writer for a key whose home this is is working
+        std::atomic<std::uint32_t> home_lock;
+        std::atomic<std::uint64_t> tags[2];
+        flat_map_detail::atomic_words<Key> keys[16];
+        flat_map_detail::atomic_words<Value> values[16];
+
+        group():
+            home_lock(0)
+        {
+            tags[0].store(flat_map_detail::all_empty,std::memory_order_relaxed);
+            tags[1].store(flat_map_detail::all_empty,std::memory_order_relaxed);
+        }
+
+        void lock()
+        {
+            version.lock();
+        }
+
+        void unlock()
+        {
+            version.unlock();
+        }
+
+        // Only with the group locked
+        void set_tag(unsigned slot,std::uint8_t tag)
+        {
+            std::atomic<std::uint64_t>& word=tags[slot/8];
+            unsigned const shift=8*(slot%8);
+            std::uint64_t const w=word.load(std::memory_order_relaxed);
+            word.store((w&~(std::uint64_t(0xff)<<shift))|(std::uint64_t(tag)<<shift),std::memory_order_relaxed);
+        }
+
+        /**
+         * Reads the group without locking it: the slot holding key (or -1),
+         * which slots are free and whether any is empty; and key's value,
+         * if value isn't null.
+        */
+        void look(Key const& key,std::uint8_t tag,Value* value,lookup& result) const
+        {
+            for(;;)
+            {
+                std::uint64_t seen;
+                if(!version.read_lock(seen))
+                    continue;
+                std::uint64_t const low=tags[0].load(std::memory_order_relaxed);
+                std::uint64_t const high=tags[1].load(std::memory_order_relaxed);
+                result.slot=-1;
+                for(unsigned m=match_bytes16(low,high,tag);m;m&=m-1)
+                {
+                    unsigned const slot=__builtin_ctz(m);
+                    if(keys[slot].load()==key)
+                    {
+                        result.slot=static_cast<int>(slot);
+                        if(value)
+                            *value=values[slot].load();
+                        break;
+                    }
+                }
+                result.free=flat_map_detail::match_free(low,high);
+                result.end=match_bytes16(low,high,flat_map_detail::empty_tag)!=0;
+                if(version.validate(seen))
+                    return;
+            }
+        }
+
+        unsigned free_slots() const
+        {
+            return flat_map_detail::match_free(tags[0].load(std::memory_order_relaxed),
+                                               tags[1].load(std::memory_order_relaxed));
+        }
+
+        unsigned empty_slots() const
+        {
+            return match_bytes16(tags[0].load(std::memory_order_relaxed),
+                                          tags[1].load(std::memory_order_relaxed),
+                                          flat_map_detail::empty_tag);
+        }
+    };
+
+    struct home_guard
+    {
+        group& home;
+
+        explicit home_guard(group& home_):
+            home(home_)
+        {
+            flat_map_detail::spin_lock(home.home_lock);
+        }
+
+        ~home_guard()
+        {
+            home.home_lock.fetch_add(1,std::memory_order_release);
+        }
+    };
+
+    std::size_t const group_count;
+    group* const groups;
+    sharded_counter entries;
+    Hash hasher;
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t c=1;
+        while(c<n)
+            c<<=1;
+        return c;
+    }
+
+    std::uint64_t hash_of(Key const& key) const
+    {
+        return mix_hash(hasher(key));
+    }
+
+    static std::uint8_t tag_of(std::uint64_t hash)
+    {
+        return static_cast<std::uint8_t>(hash&0x7f);
+    }
+
+    group& probe(std::uint64_t hash,std::size_t i) const
+    {
+        // Triangular numbers visit every group when the count is a power of two
+        return groups[((hash>>7)+i*(i+1)/2)&(group_count-1)];
+    }
+
+    template<typename F>
+    bool upsert_hashed(Key const& key,std::uint64_t hash,F& fn)
+    {
+        std::uint8_t const tag=tag_of(hash);
+        home_guard home(probe(hash,0));
+        for(;;)
+        {
+            // Look for the key, remembering the first group with room
+            std::size_t free_at=group_count;
+            lookup r;
+            for(std::size_t i=0;i<group_count;++i)
+            {
+                group& g=probe(hash,i);
+                g.look(key,tag,nullptr,r);
+                if(r.slot>=0)
+                {
+                    g.lock();
+                    Value value=g.values[r.slot].load();
+                    fn(value);
+                    g.values[r.slot].store(value);
+                    g.unlock();
+                    return false;
+                }
+                if(free_at==group_count && r.free)
+                    free_at=i;
+                if(r.end)
+                    break;
+            }
+            if(free_at==group_count)
+                throw std::length_error("concurrent_flat_map: full");
+            group& g=probe(hash,free_at);
+            g.lock();
+            unsigned const free=g.free_slots();
+            // Another writer may have taken the room since: look again
+            if(!free)
+            {
+                g.unlock();
+                continue;
+            }
+            unsigned const slot=__builtin_ctz(free);
+            Value value=Value();
+            fn(value);
+            g.keys[slot].store(key);
+            g.values[slot].store(value);
+            g.set_tag(slot,tag);
+            g.unlock();
+            entries.add(1);
+            return true;
+        }
+    }
+
+    struct assign
+    {
+        Value const& value;
+
+        void operator()(Value& v) const
+        {
+            v=value;
+        }
+    };
+
+public:
+    /**
+     * Room for capacity entries, rounded up to a power of two.
+    */
+    explicit concurrent_flat_map(std::size_t capacity):
+        group_count(round_up((capacity+15)/16)),
+        groups(allocate_cache_aligned<group>(group_count))
+    {}
+
+    ~concurrent_flat_map()
+    {
+        free_cache_aligned(groups,group_count);
+    }
+
+    concurrent_flat_map(concurrent_flat_map const&)=delete;
+    concurrent_flat_map& operator=(concurrent_flat_map const&)=delete;
+
+    bool find(Key const& key,Value& value) const
+    {
+        std::uint64_t const hash=hash_of(key);
+        std::uint8_t const tag=tag_of(hash);
+        Value candidate;
+        lookup r;
+        for(std::size_t i=0;i<group_count;++i)
+        {
+            probe(hash,i).look(key,tag,&candidate,r);
+            if(r.slot>=0)
+            {
+                value=candidate;
+                return true;
+            }
+            if(r.end)
+                return false;
+        }
+        return false;
+    }
+
+    bool contains(Key const& key) const
+    {
+        Value ignored;
+        return find(key,ignored);
+    }
+
+    /**
+     * True if key was new.
+    */
+    bool insert_or_assign(Key const& key,Value const& value)
+    {
+        assign a={value};
+        return upsert_hashed(key,hash_of(key),a);
+    }
+
+    /**
+     * Calls fn(Value&) on key's value, or on a value-initialised one that
+     * is then inserted, with the group locked: readers of the group wait
+     * for it, so keep fn short. True if key was new.
+    */
+    template<typename F>
+    bool upsert(Key const& key,F fn)
+    {
+        return upsert_hashed(key,hash_of(key),fn);
+    }
+
+    bool erase(Key const& key)
+    {
+        std::uint64_t const hash=hash_of(key);
+        std::uint8_t const tag=tag_of(hash);
+        home_guard home(probe(hash,0));
+        lookup r;
+        for(std::size_t i=0;i<group_count;++i)
+        {
+            group& g=probe(hash,i);
+            g.look(key,tag,nullptr,r);
+            if(r.slot>=0)
+            {
+                g.lock();
+                g.set_tag(r.slot,g.empty_slots()?flat_map_detail::empty_tag:flat_map_detail::deleted_tag);
+                g.unlock();
+                entries.add(-1);
+                return true;
+            }
+            if(r.end)
+                return false;
+        }
+        return false;
+    }
+
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(entries.value());
+    }
+
+    std::size_t capacity() const
+    {
+        return 16*group_count;
+    }
+
+    std::size_t memory_bytes() const
+    {
+        return group_count*sizeof(group);
+    }
+};
+
+#endif
@@ -0,0 +1,482 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <list>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+#include "concurrent-radix-tree.hpp"
+#include "striped-hash-map.hpp"
+
+/**
+ * String keys: adaptive radix tree
+ * ================================
+ *
+ * 1. Checks: random inserts, erases, lookups, prefix walks, first-with-
+ *    prefix and longest-prefix matches on short keys over a four-letter
+ *    alphabet (so keys are often prefixes of each other, and nodes split
+ *    and grow), against std::map; four threads inserting URL paths and
+ *    session IDs while a reader checks values and a walker checks every
+ *    prefix walk is sorted and on its prefix; erasing half the keys while
+ *    readers look for the other half; six rounds of inserting and
+ *    erasing 100k session IDs, after which the heap should be back to an
+ *    empty tree.
+ *
+ * 2. One million keys, half URL paths (/api/v1/users/<id>/orders/<n>,
+ *    eight orders a user) and half 32-character session IDs, in
+ *    concurrent_radix_tree, std::map behind a mutex and striped_hash_map:
+ *    load time, heap per key, lookups/s from four threads with half of
+ *    them missing, and walks of one user's orders (a prefix). Then the
+ *    first key with a given prefix, from the tree and from a list scanned
+ *    the way threadsafe_list::find_first_if does.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+std::uint64_t mix(std::uint64_t x)
+{
+    x^=x>>33;
+    x*=0xff51afd7ed558ccdULL;
+    x^=x>>33;
+    x*=0xc4ceb9fe1a85ec53ULL;
+    x^=x>>33;
+    return x;
+}
+
+std::string user_prefix(std::uint64_t user)
+{
+    return "/api/v1/users/"+std::to_string(user)+"/orders/";
+}
+
+std::string session_id(std::uint64_t i)
+{
+    static char const hex[]="0123456789abcdef";
+    std::string id(32,'0');
+    std::uint64_t a=mix(i),b=mix(~i);
+    for(unsigned j=0;j<16;++j,a>>=4,b>>=4)
+    {
+        id[j]=hex[a&15];
+        id[16+j]=hex[b&15];
+    }
+    return id;
+}
+
+// Even i are URL paths, odd ones session IDs
+std::string key_of(std::uint64_t i)
+{
+    return i&1?session_id(i/2):user_prefix(i/16)+std::to_string((i/2)%8);
+}
+
+std::size_t heap_in_use()
+{
+    struct mallinfo2 const m=mallinfo2();
+    return m.uordblks+m.hblkhd;
+}
+
+typedef concurrent_radix_tree<std::uint64_t> radix_tree;
+
+struct collect
+{
+    std::vector<std::pair<std::string,std::uint64_t> >& out;
+
+    void operator()(std::string const& key,std::uint64_t value) const
+    {
+        out.push_back(std::make_pair(key,value));
+    }
+};
+
+bool check_against_map()
+{
+    radix_tree tree;
+    std::map<std::string,std::uint64_t> model;
+    std::vector<std::pair<std::string,std::uint64_t> > got;
+    std::uint64_t x=1;
+    for(unsigned i=0;i<400000;++i)
+    {
+        x=x*6364136223846793005ULL+1442695040888963407ULL;
+        std::string key;
+        for(unsigned n=(x>>60)%7,j=0;j<n;++j)
+            key.push_back("ab/c"[(x>>(20+2*j))&3]);
+        std::uint64_t value=0;
+        std::string found_key;
+        switch((x>>40)%6)
+        {
+        case 0:
+        case 1:
+            if(tree.insert_or_assign(key,i)!=(model.count(key)==0))
+                return false;
+            model[key]=i;
+            break;
+        case 2:
+            if(tree.erase(key)!=(model.erase(key)==1))
+                return false;
+            break;
+        case 3:
+            if(tree.find(key,value)!=(model.count(key)==1) || (model.count(key) && value!=model[key]))
+                return false;
+            break;
+        case 4:
+        {
+            got.clear();
+            collect c={got};
+            tree.for_each_prefix(key,c);
+            std::map<std::string,std::uint64_t>::const_iterator it=model.lower_bound(key);
+            for(std::size_t j=0;j<got.size();++j,++it)
+            {
+                if(it==model.end() || it->first!=got[j].first || it->second!=got[j].second)
+                    return false;
+            }
+            if(it!=model.end() && it->first.compare(0,key.size(),key)==0)
+                return false;
+            bool const first=tree.first_with_prefix(key,found_key,value);
+            if(first!=!got.empty() || (first && (found_key!=got[0].first || value!=got[0].second)))
+                return false;
+            break;
+        }
+        default:
+        {
+            // The longest key that is a prefix of this one
+            std::size_t n=key.size()+1;
+            while(n && !model.count(key.substr(0,n-1)))
+                --n;
+            bool const matched=tree.longest_prefix_of(key,found_key,value);
+            if(matched!=(n>0) || (matched && (found_key!=key.substr(0,n-1) || value!=model[found_key])))
+                return false;
+        }
+        }
+    }
+    return tree.size()==model.size();
+}
+
+struct check_walk
+{
+    std::string const& prefix;
+    std::string& last;
+    bool& ok;
+
+    void operator()(std::string const& key,std::uint64_t) const
+    {
+        if(key.compare(0,prefix.size(),prefix)!=0 || (!last.empty() && key<=last))
+            ok=false;
+        last=key;
+    }
+};
+
+bool check_concurrent(unsigned threads,std::uint64_t per_thread)
+{
+    radix_tree tree;
+    std::uint64_t const keys=threads*per_thread;
+    std::atomic<bool> done(false);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(std::uint64_t i=t;i<keys;i+=threads)
+                tree.insert_or_assign(key_of(i),i);
+        }));
+    }
+    std::thread reader([&]{
+        std::uint64_t x=1,v;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::uint64_t const i=(x>>33)%keys;
+            if(tree.find(key_of(i),v) && v!=i)
+                ok=false;
+        }
+    });
+    std::thread walker([&]{
+        std::uint64_t x=7;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::string const prefix=(x>>40)&1?"/api/v1/users/"+std::to_string((x>>33)%100):
+                std::string(1,"0123456789abcdef"[(x>>33)&15]);
+            std::string last;
+            bool sorted=true;
+            tree.for_each_prefix(prefix,check_walk{prefix,last,sorted});
+            if(!sorted)
+                ok=false;
+        }
+    });
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    done=true;
+    reader.join();
+    walker.join();
+    std::string const everything;
+    std::string last;
+    bool sorted=true;
+    if(!ok || tree.size()!=keys || tree.for_each_prefix(everything,check_walk{everything,last,sorted})!=keys ||
+       !sorted)
+        return false;
+    workers.clear();
+    // Erase the even i while readers look for the odd ones
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(std::uint64_t i=2*t;i<keys;i+=2*threads)
+            {
+                if(!tree.erase(key_of(i)))
+                    ok=false;
+            }
+        }));
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t v;
+            for(std::uint64_t i=2*t+1;i<keys;i+=2*threads)
+            {
+                if(!tree.find(key_of(i),v) || v!=i)
+                    ok=false;
+            }
+        }));
+    }
+    for(std::size_t i=0;i<workers.size();++i)
+        workers[i].join();
+    last.clear();
+    return ok && tree.size()==keys/2 &&
+        tree.for_each_prefix(everything,check_walk{everything,last,sorted})==keys/2 && sorted;
+}
+
+/**
+ * Session-ID churn: rounds of inserting and erasing fresh random keys.
+ * Once retired nodes are freed an empty tree should be back to its root.
+*/
+bool check_churn(unsigned rounds,std::uint64_t per_round,std::size_t& left)
+{
+    // Every scan can move the epoch on once; three free everything retired
+    for(unsigned i=0;i<3;++i)
+        epoch_reclaimer::scan();
+    radix_tree tree;
+    std::size_t const heap_empty=heap_in_use();
+    for(unsigned r=0;r<rounds;++r)
+    {
+        for(std::uint64_t i=0;i<per_round;++i)
+            tree.insert_or_assign(session_id(r*per_round+i),i);
+        for(std::uint64_t i=0;i<per_round;++i)
+        {
+            if(!tree.erase(session_id(r*per_round+i)))
+                return false;
+        }
+    }
+    for(unsigned i=0;i<3;++i)
+        epoch_reclaimer::scan();
+    left=heap_in_use()-heap_empty;
+    return tree.size()==0 && left<64*1024;
+}
+
+class locked_map
+{
+    std::mutex m;
+    std::map<std::string,std::uint64_t> map;
+public:
+    bool find(std::string const& key,std::uint64_t& value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::map<std::string,std::uint64_t>::const_iterator const it=map.find(key);
+        if(it==map.end())
+            return false;
+        value=it->second;
+        return true;
+    }
+
+    bool insert_or_assign(std::string const& key,std::uint64_t value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::pair<std::map<std::string,std::uint64_t>::iterator,bool> const r=map.insert(std::make_pair(key,value));
+        if(!r.second)
+            r.first->second=value;
+        return r.second;
+    }
+
+    template<typename F>
+    std::size_t for_each_prefix(std::string const& prefix,F fn)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::size_t visited=0;
+        for(std::map<std::string,std::uint64_t>::const_iterator it=map.lower_bound(prefix);
+            it!=map.end() && it->first.compare(0,prefix.size(),prefix)==0;++it,++visited)
+            fn(it->first,it->second);
+        return visited;
+    }
+};
+
+struct hash_map:
+    striped_hash_map<std::string,std::uint64_t>
+{
+    // No order, so no prefix walks; bench() doesn't ask for any
+    template<typename F>
+    std::size_t for_each_prefix(std::string const&,F)
+    {
+        return 0;
+    }
+};
+
+/**
+ * The list scan: every prefix query visits every entry until it matches.
+*/
+class locked_list
+{
+    std::mutex m;
+    std::list<std::pair<std::string,std::uint64_t> > entries;
+
+    struct starts_with
+    {
+        std::string const& prefix;
+
+        bool operator()(std::pair<std::string,std::uint64_t> const& entry) const
+        {
+            return entry.first.compare(0,prefix.size(),prefix)==0;
+        }
+    };
+public:
+    void push_front(std::string const& key,std::uint64_t value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        entries.push_front(std::make_pair(key,value));
+    }
+
+    bool find_first_with_prefix(std::string const& prefix,std::uint64_t& value)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::list<std::pair<std::string,std::uint64_t> >::const_iterator const it=
+            std::find_if(entries.begin(),entries.end(),starts_with{prefix});
+        if(it==entries.end())
+            return false;
+        value=it->second;
+        return true;
+    }
+};
+
+// What the operations found, so that none of them can be optimised away
+std::atomic<std::uint64_t> sink(0);
+
+struct sum_values
+{
+    std::uint64_t& sum;
+
+    void operator()(std::string const&,std::uint64_t value) const
+    {
+        sum+=value;
+    }
+};
+
+template<typename Index,typename Op>
+double run(Index& index,unsigned threads,unsigned ops,Op op)
+{
+    std::vector<std::thread> workers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t x=t+1,found=0;
+            for(unsigned i=0;i<ops;++i)
+            {
+                x=x*6364136223846793005ULL+1442695040888963407ULL;
+                found+=op(index,x);
+            }
+            sink+=found;
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return static_cast<double>(threads)*ops/
+        std::chrono::duration<double>(bench_clock::now()-start).count();
+}
+
+template<typename Index>
+void bench(char const* name,std::uint64_t keys,unsigned threads,unsigned ops,bool ordered)
+{
+    std::size_t const heap_before=heap_in_use();
+    Index index;
+    bench_clock::time_point const start=bench_clock::now();
+    for(std::uint64_t i=0;i<keys;++i)
+        index.insert_or_assign(key_of(i),i);
+    double const load_ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/keys;
+    double const bytes=static_cast<double>(heap_in_use()-heap_before)/keys;
+
+    // Building the key strings costs every index the same
+    double const lookups=run(index,threads,ops,[keys](Index& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t v=0;
+        return ix.find(key_of((x>>33)%(2*keys)),v)+v;
+    });
+    std::cout << name << "\t" << load_ns << "\t\t" << bytes << "\t\t" << lookups/1e6 << "\t\t";
+    if(!ordered)
+    {
+        std::cout << "-" << std::endl;
+        return;
+    }
+    double const walks=run(index,threads,ops/10,[keys](Index& ix,std::uint64_t x)->std::uint64_t{
+        std::uint64_t sum=0;
+        sum_values s={sum};
+        ix.for_each_prefix(user_prefix((x>>33)%(keys/16)),s);
+        return sum;
+    });
+    std::cout << walks/1e3 << std::endl;
+}
+
+void bench_first_with_prefix(std::uint64_t keys,unsigned queries)
+{
+    radix_tree tree;
+    locked_list list;
+    for(std::uint64_t i=0;i<keys;++i)
+    {
+        tree.insert_or_assign(key_of(i),i);
+        list.push_front(key_of(i),i);
+    }
+    std::uint64_t x=3,found=0;
+    std::vector<std::string> prefixes;
+    for(unsigned q=0;q<queries;++q)
+    {
+        x=x*6364136223846793005ULL+1442695040888963407ULL;
+        prefixes.push_back(user_prefix((x>>33)%(keys/16)));
+    }
+    bench_clock::time_point start=bench_clock::now();
+    for(unsigned q=0;q<queries;++q)
+    {
+        std::string key;
+        std::uint64_t v=0;
+        found+=tree.first_with_prefix(prefixes[q],key,v);
+    }
+    double const tree_us=std::chrono::duration<double,std::micro>(bench_clock::now()-start).count()/queries;
+    start=bench_clock::now();
+    for(unsigned q=0;q<queries;++q)
+    {
+        std::uint64_t v=0;
+        found+=list.find_first_with_prefix(prefixes[q],v);
+    }
+    double const list_us=std::chrono::duration<double,std::micro>(bench_clock::now()-start).count()/queries;
+    sink+=found;
+    std::cout << "first key with a user's prefix: tree " << tree_us << " us, list scan " << list_us << " us"
+              << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    std::uint64_t const keys=argc>1?std::strtoull(argv[1],nullptr,10):1000000;
+    unsigned const threads=4;
+    unsigned const ops=500000;
+
+    std::cout << "random operations match std::map: " << (check_against_map()?"yes":"NO") << std::endl
+              << "concurrent inserts, erases and walks: " << (check_concurrent(4,50000)?"ok":"FAILED") << std::endl;
+    std::size_t left=0;
+    bool const churn_ok=check_churn(6,100000,left);
+    std::cout << "6 rounds of 100k session IDs in and out: " << left << " bytes left beyond an empty tree"
+              << (churn_ok?"":" FAILED") << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << keys << " keys, "
+              << threads << " threads" << std::endl
+              << "index\tload ns/key\tbytes/key\tMlookups/s\tKwalks/s (8 keys)" << std::endl;
+    bench<radix_tree>("radix",keys,threads,ops,true);
+    bench<locked_map>("map",keys,threads,ops,true);
+    bench<hash_map>("hash",keys,threads,ops,false);
+    std::cout << std::endl;
+    bench_first_with_prefix(keys,100);
+    return 0;
+}
@@ -0,0 +1,1143 @@
+#ifndef CONCURRENT_RADIX_TREE_HPP
+#define CONCURRENT_RADIX_TREE_HPP
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "optimistic-lock.hpp"
+#include "reclamation.hpp"
+#include "sharded-counter.hpp"
+
+/**
+ * Concurrent adaptive radix tree
+ * ==============================
+ *
+ * An ordered index for string keys such as URL paths and session IDs. A
+ * hash map loses the order, so it can't answer "everything under
+ * /api/v1/users/42/"; a comparison tree (std::map, concurrent_btree)
+ * compares whole keys at every level, and keys with long shared prefixes
+ * make every comparison long. chapter 6's threadsafe_list::find_first_if
+ * answers a prefix query by visiting every node.
+ *
+ * A radix tree walks the key one byte per level instead, so a lookup
+ * costs the key's length, not log n comparisons of it. Leis et al.'s
+ * adaptive radix tree keeps that compact:
+ *
+ *  - Inner nodes come in four sizes and grow as children are added:
+ *    Node4 and Node16 keep up to 4 or 16 key bytes sorted, with children
+ *    alongside (Node16 compares all 16 bytes with one SSE2 compare, a byte
+ *    loop where there is no SSE2); Node48 maps all 256 byte values to up
+ *    to 48 child slots; Node256 is a plain array of 256 children.
+ *  - Path compression: a node whose subtree shares more bytes than the one
+ *    that led to it stores them as its prefix, so a chain of one-child
+ *    nodes is one node. A key is stored whole in its leaf.
+ *  - A key that ends at an inner node (/api next to /api/v1) is that
+ *    node's "here" leaf, so keys may be prefixes of each other and may
+ *    hold any bytes.
+ *
+ * Synchronisation is optimistic lock coupling, as in concurrent_btree:
+ * every node has a version word, odd while a writer holds it; readers note
+ * versions, re-check the parent after reading the child's, and start again
+ * on any change, so lookups take no lock and write nothing shared. Writers
+ * lock the node they change; growing a node or splitting its prefix
+ * builds a replacement, swaps it in under the parent's lock and marks the
+ * old one obsolete, which sends any reader still in it back to the root.
+ * Node prefixes never change in place, only by replacement, so reading
+ * one needs no check.
+ *
+ * Replaced nodes and erased leaves are retired through epoch_reclaimer,
+ * and every operation runs under an epoch guard, so a reader can finish
+ * with a node that was swapped out under it. An erase that leaves a node
+ * with a single entry folds the node into its parent, so a tree whose keys
+ * come and go (session IDs) stays the size of what it holds; nodes don't
+ * move down to a smaller kind, though. Values must be trivially copyable
+ * and at most 8 bytes; they are stored in atomic words so that reassigning
+ * one doesn't disturb readers.
+*/
+
+namespace radix_detail
+{
+    // Bytes packed eight to an atomic word, so racing reads are well defined
+    inline std::uint8_t get_byte(std::atomic<std::uint64_t> const* words,unsigned i)
+    {
+        return static_cast<std::uint8_t>(words[i/8].load(std::memory_order_relaxed)>>(8*(i%8)));
+    }
+
+    // Only by the writer holding the node
+    inline void set_byte(std::atomic<std::uint64_t>* words,unsigned i,std::uint8_t byte)
+    {
+        unsigned const shift=8*(i%8);
+        std::uint64_t const w=words[i/8].load(std::memory_order_relaxed);
+        words[i/8].store((w&~(std::uint64_t(0xff)<<shift))|(std::uint64_t(byte)<<shift),std::memory_order_relaxed);
+    }
+}
+
+template<typename Value=std::uint64_t>
+class concurrent_radix_tree
+{
+    static_assert(std::is_trivially_copyable<Value>::value && sizeof(Value)<=8,
+                  "concurrent_radix_tree: values must be trivially copyable words");
+
+    struct leaf
+    {
+        std::string const key;
+        std::atomic<std::uint64_t> value;
+
+        leaf(std::string const& key_,std::uint64_t value_):
+            key(key_),value(value_)
+        {}
+    };
+
+    enum class kind:std::uint8_t{node4,node16,node48,node256};
+
+    struct node:
+        optimistic_lock
+    {
+        std::atomic<std::uint16_t> count;
+        kind const type;
+        std::string const prefix;
+        std::atomic<leaf*> here;
+
+        node(kind type_,std::string const& prefix_):
+            count(0),type(type_),prefix(prefix_),here(nullptr)
+        {}
+
+        unsigned size(unsigned capacity) const
+        {
+            // A torn read can claim anything; keep indexes in bounds
+            unsigned const n=count.load(std::memory_order_relaxed);
+            return n<capacity?n:capacity;
+        }
+    };
+
+    // Children are tagged: low bit set for a leaf
+    typedef std::atomic<std::uintptr_t> link;
+
+    struct node4:
+        node
+    {
+        std::atomic<std::uint64_t> keys[1];
+        link children[4];
+
+        explicit node4(std::string const& prefix_):
+            node(kind::node4,prefix_)
+        {
+            keys[0].store(0,std::memory_order_relaxed);
+            for(unsigned i=0;i<4;++i)
+                children[i].store(0,std::memory_order_relaxed);
+        }
+    };
+
+    struct node16:
+        node
+    {
+        std::atomic<std::uint64_t> keys[2];
+        link children[16];
+
+        explicit node16(std::string const& prefix_):
+            node(kind::node16,prefix_)
+        {
+            for(unsigned i=0;i<2;++i)
+                keys[i].store(0,std::memory_order_relaxed);
+            for(unsigned i=0;i<16;++i)
+                children[i].store(0,std::memory_order_relaxed);
+        }
+    };
+
+    struct node48:
+        node
+    {
+        // Slot+1 of each byte's child, 0 for none
+        std::atomic<std::uint64_t> index[32];
+        link children[48];
+
+        explicit node48(std::string const& prefix_):
+            node(kind::node48,prefix_)
+        {
+            for(unsigned i=0;i<32;++i)
+                index[i].store(0,std::memory_order_relaxed);
+            for(unsigned i=0;i<48;++i)
+                children[i].store(0,std::memory_order_relaxed);
+        }
+    };
+
+    struct node256:
+        node
+    {
+        link children[256];
+
+        explicit node256(std::string const& prefix_):
+            node(kind::node256,prefix_)
+        {
+            for(unsigned i=0;i<256;++i)
+                children[i].store(0,std::memory_order_relaxed);
+        }
+    };
+
+    enum class outcome{yes,no,retry};
+
+    // The root is a Node256 with no prefix, so it is never replaced
+    node256* const root;
+    sharded_counter entries;
+
+    static bool is_leaf(std::uintptr_t l)
+    {
+        return l&1;
+    }
+
+    static leaf* leaf_of(std::uintptr_t l)
+    {
+        return reinterpret_cast<leaf*>(l&~std::uintptr_t(1));
+    }
+
+    static node* node_of(std::uintptr_t l)
+    {
+        return reinterpret_cast<node*>(l);
+    }
+
+    static std::uintptr_t link_to(leaf* l)
+    {
+        return reinterpret_cast<std::uintptr_t>(l)|1;
+    }
+
+    static std::uintptr_t link_to(node* n)
+    {
+        return reinterpret_cast<std::uintptr_t>(n);
+    }
+
+    static std::uint8_t byte_at(std::string const& s,std::size_t i)
+    {
+        return static_cast<std::uint8_t>(s[i]);
+    }
+
+    static std::uint64_t word_of(Value const& value)
+    {
+        std::uint64_t word=0;
+        std::memcpy(&word,&value,sizeof(Value));
+        return word;
+    }
+
+    static Value value_of(std::uint64_t word)
+    {
+        Value value;
+        std::memcpy(&value,&word,sizeof(Value));
+        return value;
+    }
+
+    static unsigned capacity(kind type)
+    {
+        switch(type)
+        {
+        case kind::node4:
+            return 4;
+        case kind::node16:
+            return 16;
+        case kind::node48:
+            return 48;
+        default:
+            return 256;
+        }
+    }
+
+    static node* make_node(kind type,std::string const& prefix)
+    {
+        switch(type)
+        {
+        case kind::node4:
+            return new node4(prefix);
+        case kind::node16:
+            return new node16(prefix);
+        case kind::node48:
+            return new node48(prefix);
+        default:
+            return new node256(prefix);
+        }
+    }
+
+    static void delete_node(node* n)
+    {
+        switch(n->type)
+        {
+        case kind::node4:
+            delete static_cast<node4*>(n);
+            break;
+        case kind::node16:
+            delete static_cast<node16*>(n);
+            break;
+        case kind::node48:
+            delete static_cast<node48*>(n);
+            break;
+        default:
+            delete static_cast<node256*>(n);
+        }
+    }
+
+    static void retire_node(node* n)
+    {
+        switch(n->type)
+        {
+        case kind::node4:
+            epoch_reclaimer::retire(static_cast<node4*>(n));
+            break;
+        case kind::node16:
+            epoch_reclaimer::retire(static_cast<node16*>(n));
+            break;
+        case kind::node48:
+            epoch_reclaimer::retire(static_cast<node48*>(n));
+            break;
+        default:
+            epoch_reclaimer::retire(static_cast<node256*>(n));
+        }
+    }
+
+    static link* sorted_children(node* n,std::atomic<std::uint64_t>*& keys)
+    {
+        if(n->type==kind::node4)
+        {
+            keys=static_cast<node4*>(n)->keys;
+            return static_cast<node4*>(n)->children;
+        }
+        keys=static_cast<node16*>(n)->keys;
+        return static_cast<node16*>(n)->children;
+    }
+
+    /**
+     * The child for byte, or 0.
+    */
+    static std::uintptr_t find_child(node const* n,std::uint8_t byte)
+    {
+        switch(n->type)
+        {
+        case kind::node4:
+        {
+            node4 const* const n4=static_cast<node4 const*>(n);
+            for(unsigned i=0,c=n->size(4);i<c;++i)
+            {
+                if(radix_detail::get_byte(n4->keys,i)==byte)
+                    return n4->children[i].load(std::memory_order_acquire);
+            }
+            return 0;
+        }
+        case kind::node16:
+        {
+            node16 const* const n16=static_cast<node16 const*>(n);
+            unsigned const c=n->size(16);
+            unsigned const m=match_bytes16(n16->keys[0].load(std::memory_order_relaxed),
+                                                   n16->keys[1].load(std::memory_order_relaxed),byte)&
+                ((1u<<c)-1);
+            return m?n16->children[__builtin_ctz(m)].load(std::memory_order_acquire):0;
+        }
+        case kind::node48:
+        {
+            node48 const* const n48=static_cast<node48 const*>(n);
+            unsigned const slot=radix_detail::get_byte(n48->index,byte);
+            return slot && slot<=48?n48->children[slot-1].load(std::memory_order_acquire):0;
+        }
+        default:
+            return static_cast<node256 const*>(n)->children[byte].load(std::memory_order_acquire);
+        }
+    }
+
+    /**
+     * The child with the smallest byte >= from, and that byte; 0 if none.
+    */
+    static std::uintptr_t next_child(node const* n,unsigned from,unsigned& byte)
+    {
+        switch(n->type)
+        {
+        case kind::node4:
+        case kind::node16:
+        {
+            std::atomic<std::uint64_t> const* keys;
+            link const* children;
+            unsigned c;
+            if(n->type==kind::node4)
+            {
+                keys=static_cast<node4 const*>(n)->keys;
+                children=static_cast<node4 const*>(n)->children;
+                c=n->size(4);
+            }
+            else
+            {
+                keys=static_cast<node16 const*>(n)->keys;
+                children=static_cast<node16 const*>(n)->children;
+                c=n->size(16);
+            }
+            for(unsigned i=0;i<c;++i)
+            {
+                unsigned const b=radix_detail::get_byte(keys,i);
+                if(b>=from)
+                {
+                    byte=b;
+                    return children[i].load(std::memory_order_acquire);
+                }
+            }
+            return 0;
+        }
+        case kind::node48:
+        {
+            node48 const* const n48=static_cast<node48 const*>(n);
+            for(unsigned b=from;b<256;++b)
+            {
+                unsigned const slot=radix_detail::get_byte(n48->index,b);
+                if(slot && slot<=48)
+                {
+                    byte=b;
+                    return n48->children[slot-1].load(std::memory_order_acquire);
+                }
+            }
+            return 0;
+        }
+        default:
+        {
+            node256 const* const n256=static_cast<node256 const*>(n);
+            for(unsigned b=from;b<256;++b)
+            {
+                std::uintptr_t const child=n256->children[b].load(std::memory_order_acquire);
+                if(child)
+                {
+                    byte=b;
+                    return child;
+                }
+            }
+            return 0;
+        }
+        }
+    }
+
+    // The writers below are called with n locked
+
+    static void add_child(node* n,std::uint8_t byte,std::uintptr_t child)
+    {
+        unsigned const c=n->count.load(std::memory_order_relaxed);
+        switch(n->type)
+        {
+        case kind::node4:
+        case kind::node16:
+        {
+            std::atomic<std::uint64_t>* keys;
+            link* const children=sorted_children(n,keys);
+            unsigned pos=c;
+            while(pos && radix_detail::get_byte(keys,pos-1)>byte)
+            {
+                radix_detail::set_byte(keys,pos,radix_detail::get_byte(keys,pos-1));
+                children[pos].store(children[pos-1].load(std::memory_order_relaxed),std::memory_order_relaxed);
+                --pos;
+            }
+            radix_detail::set_byte(keys,pos,byte);
+            children[pos].store(child,std::memory_order_release);
+            break;
+        }
+        case kind::node48:
+        {
+            node48* const n48=static_cast<node48*>(n);
+            unsigned slot=0;
+            while(n48->children[slot].load(std::memory_order_relaxed))
+                ++slot;
+            n48->children[slot].store(child,std::memory_order_release);
+            radix_detail::set_byte(n48->index,byte,static_cast<std::uint8_t>(slot+1));
+            break;
+        }
+        default:
+            static_cast<node256*>(n)->children[byte].store(child,std::memory_order_release);
+        }
+        n->count.store(static_cast<std::uint16_t>(c+1),std::memory_order_relaxed);
+    }
+
+    static void remove_child(node* n,std::uint8_t byte)
+    {
+        unsigned const c=n->count.load(std::memory_order_relaxed);
+        switch(n->type)
+        {
+        case kind::node4:
+        case kind::node16:
+        {
+            std::atomic<std::uint64_t>* keys;
+            link* const children=sorted_children(n,keys);
+            unsigned pos=0;
+            while(radix_detail::get_byte(keys,pos)!=byte)
+                ++pos;
+            for(;pos+1<c;++pos)
+            {
+                radix_detail::set_byte(keys,pos,radix_detail::get_byte(keys,pos+1));
+                children[pos].store(children[pos+1].load(std::memory_order_relaxed),std::memory_order_relaxed);
+            }
+            children[c-1].store(0,std::memory_order_relaxed);
+            break;
+        }
+        case kind::node48:
+        {
+            node48* const n48=static_cast<node48*>(n);
+            unsigned const slot=radix_detail::get_byte(n48->index,byte);
+            radix_detail::set_byte(n48->index,byte,0);
+            n48->children[slot-1].store(0,std::memory_order_relaxed);
+            break;
+        }
+        default:
+            static_cast<node256*>(n)->children[byte].store(0,std::memory_order_relaxed);
+        }
+        n->count.store(static_cast<std::uint16_t>(c-1),std::memory_order_relaxed);
+    }
+
+    static void replace_child(node* n,std::uint8_t byte,std::uintptr_t child)
+    {
+        switch(n->type)
+        {
+        case kind::node4:
+        case kind::node16:
+        {
+            std::atomic<std::uint64_t>* keys;
+            link* const children=sorted_children(n,keys);
+            unsigned pos=0;
+            while(radix_detail::get_byte(keys,pos)!=byte)
+                ++pos;
+            children[pos].store(child,std::memory_order_release);
+            break;
+        }
+        case kind::node48:
+        {
+            node48* const n48=static_cast<node48*>(n);
+            n48->children[radix_detail::get_byte(n48->index,byte)-1].store(child,std::memory_order_release);
+            break;
+        }
+        default:
+            static_cast<node256*>(n)->children[byte].store(child,std::memory_order_release);
+        }
+    }
+
+    /**
+     * A new node of the given kind and prefix with n's children and here
+     * leaf; n must be locked so that those are consistent.
+    */
+    static node* copy_of(node const* n,kind type,std::string const& prefix)
+    {
+        node* const copy=make_node(type,prefix);
+        copy->here.store(n->here.load(std::memory_order_relaxed),std::memory_order_relaxed);
+        unsigned byte=0;
+        for(unsigned from=0;from<256;from=byte+1)
+        {
+            std::uintptr_t const child=next_child(n,from,byte);
+            if(!child)
+                break;
+            add_child(copy,static_cast<std::uint8_t>(byte),child);
+        }
+        return copy;
+    }
+
+    /**
+     * How many bytes of n's prefix match key from depth on.
+    */
+    static std::size_t matching(node const* n,std::string const& key,std::size_t depth)
+    {
+        std::size_t i=0;
+        while(i<n->prefix.size() && depth+i<key.size() && n->prefix[i]==key[depth+i])
+            ++i;
+        return i;
+    }
+
+    // Hangs l under n, which is new: as its here leaf if l's key ends at depth
+    static void attach(node* n,leaf* l,std::size_t depth)
+    {
+        if(l->key.size()==depth)
+            n->here.store(l,std::memory_order_relaxed);
+        else
+            add_child(n,byte_at(l->key,depth),link_to(l));
+    }
+
+    outcome try_find(std::string const& key,std::uint64_t& word) const
+    {
+        node* n=root;
+        std::uint64_t v;
+        if(!n->read_lock(v))
+            return outcome::retry;
+        std::size_t depth=0;
+        for(;;)
+        {
+            std::size_t const m=matching(n,key,depth);
+            if(m<n->prefix.size())
+                return outcome::no;
+            depth+=m;
+            if(depth==key.size())
+            {
+                leaf* const l=n->here.load(std::memory_order_acquire);
+                if(!n->validate(v))
+                    return outcome::retry;
+                if(!l)
+                    return outcome::no;
+                word=l->value.load(std::memory_order_relaxed);
+                return outcome::yes;
+            }
+            std::uintptr_t const child=find_child(n,byte_at(key,depth));
+            if(!n->validate(v))
+                return outcome::retry;
+            if(!child)
+                return outcome::no;
+            if(is_leaf(child))
+            {
+                leaf* const l=leaf_of(child);
+                if(l->key!=key)
+                    return outcome::no;
+                word=l->value.load(std::memory_order_relaxed);
+                return outcome::yes;
+            }
+            node* const next=node_of(child);
+            std::uint64_t next_seen;
+            if(!next->read_lock(next_seen) || !n->validate(v))
+                return outcome::retry;
+            n=next;
+            v=next_seen;
+            ++depth;
+        }
+    }
+
+    /**
+     * yes if key was inserted, no if it was there and has been assigned.
+    */
+    outcome try_insert(std::string const& key,std::uint64_t word)
+    {
+        node* n=root;
+        std::uint64_t v;
+        if(!n->read_lock(v))
+            return outcome::retry;
+        node* parent=nullptr;
+        std::uint64_t parent_seen=0;
+        std::uint8_t parent_byte=0;
+        std::size_t depth=0;
+        for(;;)
+        {
+            std::size_t const m=matching(n,key,depth);
+            if(m<n->prefix.size())
+            {
+                // Split the prefix: a Node4 with the shared part replaces n,
+                // and a copy of n with the rest hangs under it
+                if(!parent->upgrade(parent_seen))
+                    return outcome::retry;
+                if(!n->upgrade(v))
+                {
+                    parent->unlock();
+                    return outcome::retry;
+                }
+                node* const top=new node4(n->prefix.substr(0,m));
+                add_child(top,byte_at(n->prefix,m),link_to(copy_of(n,n->type,n->prefix.substr(m+1))));
+                attach(top,new leaf(key,word),depth+m);
+                replace_child(parent,parent_byte,link_to(top));
+                n->unlock_obsolete();
+                parent->unlock();
+                retire_node(n);
+                return outcome::yes;
+            }
+            depth+=m;
+            if(depth==key.size())
+            {
+                if(!n->upgrade(v))
+                    return outcome::retry;
+                leaf* const l=n->here.load(std::memory_order_relaxed);
+                if(l)
+                    l->value.store(word,std::memory_order_relaxed);
+                else
+                    n->here.store(new leaf(key,word),std::memory_order_release);
+                n->unlock();
+                return l?outcome::no:outcome::yes;
+            }
+            std::uint8_t const byte=byte_at(key,depth);
+            std::uintptr_t const child=find_child(n,byte);
+            if(!n->validate(v))
+                return outcome::retry;
+            if(!child)
+            {
+                if(n->count.load(std::memory_order_relaxed)<capacity(n->type))
+                {
+                    if(!n->upgrade(v))
+                        return outcome::retry;
+                    add_child(n,byte,link_to(new leaf(key,word)));
+                    n->unlock();
+                    return outcome::yes;
+                }
+                // Full: replace n with the next size up (never the root,
+                // which is a Node256)
+                if(!parent->upgrade(parent_seen))
+                    return outcome::retry;
+                if(!n->upgrade(v))
+                {
+                    parent->unlock();
+                    return outcome::retry;
+                }
+                node* const bigger=copy_of(n,static_cast<kind>(static_cast<int>(n->type)+1),n->prefix);
+                add_child(bigger,byte,link_to(new leaf(key,word)));
+                replace_child(parent,parent_byte,link_to(bigger));
+                n->unlock_obsolete();
+                parent->unlock();
+                retire_node(n);
+                return outcome::yes;
+            }
+            if(is_leaf(child))
+            {
+                leaf* const other=leaf_of(child);
+                if(!n->upgrade(v))
+                    return outcome::retry;
+                if(other->key==key)
+                {
+                    other->value.store(word,std::memory_order_relaxed);
+                    n->unlock();
+                    return outcome::no;
+                }
+                // Both keys run on past depth: a Node4 holding what else
+                // they share takes the leaf's place, with both under it
+                std::size_t at=depth+1;
+                while(at<key.size() && at<other->key.size() && key[at]==other->key[at])
+                    ++at;
+                node* const split=new node4(key.substr(depth+1,at-depth-1));
+                attach(split,other,at);
+                attach(split,new leaf(key,word),at);
+                replace_child(n,byte,link_to(split));
+                n->unlock();
+                return outcome::yes;
+            }
+            node* const next=node_of(child);
+            std::uint64_t next_seen;
+            if(!next->read_lock(next_seen) || !n->validate(v))
+                return outcome::retry;
+            parent=n;
+            parent_seen=v;
+            parent_byte=byte;
+            n=next;
+            v=next_seen;
+            ++depth;
+        }
+    }
+
+    /**
+     * Takes l out of n. Every node below the root holds at least two
+     * entries (children plus here leaf): inserts only ever create nodes
+     * with two, and an erase that would leave one folds n into its parent
+     * instead - the last entry, if a leaf, takes n's place, and if a node,
+     * a copy of it with n's prefix and byte in front of its own does. Each
+     * erase therefore frees whatever it empties and the tree shrinks back
+     * as keys go.
+    */
+    outcome remove_leaf(node* n,std::uint64_t v,node* parent,std::uint64_t parent_seen,
+                        std::uint8_t parent_byte,leaf* l,bool is_here,std::uint8_t byte)
+    {
+        unsigned const count=n->count.load(std::memory_order_relaxed);
+        bool const has_here=n->here.load(std::memory_order_relaxed)!=nullptr;
+        unsigned const left=count+has_here-1;
+        if(!n->validate(v))
+            return outcome::retry;
+        if(n==root || left>=2)
+        {
+            if(!n->upgrade(v))
+                return outcome::retry;
+            if(is_here)
+                n->here.store(nullptr,std::memory_order_relaxed);
+            else
+                remove_child(n,byte);
+            n->unlock();
+            epoch_reclaimer::retire(l);
+            return outcome::yes;
+        }
+        if(!parent->upgrade(parent_seen))
+            return outcome::retry;
+        if(!n->upgrade(v))
+        {
+            parent->unlock();
+            return outcome::retry;
+        }
+        // n is locked, so what it holds now is what we counted
+        std::uintptr_t last=0;
+        unsigned last_byte=0;
+        if(left)
+        {
+            if(!is_here && has_here)
+                last=link_to(n->here.load(std::memory_order_relaxed));
+            else
+            {
+                // The child that isn't l
+                last=next_child(n,0,last_byte);
+                if(!is_here && last_byte==byte)
+                    last=next_child(n,last_byte+1,last_byte);
+            }
+        }
+        node* const only=last && !is_leaf(last)?node_of(last):nullptr;
+        std::uint64_t only_seen;
+        if(only && (!only->read_lock(only_seen) || !only->upgrade(only_seen)))
+        {
+            n->unlock();
+            parent->unlock();
+            return outcome::retry;
+        }
+        if(!left)
+            remove_child(parent,parent_byte);
+        else if(!only)
+            replace_child(parent,parent_byte,last);
+        else
+        {
+            std::string const prefix=n->prefix+static_cast<char>(last_byte)+only->prefix;
+            replace_child(parent,parent_byte,link_to(copy_of(only,only->type,prefix)));
+            only->unlock_obsolete();
+            retire_node(only);
+        }
+        n->unlock_obsolete();
+        parent->unlock();
+        retire_node(n);
+        epoch_reclaimer::retire(l);
+        return outcome::yes;
+    }
+
+    outcome try_erase(std::string const& key)
+    {
+        node* n=root;
+        std::uint64_t v;
+        if(!n->read_lock(v))
+            return outcome::retry;
+        node* parent=nullptr;
+        std::uint64_t parent_seen=0;
+        std::uint8_t parent_byte=0;
+        std::size_t depth=0;
+        for(;;)
+        {
+            std::size_t const m=matching(n,key,depth);
+            if(m<n->prefix.size())
+                return outcome::no;
+            depth+=m;
+            if(depth==key.size())
+            {
+                leaf* const l=n->here.load(std::memory_order_acquire);
+                if(!n->validate(v))
+                    return outcome::retry;
+                if(!l)
+                    return outcome::no;
+                return remove_leaf(n,v,parent,parent_seen,parent_byte,l,true,0);
+            }
+            std::uint8_t const byte=byte_at(key,depth);
+            std::uintptr_t const child=find_child(n,byte);
+            if(!n->validate(v))
+                return outcome::retry;
+            if(!child)
+                return outcome::no;
+            if(is_leaf(child))
+            {
+                leaf* const l=leaf_of(child);
+                if(l->key!=key)
+                    return outcome::no;
+                return remove_leaf(n,v,parent,parent_seen,parent_byte,l,false,byte);
+            }
+            node* const next=node_of(child);
+            std::uint64_t next_seen;
+            if(!next->read_lock(next_seen) || !n->validate(v))
+                return outcome::retry;
+            parent=n;
+            parent_seen=v;
+            parent_byte=byte;
+            n=next;
+            v=next_seen;
+            ++depth;
+        }
+    }
+
+    outcome try_longest_prefix(std::string const& key,leaf*& best) const
+    {
+        best=nullptr;
+        node* n=root;
+        std::uint64_t v;
+        if(!n->read_lock(v))
+            return outcome::retry;
+        std::size_t depth=0;
+        for(;;)
+        {
+            std::size_t const m=matching(n,key,depth);
+            if(m<n->prefix.size())
+                break;
+            depth+=m;
+            // Its key is key's first depth bytes
+            if(leaf* const l=n->here.load(std::memory_order_acquire))
+                best=l;
+            if(depth==key.size())
+                break;
+            std::uintptr_t const child=find_child(n,byte_at(key,depth));
+            if(!n->validate(v))
+                return outcome::retry;
+            if(!child)
+                break;
+            if(is_leaf(child))
+            {
+                leaf* const l=leaf_of(child);
+                if(l->key.size()<=key.size() && key.compare(0,l->key.size(),l->key)==0)
+                    best=l;
+                break;
+            }
+            node* const next=node_of(child);
+            std::uint64_t next_seen;
+            if(!next->read_lock(next_seen) || !n->validate(v))
+                return outcome::retry;
+            n=next;
+            v=next_seen;
+            ++depth;
+        }
+        if(!n->validate(v))
+            return outcome::retry;
+        return best?outcome::yes:outcome::no;
+    }
+
+    /**
+     * Where an ordered walk of the keys starting with prefix has got to:
+     * the last key handed to visit, so that a walk that has to start again
+     * skips what it has done.
+    */
+    template<typename Visit>
+    struct walk
+    {
+        std::string const& prefix;
+        Visit& visit;
+        std::string last;
+        bool started;
+        std::string path;
+
+        // True if l is a key to hand on; false from visit means stop
+        outcome offer(leaf const* l)
+        {
+            if(l->key.size()<prefix.size() || l->key.compare(0,prefix.size(),prefix)!=0 ||
+               (started && l->key<=last))
+                return outcome::yes;
+            last=l->key;
+            started=true;
+            return visit(l->key,l->value.load(std::memory_order_relaxed))?outcome::yes:outcome::no;
+        }
+
+        // yes when n's subtree is done, no to stop, retry to start again
+        outcome from(node const* n)
+        {
+            std::uint64_t v;
+            if(!n->read_lock(v))
+                return outcome::retry;
+            std::size_t const base=path.size();
+            path+=n->prefix;
+            outcome r=subtree(n,v);
+            path.resize(base);
+            return r;
+        }
+
+        outcome subtree(node const* n,std::uint64_t v)
+        {
+            std::size_t const overlap=path.size()<prefix.size()?path.size():prefix.size();
+            // Off to the side of the prefix, or all before the last key
+            if(path.compare(0,overlap,prefix,0,overlap)!=0 || (started && last.compare(0,path.size(),path)>0))
+                return outcome::yes;
+            leaf* const l=n->here.load(std::memory_order_acquire);
+            if(!n->validate(v))
+                return outcome::retry;
+            if(l && offer(l)==outcome::no)
+                return outcome::no;
+            // Short of the prefix only one child can lead to it; past the
+            // last key, none before its next byte can
+            unsigned from_byte=0;
+            unsigned until_byte=255;
+            if(path.size()<prefix.size())
+                from_byte=until_byte=byte_at(prefix,path.size());
+            if(started && last.size()>path.size() && last.compare(0,path.size(),path)==0 &&
+               byte_at(last,path.size())>from_byte)
+                from_byte=byte_at(last,path.size());
+            unsigned at=from_byte;
+            while(at<=until_byte)
+            {
+                unsigned byte;
+                std::uintptr_t const child=next_child(n,at,byte);
+                if(!n->validate(v))
+                {
+                    // Changed under us: going on by byte value is still right
+                    if(!n->read_lock(v))
+                        return outcome::retry;
+                    continue;
+                }
+                if(!child || byte>until_byte)
+                    break;
+                outcome r;
+                if(is_leaf(child))
+                    r=offer(leaf_of(child));
+                else
+                {
+                    path.push_back(static_cast<char>(byte));
+                    r=from(node_of(child));
+                    path.pop_back();
+                }
+                if(r!=outcome::yes)
+                    return r;
+                at=byte+1;
+            }
+            return outcome::yes;
+        }
+    };
+
+    template<typename Visit>
+    void walk_prefix(std::string const& prefix,Visit& visit) const
+    {
+        walk<Visit> w={prefix,visit,std::string(),false,std::string()};
+        for(;;)
+        {
+            epoch_reclaimer::guard g;
+            if(w.from(root)!=outcome::retry)
+                return;
+        }
+    }
+
+    template<typename F>
+    struct call_each
+    {
+        F& fn;
+        std::size_t count;
+
+        bool operator()(std::string const& key,std::uint64_t word)
+        {
+            fn(key,value_of(word));
+            ++count;
+            return true;
+        }
+    };
+
+    struct take_first
+    {
+        std::string& key;
+        std::uint64_t word;
+        bool found;
+
+        bool operator()(std::string const& key_,std::uint64_t word_)
+        {
+            key=key_;
+            word=word_;
+            found=true;
+            return false;
+        }
+    };
+
+    static void destroy(node* n)
+    {
+        delete n->here.load(std::memory_order_relaxed);
+        unsigned byte=0;
+        for(unsigned from=0;from<256;from=byte+1)
+        {
+            std::uintptr_t const child=next_child(n,from,byte);
+            if(!child)
+                break;
+            if(is_leaf(child))
+                delete leaf_of(child);
+            else
+                destroy(node_of(child));
+        }
+        delete_node(n);
+    }
+
+public:
+    concurrent_radix_tree():
+        root(new node256(std::string()))
+    {}
+
+    ~concurrent_radix_tree()
+    {
+        destroy(root);
+    }
+
+    concurrent_radix_tree(concurrent_radix_tree const&)=delete;
+    concurrent_radix_tree& operator=(concurrent_radix_tree const&)=delete;
+
+    bool find(std::string const& key,Value& value) const
+    {
+        epoch_reclaimer::guard g;
+        std::uint64_t word=0;
+        outcome r;
+        while((r=try_find(key,word))==outcome::retry)
+            ;
+        if(r==outcome::yes)
+            value=value_of(word);
+        return r==outcome::yes;
+    }
+
+    bool contains(std::string const& key) const
+    {
+        Value ignored;
+        return find(key,ignored);
+    }
+
+    /**
+     * True if key was new.
+    */
+    bool insert_or_assign(std::string const& key,Value const& value)
+    {
+        epoch_reclaimer::guard g;
+        std::uint64_t const word=word_of(value);
+        outcome r;
+        while((r=try_insert(key,word))==outcome::retry)
+            ;
+        if(r==outcome::yes)
+            entries.add(1);
+        return r==outcome::yes;
+    }
+
+    bool erase(std::string const& key)
+    {
+        epoch_reclaimer::guard g;
+        outcome r;
+        while((r=try_erase(key))==outcome::retry)
+            ;
+        if(r==outcome::yes)
+            entries.add(-1);
+        return r==outcome::yes;
+    }
+
+    /**
+     * Calls fn(key,value) for every key that starts with prefix, in order,
+     * and returns how many that was. Each node is read consistently, but
+     * the walk as a whole isn't a snapshot: keys added or erased while it
+     * runs may or may not be seen. fn runs inside an epoch guard, so a slow
+     * one holds up reclamation.
+    */
+    template<typename F>
+    std::size_t for_each_prefix(std::string const& prefix,F fn) const
+    {
+        call_each<F> visit={fn,0};
+        walk_prefix(prefix,visit);
+        return visit.count;
+    }
+
+    /**
+     * The smallest key that starts with prefix: what find_first_if over a
+     * list does by visiting every node.
+    */
+    bool first_with_prefix(std::string const& prefix,std::string& key,Value& value) const
+    {
+        take_first visit={key,0,false};
+        walk_prefix(prefix,visit);
+        if(visit.found)
+            value=value_of(visit.word);
+        return visit.found;
+    }
+
+    /**
+     * The longest key that is a prefix of path, as a router matches a URL
+     * against its routes.
+    */
+    bool longest_prefix_of(std::string const& path,std::string& key,Value& value) const
+    {
+        epoch_reclaimer::guard g;
+        leaf* best;
+        outcome r;
+        while((r=try_longest_prefix(path,best))==outcome::retry)
+            ;
+        if(r!=outcome::yes)
+            return false;
+        key=best->key;
+        value=value_of(best->value.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    /**
+     * Exact only when nothing is changing the tree.
+    */
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(entries.value());
+    }
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include "concurrent-vector.hpp"
+
+/**
+ * Append-only event table
+ * =======================
+ *
+ * Writers append events and publish the index they got; readers keep looking
+ * up recently published events. Compared with a std::vector wrapped in a
+ * mutex, the data_wrapper way.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct event
+{
+    unsigned long id;
+    unsigned long payload[3];
+    explicit event(unsigned long id_):
+        id(id_)
+    {
+        payload[0]=payload[1]=payload[2]=id_*3;
+    }
+};
+
+struct concurrent_table
+{
+    concurrent_vector<event> events;
+    std::size_t append(unsigned long id)
+    {
+        return events.emplace_back(id);
+    }
+    unsigned long read(std::size_t i)
+    {
+        // Another writer may still be constructing an index below the
+        // published one
+        return events.ready(i)?events[i].payload[0]:0;
+    }
+};
+
+struct locked_table
+{
+    std::vector<event> events;
+    std::mutex m;
+    std::size_t append(unsigned long id)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        events.push_back(event(id));
+        return events.size()-1;
+    }
+    unsigned long read(std::size_t i)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return events[i].payload[0];
+    }
+};
+
+template<typename Table>
+void run(char const* name,unsigned writers,unsigned readers,unsigned long appends)
+{
+    Table table;
+    std::atomic<std::size_t> last_published(table.append(0));
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long> reads(0);
+    std::atomic<unsigned long> bad(0);
+
+    bench_clock::time_point const start=bench_clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned r=0;r<readers;++r)
+    {
+        threads.push_back(std::thread([&]{
+            unsigned long n=0;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                std::size_t const i=last_published.load(std::memory_order_acquire);
+                for(std::size_t j=i>64?i-64:0;j<=i;++j)
+                {
+                    if(table.read(j)%3!=0)
+                        ++bad;
+                    ++n;
+                }
+            }
+            reads+=n;
+        }));
+    }
+    std::vector<std::thread> writer_threads;
+    for(unsigned w=0;w<writers;++w)
+    {
+        writer_threads.push_back(std::thread([&,w]{
+            for(unsigned long i=0;i<appends;++i)
+            {
+                std::size_t const idx=table.append(w*appends+i);
+                // Publish only if newer: readers may look at anything below it
+                std::size_t seen=last_published.load(std::memory_order_relaxed);
+                while(seen<idx && !last_published.compare_exchange_weak(seen,idx,
+                                                                       std::memory_order_release));
+            }
+        }));
+    }
+    for(unsigned w=0;w<writers;++w)
+        writer_threads[w].join();
+    double const seconds=std::chrono::duration<double>(bench_clock::now()-start).count();
+    done=true;
+    for(unsigned r=0;r<readers;++r)
+        threads[r].join();
+
+    std::cout << name << std::endl;
+    std::cout << "  appends/s: " << writers*appends/seconds
+              << "   reads/s: " << reads/seconds << std::endl;
+    if(bad)
+        std::cout << "  BAD READS: " << bad << std::endl;
+}
+
+/**
+ * References taken before growth must still point at the same element after.
+*/
+bool references_stable()
+{
+    concurrent_vector<event> v;
+    v.emplace_back(0);
+    event const* const first=&v[0];
+    std::vector<std::thread> threads;
+    for(unsigned t=0;t<4;++t)
+    {
+        threads.push_back(std::thread([&]{
+            for(unsigned i=0;i<100000;++i)
+                v.emplace_back(i);
+        }));
+    }
+    for(unsigned t=0;t<4;++t)
+        threads[t].join();
+    bool all_ready=true;
+    for(std::size_t i=0;i<v.size();++i)
+        all_ready=all_ready && v.ready(i);
+    return first==&v[0] && first->id==0 && v.size()==400001 && all_ready;
+}
+
+/**
+ * std::allocator that counts its allocations, shared between rebinds
+*/
+template<typename T>
+struct counting_allocator
+{
+    typedef T value_type;
+    std::atomic<unsigned>* count;
+
+    explicit counting_allocator(std::atomic<unsigned>* count_):
+        count(count_)
+    {}
+
+    template<typename U>
+    counting_allocator(counting_allocator<U> const& other):
+        count(other.count)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        ++*count;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p,std::size_t n)
+    {
+        std::allocator<T>().deallocate(p,n);
+    }
+};
+
+template<typename T,typename U>
+bool operator==(counting_allocator<T> const& a,counting_allocator<U> const& b)
+{
+    return a.count==b.count;
+}
+
+template<typename T,typename U>
+bool operator!=(counting_allocator<T> const& a,counting_allocator<U> const& b)
+{
+    return !(a==b);
+}
+
+/**
+ * Threads racing into a missing segment must not each allocate it: the
+ * losers' copies are wasted work, and in an arena, wasted memory for good.
+*/
+void segments_allocated_once()
+{
+    std::atomic<unsigned> allocations(0);
+    unsigned long const per_thread=1000000;
+    {
+        concurrent_vector<event,counting_allocator<event> > v{counting_allocator<event>(&allocations)};
+        std::vector<std::thread> threads;
+        for(unsigned t=0;t<8;++t)
+        {
+            threads.push_back(std::thread([&]{
+                for(unsigned long i=0;i<per_thread;++i)
+                    v.emplace_back(i);
+            }));
+        }
+        for(unsigned t=0;t<8;++t)
+            threads[t].join();
+    }
+    // 8M entries: segment 0 of 8 slots, then doubling up to 2^23
+    unsigned segments=1;
+    while((std::size_t(8)<<(segments-1))<8*per_thread)
+        ++segments;
+    std::cout << "segment allocations for 8 threads appending 1M each: " << allocations << " for "
+              << segments << " segments" << (allocations==segments?"":" FAILED") << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const writers=argc>1?std::atoi(argv[1]):2;
+    unsigned const readers=argc>2?std::atoi(argv[2]):6;
+    unsigned long const appends=argc>3?std::strtoul(argv[3],nullptr,10):500000;
+
+    std::cout << "references stable across growth: " << (references_stable()?"ok":"FAILED") << std::endl;
+    segments_allocated_once();
+    std::cout << writers << " writers, " << readers << " readers" << std::endl;
+    run<concurrent_table>("concurrent_vector",writers,readers,appends);
+    run<locked_table>("std::vector + mutex",writers,readers,appends);
+    return 0;
+}
@@ -0,0 +1,264 @@
+#ifndef CONCURRENT_VECTOR_HPP
+#define CONCURRENT_VECTOR_HPP
+
+#include <atomic>
+#include <thread>
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <memory>
+#include <cstddef>
+
+/**
+ * Concurrent growable vector
+ * ==========================
+ *
+ * std::vector can't be shared: push_back() may reallocate and move every
+ * element, so any reference or pointer another thread holds becomes
+ * dangling. The usual fix in this project is to put it behind a mutex
+ * (data_wrapper, threadsafe_stack), which serialises readers too.
+ *
+ * concurrent_vector<T> never moves an element. Storage is a fixed table of
+ * segments whose sizes grow geometrically:
+ *
+ *   segment 0: indices [0, B)
+ *   segment k: indices [B<<(k-1), B<<k)      for k >= 1
+ *
+ * so the segment for index i is found with one bit scan, and the table needs
+ * at most ~64 entries. Growing means allocating the next segment; nothing
+ * already stored is touched.
+ *
+ *  - push_back() takes an index with one fetch_add, constructs the element
+ *    and then marks the slot ready. Lock-free, except when the index is in a
+ *    segment not allocated yet: the first thread to claim the segment
+ *    allocates it and any others that need it wait for it.
+ *  - operator[] on an index that has been published - e.g. returned by
+ *    push_back() and passed on through any synchronising channel - is two
+ *    plain loads. No lock, and nothing written to shared memory.
+ *  - ready(i) tells whether slot i has finished construction, for readers
+ *    that scan up to size() without knowing which indices are published.
+ *
+ * Elements are never removed; this is for append-only tables (events,
+ * connections) that are read far more often than they grow.
+ *
+ * Segments come from Allocator, so a large table can be placed in an arena
+ * (arena.hpp) on huge pages:
+ *
+ *   arena a(1<<30);
+ *   concurrent_vector<event,arena_allocator<event> > events{arena_allocator<event>(a)};
+*/
+template<typename T,typename Allocator=std::allocator<T> >
+class concurrent_vector
+{
+    static unsigned const first_segment_bits=3;
+    static std::size_t const first_segment_size=std::size_t(1)<<first_segment_bits;
+    static unsigned const max_segments=sizeof(std::size_t)*8-first_segment_bits;
+
+    struct slot
+    {
+        typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+        std::atomic<bool> is_ready;
+
+        slot():
+            is_ready(false)
+        {}
+
+        T* get()
+        {
+            return reinterpret_cast<T*>(&storage);
+        }
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<slot> slot_allocator;
+    typedef std::allocator_traits<slot_allocator> slot_traits;
+
+    std::atomic<slot*> segments[max_segments];
+    std::atomic<bool> claimed[max_segments];
+    std::atomic<std::size_t> reserved;
+    slot_allocator alloc;
+
+    static unsigned highest_bit(std::size_t i)
+    {
+        return static_cast<unsigned>(sizeof(unsigned long long)*8-1-
+                                     __builtin_clzll(static_cast<unsigned long long>(i)));
+    }
+
+    static unsigned segment_of(std::size_t i)
+    {
+        return i<first_segment_size?0:highest_bit(i)-first_segment_bits+1;
+    }
+
+    static std::size_t segment_base(unsigned k)
+    {
+        return k==0?0:first_segment_size<<(k-1);
+    }
+
+    static std::size_t segment_size(unsigned k)
+    {
+        return k==0?first_segment_size:first_segment_size<<(k-1);
+    }
+
+    slot* allocate_segment(unsigned k)
+    {
+        std::size_t const n=segment_size(k);
+        slot* const s=slot_traits::allocate(alloc,n);
+        for(std::size_t i=0;i<n;++i)
+            new(s+i) slot;
+        return s;
+    }
+
+    void free_segment(slot* s,unsigned k)
+    {
+        std::size_t const n=segment_size(k);
+        for(std::size_t i=0;i<n;++i)
+        {
+            if(s[i].is_ready.load(std::memory_order_relaxed))
+                s[i].get()->~T();
+            s[i].~slot();
+        }
+        slot_traits::deallocate(alloc,s,n);
+    }
+
+    slot* get_segment(unsigned k)
+    {
+        for(;;)
+        {
+            slot* const s=segments[k].load(std::memory_order_acquire);
+            if(s)
+                return s;
+            // One thread allocates and the rest wait: segment k is 2^k
+            // slots, and a copy built only to be thrown away costs as much
+            // (in an arena, it is never given back)
+            bool expected=false;
+            if(!claimed[k].compare_exchange_strong(expected,true,std::memory_order_relaxed))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            slot* fresh;
+            try
+            {
+                fresh=allocate_segment(k);
+            }
+            catch(...)
+            {
+                // Let a waiter try instead
+                claimed[k].store(false,std::memory_order_relaxed);
+                throw;
+            }
+            segments[k].store(fresh,std::memory_order_release);
+            return fresh;
+        }
+    }
+
+    slot& slot_at(std::size_t i) const
+    {
+        unsigned const k=segment_of(i);
+        return segments[k].load(std::memory_order_acquire)[i-segment_base(k)];
+    }
+
+public:
+    explicit concurrent_vector(Allocator const& alloc_=Allocator()):
+        reserved(0),alloc(alloc_)
+    {
+        for(unsigned k=0;k<max_segments;++k)
+        {
+            segments[k].store(nullptr,std::memory_order_relaxed);
+            claimed[k].store(false,std::memory_order_relaxed);
+        }
+    }
+
+    ~concurrent_vector()
+    {
+        for(unsigned k=0;k<max_segments;++k)
+        {
+            if(slot* const s=segments[k].load(std::memory_order_relaxed))
+                free_segment(s,k);
+        }
+    }
+
+    concurrent_vector(concurrent_vector const&)=delete;
+    concurrent_vector& operator=(concurrent_vector const&)=delete;
+
+    /**
+     * Returns the index of the new element. Its address never changes.
+    */
+    template<typename... Args>
+    std::size_t emplace_back(Args&&... args)
+    {
+        std::size_t const i=reserved.fetch_add(1,std::memory_order_relaxed);
+        unsigned const k=segment_of(i);
+        slot& s=get_segment(k)[i-segment_base(k)];
+        new(s.get()) T(std::forward<Args>(args)...);
+        s.is_ready.store(true,std::memory_order_release);
+        return i;
+    }
+
+    std::size_t push_back(T const& value)
+    {
+        return emplace_back(value);
+    }
+
+    std::size_t push_back(T&& value)
+    {
+        return emplace_back(std::move(value));
+    }
+
+    /**
+     * Index must be published (see above). Unchecked.
+    */
+    T& operator[](std::size_t i)
+    {
+        return *slot_at(i).get();
+    }
+
+    T const& operator[](std::size_t i) const
+    {
+        return *slot_at(i).get();
+    }
+
+    /**
+     * Checked access for indices that may still be under construction.
+    */
+    T& at(std::size_t i)
+    {
+        if(!ready(i))
+            throw std::out_of_range("concurrent_vector: element not ready");
+        return *slot_at(i).get();
+    }
+
+    bool ready(std::size_t i) const
+    {
+        if(i>=reserved.load(std::memory_order_acquire))
+            return false;
+        unsigned const k=segment_of(i);
+        slot const* const s=segments[k].load(std::memory_order_acquire);
+        return s && s[i-segment_base(k)].is_ready.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Number of indices handed out so far, including ones whose
+     * constructors may still be running.
+    */
+    std::size_t size() const
+    {
+        return reserved.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Calls f on every element that is ready at the time it is visited.
+    */
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        std::size_t const n=size();
+        for(std::size_t i=0;i<n;++i)
+        {
+            if(ready(i))
+                f(*slot_at(i).get());
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <sys/resource.h>
+#include "futex-mutex.hpp"
+#include "eventcount.hpp"
+#include "barrier.hpp"
+#include "threadsafe-queue.hpp"
+
+/**
+ * Notify costs and hand-off through queues
+ * ========================================
+ *
+ * 1. The cost of a notify nobody is waiting for: std::condition_variable,
+ *    futex_condition_variable and eventcount.
+ *
+ * 2. Producers and consumers passing items through queues of ints: the
+ *    chapter 6 shape (std::mutex + std::condition_variable, notify under
+ *    the lock), the same with futex_mutex + futex_condition_variable, and
+ *    std::mutex + eventcount with the notify after the unlock. Then
+ *    threadsafe_queue, which now waits on an eventcount but also
+ *    allocates a shared_ptr per item. Reported as throughput and context
+ *    switches per item (getrusage), which is where "hurry up and wait"
+ *    shows.
+ *
+ * 3. Broadcast: 32 threads wait on one flag under a mutex; the time from
+ *    notify_all() until all of them have got through the mutex, with
+ *    std::condition_variable and with the requeueing
+ *    futex_condition_variable.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+template<typename Mutex,typename CondVar>
+class cv_queue
+{
+    Mutex m;
+    CondVar cond;
+    std::queue<int> items;
+public:
+    void push(int v)
+    {
+        std::lock_guard<Mutex> lk(m);
+        items.push(v);
+        cond.notify_one();
+    }
+
+    void wait_and_pop(int& v)
+    {
+        std::unique_lock<Mutex> lk(m);
+        cond.wait(lk,[this]{ return !items.empty(); });
+        v=items.front();
+        items.pop();
+    }
+};
+
+class eventcount_queue
+{
+    std::mutex m;
+    eventcount ready;
+    std::queue<int> items;
+
+    bool try_pop(int& v)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if(items.empty())
+            return false;
+        v=items.front();
+        items.pop();
+        return true;
+    }
+public:
+    void push(int v)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            items.push(v);
+        }
+        ready.notify();
+    }
+
+    void wait_and_pop(int& v)
+    {
+        while(!try_pop(v))
+        {
+            eventcount::key const k=ready.prepare_wait();
+            if(try_pop(v))
+            {
+                ready.cancel_wait();
+                return;
+            }
+            ready.commit_wait(k);
+        }
+    }
+};
+
+long context_switches()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_nvcsw+usage.ru_nivcsw;
+}
+
+template<typename Notify>
+double ns_per_notify(Notify notify)
+{
+    unsigned const n=10000000;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned i=0;i<n;++i)
+        notify();
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/n;
+}
+
+template<typename Queue>
+void handoff(char const* name,unsigned pairs,unsigned items)
+{
+    Queue q;
+    std::vector<std::thread> threads;
+    long const switches=context_switches();
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned p=0;p<pairs;++p)
+    {
+        threads.push_back(std::thread([&]{
+            for(unsigned i=0;i<items;++i)
+                q.push(static_cast<int>(i));
+        }));
+        threads.push_back(std::thread([&]{
+            int v;
+            for(unsigned i=0;i<items;++i)
+                q.wait_and_pop(v);
+        }));
+    }
+    for(std::size_t t=0;t<threads.size();++t)
+        threads[t].join();
+    double const s=std::chrono::duration<double>(bench_clock::now()-start).count();
+    double const total=static_cast<double>(pairs)*items;
+    std::cout << name << "\t" << pairs << "\t" << total/s/1e6 << "\t\t"
+              << (context_switches()-switches)/total << std::endl;
+}
+
+template<typename Mutex,typename CondVar>
+double broadcast_us(unsigned waiters)
+{
+    Mutex m;
+    CondVar cond;
+    bool go=false;
+    latch ready(waiters);
+    latch through(waiters);
+    std::vector<std::thread> threads;
+    for(unsigned t=0;t<waiters;++t)
+    {
+        threads.push_back(std::thread([&]{
+            std::unique_lock<Mutex> lk(m);
+            ready.count_down();
+            cond.wait(lk,[&]{ return go; });
+            lk.unlock();
+            through.count_down();
+        }));
+    }
+    ready.wait();
+    // Every waiter counted down while holding the mutex, so once we get it
+    // the last one is inside wait() and has released it
+    bench_clock::time_point start;
+    {
+        std::lock_guard<Mutex> lk(m);
+        go=true;
+        start=bench_clock::now();
+        cond.notify_all();
+    }
+    through.wait();
+    double const us=std::chrono::duration<double,std::micro>(bench_clock::now()-start).count();
+    for(unsigned t=0;t<waiters;++t)
+        threads[t].join();
+    return us;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const items=argc>1?std::strtoul(argv[1],nullptr,10):1000000;
+
+    std::condition_variable std_cond;
+    futex_condition_variable futex_cond;
+    eventcount ec;
+    std::cout << "notify with no waiters, ns" << std::endl
+              << "  std::condition_variable::notify_one  " << ns_per_notify([&]{ std_cond.notify_one(); }) << std::endl
+              << "  futex_condition_variable::notify_one " << ns_per_notify([&]{ futex_cond.notify_one(); }) << std::endl
+              << "  eventcount::notify                   " << ns_per_notify([&]{ ec.notify(); }) << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << items << " items per pair" << std::endl
+              << "queue\t\tpairs\tMitems/s\tcontext switches/item" << std::endl;
+    for(unsigned pairs=1;pairs<=4;pairs*=2)
+    {
+        handoff<cv_queue<std::mutex,std::condition_variable> >("std cv\t",pairs,items);
+        handoff<cv_queue<futex_mutex,futex_condition_variable> >("futex cv",pairs,items);
+        handoff<eventcount_queue>("eventcount",pairs,items);
+        handoff<threadsafe_queue<int> >("threadsafe_queue",pairs,items);
+    }
+
+    unsigned const waiters=32;
+    double std_us=0,futex_us=0;
+    for(int run=0;run<10;++run)
+    {
+        std_us+=broadcast_us<std::mutex,std::condition_variable>(waiters)/10;
+        futex_us+=broadcast_us<futex_mutex,futex_condition_variable>(waiters)/10;
+    }
+    std::cout << std::endl << "notify_all to " << waiters << " waiters, until all are through the mutex" << std::endl
+              << "  std::condition_variable   " << std_us << " us" << std::endl
+              << "  futex_condition_variable  " << futex_us << " us (requeued onto the mutex)" << std::endl;
+    return 0;
+}
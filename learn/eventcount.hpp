@@ -0,0 +1,147 @@
+#ifndef EVENTCOUNT_HPP
+#define EVENTCOUNT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include "futex.hpp"
+#include "stop-token.hpp"
+
+/**
+ * Eventcount
+ * ==========
+ *
+ * A condition variable for lock-free (or just lock-light) code: it doesn't
+ * need a mutex around the condition. A consumer that found nothing to do
+ * goes through three steps:
+ *
+ *     eventcount::key const k=ec.prepare_wait();
+ *     if(try_pop(value))          // check the condition again
+ *         ec.cancel_wait();
+ *     else
+ *         ec.commit_wait(k);      // sleeps unless notified since prepare
+ *
+ * and a producer makes the condition true, then calls notify(). A notify
+ * between prepare_wait() and commit_wait() bumps the epoch, and the commit
+ * sees the epoch moved and doesn't sleep, so no wake-up is lost.
+ *
+ * The producer side is one fence and one load when nobody is waiting; the
+ * epoch bump and the wake syscall only happen when somebody has announced
+ * they might sleep. Wakes already sent are counted against the waiters,
+ * so a producer that keeps pushing while the consumer it woke hasn't been
+ * scheduled yet doesn't make a syscall per push.
+*/
+
+class eventcount
+{
+    std::atomic<std::uint32_t> epoch;
+    // Waiters between prepare_wait() and leaving, in the high half; wakes
+    // sent to them and not yet accounted for, in the low half
+    std::atomic<std::uint64_t> state;
+
+    static std::uint64_t const one_waiter=std::uint64_t(1)<<32;
+
+    static std::uint32_t waiters_of(std::uint64_t s)
+    {
+        return static_cast<std::uint32_t>(s>>32);
+    }
+
+    static std::uint32_t signals_of(std::uint64_t s)
+    {
+        return static_cast<std::uint32_t>(s);
+    }
+
+    void leave()
+    {
+        // Take one outstanding signal with us, if there is one; it may have
+        // been meant for somebody else, which only costs a spare wake later
+        std::uint64_t s=state.load(std::memory_order_relaxed);
+        while(!state.compare_exchange_weak(s,s-one_waiter-(signals_of(s)?1:0),
+                                           std::memory_order_relaxed))
+            ;
+    }
+
+    void signal(bool all)
+    {
+        // Dekker with prepare_wait(): either we see its waiter, or its
+        // re-check of the condition sees what the producer did
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t s=state.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            std::uint32_t const waiters=waiters_of(s);
+            if(waiters<=signals_of(s))
+                return;
+            std::uint64_t const next=all?(s&~std::uint64_t(0xffffffff))|waiters:s+1;
+            if(state.compare_exchange_weak(s,next,std::memory_order_relaxed))
+                break;
+        }
+        epoch.fetch_add(1,std::memory_order_release);
+        futex_wake(epoch,all?INT_MAX:1);
+    }
+
+public:
+    typedef std::uint32_t key;
+
+    eventcount():
+        epoch(0),state(0)
+    {}
+
+    eventcount(eventcount const&)=delete;
+    eventcount& operator=(eventcount const&)=delete;
+
+    key prepare_wait()
+    {
+        state.fetch_add(one_waiter,std::memory_order_seq_cst);
+        // The caller's re-check of the condition must not move above this
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_relaxed);
+    }
+
+    void cancel_wait()
+    {
+        leave();
+    }
+
+    void commit_wait(key k)
+    {
+        if(!spin_until([&]{ return epoch.load(std::memory_order_acquire)!=k; }))
+        {
+            while(epoch.load(std::memory_order_acquire)==k)
+                futex_wait(epoch,k);
+        }
+        leave();
+    }
+
+    /**
+     * commit_wait() that gives up when a stop is requested on token.
+     * Returns false if it did.
+    */
+    bool commit_wait(key k,stop_token const& token)
+    {
+        if(!spin_until([&]{ return epoch.load(std::memory_order_acquire)!=k; }))
+        {
+            while(epoch.load(std::memory_order_acquire)==k)
+            {
+                if(!futex_wait_unless_stopped(epoch,k,token))
+                {
+                    leave();
+                    return false;
+                }
+            }
+        }
+        leave();
+        return true;
+    }
+
+    void notify()
+    {
+        signal(false);
+    }
+
+    void notify_all()
+    {
+        signal(true);
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include "cache-line.hpp"
+#include "fine-grained-queue.hpp"
+#include "threadsafe-stack.hpp"
+
+/**
+ * False sharing
+ * =============
+ *
+ * Every container twice: cache_layout::packed, the way the chapter
+ * listings declare their members, and cache_layout::padded. Nothing but
+ * the layout differs.
+ *
+ * 1. sizeof of each layout.
+ *
+ * 2. Per-thread counters in one array, plain and cache_padded: the bare
+ *    effect, with no locks in the way.
+ *
+ * 3. chapter 6's fine-grained queue with one producer and one consumer,
+ *    then two of each: push and try_pop take different mutexes, so any
+ *    difference is the head side and the tail side sharing a line.
+ *
+ * 4. One threadsafe_stack per thread, in one array, each thread pushing
+ *    and popping its own: nothing is shared but the lines between
+ *    neighbouring stacks.
+ *
+ * False sharing needs two cores writing the same line at the same time;
+ * on a single CPU the packed and padded numbers come out the same.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+double mops_since(bench_clock::time_point start,double ops)
+{
+    return ops/std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+template<typename Counter>
+double counters_mops(unsigned threads,unsigned per_thread)
+{
+    Counter* const counters=allocate_cache_aligned<Counter>(threads);
+    std::vector<std::thread> workers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([=]{
+            std::atomic<long>& c=*counters[t];
+            for(unsigned i=0;i<per_thread;++i)
+                c.fetch_add(1,std::memory_order_relaxed);
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    double const mops=mops_since(start,static_cast<double>(threads)*per_thread);
+    free_cache_aligned(counters,threads);
+    return mops;
+}
+
+template<cache_layout Layout>
+double queue_mops(unsigned pairs,unsigned per_producer)
+{
+    fine_grained_queue<unsigned,Layout> q;
+    std::atomic<unsigned> popped(0);
+    unsigned const total=pairs*per_producer;
+    std::vector<std::thread> threads;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned p=0;p<pairs;++p)
+    {
+        threads.push_back(std::thread([&]{
+            for(unsigned i=0;i<per_producer;++i)
+                q.push(i);
+        }));
+        threads.push_back(std::thread([&]{
+            unsigned v;
+            while(popped.load(std::memory_order_relaxed)<total)
+            {
+                if(q.try_pop(v))
+                    popped.fetch_add(1,std::memory_order_relaxed);
+                else
+                    std::this_thread::yield();
+            }
+        }));
+    }
+    for(std::size_t i=0;i<threads.size();++i)
+        threads[i].join();
+    return mops_since(start,total);
+}
+
+template<cache_layout Layout>
+double stacks_mops(unsigned threads,unsigned per_thread)
+{
+    typedef threadsafe_stack<long,Layout> stack;
+    stack* const stacks=allocate_cache_aligned<stack>(threads);
+    std::vector<std::thread> workers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([=]{
+            stack& s=stacks[t];
+            long v;
+            for(unsigned i=0;i<per_thread;++i)
+            {
+                s.push(i);
+                s.pop(v);
+            }
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    double const mops=mops_since(start,2.0*threads*per_thread);
+    free_cache_aligned(stacks,threads);
+    return mops;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const items=argc>1?std::strtoul(argv[1],nullptr,10):2000000;
+    unsigned const threads=4;
+
+    std::cout << "cache line " << cache_line_size << " bytes" << std::endl
+              << "sizeof\t\t\tpacked\tpadded" << std::endl
+              << "fine_grained_queue\t" << sizeof(fine_grained_queue<int,cache_layout::packed>) << "\t"
+              << sizeof(fine_grained_queue<int,cache_layout::padded>) << std::endl
+              << "threadsafe_stack\t" << sizeof(threadsafe_stack<int,cache_layout::packed>) << "\t"
+              << sizeof(threadsafe_stack<int,cache_layout::padded>) << std::endl;
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, Mops/s\t\tpacked\tpadded" << std::endl
+              << threads << " per-thread counters\t\t"
+              << counters_mops<cache_packed<std::atomic<long> > >(threads,items*10) << "\t"
+              << counters_mops<cache_padded<std::atomic<long> > >(threads,items*10) << std::endl
+              << "queue, 1 producer 1 consumer\t"
+              << queue_mops<cache_layout::packed>(1,items) << "\t"
+              << queue_mops<cache_layout::padded>(1,items) << std::endl
+              << "queue, 2 producers 2 consumers\t"
+              << queue_mops<cache_layout::packed>(2,items/2) << "\t"
+              << queue_mops<cache_layout::padded>(2,items/2) << std::endl
+              << threads << " per-thread stacks\t\t"
+              << stacks_mops<cache_layout::packed>(threads,items) << "\t"
+              << stacks_mops<cache_layout::padded>(threads,items) << std::endl;
+    return 0;
+}
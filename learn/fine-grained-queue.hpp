@@ -0,0 +1,119 @@
+#ifndef FINE_GRAINED_QUEUE_HPP
+#define FINE_GRAINED_QUEUE_HPP
+
+#include <mutex>
+#include <memory>
+#include <cstddef>
+#include "cache-line.hpp"
+
+/**
+ * The fine-grained queue from chapter 6, pulled into a header: a singly
+ * linked list with a dummy node, head_mutex guarding the head and
+ * tail_mutex the tail, so push() and try_pop() only meet in get_tail().
+ *
+ * In the listing the four members are declared one after the other and
+ * share a cache line, so the producer taking tail_mutex invalidates the
+ * line holding head_mutex and head and the consumer pays a miss for every
+ * push it didn't even contend with. Here the head side and the tail side
+ * are each a cache_slot: with cache_layout::padded (the default) each gets
+ * its own line; cache_layout::packed keeps the listing's layout, for
+ * comparison.
+*/
+template<typename T,cache_layout Layout=cache_layout::padded>
+class fine_grained_queue:
+    public cache_aligned_new
+{
+    struct node
+    {
+        std::shared_ptr<T> data;
+        std::unique_ptr<node> next;
+    };
+
+    struct head_state
+    {
+        std::mutex head_mutex;
+        std::unique_ptr<node> head;
+    };
+
+    struct tail_state
+    {
+        std::mutex tail_mutex;
+        node* tail;
+    };
+
+    cache_slot<head_state,Layout> head_side;
+    cache_slot<tail_state,Layout> tail_side;
+
+    node* get_tail()
+    {
+        std::lock_guard<std::mutex> tail_lock(tail_side->tail_mutex);
+        return tail_side->tail;
+    }
+
+    std::unique_ptr<node> pop_head()
+    {
+        std::lock_guard<std::mutex> head_lock(head_side->head_mutex);
+        if(head_side->head.get()==get_tail())
+            return nullptr;
+        std::unique_ptr<node> old_head=std::move(head_side->head);
+        head_side->head=std::move(old_head->next);
+        return old_head;
+    }
+
+public:
+    fine_grained_queue()
+    {
+        static_assert(Layout==cache_layout::packed ||
+                      on_separate_cache_lines(offsetof(fine_grained_queue,head_side),sizeof(head_side),
+                                              offsetof(fine_grained_queue,tail_side),sizeof(tail_side)),
+                      "fine_grained_queue: head and tail share a cache line");
+        head_side->head.reset(new node);
+        tail_side->tail=head_side->head.get();
+    }
+
+    ~fine_grained_queue()
+    {
+        // Unlink iteratively; the recursive unique_ptr destructor would
+        // overflow the stack on a long queue
+        std::unique_ptr<node> n=std::move(head_side->head);
+        while(n)
+            n=std::move(n->next);
+    }
+
+    fine_grained_queue(fine_grained_queue const&)=delete;
+    fine_grained_queue& operator=(fine_grained_queue const&)=delete;
+
+    std::shared_ptr<T> try_pop()
+    {
+        std::unique_ptr<node> old_head=pop_head();
+        return old_head?old_head->data:std::shared_ptr<T>();
+    }
+
+    bool try_pop(T& value)
+    {
+        std::unique_ptr<node> const old_head=pop_head();
+        if(!old_head)
+            return false;
+        value=std::move(*old_head->data);
+        return true;
+    }
+
+    void push(T new_value)
+    {
+        std::shared_ptr<T> new_data(std::make_shared<T>(std::move(new_value)));
+        std::unique_ptr<node> p(new node);
+        node* const new_tail=p.get();
+        std::lock_guard<std::mutex> tail_lock(tail_side->tail_mutex);
+        tail_side->tail->data=new_data;
+        tail_side->tail->next=std::move(p);
+        tail_side->tail=new_tail;
+    }
+
+    bool empty()
+    {
+        std::lock_guard<std::mutex> head_lock(head_side->head_mutex);
+        return head_side->head.get()==get_tail();
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef FUTEX_MUTEX_HPP
+#define FUTEX_MUTEX_HPP
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include "futex.hpp"
+#include "stop-token.hpp"
+
+/**
+ * Futex mutex and condition variable
+ * ==================================
+ *
+ * futex_mutex is the three-state mutex from Drepper's "Futexes Are
+ * Tricky": 0 free, 1 locked, 2 locked and maybe somebody asleep. Lock and
+ * unlock are one atomic instruction each unless there is contention, and
+ * unlock only makes the wake syscall from state 2.
+ *
+ * futex_condition_variable works with std::unique_lock<futex_mutex>.
+ *
+ *  - A notify with nobody waiting is a load and a branch, no syscall. The
+ *    notifier takes the waiter it wakes off the count, so notifies that
+ *    follow before that waiter has even run don't make syscalls either.
+ *    (A waiter that returns spuriously and waits again is counted twice;
+ *    that only costs a spare wake.)
+ *  - notify_all() wakes one waiter and requeues the rest straight onto the
+ *    mutex's futex (FUTEX_CMP_REQUEUE). Waking them all would only have
+ *    them run, find the mutex taken by the first, and go back to sleep on
+ *    it: the thundering herd of "hurry up and wait". Requeued, each is
+ *    woken by the unlock of the one before it.
+ *  - A woken waiter always relocks in state 2, since there may be
+ *    requeued threads behind it that only an unlock from state 2 will
+ *    wake.
+ *
+ * notify_one() just wakes one waiter. Calling it after unlocking the mutex
+ * (as the chapter 6 queues discuss) keeps the woken thread from running
+ * straight into the notifier's lock.
+ *
+ * As with pthreads, all concurrent waits on one condition variable must
+ * use the same mutex; it is the requeue target.
+*/
+
+class futex_condition_variable;
+
+class futex_mutex
+{
+    friend class futex_condition_variable;
+
+    std::atomic<std::uint32_t> word;
+
+    void lock_contended()
+    {
+        while(word.exchange(2,std::memory_order_acquire)!=0)
+            futex_wait(word,2);
+    }
+
+public:
+    futex_mutex():
+        word(0)
+    {}
+
+    futex_mutex(futex_mutex const&)=delete;
+    futex_mutex& operator=(futex_mutex const&)=delete;
+
+    bool try_lock()
+    {
+        std::uint32_t expected=0;
+        return word.compare_exchange_strong(expected,1,std::memory_order_acquire,
+                                            std::memory_order_relaxed);
+    }
+
+    void lock()
+    {
+        if(try_lock())
+            return;
+        if(spin_until([this]{ return word.load(std::memory_order_relaxed)==0 && try_lock(); }))
+            return;
+        lock_contended();
+    }
+
+    void unlock()
+    {
+        if(word.exchange(0,std::memory_order_release)==2)
+            futex_wake(word,1);
+    }
+};
+
+class futex_condition_variable
+{
+    std::atomic<std::uint32_t> sequence;
+    std::atomic<std::uint32_t> waiters;
+    std::atomic<futex_mutex*> mutex;
+
+public:
+    futex_condition_variable():
+        sequence(0),waiters(0),mutex(nullptr)
+    {}
+
+    futex_condition_variable(futex_condition_variable const&)=delete;
+    futex_condition_variable& operator=(futex_condition_variable const&)=delete;
+
+    void wait(std::unique_lock<futex_mutex>& lk)
+    {
+        futex_mutex* const m=lk.mutex();
+        mutex.store(m,std::memory_order_relaxed);
+        // Counted while still holding the mutex: a notifier that changes
+        // the state under the mutex afterwards is bound to see it
+        waiters.fetch_add(1,std::memory_order_seq_cst);
+        std::uint32_t const seen=sequence.load(std::memory_order_relaxed);
+        m->unlock();
+        futex_wait(sequence,seen);
+        m->lock_contended();
+    }
+
+    template<typename Predicate>
+    void wait(std::unique_lock<futex_mutex>& lk,Predicate ready)
+    {
+        while(!ready())
+            wait(lk);
+    }
+
+    /**
+     * Like C++20's condition_variable_any::wait(lock, stop_token, pred):
+     * also returns, with the lock held, once a stop is requested on token.
+     * The result is ready() as of then.
+    */
+    template<typename Predicate>
+    bool wait(std::unique_lock<futex_mutex>& lk,stop_token const& token,Predicate ready)
+    {
+        futex_mutex* const m=lk.mutex();
+        mutex.store(m,std::memory_order_relaxed);
+        while(!ready())
+        {
+            if(token.stop_requested())
+                return false;
+            waiters.fetch_add(1,std::memory_order_seq_cst);
+            std::uint32_t const seen=sequence.load(std::memory_order_relaxed);
+            m->unlock();
+            futex_wait_unless_stopped(sequence,seen,token);
+            m->lock_contended();
+        }
+        return true;
+    }
+
+    void notify_one()
+    {
+        std::uint32_t w=waiters.load(std::memory_order_seq_cst);
+        while(w && !waiters.compare_exchange_weak(w,w-1,std::memory_order_seq_cst))
+            ;
+        if(!w)
+            return;
+        sequence.fetch_add(1,std::memory_order_seq_cst);
+        futex_wake(sequence,1);
+    }
+
+    void notify_all()
+    {
+        if(!waiters.exchange(0,std::memory_order_seq_cst))
+            return;
+        std::uint32_t const now=sequence.fetch_add(1,std::memory_order_seq_cst)+1;
+        futex_mutex* const m=mutex.load(std::memory_order_relaxed);
+        // Fails if another notify moved the sequence in between; then just
+        // wake everybody
+        if(!m || futex_requeue(sequence,now,1,m->word)<0)
+            futex_wake(sequence);
+    }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef FUTEX_HPP
+#define FUTEX_HPP
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * Futex helpers
+ * =============
+ *
+ * A futex is a 32-bit word in user memory plus a kernel wait queue keyed by
+ * its address. futex_wait() sleeps only if the word still holds the value
+ * the caller expects, checked atomically in the kernel, so a wake that
+ * races with going to sleep can't be lost. futex_wake() wakes up to count
+ * sleepers. futex_requeue() wakes some and moves the rest to another word's
+ * queue, so a broadcast doesn't wake everyone just to have them pile up on
+ * a mutex. Nothing touches the kernel's state for the word unless called;
+ * the fast paths of everything built on top stay in user space.
+ *
+ * std::atomic<std::uint32_t> is lock-free and the size of the word, so its
+ * address is what the kernel gets. All calls use the _PRIVATE variants:
+ * these words are never shared between processes.
+ *
+ * spin_until() is the "spin a little first" half of spin-then-futex:
+ * a wait that ends within a few hundred cycles never pays for the two
+ * syscalls. On a single-CPU machine spinning can't help (whoever we wait
+ * for isn't running) so it returns at once.
+*/
+
+inline long futex_wait(std::atomic<std::uint32_t>& word,std::uint32_t expected,
+                       timespec const* timeout=nullptr)
+{
+    return syscall(SYS_futex,reinterpret_cast<std::uint32_t*>(&word),FUTEX_WAIT_PRIVATE,
+                   expected,timeout,nullptr,0);
+}
+
+inline long futex_wake(std::atomic<std::uint32_t>& word,int count=INT_MAX)
+{
+    return syscall(SYS_futex,reinterpret_cast<std::uint32_t*>(&word),FUTEX_WAKE_PRIVATE,
+                   count,nullptr,nullptr,0);
+}
+
+/**
+ * Wakes up to wake_count sleepers on from and moves up to requeue_count of
+ * the rest onto to's queue without waking them, provided from still holds
+ * expected (otherwise fails with EAGAIN and does nothing).
+*/
+inline long futex_requeue(std::atomic<std::uint32_t>& from,std::uint32_t expected,int wake_count,
+                          std::atomic<std::uint32_t>& to,int requeue_count=INT_MAX)
+{
+    // The requeue count travels in the timeout argument's slot
+    return syscall(SYS_futex,reinterpret_cast<std::uint32_t*>(&from),FUTEX_CMP_REQUEUE_PRIVATE,
+                   wake_count,reinterpret_cast<timespec*>(static_cast<long>(requeue_count)),
+                   reinterpret_cast<std::uint32_t*>(&to),expected);
+}
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+static unsigned const futex_spin_limit=256;
+
+inline bool spinning_pays()
+{
+    static bool const multi_cpu=std::thread::hardware_concurrency()>1;
+    return multi_cpu;
+}
+
+/**
+ * Polls done() up to futex_spin_limit times; true as soon as it holds.
+*/
+template<typename Predicate>
+bool spin_until(Predicate done)
+{
+    if(done())
+        return true;
+    if(!spinning_pays())
+        return false;
+    for(unsigned i=0;i<futex_spin_limit;++i)
+    {
+        cpu_relax();
+        if(done())
+            return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef HASH_MIX_HPP
+#define HASH_MIX_HPP
+
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+/**
+ * Hash table helpers
+ * ==================
+ *
+ * What the hash tables and filters here have in common:
+ *
+ *  - std::hash of an integer is the integer itself in libstdc++, so
+ *    sequential ids would fill neighbouring buckets and leave the high
+ *    bits, which the filters and split ordering use, all zero. mix_hash()
+ *    is MurmurHash3's 64-bit finalizer: every input bit affects every
+ *    output bit.
+ *  - allocate_zeroed() gets a bucket array from calloc. Big arrays come
+ *    from mmap already zeroed, and all zero bytes is a null pointer (or a
+ *    null atomic pointer), so a new table costs no pass over its memory;
+ *    its pages fault in as the buckets are filled. Free it with std::free.
+*/
+
+inline std::uint64_t mix_hash(std::uint64_t h)
+{
+    h^=h>>33;
+    h*=0xff51afd7ed558ccdULL;
+    h^=h>>33;
+    h*=0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+    return h;
+}
+
+template<typename T>
+T* allocate_zeroed(std::size_t n)
+{
+    T* const array=static_cast<T*>(std::calloc(n,sizeof(T)));
+    if(!array)
+        throw std::bad_alloc();
+    return array;
+}
+
+#endif
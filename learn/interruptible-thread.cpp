@@ -0,0 +1,182 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include "interruptible-thread.hpp"
+#include "barrier.hpp"
+#include "thread-pool.hpp"
+
+/**
+ * Shutting down blocked threads
+ * =============================
+ *
+ * N threads (20, 200 and 2000 by default) block forever: in a queue pop, in a
+ * condition variable wait, or in an hour-long sleep. Then all of them are
+ * interrupted, and we time until the last one has been joined:
+ *
+ *  - as interruptible_threads sharing one stop_source;
+ *  - the sleepers again, each with its own source, interrupted one by one;
+ *  - the baseline without interruption: threads that wait with a 100ms
+ *    timeout and check a shutdown flag each time they wake up;
+ *  - and a thread_pool of N idle workers, constructed and destroyed.
+ *
+ * Also checks that interrupting consumers part way through loses no items:
+ * everything pushed is either popped or still in the queue.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+double ms_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double,std::milli>(bench_clock::now()-start).count();
+}
+
+template<typename F>
+double interrupt_group_ms(unsigned threads,F block)
+{
+    stop_source group;
+    latch ready(threads);
+    std::unique_ptr<std::vector<interruptible_thread> > workers(new std::vector<interruptible_thread>);
+    workers->reserve(threads);
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers->emplace_back(group,[&]{
+            ready.count_down();
+            block();
+        });
+    }
+    ready.wait();
+    // Give the last ones time to actually go to sleep
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    bench_clock::time_point const start=bench_clock::now();
+    group.request_stop();
+    workers.reset();
+    return ms_since(start);
+}
+
+double interrupt_each_ms(unsigned threads)
+{
+    latch ready(threads);
+    std::unique_ptr<std::vector<interruptible_thread> > workers(new std::vector<interruptible_thread>);
+    workers->reserve(threads);
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers->emplace_back([&]{
+            ready.count_down();
+            interruptible_sleep_for(std::chrono::hours(1));
+        });
+    }
+    ready.wait();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+        (*workers)[t].interrupt();
+    workers.reset();
+    return ms_since(start);
+}
+
+double polling_ms(unsigned threads)
+{
+    std::mutex m;
+    std::condition_variable cond;
+    std::atomic<bool> shutdown(false);
+    latch ready(threads);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            ready.count_down();
+            std::unique_lock<std::mutex> lk(m);
+            while(!shutdown.load())
+                cond.wait_for(lk,std::chrono::milliseconds(100));
+        }));
+    }
+    ready.wait();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    bench_clock::time_point const start=bench_clock::now();
+    shutdown.store(true);
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return ms_since(start);
+}
+
+bool check_no_lost_items()
+{
+    threadsafe_queue<int> queue;
+    std::atomic<unsigned> popped(0);
+    unsigned pushed=0;
+    bool ok=true;
+    for(int run=0;run<100;++run)
+    {
+        stop_source group;
+        std::vector<interruptible_thread> consumers;
+        for(unsigned t=0;t<4;++t)
+        {
+            consumers.emplace_back(group,[&]{
+                int v;
+                for(;;)
+                {
+                    interruptible_wait_and_pop(queue,v);
+                    popped.fetch_add(1);
+                }
+            });
+        }
+        for(unsigned i=0;i<1000;++i,++pushed)
+            queue.push(static_cast<int>(i));
+        group.request_stop();
+        for(std::size_t t=0;t<consumers.size();++t)
+            consumers[t].join();
+        int v;
+        while(queue.try_pop(v))
+            popped.fetch_add(1);
+        if(popped.load()!=pushed)
+            ok=false;
+    }
+    return ok;
+}
+
+void shutdown_times(unsigned threads)
+{
+    threadsafe_queue<int> queue;
+    futex_mutex m;
+    futex_condition_variable cond;
+
+    std::cout << threads << " blocked threads, from interrupt until all joined" << std::endl
+              << "  queue pop, one stop_source     " << interrupt_group_ms(threads,[&]{
+                     int v;
+                     interruptible_wait_and_pop(queue,v);
+                 }) << " ms" << std::endl
+              << "  cv wait, one stop_source       " << interrupt_group_ms(threads,[&]{
+                     std::unique_lock<futex_mutex> lk(m);
+                     interruptible_wait(cond,lk,[]{ return false; });
+                 }) << " ms" << std::endl
+              << "  sleep, one stop_source         " << interrupt_group_ms(threads,[]{
+                     interruptible_sleep_for(std::chrono::hours(1));
+                 }) << " ms" << std::endl
+              << "  sleep, interrupted one by one  " << interrupt_each_ms(threads) << " ms" << std::endl
+              << "  polling with a 100ms timeout   " << polling_ms(threads) << " ms" << std::endl;
+
+    bench_clock::time_point start=bench_clock::now();
+    std::unique_ptr<thread_pool> pool(new thread_pool(threads));
+    double const construct_ms=ms_since(start);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    start=bench_clock::now();
+    pool.reset();
+    std::cout << "  thread_pool of idle workers: constructed in " << construct_ms
+              << " ms, destroyed in " << ms_since(start) << " ms" << std::endl << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const max_threads=argc>1?std::strtoul(argv[1],nullptr,10):2000;
+
+    for(unsigned threads=20;threads<=max_threads;threads*=10)
+        shutdown_times(threads);
+    std::cout << "interrupted consumers lose no items: " << (check_no_lost_items()?"yes":"NO") << std::endl;
+    return 0;
+}
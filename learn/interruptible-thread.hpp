@@ -0,0 +1,181 @@
+#ifndef INTERRUPTIBLE_THREAD_HPP
+#define INTERRUPTIBLE_THREAD_HPP
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <utility>
+#include "stop-token.hpp"
+#include "futex-mutex.hpp"
+#include "threadsafe-queue.hpp"
+
+/**
+ * Interruptible threads
+ * =====================
+ *
+ * scoped_thread joins in its destructor, which hangs for good if the
+ * thread is blocked in wait_and_pop() on a queue nobody will push to
+ * again; detach() instead (as run-background.cpp does) leaks it.
+ *
+ * interruptible_thread owns a stop_source, like C++20's std::jthread, and
+ * makes the token the thread's own: this_thread_stop_token() returns it
+ * inside the thread. interrupt() requests the stop; the destructor
+ * interrupts and then joins.
+ *
+ * Interruption is cooperative. The thread notices it at interruption
+ * points, which throw thread_interrupted, and interruptible_thread catches
+ * that at the top of the thread, so the stack unwinds normally:
+ *
+ *  - interruption_point(), for loops that don't block;
+ *  - interruptible_wait() on a futex_condition_variable;
+ *  - interruptible_wait_and_pop() on a threadsafe_queue;
+ *  - interruptible_sleep_for().
+ *
+ * The blocking ones are woken by the stop request itself (see
+ * stop-token.hpp), so an interrupted thread gets out within a wake-up,
+ * not at the next timeout of a polling loop.
+ *
+ * Threads that are shut down together can share one stop_source: pass it
+ * to the constructor, and one request_stop() on it interrupts them all
+ * with a single wake per futex word they sleep on.
+*/
+
+class thread_interrupted
+{};
+
+namespace interruptible_detail
+{
+    inline stop_token& current_token()
+    {
+        static thread_local stop_token token;
+        return token;
+    }
+}
+
+/**
+ * The running thread's stop token; one that never stops outside an
+ * interruptible_thread.
+*/
+inline stop_token const& this_thread_stop_token()
+{
+    return interruptible_detail::current_token();
+}
+
+inline void interruption_point()
+{
+    if(this_thread_stop_token().stop_requested())
+        throw thread_interrupted();
+}
+
+class interruptible_thread
+{
+    stop_source source;
+    std::thread t;
+
+    template<typename F>
+    static void run(stop_token token,F f)
+    {
+        interruptible_detail::current_token()=token;
+        try
+        {
+            f();
+        }
+        catch(thread_interrupted const&)
+        {}
+    }
+
+public:
+    template<typename F>
+    explicit interruptible_thread(F f):
+        t(&interruptible_thread::run<F>,source.get_token(),std::move(f))
+    {}
+
+    template<typename F>
+    interruptible_thread(stop_source const& group,F f):
+        source(group),
+        t(&interruptible_thread::run<F>,source.get_token(),std::move(f))
+    {}
+
+    interruptible_thread(interruptible_thread&& other)=default;
+
+    ~interruptible_thread()
+    {
+        if(t.joinable())
+        {
+            interrupt();
+            t.join();
+        }
+    }
+
+    interruptible_thread(interruptible_thread const&)=delete;
+    interruptible_thread& operator=(interruptible_thread const&)=delete;
+    interruptible_thread& operator=(interruptible_thread&&)=delete;
+
+    void interrupt()
+    {
+        source.request_stop();
+    }
+
+    bool joinable() const
+    {
+        return t.joinable();
+    }
+
+    void join()
+    {
+        t.join();
+    }
+
+    stop_token get_stop_token() const
+    {
+        return source.get_token();
+    }
+
+    stop_source get_stop_source() const
+    {
+        return source;
+    }
+};
+
+template<typename Predicate>
+void interruptible_wait(futex_condition_variable& cond,std::unique_lock<futex_mutex>& lk,
+                        Predicate ready)
+{
+    if(!cond.wait(lk,this_thread_stop_token(),ready))
+        throw thread_interrupted();
+}
+
+template<typename T>
+void interruptible_wait_and_pop(threadsafe_queue<T>& queue,T& value)
+{
+    if(!queue.wait_and_pop(value,this_thread_stop_token()))
+        throw thread_interrupted();
+}
+
+template<typename Rep,typename Period>
+void interruptible_sleep_for(std::chrono::duration<Rep,Period> const& duration)
+{
+    // Nobody else wakes this word, only a stop request
+    static thread_local std::atomic<std::uint32_t> word(0);
+    typedef std::chrono::steady_clock clock;
+    clock::time_point const deadline=clock::now()+
+        std::chrono::duration_cast<clock::duration>(duration);
+    stop_token const& token=this_thread_stop_token();
+    for(;;)
+    {
+        interruption_point();
+        clock::duration const left=deadline-clock::now();
+        if(left<=clock::duration::zero())
+            return;
+        std::chrono::seconds const s=std::chrono::duration_cast<std::chrono::seconds>(left);
+        timespec timeout;
+        timeout.tv_sec=s.count();
+        timeout.tv_nsec=std::chrono::duration_cast<std::chrono::nanoseconds>(left-s).count();
+        futex_wait_unless_stopped(word,word.load(std::memory_order_relaxed),token,&timeout);
+    }
+}
+
+#endif
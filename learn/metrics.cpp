@@ -0,0 +1,125 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "metrics.hpp"
+#include "threadsafe-queue.hpp"
+#include "scoped-thread.hpp"
+
+/**
+ * Instrumented producer/consumer
+ * ==============================
+ *
+ * Producers push into a threadsafe_queue that reports its depth, consumers
+ * pop and update a shared total under an instrumented_mutex, and every thread
+ * is started through instrumented_thread(). While that runs we scrape the
+ * loopback exporter like Prometheus would and print what it returns.
+ *
+ * Also prints what one metric update costs on the hot path.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+std::string scrape(unsigned short port)
+{
+    int const fd=socket(AF_INET,SOCK_STREAM,0);
+    sockaddr_in addr;
+    std::memset(&addr,0,sizeof(addr));
+    addr.sin_family=AF_INET;
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    addr.sin_port=htons(port);
+    std::string response;
+    if(connect(fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))==0)
+    {
+        char const request[]="GET /metrics HTTP/1.0\r\n\r\n";
+        send(fd,request,sizeof(request)-1,0);
+        char buffer[4096];
+        ssize_t n;
+        while((n=recv(fd,buffer,sizeof(buffer),0))>0)
+            response.append(buffer,n);
+    }
+    close(fd);
+    std::string::size_type const body=response.find("\r\n\r\n");
+    return body==std::string::npos?response:response.substr(body+4);
+}
+
+template<typename Update>
+double ns_per_update(Update update,long n)
+{
+    bench_clock::time_point const start=bench_clock::now();
+    for(long i=0;i<n;++i)
+        update(i);
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/n;
+}
+
+int main()
+{
+    stats_registry registry;
+
+    sharded_counter& c=registry.counter("bench_counter_total");
+    sharded_gauge& g=registry.gauge("bench_gauge");
+    log_histogram& h=registry.histogram("bench_histogram");
+    std::cout << "update cost (ns):  counter "
+              << ns_per_update([&](long){c.add();},100000000)
+              << "   gauge " << ns_per_update([&](long i){g.add(i&1?1:-1);},100000000)
+              << "   histogram " << ns_per_update([&](long i){h.record(i);},100000000) << std::endl;
+
+    prometheus_exporter exporter(registry);
+    unsigned short const port=exporter.listen();
+    std::cout << "serving metrics on 127.0.0.1:" << port << std::endl;
+
+    threadsafe_queue<int> requests;
+    requests.set_depth_gauge(registry.gauge("queue_depth{queue=\"requests\"}",
+                                            "Items waiting in the queue"));
+    sharded_counter& processed=registry.counter("requests_processed_total","Requests handled");
+    instrumented_mutex total_mutex(registry,"total");
+    long total=0;
+    thread_metrics producers(registry,"producers");
+    thread_metrics consumers(registry,"consumers");
+
+    std::atomic<bool> done(false);
+    {
+        std::vector<std::unique_ptr<scoped_thread> > threads;
+        for(unsigned i=0;i<2;++i)
+        {
+            threads.push_back(std::unique_ptr<scoped_thread>(new scoped_thread(
+                instrumented_thread(producers,[&]{
+                    for(int v=0;v<200000;++v)
+                        requests.push(v);
+                }))));
+        }
+        for(unsigned i=0;i<3;++i)
+        {
+            threads.push_back(std::unique_ptr<scoped_thread>(new scoped_thread(
+                instrumented_thread(consumers,[&]{
+                    int v;
+                    while(!done.load() || !requests.empty())
+                    {
+                        if(!requests.try_pop(v))
+                        {
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        std::lock_guard<instrumented_mutex> lk(total_mutex);
+                        total+=v;
+                        processed.add();
+                    }
+                }))));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::cout << std::endl << "--- scrape while running ---" << std::endl << scrape(port);
+        done=true;
+    }
+    std::cout << std::endl << "--- scrape after shutdown ---" << std::endl << scrape(port);
+    std::cout << std::endl << "file dump to /tmp/metrics.prom: "
+              << (exporter.dump_to_file("/tmp/metrics.prom")?"ok":"failed") << std::endl;
+    return 0;
+}
@@ -0,0 +1,334 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include "sharded-counter.hpp"
+
+/**
+ * Metrics export
+ * ==============
+ *
+ * stats_registry already keeps its counters, gauges and histograms in
+ * per-thread slots. This header adds the other half:
+ *
+ *  - render_prometheus() turns a snapshot into Prometheus text format.
+ *  - prometheus_exporter serves that on a loopback-only HTTP port, or dumps
+ *    it to a file for node_exporter's textfile collector.
+ *  - instrumented_mutex and instrumented_thread() feed lock wait times and
+ *    thread lifecycle events into a registry; threadsafe_queue::set_depth_gauge()
+ *    does the same for queue depths.
+ *
+ * A scrape only reads the slots with relaxed loads. Worker threads never
+ * take a lock that a scrape holds, so scraping can't stall them.
+*/
+
+/**
+ * Splits `name{labels}` into its base name and the label list without braces.
+*/
+inline void split_metric_name(std::string const& full,std::string& base,std::string& labels)
+{
+    std::string::size_type const brace=full.find('{');
+    if(brace==std::string::npos)
+    {
+        base=full;
+        labels.clear();
+        return;
+    }
+    base=full.substr(0,brace);
+    std::string::size_type const close=full.rfind('}');
+    labels=full.substr(brace+1,close==std::string::npos?std::string::npos:close-brace-1);
+}
+
+inline std::string render_prometheus(std::vector<stats_registry::sample> const& samples)
+{
+    // Prometheus wants all series of one metric together under one TYPE line
+    std::map<std::string,std::vector<stats_registry::sample const*> > by_base;
+    std::vector<std::string> order;
+    for(std::size_t i=0;i<samples.size();++i)
+    {
+        std::string base,labels;
+        split_metric_name(samples[i].name,base,labels);
+        if(by_base.find(base)==by_base.end())
+            order.push_back(base);
+        by_base[base].push_back(&samples[i]);
+    }
+
+    std::ostringstream out;
+    for(std::size_t i=0;i<order.size();++i)
+    {
+        std::vector<stats_registry::sample const*> const& series=by_base[order[i]];
+        std::string const& base=order[i];
+        char const* const type=series[0]->kind==stats_registry::counter_kind?"counter":
+                               series[0]->kind==stats_registry::gauge_kind?"gauge":"histogram";
+        if(!series[0]->help.empty())
+            out << "# HELP " << base << " " << series[0]->help << "\n";
+        out << "# TYPE " << base << " " << type << "\n";
+        for(std::size_t j=0;j<series.size();++j)
+        {
+            stats_registry::sample const& s=*series[j];
+            std::string ignored,labels;
+            split_metric_name(s.name,ignored,labels);
+            if(s.kind!=stats_registry::histogram_kind)
+            {
+                out << s.name << " " << s.value << "\n";
+                continue;
+            }
+            std::string const sep=labels.empty()?"":labels+",";
+            std::string const braces=labels.empty()?"":"{"+labels+"}";
+            unsigned last=0;
+            for(unsigned b=0;b<log_histogram::buckets;++b)
+            {
+                if(s.histogram.count[b])
+                    last=b;
+            }
+            unsigned long long cumulative=0;
+            for(unsigned b=0;b<=last;++b)
+            {
+                cumulative+=s.histogram.count[b];
+                out << base << "_bucket{" << sep << "le=\"" << log_histogram::upper_bound(b)
+                    << "\"} " << cumulative << "\n";
+            }
+            out << base << "_bucket{" << sep << "le=\"+Inf\"} " << s.histogram.total << "\n";
+            out << base << "_sum" << braces << " " << s.histogram.sum << "\n";
+            out << base << "_count" << braces << " " << s.histogram.total << "\n";
+        }
+    }
+    return out.str();
+}
+
+class prometheus_exporter
+{
+    stats_registry& registry;
+    int listen_fd;
+    std::thread server;
+    std::atomic<bool> stopping;
+
+    void serve()
+    {
+        while(!stopping.load())
+        {
+            pollfd p;
+            p.fd=listen_fd;
+            p.events=POLLIN;
+            // Wake up regularly to notice stop()
+            if(poll(&p,1,100)<=0)
+                continue;
+            int const fd=accept(listen_fd,nullptr,nullptr);
+            if(fd<0)
+                continue;
+            timeval timeout={1,0};
+            setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+            std::string request;
+            char buffer[1024];
+            while(request.find("\r\n\r\n")==std::string::npos && request.size()<8192)
+            {
+                ssize_t const n=recv(fd,buffer,sizeof(buffer),0);
+                if(n<=0)
+                    break;
+                request.append(buffer,n);
+            }
+            std::string const body=render_prometheus(registry.snapshot());
+            std::ostringstream response;
+            response << "HTTP/1.0 200 OK\r\n"
+                     << "Content-Type: text/plain; version=0.0.4\r\n"
+                     << "Content-Length: " << body.size() << "\r\n"
+                     << "Connection: close\r\n\r\n"
+                     << body;
+            std::string const r=response.str();
+            std::size_t sent=0;
+            while(sent<r.size())
+            {
+                ssize_t const n=send(fd,r.data()+sent,r.size()-sent,MSG_NOSIGNAL);
+                if(n<=0)
+                    break;
+                sent+=n;
+            }
+            close(fd);
+        }
+    }
+
+public:
+    explicit prometheus_exporter(stats_registry& registry_):
+        registry(registry_),listen_fd(-1),stopping(false)
+    {}
+
+    ~prometheus_exporter()
+    {
+        stop();
+    }
+
+    prometheus_exporter(prometheus_exporter const&)=delete;
+    prometheus_exporter& operator=(prometheus_exporter const&)=delete;
+
+    /**
+     * Start serving on 127.0.0.1:port. Port 0 picks a free one.
+     * Returns the port actually bound.
+    */
+    unsigned short listen(unsigned short port=0)
+    {
+        listen_fd=socket(AF_INET,SOCK_STREAM,0);
+        if(listen_fd<0)
+            throw std::runtime_error("prometheus_exporter: socket() failed");
+        int const one=1;
+        setsockopt(listen_fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr,0,sizeof(addr));
+        addr.sin_family=AF_INET;
+        addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        addr.sin_port=htons(port);
+        if(bind(listen_fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0 ||
+           ::listen(listen_fd,16)<0)
+        {
+            close(listen_fd);
+            listen_fd=-1;
+            throw std::runtime_error("prometheus_exporter: cannot listen on loopback");
+        }
+        socklen_t len=sizeof(addr);
+        getsockname(listen_fd,reinterpret_cast<sockaddr*>(&addr),&len);
+        stopping=false;
+        server=std::thread(&prometheus_exporter::serve,this);
+        return ntohs(addr.sin_port);
+    }
+
+    void stop()
+    {
+        stopping=true;
+        if(server.joinable())
+            server.join();
+        if(listen_fd>=0)
+        {
+            close(listen_fd);
+            listen_fd=-1;
+        }
+    }
+
+    /**
+     * Write to a temporary file and rename it, so a collector never reads a
+     * half-written dump.
+    */
+    bool dump_to_file(std::string const& path)
+    {
+        std::string const tmp=path+".tmp";
+        {
+            std::ofstream out(tmp.c_str());
+            if(!out)
+                return false;
+            out << render_prometheus(registry.snapshot());
+            if(!out)
+                return false;
+        }
+        return std::rename(tmp.c_str(),path.c_str())==0;
+    }
+};
+
+/**
+ * Drop-in replacement for std::mutex that records how long lock() waited.
+ * The uncontended path is a try_lock() and nothing else; the clock is only
+ * read when we actually have to wait.
+*/
+class instrumented_mutex
+{
+    std::mutex m;
+    log_histogram& wait_ns;
+    sharded_counter& contended;
+public:
+    instrumented_mutex(stats_registry& registry,std::string const& name):
+        wait_ns(registry.histogram("mutex_wait_ns{mutex=\""+name+"\"}",
+                                   "Time spent blocked in lock() when the mutex was contended")),
+        contended(registry.counter("mutex_contended_total{mutex=\""+name+"\"}",
+                                   "Number of lock() calls that had to wait"))
+    {}
+
+    instrumented_mutex(instrumented_mutex const&)=delete;
+    instrumented_mutex& operator=(instrumented_mutex const&)=delete;
+
+    void lock()
+    {
+        if(m.try_lock())
+            return;
+        std::chrono::steady_clock::time_point const start=std::chrono::steady_clock::now();
+        m.lock();
+        contended.add();
+        wait_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now()-start).count());
+    }
+
+    bool try_lock()
+    {
+        return m.try_lock();
+    }
+
+    void unlock()
+    {
+        m.unlock();
+    }
+};
+
+/**
+ * Thread lifecycle metrics for one group of threads.
+*/
+struct thread_metrics
+{
+    sharded_counter& started;
+    sharded_counter& finished;
+    sharded_gauge& running;
+
+    thread_metrics(stats_registry& registry,std::string const& group):
+        started(registry.counter("threads_started_total{group=\""+group+"\"}",
+                                 "Threads started")),
+        finished(registry.counter("threads_finished_total{group=\""+group+"\"}",
+                                  "Threads that ran to completion or threw")),
+        running(registry.gauge("threads_running{group=\""+group+"\"}",
+                               "Threads currently running"))
+    {}
+};
+
+class thread_lifecycle_scope
+{
+    thread_metrics& m;
+public:
+    explicit thread_lifecycle_scope(thread_metrics& m_):
+        m(m_)
+    {
+        m.started.add();
+        m.running.add(1);
+    }
+    ~thread_lifecycle_scope()
+    {
+        m.running.add(-1);
+        m.finished.add();
+    }
+};
+
+/**
+ * Starts a std::thread running f that reports its start and exit into m.
+ * Hand the result to scoped_thread or thread_guard as usual:
+ *
+ *   scoped_thread t(instrumented_thread(pool_metrics,worker));
+*/
+template<typename Function>
+std::thread instrumented_thread(thread_metrics& m,Function f)
+{
+    return std::thread([&m,f]() mutable {
+        thread_lifecycle_scope scope(m);
+        f();
+    });
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef OPTIMISTIC_LOCK_HPP
+#define OPTIMISTIC_LOCK_HPP
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Optimistic locks
+ * ================
+ *
+ * The version word behind concurrent_btree, concurrent_radix_tree and
+ * concurrent_flat_map's groups. Readers take no lock: they note the
+ * version, read, and check the version again, retrying if a writer got in
+ * between. A writer makes the word odd while it changes what it guards.
+ *
+ *  - read_lock() notes the version, or fails if a writer holds the word or
+ *    it is obsolete.
+ *  - validate() is true if nothing changed since read_lock(). Reads in
+ *    between must be relaxed atomics; the fence orders them before the
+ *    check.
+ *  - upgrade() turns a read into a write lock if the version hasn't moved,
+ *    so a writer can descend like a reader and lock only what it changes.
+ *    lock() spins until it gets the word.
+ *  - unlock_obsolete() marks what the word guards as replaced (bit 1), and
+ *    every later read_lock() fails: a reader that found it by an old
+ *    pointer starts again. Containers that never replace nodes don't use it.
+ *
+ * match_bytes16() is the other half of reading a node or group in one go:
+ * where each of 16 key bytes or tags equals a byte, with one SSE2 compare
+ * (a byte loop where there is no SSE2).
+*/
+
+class optimistic_lock
+{
+    // Bit 0: a writer holds it. Bit 1: obsolete. The rest count writes
+    std::atomic<std::uint64_t> version;
+
+public:
+    optimistic_lock():
+        version(0)
+    {}
+
+    bool read_lock(std::uint64_t& seen) const
+    {
+        seen=version.load(std::memory_order_acquire);
+        if(!(seen&3))
+            return true;
+        std::this_thread::yield();
+        return false;
+    }
+
+    bool validate(std::uint64_t seen) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return version.load(std::memory_order_relaxed)==seen;
+    }
+
+    bool upgrade(std::uint64_t seen)
+    {
+        if(!version.compare_exchange_strong(seen,seen+1,std::memory_order_acquire))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    void lock()
+    {
+        std::uint64_t seen;
+        while(!read_lock(seen) || !upgrade(seen))
+            ;
+    }
+
+    void unlock()
+    {
+        version.store(version.load(std::memory_order_relaxed)+3,std::memory_order_release);
+    }
+
+    void unlock_obsolete()
+    {
+        version.store(version.load(std::memory_order_relaxed)+1,std::memory_order_release);
+    }
+};
+
+/**
+ * Bit i of the result is set if byte i of low:high equals byte.
+*/
+inline unsigned match_bytes16(std::uint64_t low,std::uint64_t high,std::uint8_t byte)
+{
+#if defined(__SSE2__)
+    __m128i const bytes=_mm_set_epi64x(static_cast<long long>(high),static_cast<long long>(low));
+    return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes,_mm_set1_epi8(static_cast<char>(byte)))));
+#else
+    unsigned m=0;
+    for(unsigned i=0;i<8;++i)
+    {
+        m|=static_cast<unsigned>(static_cast<std::uint8_t>(low>>(8*i))==byte)<<i;
+        m|=static_cast<unsigned>(static_cast<std::uint8_t>(high>>(8*i))==byte)<<(i+8);
+    }
+    return m;
+#endif
+}
+
+#endif
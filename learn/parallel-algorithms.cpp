@@ -0,0 +1,264 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+#include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include "parallel-algorithms.hpp"
+#include "reclamation.hpp"
+
+/**
+ * Speedup of the parallel algorithms
+ * ==================================
+ *
+ * For each size from 1M up to 1B elements (or the largest that fits in
+ * about half the machine's memory; the first argument overrides the upper
+ * bound) and each pool size from 1 thread up to one per core, time every
+ * algorithm and print its speedup over the serial std:: version.
+ *
+ * Also checks results against the serial versions, that an exception thrown
+ * by one chunk comes out of the call, and that parallel_find stops early.
+ * Checks that a task the pool can't take runs on the caller, that a thread
+ * outside the pool can steal from any worker, and
+ * finally it leaves retired nodes pending on the shared pool's workers, so
+ * those workers still have reclamation work to hand over when the pool is
+ * torn down at exit (run under -fsanitize=address to see that it's safe).
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+template<typename Function>
+double seconds(Function f)
+{
+    bench_clock::time_point const start=bench_clock::now();
+    f();
+    return std::chrono::duration<double>(bench_clock::now()-start).count();
+}
+
+void check_correctness(thread_pool& pool)
+{
+    std::vector<std::uint64_t> v(1000003);
+    for(std::size_t i=0;i<v.size();++i)
+        v[i]=i%13;
+    std::vector<std::uint64_t> a(v.size()),b(v.size());
+
+    bool ok=parallel_accumulate(pool,v.begin(),v.end(),std::uint64_t(5),std::plus<std::uint64_t>())==
+        std::accumulate(v.begin(),v.end(),std::uint64_t(5));
+
+    parallel_inclusive_scan(pool,v.begin(),v.end(),a.begin(),std::plus<std::uint64_t>());
+    std::partial_sum(v.begin(),v.end(),b.begin());
+    ok=ok && a==b;
+
+    parallel_exclusive_scan(pool,v.begin(),v.end(),a.begin(),std::uint64_t(7),std::plus<std::uint64_t>());
+    b[0]=7;
+    for(std::size_t i=1;i<v.size();++i)
+        b[i]=b[i-1]+v[i-1];
+    ok=ok && a==b;
+
+    parallel_transform(pool,v.begin(),v.end(),a.begin(),[](std::uint64_t x){ return x*x; });
+    std::transform(v.begin(),v.end(),b.begin(),[](std::uint64_t x){ return x*x; });
+    ok=ok && a==b;
+
+    v[700000]=99;
+    v[900000]=99;
+    ok=ok && parallel_find_if(pool,v.begin(),v.end(),[](std::uint64_t x){ return x==99; })-v.begin()==700000;
+
+    bool threw=false;
+    std::atomic<unsigned long> visited(0);
+    try
+    {
+        parallel_for(pool,0,v.size(),1000,[&](std::size_t i){
+            ++visited;
+            if(i==1234)
+                throw std::runtime_error("chunk failed");
+        });
+    }
+    catch(std::runtime_error const&)
+    {
+        threw=true;
+    }
+    std::cout << "results match serial: " << (ok?"yes":"NO")
+              << ", exception propagated: " << (threw?"yes":"NO")
+              << " (" << visited << " of " << v.size() << " elements visited)" << std::endl;
+}
+
+/**
+ * Copying this throws, as spawning does when it runs out of memory
+*/
+struct copy_throws
+{
+    unsigned* ran;
+
+    explicit copy_throws(unsigned* ran_):
+        ran(ran_)
+    {}
+
+    copy_throws(copy_throws&& other) noexcept:
+        ran(other.ran)
+    {}
+
+    copy_throws(copy_throws const&)
+    {
+        throw std::bad_alloc();
+    }
+
+    void operator()()
+    {
+        ++*ran;
+    }
+};
+
+/**
+ * A task that can't be spawned runs on the caller, and wait() returns
+ * instead of waiting forever for it
+*/
+bool failed_spawn_runs_inline(thread_pool& pool)
+{
+    unsigned ran=0;
+    task_group group(pool);
+    group.run(copy_throws(&ran));
+    group.wait();
+    return ran==1;
+}
+
+/**
+ * The pool's only worker spawns a subtask onto its own deque and then waits
+ * for it, so the subtask runs only if the main thread steals it
+*/
+bool outside_thread_steals()
+{
+    thread_pool pool(1);
+    std::atomic<bool> spawned(false);
+    std::atomic<bool> stolen(false);
+    std::atomic<bool> give_up(false);
+    pool.spawn([&]{
+        pool.spawn([&]{ stolen.store(true); });
+        spawned.store(true);
+        while(!stolen.load() && !give_up.load())
+            std::this_thread::yield();
+    });
+    // Don't take the outer task from the global queue ourselves
+    while(!spawned.load())
+        std::this_thread::yield();
+    bench_clock::time_point const deadline=bench_clock::now()+std::chrono::seconds(2);
+    while(!stolen.load() && bench_clock::now()<deadline)
+        pool.run_pending_task();
+    give_up.store(true);
+    return stolen.load();
+}
+
+/**
+ * The workers retire a few nodes each, then a thread that exits hands its
+ * own over to the orphan list, so the reclaimer's statics are set up after
+ * the shared pool and are in use again when its workers exit
+*/
+void leave_retired_on_shared_pool()
+{
+    thread_pool& pool=thread_pool::shared();
+    std::vector<std::future<void> > done;
+    for(unsigned i=0;i<4*pool.size();++i)
+    {
+        done.push_back(pool.submit([i]{
+            epoch_reclaimer::retire(new std::uint64_t(i));
+        }));
+    }
+    for(std::size_t i=0;i<done.size();++i)
+        done[i].get();
+    std::thread([]{
+        epoch_reclaimer::retire(new std::uint64_t(42));
+    }).join();
+}
+
+void bench(std::size_t n,unsigned threads)
+{
+    thread_pool pool(threads);
+    std::vector<std::uint32_t> in(n),out(n);
+    for(std::size_t i=0;i<n;++i)
+        in[i]=static_cast<std::uint32_t>(i%7);
+    volatile std::uint64_t sink=0;
+
+    // The needle sits in the middle so the serial search reads half the range
+    in[n/2]=42;
+    double const serial_for=seconds([&]{
+        for(std::size_t i=0;i<n;++i)
+            out[i]=in[i]*3+1;
+    });
+    double const serial_accumulate=seconds([&]{
+        sink=std::accumulate(in.begin(),in.end(),std::uint64_t(0));
+    });
+    double const serial_scan=seconds([&]{
+        std::partial_sum(in.begin(),in.end(),out.begin());
+    });
+    double const serial_transform=seconds([&]{
+        std::transform(in.begin(),in.end(),out.begin(),[](std::uint32_t x){ return x*x+1; });
+    });
+    double const serial_find=seconds([&]{
+        sink=std::find(in.begin(),in.end(),42u)-in.begin();
+    });
+
+    double const par_for=seconds([&]{
+        parallel_for(pool,0,n,0,[&](std::size_t i){ out[i]=in[i]*3+1; });
+    });
+    double const par_accumulate=seconds([&]{
+        sink=parallel_accumulate(pool,in.begin(),in.end(),std::uint64_t(0),std::plus<std::uint64_t>());
+    });
+    double const par_scan=seconds([&]{
+        parallel_inclusive_scan(pool,in.begin(),in.end(),out.begin(),std::plus<std::uint32_t>());
+    });
+    double const par_transform=seconds([&]{
+        parallel_transform(pool,in.begin(),in.end(),out.begin(),[](std::uint32_t x){ return x*x+1; });
+    });
+    double const par_find=seconds([&]{
+        sink=parallel_find_if(pool,in.begin(),in.end(),[](std::uint32_t x){ return x==42; })-in.begin();
+    });
+
+    std::cout << n << "\t" << threads << "\t"
+              << serial_for/par_for << "\t" << serial_accumulate/par_accumulate << "\t"
+              << serial_scan/par_scan << "\t" << serial_transform/par_transform << "\t"
+              << serial_find/par_find << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const cores=std::thread::hardware_concurrency()?std::thread::hardware_concurrency():2;
+    {
+        thread_pool pool(cores);
+        check_correctness(pool);
+        std::cout << "task that can't be spawned runs inline: "
+                  << (failed_spawn_runs_inline(pool)?"yes":"NO") << std::endl;
+    }
+    std::cout << "outside thread steals from a worker: "
+              << (outside_thread_steals()?"yes":"NO") << std::endl;
+
+    // Two uint32_t arrays per run; keep them within half of physical memory
+    std::size_t const memory=static_cast<std::size_t>(sysconf(_SC_PHYS_PAGES))*sysconf(_SC_PAGESIZE);
+    std::size_t const fits=memory/2/(2*sizeof(std::uint32_t));
+    std::size_t const largest=argc>1?std::strtoull(argv[1],nullptr,10):1000000000;
+
+    std::cout << std::endl << "speedup over serial std:: algorithms" << std::endl
+              << "n\tthreads\tfor\taccum\tscan\ttransf\tfind" << std::endl;
+    for(std::size_t n=1000000;n<=largest;n*=10)
+    {
+        if(n>fits)
+        {
+            std::cout << n << "\tskipped: needs " << (2*n*sizeof(std::uint32_t)>>20) << " MB" << std::endl;
+            continue;
+        }
+        for(unsigned threads=1;;threads*=2)
+        {
+            if(threads>cores)
+                threads=cores;
+            bench(n,threads);
+            if(threads==cores)
+                break;
+        }
+    }
+
+    leave_retired_on_shared_pool();
+    return 0;
+}
@@ -0,0 +1,442 @@
+#ifndef PARALLEL_ALGORITHMS_HPP
+#define PARALLEL_ALGORITHMS_HPP
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <iterator>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <numeric>
+#include "thread-pool.hpp"
+
+/**
+ * Parallel algorithms
+ * ===================
+ *
+ * parallel_for, parallel_accumulate, parallel_inclusive_scan /
+ * parallel_exclusive_scan, parallel_transform and parallel_find_if over
+ * random-access ranges, running on a thread_pool (thread_pool::shared()
+ * unless one is passed first).
+ *
+ * Chunking: a range of n elements is cut into chunks of
+ * max(grain, n / (8 * pool size)) elements, so there are enough chunks for
+ * stealing to even out uneven work and few enough that per-chunk overhead
+ * doesn't show. grain 0 means "pick for me". The chunks themselves are
+ * spawned by recursive halving, so a thief takes half of what is left
+ * rather than one chunk at a time.
+ *
+ * Exceptions: the first exception thrown by any chunk is kept, every chunk
+ * that hasn't started yet is skipped, and the exception is rethrown on the
+ * calling thread once the chunks already running have finished. The caller
+ * helps run tasks while it waits, so these can be called from inside a
+ * pool task too.
+*/
+
+/**
+ * A set of tasks with a shared cancellation flag and first-exception slot.
+*/
+class task_group
+{
+    thread_pool& pool;
+    std::atomic<std::size_t> pending;
+    std::atomic<bool> cancelled_;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+public:
+    explicit task_group(thread_pool& pool_):
+        pool(pool_),pending(0),cancelled_(false)
+    {}
+
+    ~task_group()
+    {
+        // Tasks refer to the group; never let it go away under them
+        while(pending.load(std::memory_order_acquire))
+        {
+            if(!pool.run_pending_task())
+                std::this_thread::yield();
+        }
+    }
+
+    task_group(task_group const&)=delete;
+    task_group& operator=(task_group const&)=delete;
+
+    thread_pool& get_pool()
+    {
+        return pool;
+    }
+
+    bool cancelled() const
+    {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+    void cancel()
+    {
+        cancelled_.store(true,std::memory_order_relaxed);
+    }
+
+    /**
+     * Runs f, catching what it throws. Only the first exception is kept.
+    */
+    template<typename Function>
+    void run_here(Function& f)
+    {
+        if(cancelled())
+            return;
+        try
+        {
+            f();
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lk(error_mutex);
+            if(!error)
+                error=std::current_exception();
+            cancel();
+        }
+    }
+
+    /**
+     * Queues f on the pool. If that fails (spawning allocates), f runs
+     * here instead, so the count of pending tasks never stays up for a
+     * task that doesn't exist.
+    */
+    template<typename Function>
+    void run(Function f)
+    {
+        pending.fetch_add(1,std::memory_order_relaxed);
+        try
+        {
+            pool.spawn([this,f]() mutable {
+                run_here(f);
+                pending.fetch_sub(1,std::memory_order_release);
+            });
+        }
+        catch(...)
+        {
+            run_here(f);
+            pending.fetch_sub(1,std::memory_order_release);
+        }
+    }
+
+    /**
+     * Helps the pool until every task has finished, then rethrows the first
+     * exception, if any.
+    */
+    void wait()
+    {
+        while(pending.load(std::memory_order_acquire))
+        {
+            if(!pool.run_pending_task())
+                std::this_thread::yield();
+        }
+        if(error)
+        {
+            std::exception_ptr e=error;
+            error=nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+};
+
+namespace parallel_detail
+{
+    inline std::size_t chunk_size(std::size_t n,std::size_t grain,thread_pool& pool)
+    {
+        std::size_t const target=n/(8*static_cast<std::size_t>(pool.size()))+1;
+        return std::max<std::size_t>(std::max<std::size_t>(grain,target),1);
+    }
+
+    inline std::size_t chunk_count(std::size_t n,std::size_t chunk)
+    {
+        return (n+chunk-1)/chunk;
+    }
+
+    /**
+     * Calls body(c) for every chunk index c in [first, last), splitting the
+     * index range in halves and spawning the right half each time.
+    */
+    template<typename Body>
+    void spawn_chunks(task_group& group,std::size_t first,std::size_t last,Body const& body)
+    {
+        while(last-first>1)
+        {
+            if(group.cancelled())
+                return;
+            std::size_t const middle=first+(last-first)/2;
+            Body const* const b=&body;
+            task_group* const g=&group;
+            group.run([g,b,middle,last]{ spawn_chunks(*g,middle,last,*b); });
+            last=middle;
+        }
+        if(first<last)
+        {
+            auto f=[&]{ body(first); };
+            group.run_here(f);
+        }
+    }
+
+    template<typename Body>
+    void for_each_chunk(thread_pool& pool,std::size_t chunks,Body const& body)
+    {
+        task_group group(pool);
+        // The caller runs the leftmost chunks itself while the rest are
+        // stolen; body must outlive wait(), which it does here
+        auto root=[&]{ spawn_chunks(group,0,chunks,body); };
+        group.run_here(root);
+        group.wait();
+    }
+}
+
+/**
+ * f(i) for every i in [begin, end).
+*/
+template<typename Function>
+void parallel_for(thread_pool& pool,std::size_t begin,std::size_t end,std::size_t grain,Function f)
+{
+    if(begin>=end)
+        return;
+    std::size_t const n=end-begin;
+    std::size_t const chunk=parallel_detail::chunk_size(n,grain,pool);
+    parallel_detail::for_each_chunk(pool,parallel_detail::chunk_count(n,chunk),
+        [&](std::size_t c){
+            std::size_t const first=begin+c*chunk;
+            std::size_t const last=std::min(end,first+chunk);
+            for(std::size_t i=first;i<last;++i)
+                f(i);
+        });
+}
+
+template<typename Function>
+void parallel_for(std::size_t begin,std::size_t end,std::size_t grain,Function f)
+{
+    parallel_for(thread_pool::shared(),begin,end,grain,f);
+}
+
+/**
+ * Like std::accumulate, but op must be associative: chunks are reduced
+ * independently and the partial results combined in order.
+*/
+template<typename Iterator,typename T,typename BinaryOp>
+T parallel_accumulate(thread_pool& pool,Iterator first,Iterator last,T init,BinaryOp op,
+                      std::size_t grain=0)
+{
+    std::size_t const n=static_cast<std::size_t>(last-first);
+    if(!n)
+        return init;
+    std::size_t const chunk=parallel_detail::chunk_size(n,grain,pool);
+    std::size_t const chunks=parallel_detail::chunk_count(n,chunk);
+    std::vector<T> partial(chunks);
+    parallel_detail::for_each_chunk(pool,chunks,[&](std::size_t c){
+        Iterator const b=first+c*chunk;
+        Iterator const e=first+std::min(n,(c+1)*chunk);
+        T sum=*b;
+        for(Iterator it=b+1;it!=e;++it)
+            sum=op(sum,*it);
+        partial[c]=sum;
+    });
+    T result=init;
+    for(std::size_t c=0;c<chunks;++c)
+        result=op(result,partial[c]);
+    return result;
+}
+
+template<typename Iterator,typename T,typename BinaryOp>
+T parallel_accumulate(Iterator first,Iterator last,T init,BinaryOp op)
+{
+    return parallel_accumulate(thread_pool::shared(),first,last,init,op);
+}
+
+template<typename Iterator,typename T>
+T parallel_accumulate(Iterator first,Iterator last,T init)
+{
+    return parallel_accumulate(thread_pool::shared(),first,last,init,std::plus<T>());
+}
+
+/**
+ * out[i]=f(first[i]). out may be first.
+*/
+template<typename InputIt,typename OutputIt,typename Function>
+OutputIt parallel_transform(thread_pool& pool,InputIt first,InputIt last,OutputIt out,Function f,
+                            std::size_t grain=0)
+{
+    std::size_t const n=static_cast<std::size_t>(last-first);
+    if(!n)
+        return out;
+    std::size_t const chunk=parallel_detail::chunk_size(n,grain,pool);
+    parallel_detail::for_each_chunk(pool,parallel_detail::chunk_count(n,chunk),[&](std::size_t c){
+        std::size_t const b=c*chunk;
+        std::size_t const e=std::min(n,b+chunk);
+        std::transform(first+b,first+e,out+b,f);
+    });
+    return out+n;
+}
+
+template<typename InputIt,typename OutputIt,typename Function>
+OutputIt parallel_transform(InputIt first,InputIt last,OutputIt out,Function f)
+{
+    return parallel_transform(thread_pool::shared(),first,last,out,f);
+}
+
+namespace parallel_detail
+{
+    /**
+     * Two passes: reduce each chunk, scan the chunk totals serially (there
+     * are only a few dozen), then scan each chunk again starting from its
+     * offset. Reads the input twice, which is the price of being parallel.
+    */
+    template<typename InputIt,typename OutputIt,typename T,typename BinaryOp>
+    OutputIt scan(thread_pool& pool,InputIt first,InputIt last,OutputIt out,
+                  T const* init,BinaryOp op,bool inclusive,std::size_t grain)
+    {
+        std::size_t const n=static_cast<std::size_t>(last-first);
+        if(!n)
+            return out;
+        std::size_t const chunk=chunk_size(n,grain,pool);
+        std::size_t const chunks=chunk_count(n,chunk);
+        std::vector<T> totals(chunks);
+        for_each_chunk(pool,chunks,[&](std::size_t c){
+            InputIt const b=first+c*chunk;
+            InputIt const e=first+std::min(n,(c+1)*chunk);
+            T sum=*b;
+            for(InputIt it=b+1;it!=e;++it)
+                sum=op(sum,*it);
+            totals[c]=sum;
+        });
+
+        // offsets[c] is what precedes chunk c; has_offset is false only for
+        // the first chunk of an inclusive scan without init
+        std::vector<T> offsets(chunks);
+        bool const first_has_offset=init!=nullptr;
+        if(init)
+            offsets[0]=*init;
+        for(std::size_t c=1;c<chunks;++c)
+            offsets[c]=(c==1 && !first_has_offset)?totals[0]:op(offsets[c-1],totals[c-1]);
+
+        for_each_chunk(pool,chunks,[&](std::size_t c){
+            std::size_t const b=c*chunk;
+            std::size_t const e=std::min(n,b+chunk);
+            bool have=c>0 || first_has_offset;
+            T running=offsets[c];
+            for(std::size_t i=b;i<e;++i)
+            {
+                T const x=first[i];
+                if(inclusive)
+                {
+                    running=have?op(running,x):x;
+                    have=true;
+                    out[i]=running;
+                }
+                else
+                {
+                    out[i]=running;
+                    running=op(running,x);
+                }
+            }
+        });
+        return out+n;
+    }
+}
+
+/**
+ * out[i] = first[0] op ... op first[i]
+*/
+template<typename InputIt,typename OutputIt,typename BinaryOp>
+OutputIt parallel_inclusive_scan(thread_pool& pool,InputIt first,InputIt last,OutputIt out,
+                                 BinaryOp op,std::size_t grain=0)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    return parallel_detail::scan<InputIt,OutputIt,value_type>(pool,first,last,out,nullptr,op,
+                                                               true,grain);
+}
+
+template<typename InputIt,typename OutputIt,typename BinaryOp>
+OutputIt parallel_inclusive_scan(InputIt first,InputIt last,OutputIt out,BinaryOp op)
+{
+    return parallel_inclusive_scan(thread_pool::shared(),first,last,out,op);
+}
+
+template<typename InputIt,typename OutputIt>
+OutputIt parallel_inclusive_scan(InputIt first,InputIt last,OutputIt out)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    return parallel_inclusive_scan(thread_pool::shared(),first,last,out,std::plus<value_type>());
+}
+
+/**
+ * out[i] = init op first[0] op ... op first[i-1]
+*/
+template<typename InputIt,typename OutputIt,typename T,typename BinaryOp>
+OutputIt parallel_exclusive_scan(thread_pool& pool,InputIt first,InputIt last,OutputIt out,
+                                 T init,BinaryOp op,std::size_t grain=0)
+{
+    return parallel_detail::scan(pool,first,last,out,&init,op,false,grain);
+}
+
+template<typename InputIt,typename OutputIt,typename T,typename BinaryOp>
+OutputIt parallel_exclusive_scan(InputIt first,InputIt last,OutputIt out,T init,BinaryOp op)
+{
+    return parallel_exclusive_scan(thread_pool::shared(),first,last,out,init,op);
+}
+
+template<typename InputIt,typename OutputIt,typename T>
+OutputIt parallel_exclusive_scan(InputIt first,InputIt last,OutputIt out,T init)
+{
+    return parallel_exclusive_scan(thread_pool::shared(),first,last,out,init,std::plus<T>());
+}
+
+/**
+ * First element (lowest position) matching pred, or last.
+ *
+ * A chunk that finds a match lowers a shared "best so far" index. Chunks
+ * starting after it are skipped, and a chunk in progress gives up once it
+ * is past it, so the rest of the range isn't searched. Chunks before it
+ * still run, since one of them may hold an earlier match.
+*/
+template<typename Iterator,typename Predicate>
+Iterator parallel_find_if(thread_pool& pool,Iterator first,Iterator last,Predicate pred,
+                          std::size_t grain=0)
+{
+    std::size_t const n=static_cast<std::size_t>(last-first);
+    if(!n)
+        return last;
+    std::size_t const chunk=parallel_detail::chunk_size(n,grain,pool);
+    std::atomic<std::size_t> best(n);
+    parallel_detail::for_each_chunk(pool,parallel_detail::chunk_count(n,chunk),[&](std::size_t c){
+        std::size_t const b=c*chunk;
+        std::size_t const e=std::min(n,b+chunk);
+        for(std::size_t i=b;i<e;++i)
+        {
+            // Check on entry and every 1024 elements after that
+            if((i==b || (i&1023)==0) && i>=best.load(std::memory_order_relaxed))
+                return;
+            if(pred(first[i]))
+            {
+                std::size_t current=best.load(std::memory_order_relaxed);
+                while(i<current && !best.compare_exchange_weak(current,i,std::memory_order_relaxed));
+                return;
+            }
+        }
+    });
+    return first+best.load(std::memory_order_relaxed);
+}
+
+template<typename Iterator,typename Predicate>
+Iterator parallel_find_if(Iterator first,Iterator last,Predicate pred)
+{
+    return parallel_find_if(thread_pool::shared(),first,last,pred);
+}
+
+template<typename Iterator,typename T>
+Iterator parallel_find(Iterator first,Iterator last,T const& value)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    return parallel_find_if(thread_pool::shared(),first,last,
+                            [&value](value_type const& x){ return x==value; });
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include "parallel-sort.hpp"
+
+/**
+ * Sorting 10^6 to 10^9 keys
+ * =========================
+ *
+ * Random 64-bit keys, sizes from 1M up to 1B (or the largest that fits in
+ * about half the machine's memory; the first argument overrides the upper
+ * bound). For each size std::sort and std::stable_sort are timed once, then
+ * the three parallel sorts with pools from 1 thread up to one per core.
+ *
+ * Before that, checks each sort's output against std::sort, including
+ * inputs full of duplicates and already sorted ones, and that
+ * parallel_stable_sort keeps equal keys in their original order.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+template<typename Function>
+double seconds(Function f)
+{
+    bench_clock::time_point const start=bench_clock::now();
+    f();
+    return std::chrono::duration<double>(bench_clock::now()-start).count();
+}
+
+void fill_random(std::vector<std::uint64_t>& v,std::uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    for(std::size_t i=0;i<v.size();++i)
+        v[i]=random();
+}
+
+void check_correctness(thread_pool& pool)
+{
+    std::size_t const n=3000017;
+    std::vector<std::vector<std::uint64_t> > inputs(3,std::vector<std::uint64_t>(n));
+    fill_random(inputs[0],1);
+    for(std::size_t i=0;i<n;++i)
+    {
+        inputs[1][i]=inputs[0][i]%5;
+        inputs[2][i]=i;
+    }
+
+    bool ok=true;
+    for(std::size_t k=0;k<inputs.size();++k)
+    {
+        std::vector<std::uint64_t> expected(inputs[k]);
+        std::sort(expected.begin(),expected.end());
+        std::vector<std::uint64_t> v(inputs[k]);
+        parallel_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>());
+        ok=ok && v==expected;
+        v=inputs[k];
+        parallel_stable_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>());
+        ok=ok && v==expected;
+        v=inputs[k];
+        parallel_sample_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>());
+        ok=ok && v==expected;
+    }
+
+    // Sort (key, original position) by key only
+    std::vector<std::pair<std::uint32_t,std::uint32_t> > records(n);
+    for(std::size_t i=0;i<n;++i)
+        records[i]=std::make_pair(static_cast<std::uint32_t>(inputs[0][i]%1000),static_cast<std::uint32_t>(i));
+    parallel_stable_sort(pool,records.begin(),records.end(),
+        [](std::pair<std::uint32_t,std::uint32_t> const& a,std::pair<std::uint32_t,std::uint32_t> const& b){
+            return a.first<b.first;
+        });
+    bool stable=true;
+    for(std::size_t i=1;i<n;++i)
+        stable=stable && (records[i-1].first<records[i].first ||
+                          (records[i-1].first==records[i].first && records[i-1].second<records[i].second));
+
+    std::cout << "results match std::sort: " << (ok?"yes":"NO")
+              << ", stable sort keeps equal keys in order: " << (stable?"yes":"NO") << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const cores=std::thread::hardware_concurrency()?std::thread::hardware_concurrency():2;
+    {
+        thread_pool pool(cores);
+        check_correctness(pool);
+    }
+
+    // The input, the copy being sorted and the merge/scatter buffer
+    std::size_t const memory=static_cast<std::size_t>(sysconf(_SC_PHYS_PAGES))*sysconf(_SC_PAGESIZE);
+    std::size_t const fits=memory/2/(3*sizeof(std::uint64_t));
+    std::size_t const largest=argc>1?std::strtoull(argv[1],nullptr,10):1000000000;
+
+    std::cout << std::endl << "seconds to sort n random 64-bit keys (speedup over std::sort / std::stable_sort)"
+              << std::endl << "n\tthreads\tsort\tstable\tpar_sort\tpar_stable\tsample_sort" << std::endl;
+    for(std::size_t n=1000000;n<=largest;n*=10)
+    {
+        if(n>fits)
+        {
+            std::cout << n << "\tskipped: needs " << (3*n*sizeof(std::uint64_t)>>20) << " MB" << std::endl;
+            continue;
+        }
+        std::vector<std::uint64_t> input(n);
+        fill_random(input,n);
+        std::vector<std::uint64_t> v(input);
+        double const serial=seconds([&]{ std::sort(v.begin(),v.end()); });
+        v=input;
+        double const serial_stable=seconds([&]{ std::stable_sort(v.begin(),v.end()); });
+
+        for(unsigned threads=1;;threads*=2)
+        {
+            if(threads>cores)
+                threads=cores;
+            thread_pool pool(threads);
+            v=input;
+            double const quick=seconds([&]{ parallel_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>()); });
+            v=input;
+            double const merge=seconds([&]{ parallel_stable_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>()); });
+            v=input;
+            double const sample=seconds([&]{ parallel_sample_sort(pool,v.begin(),v.end(),std::less<std::uint64_t>()); });
+
+            std::cout << n << "\t" << threads << "\t" << serial << "\t" << serial_stable << "\t"
+                      << quick << " (" << serial/quick << "x)\t"
+                      << merge << " (" << serial_stable/merge << "x)\t"
+                      << sample << " (" << serial/sample << "x)" << std::endl;
+            if(threads==cores)
+                break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,337 @@
+#ifndef PARALLEL_SORT_HPP
+#define PARALLEL_SORT_HPP
+
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <random>
+#include "parallel-algorithms.hpp"
+
+/**
+ * Parallel sorting
+ * ================
+ *
+ * Chapter 8's parallel quicksort pushes the sub-ranges left over after each
+ * partition onto a threadsafe_stack that idle threads pop from. The
+ * thread_pool does the same job with less contention: the sub-range goes
+ * into the partitioning thread's own deque, and idle workers steal it.
+ *
+ * parallel_sort(): quicksort. Partition around a median-of-three pivot into
+ * <, == and > parts, spawn the larger outer part as a task, carry on with
+ * the smaller. Ranges under the cutoff are handed to std::sort. The equal
+ * part is never touched again, so many duplicate keys don't hurt; past a
+ * recursion depth of 2*log2(n) the rest of the range also goes to std::sort,
+ * so a bad pivot sequence can't go quadratic. The first partitions are
+ * serial passes over the whole range, which is what limits its scaling.
+ *
+ * parallel_stable_sort(): merge sort. std::stable_sort one chunk per task,
+ * then merge pairs of runs in rounds through a buffer. Each merge is itself
+ * split in parallel: cut the longer run in the middle, binary-search the
+ * cut point in the other, merge the two halves independently.
+ *
+ * parallel_sample_sort(): for large inputs. Sort a random sample, pick
+ * bucket boundaries from it, then in parallel count how many elements of
+ * each block fall into each bucket, scatter them into a buffer, and sort
+ * each bucket independently. Every element moves a fixed number of times
+ * and every phase is parallel, at the cost of a buffer as big as the input.
+ *
+ * The stable and sample sorts need a default-constructible value type for
+ * their buffer.
+*/
+
+namespace parallel_detail
+{
+    static std::size_t const sort_cutoff=1<<14;
+
+    template<typename Iterator,typename Compare>
+    Iterator median_of_three(Iterator a,Iterator b,Iterator c,Compare comp)
+    {
+        if(comp(*a,*b))
+        {
+            if(comp(*b,*c))
+                return b;
+            return comp(*a,*c)?c:a;
+        }
+        if(comp(*a,*c))
+            return a;
+        return comp(*b,*c)?c:b;
+    }
+
+    template<typename Iterator,typename Compare>
+    void quicksort(task_group& group,Iterator first,Iterator last,Compare comp,unsigned depth)
+    {
+        typedef typename std::iterator_traits<Iterator>::value_type value_type;
+        while(static_cast<std::size_t>(last-first)>sort_cutoff)
+        {
+            if(group.cancelled())
+                return;
+            if(!depth--)
+            {
+                std::sort(first,last,comp);
+                return;
+            }
+            Iterator const middle=first+(last-first)/2;
+            value_type const pivot=*median_of_three(first,middle,last-1,comp);
+            Iterator const equal_begin=std::partition(first,last,
+                [&](value_type const& x){ return comp(x,pivot); });
+            Iterator const equal_end=std::partition(equal_begin,last,
+                [&](value_type const& x){ return !comp(pivot,x); });
+
+            // Hand the bigger side to the pool, keep going with the smaller
+            // one, so this thread's stack stays O(log n) deep
+            bool const left_bigger=equal_begin-first>last-equal_end;
+            Iterator const spawn_first=left_bigger?first:equal_end;
+            Iterator const spawn_last=left_bigger?equal_begin:last;
+            task_group* const g=&group;
+            group.run([g,spawn_first,spawn_last,comp,depth]{
+                quicksort(*g,spawn_first,spawn_last,comp,depth);
+            });
+            if(left_bigger)
+                first=equal_end;
+            else
+                last=equal_begin;
+        }
+        std::sort(first,last,comp);
+    }
+
+    inline unsigned depth_limit(std::size_t n)
+    {
+        unsigned d=0;
+        while(n>1)
+        {
+            n>>=1;
+            ++d;
+        }
+        return 2*d;
+    }
+
+    /**
+     * Stable merge of [first1, last1) and [first2, last2) into out, split
+     * into independent halves while it's big enough.
+    */
+    template<typename InputIt,typename OutputIt,typename Compare>
+    void merge(task_group& group,InputIt first1,InputIt last1,InputIt first2,InputIt last2,
+               OutputIt out,Compare comp)
+    {
+        for(;;)
+        {
+            std::size_t const n1=last1-first1;
+            std::size_t const n2=last2-first2;
+            if(n1+n2<=sort_cutoff || group.cancelled())
+            {
+                std::merge(first1,last1,first2,last2,out,comp);
+                return;
+            }
+            InputIt mid1,mid2;
+            if(n1>=n2)
+            {
+                // Everything in run 1 before mid1 is <= *mid1; elements of
+                // run 2 equal to *mid1 go right, after run 1's equal ones
+                mid1=first1+n1/2;
+                mid2=std::lower_bound(first2,last2,*mid1,comp);
+            }
+            else
+            {
+                // Mirror image: run 1's elements equal to *mid2 go left,
+                // before run 2's
+                mid2=first2+n2/2;
+                mid1=std::upper_bound(first1,last1,*mid2,comp);
+            }
+            OutputIt const out_right=out+((mid1-first1)+(mid2-first2));
+            task_group* const g=&group;
+            group.run([g,mid1,last1,mid2,last2,out_right,comp]{
+                merge(*g,mid1,last1,mid2,last2,out_right,comp);
+            });
+            last1=mid1;
+            last2=mid2;
+        }
+    }
+
+    template<typename Iterator,typename Compare>
+    void sample_sort(thread_pool& pool,Iterator first,Iterator last,Compare comp)
+    {
+        typedef typename std::iterator_traits<Iterator>::value_type value_type;
+        std::size_t const n=last-first;
+        std::size_t const buckets=4*static_cast<std::size_t>(pool.size());
+        std::size_t const blocks=buckets;
+        std::size_t const oversample=32;
+
+        std::vector<value_type> sample;
+        std::mt19937_64 random(n);
+        for(std::size_t i=0;i<buckets*oversample;++i)
+            sample.push_back(first[random()%n]);
+        std::sort(sample.begin(),sample.end(),comp);
+        std::vector<value_type> splitters;
+        for(std::size_t b=1;b<buckets;++b)
+            splitters.push_back(sample[b*oversample]);
+
+        std::size_t const block_size=(n+blocks-1)/blocks;
+        // counts[block*buckets+bucket]
+        std::vector<std::size_t> counts(blocks*buckets,0);
+        std::vector<unsigned> bucket_index(n);
+        parallel_for(pool,0,blocks,1,[&](std::size_t block){
+            std::size_t const b=block*block_size;
+            std::size_t const e=std::min(n,b+block_size);
+            std::size_t* const mine=&counts[block*buckets];
+            for(std::size_t i=b;i<e;++i)
+            {
+                unsigned const k=static_cast<unsigned>(
+                    std::upper_bound(splitters.begin(),splitters.end(),first[i],comp)-splitters.begin());
+                bucket_index[i]=k;
+                ++mine[k];
+            }
+        });
+
+        // Bucket-major offsets: all of bucket 0 (block 0, block 1, ...),
+        // then bucket 1, ...
+        std::vector<std::size_t> offsets(blocks*buckets);
+        std::vector<std::size_t> bucket_start(buckets+1);
+        std::size_t total=0;
+        for(std::size_t k=0;k<buckets;++k)
+        {
+            bucket_start[k]=total;
+            for(std::size_t block=0;block<blocks;++block)
+            {
+                offsets[block*buckets+k]=total;
+                total+=counts[block*buckets+k];
+            }
+        }
+        bucket_start[buckets]=total;
+
+        std::vector<value_type> buffer(n);
+        parallel_for(pool,0,blocks,1,[&](std::size_t block){
+            std::size_t const b=block*block_size;
+            std::size_t const e=std::min(n,b+block_size);
+            std::size_t* const next=&offsets[block*buckets];
+            for(std::size_t i=b;i<e;++i)
+                buffer[next[bucket_index[i]]++]=std::move(first[i]);
+        });
+
+        parallel_for(pool,0,buckets,1,[&](std::size_t k){
+            std::sort(buffer.begin()+bucket_start[k],buffer.begin()+bucket_start[k+1],comp);
+            std::move(buffer.begin()+bucket_start[k],buffer.begin()+bucket_start[k+1],
+                      first+bucket_start[k]);
+        });
+    }
+}
+
+template<typename Iterator,typename Compare>
+void parallel_sort(thread_pool& pool,Iterator first,Iterator last,Compare comp)
+{
+    task_group group(pool);
+    auto root=[&]{
+        parallel_detail::quicksort(group,first,last,comp,parallel_detail::depth_limit(last-first));
+    };
+    group.run_here(root);
+    group.wait();
+}
+
+template<typename Iterator,typename Compare>
+void parallel_sort(Iterator first,Iterator last,Compare comp)
+{
+    parallel_sort(thread_pool::shared(),first,last,comp);
+}
+
+template<typename Iterator>
+void parallel_sort(Iterator first,Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    parallel_sort(thread_pool::shared(),first,last,std::less<value_type>());
+}
+
+template<typename Iterator,typename Compare>
+void parallel_stable_sort(thread_pool& pool,Iterator first,Iterator last,Compare comp)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    std::size_t const n=last-first;
+    if(n<=parallel_detail::sort_cutoff)
+    {
+        std::stable_sort(first,last,comp);
+        return;
+    }
+    std::size_t run=std::max(parallel_detail::sort_cutoff,
+                             n/(4*static_cast<std::size_t>(pool.size()))+1);
+    parallel_for(pool,0,(n+run-1)/run,1,[&](std::size_t c){
+        std::stable_sort(first+c*run,first+std::min(n,(c+1)*run),comp);
+    });
+
+    // Ping-pong between the input and the buffer, one round per doubling
+    std::vector<value_type> buffer(n);
+    bool in_buffer=false;
+    for(;run<n;run*=2)
+    {
+        task_group group(pool);
+        for(std::size_t b=0;b<n;b+=2*run)
+        {
+            std::size_t const m=std::min(n,b+run);
+            std::size_t const e=std::min(n,b+2*run);
+            if(in_buffer)
+            {
+                typename std::vector<value_type>::iterator const src=buffer.begin();
+                group.run([&group,src,b,m,e,first,comp]{
+                    parallel_detail::merge(group,std::make_move_iterator(src+b),
+                                           std::make_move_iterator(src+m),
+                                           std::make_move_iterator(src+m),
+                                           std::make_move_iterator(src+e),first+b,comp);
+                });
+            }
+            else
+            {
+                typename std::vector<value_type>::iterator const dst=buffer.begin();
+                group.run([&group,dst,b,m,e,first,comp]{
+                    parallel_detail::merge(group,std::make_move_iterator(first+b),
+                                           std::make_move_iterator(first+m),
+                                           std::make_move_iterator(first+m),
+                                           std::make_move_iterator(first+e),dst+b,comp);
+                });
+            }
+        }
+        group.wait();
+        in_buffer=!in_buffer;
+    }
+    if(in_buffer)
+    {
+        parallel_transform(pool,buffer.begin(),buffer.end(),first,
+                           [](value_type& x){ return std::move(x); });
+    }
+}
+
+template<typename Iterator,typename Compare>
+void parallel_stable_sort(Iterator first,Iterator last,Compare comp)
+{
+    parallel_stable_sort(thread_pool::shared(),first,last,comp);
+}
+
+template<typename Iterator>
+void parallel_stable_sort(Iterator first,Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    parallel_stable_sort(thread_pool::shared(),first,last,std::less<value_type>());
+}
+
+template<typename Iterator,typename Compare>
+void parallel_sample_sort(thread_pool& pool,Iterator first,Iterator last,Compare comp)
+{
+    // Below a few buckets' worth the sampling isn't worth it
+    if(static_cast<std::size_t>(last-first)<=4*pool.size()*parallel_detail::sort_cutoff)
+        parallel_sort(pool,first,last,comp);
+    else
+        parallel_detail::sample_sort(pool,first,last,comp);
+}
+
+template<typename Iterator,typename Compare>
+void parallel_sample_sort(Iterator first,Iterator last,Compare comp)
+{
+    parallel_sample_sort(thread_pool::shared(),first,last,comp);
+}
+
+template<typename Iterator>
+void parallel_sample_sort(Iterator first,Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    parallel_sample_sort(thread_pool::shared(),first,last,std::less<value_type>());
+}
+
+#endif
@@ -0,0 +1,237 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include "pipeline.hpp"
+#include "threadsafe-queue.hpp"
+
+/**
+ * Pipelines
+ * =========
+ *
+ * 1. Checks: an ordered 4-worker stage with uneven work per item delivers
+ *    everything in order; an unordered one delivers everything; batch()
+ *    keeps the count and cuts a short last batch; a stage that throws
+ *    stops the whole pipeline and run() rethrows.
+ *
+ * 2. A source, a cheap "parse" stage, an expensive "hash" stage, batch()
+ *    and a sink, with the report showing which stage is the bottleneck.
+ *    Then again with more workers on the hash stage.
+ *
+ * 3. Overhead: three trivial stages hand-wired with std::threads and
+ *    chapter 6's threadsafe_queue, against the same as a pipeline, with
+ *    and without batch() in front.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+std::uint64_t mix(std::uint64_t x,unsigned rounds)
+{
+    for(unsigned i=0;i<rounds;++i)
+    {
+        x^=x>>33;
+        x*=0xff51afd7ed558ccdULL;
+        x^=x>>29;
+    }
+    return x;
+}
+
+bool check_ordered()
+{
+    unsigned const n=20000;
+    std::vector<unsigned> input(n);
+    for(unsigned i=0;i<n;++i)
+        input[i]=i;
+    unsigned expected=0;
+    bool ok=true;
+    pipeline_run run=from_range(input.begin(),input.end())
+        | stage([](unsigned i){
+              // Uneven work, so the workers finish out of order
+              mix(i,(i*7919)%200);
+              return i;
+          },4,stage_order::ordered)
+        | sink([&](unsigned i){
+              if(i!=expected++)
+                  ok=false;
+          });
+    run.run();
+    return ok && expected==n;
+}
+
+bool check_unordered_and_batch()
+{
+    unsigned const n=10007;
+    unsigned next=0;
+    std::atomic<unsigned long long> sum(0);
+    std::atomic<unsigned> batches(0);
+    std::atomic<unsigned> last_size(0);
+    pipeline_run run=source<unsigned>([&](unsigned& v){
+            if(next==n)
+                return false;
+            v=next++;
+            return true;
+        })
+        | stage([](unsigned i){ return static_cast<unsigned long long>(i); },3)
+        | batch(100)
+        | sink([&](std::vector<unsigned long long>&& b){
+              unsigned long long s=0;
+              for(std::size_t i=0;i<b.size();++i)
+                  s+=b[i];
+              sum+=s;
+              ++batches;
+              if(b.size()!=100)
+                  last_size=static_cast<unsigned>(b.size());
+          },2);
+    run.run();
+    return sum==static_cast<unsigned long long>(n)*(n-1)/2 && batches==101 && last_size==7;
+}
+
+bool check_error()
+{
+    unsigned next=0;
+    pipeline_run run=source<unsigned>([&](unsigned& v){
+            v=next++;
+            return true;
+        },8)
+        | stage([](unsigned i){
+              if(i==1000)
+                  throw std::runtime_error("bad item");
+              return i;
+          },2)
+        | sink([](unsigned){});
+    try
+    {
+        run.run();
+    }
+    catch(std::runtime_error const& e)
+    {
+        return std::string(e.what())=="bad item";
+    }
+    return false;
+}
+
+void bottleneck_demo(unsigned items,unsigned hash_workers)
+{
+    unsigned next=0;
+    std::atomic<std::uint64_t> checksum(0);
+    pipeline_run run=source<std::uint64_t>([&](std::uint64_t& v){
+            if(next==items)
+                return false;
+            v=next++;
+            return true;
+        })
+        | stage([](std::uint64_t v){ return mix(v,4); }).named("parse")
+        | stage([](std::uint64_t v){ return mix(v,400); },hash_workers,stage_order::ordered).named("hash")
+        | batch(64)
+        | sink([&](std::vector<std::uint64_t>&& b){
+              std::uint64_t x=0;
+              for(std::size_t i=0;i<b.size();++i)
+                  x^=b[i];
+              checksum^=x;
+          });
+    run.run();
+    std::cout << std::endl << "hash stage with " << hash_workers << " workers" << std::endl;
+    run.report(std::cout);
+}
+
+double hand_wired_mitems(unsigned items)
+{
+    threadsafe_queue<unsigned> a,b;
+    std::atomic<unsigned long long> sum(0);
+    bench_clock::time_point const start=bench_clock::now();
+    // 0 marks the end of the stream
+    std::thread producer([&]{
+        for(unsigned i=1;i<=items;++i)
+            a.push(i);
+        a.push(0);
+    });
+    std::thread middle([&]{
+        unsigned v;
+        do
+        {
+            a.wait_and_pop(v);
+            b.push(v?v+1:0);
+        }
+        while(v);
+    });
+    std::thread consumer([&]{
+        unsigned v;
+        unsigned long long s=0;
+        for(;;)
+        {
+            b.wait_and_pop(v);
+            if(!v)
+                break;
+            s+=v;
+        }
+        sum=s;
+    });
+    producer.join();
+    middle.join();
+    consumer.join();
+    return items/std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+double pipeline_mitems(unsigned items,std::size_t batch_size)
+{
+    unsigned next=0;
+    unsigned long long sum=0;
+    bench_clock::time_point const start=bench_clock::now();
+    if(batch_size<=1)
+    {
+        pipeline_run run=source<unsigned>([&](unsigned& v){
+                if(next==items)
+                    return false;
+                v=++next;
+                return true;
+            })
+            | stage([](unsigned v){ return v+1; })
+            | sink([&](unsigned v){ sum+=v; });
+        run.run();
+    }
+    else
+    {
+        pipeline_run run=source<unsigned>([&](unsigned& v){
+                if(next==items)
+                    return false;
+                v=++next;
+                return true;
+            })
+            | batch(batch_size)
+            | stage([](std::vector<unsigned>&& b){
+                  for(std::size_t i=0;i<b.size();++i)
+                      ++b[i];
+                  return std::move(b);
+              })
+            | sink([&](std::vector<unsigned>&& b){
+                  for(std::size_t i=0;i<b.size();++i)
+                      sum+=b[i];
+              });
+        run.run();
+    }
+    return items/std::chrono::duration<double>(bench_clock::now()-start).count()/1e6;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const items=argc>1?std::strtoul(argv[1],nullptr,10):200000;
+
+    std::cout << "ordered stage keeps order: " << (check_ordered()?"yes":"NO") << std::endl
+              << "unordered stage and batch deliver everything: " << (check_unordered_and_batch()?"yes":"NO") << std::endl
+              << "exception stops the pipeline and is rethrown: " << (check_error()?"yes":"NO") << std::endl;
+
+    bottleneck_demo(items,1);
+    bottleneck_demo(items,4);
+
+    unsigned const trivial=items*10;
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, " << trivial
+              << " items through three trivial stages, Mitems/s" << std::endl
+              << "  hand-wired threadsafe_queues  " << hand_wired_mitems(trivial) << std::endl
+              << "  pipeline                      " << pipeline_mitems(trivial,1) << std::endl
+              << "  pipeline with batch(256)      " << pipeline_mitems(trivial,256) << std::endl;
+    return 0;
+}
@@ -0,0 +1,830 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <iomanip>
+#include <iterator>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "futex-mutex.hpp"
+#include "sharded-counter.hpp"
+
+/**
+ * Pipelines
+ * =========
+ *
+ * Instead of wiring threads and threadsafe_queues together by hand:
+ *
+ *     pipeline_run run=from_range(lines.begin(),lines.end())
+ *                     | stage(parse,4,stage_order::ordered).named("parse")
+ *                     | batch(256)
+ *                     | sink(write_out);
+ *     run.run();
+ *     run.report(std::cout);
+ *
+ * Each stage gets its own worker threads and writes into a bounded queue
+ * that the next stage reads from.
+ *
+ *  - Backpressure: a full queue blocks the stages writing into it until it
+ *    has drained to half full, so a slow stage throttles everything
+ *    upstream instead of letting the queues grow without bound.
+ *  - Order: every queue numbers items as they are pushed. An ordered stage
+ *    pushes its results in the order of its input: a result that is done
+ *    ahead of its turn is parked in a window of 2 slots per worker, and
+ *    whoever pushes the result before it pushes it too. A worker only
+ *    waits when its result is beyond the window. An unordered stage pushes
+ *    results as they finish. Sources, batch() and a single-worker stage
+ *    keep order anyway.
+ *  - End of stream: a queue knows how many workers write into it. When
+ *    the last of them finishes, readers drain what is left and stop, and
+ *    so on down the line.
+ *  - Errors: the first exception thrown by a stage function cancels every
+ *    queue, all workers stop, and run()/wait() rethrow it.
+ *
+ * Each worker calls its own copy of the stage function. Stage functions
+ * take their input by rvalue reference (or by value) and return the output;
+ * sink functions return nothing.
+ *
+ * Every stage counts items and the time its workers spend in the stage
+ * function, waiting for input and waiting to hand the result on, in
+ * sharded_counters; every queue tracks its mean and peak depth. report()
+ * prints them, and the stage that keeps its workers busiest is the
+ * bottleneck: the ones before it wait on output, the ones after on input.
+ * The accounting costs a few clock reads per item; batch() in front of
+ * cheap stages amortizes that along with the queue traffic.
+*/
+
+enum class stage_order
+{
+    unordered,
+    ordered
+};
+
+struct stage_stats
+{
+    std::string name;
+    unsigned workers;
+    long long items;
+    double seconds;
+    // Fractions of workers*seconds
+    double busy;
+    double waiting_for_input;
+    double waiting_for_output;
+    // Of the stage's output queue; capacity 0 for the sink
+    std::size_t capacity;
+    double mean_depth;
+    std::size_t max_depth;
+};
+
+namespace pipeline_detail
+{
+    typedef std::chrono::steady_clock clock;
+
+    inline long long ns_between(clock::time_point from,clock::time_point to)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(to-from).count();
+    }
+
+    std::size_t const default_capacity=64;
+
+    template<typename T>
+    struct sequenced
+    {
+        std::uint64_t seq;
+        T value;
+    };
+
+    template<typename T>
+    class bounded_queue
+    {
+        futex_mutex m;
+        futex_condition_variable not_empty;
+        futex_condition_variable not_full;
+        std::deque<sequenced<T> > items;
+        std::size_t const capacity;
+        unsigned producers;
+        bool cancelled;
+        std::uint64_t next_seq;
+        unsigned long long depth_sum;
+        std::size_t max_depth;
+
+    public:
+        bounded_queue(std::size_t capacity_,unsigned producers_):
+            capacity(capacity_?capacity_:1),producers(producers_),cancelled(false),
+            next_seq(0),depth_sum(0),max_depth(0)
+        {}
+
+        bounded_queue(bounded_queue const&)=delete;
+        bounded_queue& operator=(bounded_queue const&)=delete;
+
+        /**
+         * Blocks while the queue is full. False if the pipeline was
+         * cancelled.
+        */
+        bool push(T&& value)
+        {
+            std::unique_lock<futex_mutex> lk(m);
+            not_full.wait(lk,[this]{ return items.size()<capacity || cancelled; });
+            if(cancelled)
+                return false;
+            depth_sum+=items.size();
+            sequenced<T> item={next_seq++,std::move(value)};
+            items.push_back(std::move(item));
+            if(items.size()>max_depth)
+                max_depth=items.size();
+            lk.unlock();
+            not_empty.notify_one();
+            return true;
+        }
+
+        /**
+         * Blocks while the queue is empty and still has producers. False at
+         * the end of the stream or if the pipeline was cancelled.
+        */
+        bool pop(sequenced<T>& item)
+        {
+            std::unique_lock<futex_mutex> lk(m);
+            not_empty.wait(lk,[this]{ return !items.empty() || !producers || cancelled; });
+            if(cancelled || items.empty())
+                return false;
+            item=std::move(items.front());
+            items.pop_front();
+            // Producers block only on a full queue. Waking one per pop would
+            // have it push one item and block again, a context switch per
+            // item; waking them at half full lets them push in runs
+            bool const drained=items.size()==capacity/2;
+            lk.unlock();
+            if(drained)
+                not_full.notify_all();
+            return true;
+        }
+
+        void producer_done()
+        {
+            std::unique_lock<futex_mutex> lk(m);
+            if(--producers)
+                return;
+            lk.unlock();
+            not_empty.notify_all();
+        }
+
+        void cancel()
+        {
+            {
+                std::lock_guard<futex_mutex> lk(m);
+                cancelled=true;
+            }
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+
+        void occupancy(stage_stats& s)
+        {
+            std::lock_guard<futex_mutex> lk(m);
+            s.capacity=capacity;
+            s.mean_depth=next_seq?static_cast<double>(depth_sum)/next_seq:0;
+            s.max_depth=max_depth;
+        }
+    };
+
+    class graph;
+
+    class node
+    {
+    public:
+        std::string name;
+        unsigned const workers;
+        sharded_counter items;
+        sharded_counter busy_ns;
+        sharded_counter input_wait_ns;
+        sharded_counter output_wait_ns;
+
+        explicit node(unsigned workers_):
+            workers(workers_?workers_:1)
+        {}
+
+        virtual ~node()
+        {}
+
+        virtual void work(graph& g)=0;
+        virtual void cancel()=0;
+        virtual void occupancy(stage_stats& s)
+        {
+            s.capacity=0;
+            s.mean_depth=0;
+            s.max_depth=0;
+        }
+    };
+
+    class graph
+    {
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+    public:
+        std::vector<std::unique_ptr<node> > nodes;
+        std::atomic<bool> failed;
+
+        graph():
+            failed(false)
+        {}
+
+        void fail(std::exception_ptr e)
+        {
+            {
+                std::lock_guard<std::mutex> lk(error_mutex);
+                if(!error)
+                    error=e;
+            }
+            cancel();
+        }
+
+        void cancel()
+        {
+            failed.store(true);
+            for(std::size_t i=0;i<nodes.size();++i)
+                nodes[i]->cancel();
+        }
+
+        void rethrow()
+        {
+            std::lock_guard<std::mutex> lk(error_mutex);
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+        std::string next_name() const
+        {
+            std::ostringstream s;
+            s << "stage " << nodes.size();
+            return s.str();
+        }
+    };
+
+    template<typename T,typename Generator>
+    class source_node: public node
+    {
+        Generator generate;
+    public:
+        std::shared_ptr<bounded_queue<T> > const output;
+
+        source_node(Generator generate_,std::size_t capacity):
+            node(1),generate(std::move(generate_)),
+            output(std::make_shared<bounded_queue<T> >(capacity,1))
+        {}
+
+        void work(graph& g)
+        {
+            T value;
+            clock::time_point t=clock::now();
+            while(!g.failed.load(std::memory_order_relaxed))
+            {
+                if(!generate(value))
+                    break;
+                clock::time_point const made=clock::now();
+                busy_ns.add(ns_between(t,made));
+                if(!output->push(std::move(value)))
+                    break;
+                t=clock::now();
+                output_wait_ns.add(ns_between(made,t));
+                items.add(1);
+            }
+            output->producer_done();
+        }
+
+        void cancel()
+        {
+            output->cancel();
+        }
+
+        void occupancy(stage_stats& s)
+        {
+            output->occupancy(s);
+        }
+    };
+
+    template<typename In,typename Out,typename F>
+    class stage_node: public node
+    {
+        F const f;
+        stage_order const order;
+        std::shared_ptr<bounded_queue<In> > const input;
+        // Ordered output: results that finished ahead of their turn wait
+        // in a window of slots indexed by input sequence number
+        futex_mutex turn_mutex;
+        futex_condition_variable window_moved;
+        std::uint64_t next_out;
+        std::vector<std::unique_ptr<Out> > pending;
+
+        bool emit(graph& g,std::uint64_t seq,Out&& result)
+        {
+            if(order==stage_order::unordered || workers==1)
+                return output->push(std::move(result));
+            std::uint64_t const window=pending.size();
+            std::unique_lock<futex_mutex> lk(turn_mutex);
+            window_moved.wait(lk,[&]{ return seq<next_out+window || g.failed.load(); });
+            if(g.failed.load())
+                return false;
+            if(seq!=next_out)
+            {
+                // Whoever pushes the one before it pushes this one too
+                pending[seq%window].reset(new Out(std::move(result)));
+                return true;
+            }
+            // Our turn: push ours and then everything queued up behind it,
+            // without holding the lock while a push waits on backpressure
+            for(;;)
+            {
+                lk.unlock();
+                bool const pushed=output->push(std::move(result));
+                lk.lock();
+                ++next_out;
+                std::unique_ptr<Out>& slot=pending[next_out%window];
+                if(!pushed || !slot)
+                    break;
+                result=std::move(*slot);
+                slot.reset();
+            }
+            lk.unlock();
+            window_moved.notify_all();
+            return !g.failed.load();
+        }
+
+    public:
+        std::shared_ptr<bounded_queue<Out> > const output;
+
+        stage_node(F const& f_,unsigned workers_,stage_order order_,
+                   std::shared_ptr<bounded_queue<In> > const& input_,std::size_t capacity):
+            node(workers_),f(f_),order(order_),input(input_),next_out(0),
+            pending(2*workers),output(std::make_shared<bounded_queue<Out> >(capacity,workers))
+        {}
+
+        void work(graph& g)
+        {
+            F call=f;
+            sequenced<In> item;
+            clock::time_point t=clock::now();
+            while(input->pop(item))
+            {
+                clock::time_point const got=clock::now();
+                input_wait_ns.add(ns_between(t,got));
+                Out result=call(std::move(item.value));
+                clock::time_point const done=clock::now();
+                busy_ns.add(ns_between(got,done));
+                if(!emit(g,item.seq,std::move(result)))
+                    break;
+                t=clock::now();
+                output_wait_ns.add(ns_between(done,t));
+                items.add(1);
+            }
+            output->producer_done();
+        }
+
+        void cancel()
+        {
+            output->cancel();
+            {
+                std::lock_guard<futex_mutex> lk(turn_mutex);
+            }
+            window_moved.notify_all();
+        }
+
+        void occupancy(stage_stats& s)
+        {
+            output->occupancy(s);
+        }
+    };
+
+    template<typename T>
+    class batch_node: public node
+    {
+        std::size_t const size;
+        std::shared_ptr<bounded_queue<T> > const input;
+    public:
+        std::shared_ptr<bounded_queue<std::vector<T> > > const output;
+
+        batch_node(std::size_t size_,std::shared_ptr<bounded_queue<T> > const& input_,
+                   std::size_t capacity):
+            node(1),size(size_?size_:1),input(input_),
+            output(std::make_shared<bounded_queue<std::vector<T> > >(capacity,1))
+        {}
+
+        void work(graph&)
+        {
+            sequenced<T> item;
+            std::vector<T> batch;
+            batch.reserve(size);
+            clock::time_point t=clock::now();
+            bool more=true;
+            while(more)
+            {
+                more=input->pop(item);
+                clock::time_point const got=clock::now();
+                input_wait_ns.add(ns_between(t,got));
+                if(more)
+                    batch.push_back(std::move(item.value));
+                if(batch.size()<size && (more || batch.empty()))
+                {
+                    t=got;
+                    continue;
+                }
+                if(!output->push(std::move(batch)))
+                    break;
+                t=clock::now();
+                output_wait_ns.add(ns_between(got,t));
+                items.add(1);
+                batch=std::vector<T>();
+                batch.reserve(size);
+            }
+            output->producer_done();
+        }
+
+        void cancel()
+        {
+            output->cancel();
+        }
+
+        void occupancy(stage_stats& s)
+        {
+            output->occupancy(s);
+        }
+    };
+
+    template<typename T,typename F>
+    class sink_node: public node
+    {
+        F const f;
+        std::shared_ptr<bounded_queue<T> > const input;
+    public:
+        sink_node(F const& f_,unsigned workers_,std::shared_ptr<bounded_queue<T> > const& input_):
+            node(workers_),f(f_),input(input_)
+        {}
+
+        void work(graph&)
+        {
+            F call=f;
+            sequenced<T> item;
+            clock::time_point t=clock::now();
+            while(input->pop(item))
+            {
+                clock::time_point const got=clock::now();
+                input_wait_ns.add(ns_between(t,got));
+                call(std::move(item.value));
+                t=clock::now();
+                busy_ns.add(ns_between(got,t));
+                items.add(1);
+            }
+        }
+
+        void cancel()
+        {}
+    };
+}
+
+template<typename F>
+struct stage_spec
+{
+    F f;
+    unsigned parallelism;
+    stage_order order;
+    std::size_t capacity;
+    std::string name;
+
+    stage_spec named(std::string const& name_) const
+    {
+        stage_spec s(*this);
+        s.name=name_;
+        return s;
+    }
+};
+
+/**
+ * A stage running f on parallelism worker threads, writing into a queue of
+ * capacity items.
+*/
+template<typename F>
+stage_spec<F> stage(F f,unsigned parallelism=1,stage_order order=stage_order::unordered,
+                    std::size_t capacity=pipeline_detail::default_capacity)
+{
+    stage_spec<F> s={std::move(f),parallelism,order,capacity,std::string()};
+    return s;
+}
+
+struct batch_spec
+{
+    std::size_t size;
+    std::size_t capacity;
+};
+
+/**
+ * Groups consecutive items into std::vectors of size items; the last one
+ * may be shorter.
+*/
+inline batch_spec batch(std::size_t size,std::size_t capacity=pipeline_detail::default_capacity)
+{
+    batch_spec b={size,capacity};
+    return b;
+}
+
+template<typename F>
+struct sink_spec
+{
+    F f;
+    unsigned parallelism;
+    std::string name;
+
+    sink_spec named(std::string const& name_) const
+    {
+        sink_spec s(*this);
+        s.name=name_;
+        return s;
+    }
+};
+
+template<typename F>
+sink_spec<F> sink(F f,unsigned parallelism=1)
+{
+    sink_spec<F> s={std::move(f),parallelism,std::string()};
+    return s;
+}
+
+/**
+ * A pipeline that is complete, sink and all. Threads start with start()
+ * or run(); the destructor cancels and joins one that is still running.
+*/
+class pipeline_run
+{
+    std::shared_ptr<pipeline_detail::graph> g;
+    std::vector<std::thread> threads;
+    pipeline_detail::clock::time_point started;
+    pipeline_detail::clock::time_point finished;
+    bool running;
+
+    static void worker(pipeline_detail::graph* g,pipeline_detail::node* n)
+    {
+        try
+        {
+            n->work(*g);
+        }
+        catch(...)
+        {
+            g->fail(std::current_exception());
+        }
+    }
+
+public:
+    explicit pipeline_run(std::shared_ptr<pipeline_detail::graph> const& g_):
+        g(g_),running(false)
+    {}
+
+    pipeline_run(pipeline_run&& other):
+        g(std::move(other.g)),threads(std::move(other.threads)),
+        started(other.started),finished(other.finished),running(other.running)
+    {
+        other.running=false;
+    }
+
+    ~pipeline_run()
+    {
+        if(running)
+        {
+            cancel();
+            join();
+        }
+    }
+
+    pipeline_run(pipeline_run const&)=delete;
+    pipeline_run& operator=(pipeline_run const&)=delete;
+    pipeline_run& operator=(pipeline_run&&)=delete;
+
+    void start()
+    {
+        if(running || !threads.empty())
+            throw std::logic_error("pipeline already started");
+        started=pipeline_detail::clock::now();
+        running=true;
+        for(std::size_t i=0;i<g->nodes.size();++i)
+        {
+            for(unsigned w=0;w<g->nodes[i]->workers;++w)
+                threads.push_back(std::thread(&pipeline_run::worker,g.get(),g->nodes[i].get()));
+        }
+    }
+
+    void join()
+    {
+        for(std::size_t i=0;i<threads.size();++i)
+        {
+            if(threads[i].joinable())
+                threads[i].join();
+        }
+        if(running)
+            finished=pipeline_detail::clock::now();
+        running=false;
+    }
+
+    /**
+     * Waits for the end of the stream; rethrows the first exception a
+     * stage threw.
+    */
+    void wait()
+    {
+        join();
+        g->rethrow();
+    }
+
+    void run()
+    {
+        start();
+        wait();
+    }
+
+    /**
+     * Stops all stages as soon as they next touch a queue.
+    */
+    void cancel()
+    {
+        g->cancel();
+    }
+
+    /**
+     * Per stage, source first; can be called while running.
+    */
+    std::vector<stage_stats> stats()
+    {
+        pipeline_detail::clock::time_point const end=
+            running?pipeline_detail::clock::now():finished;
+        double const seconds=std::chrono::duration<double>(end-started).count();
+        std::vector<stage_stats> result;
+        for(std::size_t i=0;i<g->nodes.size();++i)
+        {
+            pipeline_detail::node& n=*g->nodes[i];
+            stage_stats s;
+            s.name=n.name;
+            s.workers=n.workers;
+            s.items=n.items.value();
+            s.seconds=seconds;
+            double const capacity_ns=seconds*1e9*n.workers;
+            s.busy=capacity_ns>0?n.busy_ns.value()/capacity_ns:0;
+            s.waiting_for_input=capacity_ns>0?n.input_wait_ns.value()/capacity_ns:0;
+            s.waiting_for_output=capacity_ns>0?n.output_wait_ns.value()/capacity_ns:0;
+            n.occupancy(s);
+            result.push_back(s);
+        }
+        return result;
+    }
+
+    void report(std::ostream& out)
+    {
+        std::ios::fmtflags const flags=out.flags();
+        std::streamsize const precision=out.precision();
+        std::vector<stage_stats> const all=stats();
+        std::size_t bottleneck=0;
+        for(std::size_t i=1;i<all.size();++i)
+        {
+            if(all[i].busy>all[bottleneck].busy)
+                bottleneck=i;
+        }
+        out << "stage           workers      items     items/s   busy  in-wait  out-wait   queue mean/max/cap"
+            << std::endl;
+        for(std::size_t i=0;i<all.size();++i)
+        {
+            stage_stats const& s=all[i];
+            out << std::left << std::setw(16) << s.name << std::right
+                << std::setw(7) << s.workers
+                << std::setw(11) << s.items
+                << std::setw(12) << std::setprecision(4) << (s.seconds>0?s.items/s.seconds:0)
+                << std::setw(6) << std::fixed << std::setprecision(0) << s.busy*100 << "%"
+                << std::setw(8) << s.waiting_for_input*100 << "%"
+                << std::setw(9) << s.waiting_for_output*100 << "%";
+            if(s.capacity)
+                out << "   " << std::setprecision(1) << s.mean_depth << "/" << s.max_depth << "/" << s.capacity;
+            else
+                out << "   -";
+            out.unsetf(std::ios::fixed);
+            if(i==bottleneck)
+                out << "   <- bottleneck";
+            out << std::endl;
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+};
+
+/**
+ * The pipeline up to a stage whose output has type T.
+*/
+template<typename T>
+class pipeline
+{
+    std::shared_ptr<pipeline_detail::graph> g;
+    std::shared_ptr<pipeline_detail::bounded_queue<T> > output;
+
+    template<typename U>
+    friend class pipeline;
+
+public:
+    typedef T value_type;
+
+    pipeline(std::shared_ptr<pipeline_detail::graph> const& g_,
+             std::shared_ptr<pipeline_detail::bounded_queue<T> > const& output_):
+        g(g_),output(output_)
+    {}
+
+    template<typename F>
+    pipeline<typename std::decay<typename std::result_of<F(T&&)>::type>::type>
+    operator|(stage_spec<F> const& s) const
+    {
+        typedef typename std::decay<typename std::result_of<F(T&&)>::type>::type result_type;
+        std::unique_ptr<pipeline_detail::stage_node<T,result_type,F> > n(
+            new pipeline_detail::stage_node<T,result_type,F>(s.f,s.parallelism,s.order,output,s.capacity));
+        n->name=s.name.empty()?g->next_name():s.name;
+        std::shared_ptr<pipeline_detail::bounded_queue<result_type> > const next=n->output;
+        g->nodes.push_back(std::move(n));
+        return pipeline<result_type>(g,next);
+    }
+
+    pipeline<std::vector<T> > operator|(batch_spec const& b) const
+    {
+        std::unique_ptr<pipeline_detail::batch_node<T> > n(
+            new pipeline_detail::batch_node<T>(b.size,output,b.capacity));
+        std::ostringstream name;
+        name << "batch(" << b.size << ")";
+        n->name=name.str();
+        std::shared_ptr<pipeline_detail::bounded_queue<std::vector<T> > > const next=n->output;
+        g->nodes.push_back(std::move(n));
+        return pipeline<std::vector<T> >(g,next);
+    }
+
+    template<typename F>
+    pipeline_run operator|(sink_spec<F> const& s) const
+    {
+        std::unique_ptr<pipeline_detail::sink_node<T,F> > n(
+            new pipeline_detail::sink_node<T,F>(s.f,s.parallelism,output));
+        n->name=s.name.empty()?std::string("sink"):s.name;
+        g->nodes.push_back(std::move(n));
+        return pipeline_run(g);
+    }
+};
+
+/**
+ * A source calling generate(T&) until it returns false.
+*/
+template<typename T,typename Generator>
+pipeline<T> source(Generator generate,std::size_t capacity=pipeline_detail::default_capacity)
+{
+    std::shared_ptr<pipeline_detail::graph> const g=std::make_shared<pipeline_detail::graph>();
+    std::unique_ptr<pipeline_detail::source_node<T,Generator> > n(
+        new pipeline_detail::source_node<T,Generator>(std::move(generate),capacity));
+    n->name="source";
+    std::shared_ptr<pipeline_detail::bounded_queue<T> > const output=n->output;
+    g->nodes.push_back(std::move(n));
+    return pipeline<T>(g,output);
+}
+
+namespace pipeline_detail
+{
+    template<typename Iterator>
+    class range_generator
+    {
+        Iterator next;
+        Iterator last;
+    public:
+        range_generator(Iterator first,Iterator last_):
+            next(first),last(last_)
+        {}
+
+        bool operator()(typename std::iterator_traits<Iterator>::value_type& value)
+        {
+            if(next==last)
+                return false;
+            value=*next;
+            ++next;
+            return true;
+        }
+    };
+}
+
+/**
+ * A source producing copies of [first, last).
+*/
+template<typename Iterator>
+pipeline<typename std::iterator_traits<Iterator>::value_type>
+from_range(Iterator first,Iterator last,std::size_t capacity=pipeline_detail::default_capacity)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    return source<value_type>(pipeline_detail::range_generator<Iterator>(first,last),capacity);
+}
+
+#endif
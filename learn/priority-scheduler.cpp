@@ -0,0 +1,186 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include "priority-scheduler.hpp"
+
+/**
+ * Mixed workload: critical requests behind bulk jobs
+ * ==================================================
+ *
+ * A bulk producer dumps large batches of background jobs while a critical
+ * producer trickles in latency-sensitive requests. Workers pop and "process"
+ * each job by spinning for a fixed time. We record enqueue-to-dequeue latency
+ * per class and report p50/p99 for the priority scheduler and for a FIFO
+ * threadsafe_queue from chapter 6.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct job
+{
+    unsigned priority_class;
+    bench_clock::time_point enqueued;
+};
+
+unsigned const critical=0;
+unsigned const bulk=2;
+unsigned const stop=99;
+
+/**
+ * threadsafe_queue from chapter 6
+*/
+template<typename T>
+class fifo_queue
+{
+    std::mutex mut;
+    std::queue<T> data_queue;
+    std::condition_variable data_cond;
+public:
+    void push(T new_value,unsigned)
+    {
+        std::lock_guard<std::mutex> lk(mut);
+        data_queue.push(std::move(new_value));
+        data_cond.notify_one();
+    }
+    void wait_and_pop(T& value)
+    {
+        std::unique_lock<std::mutex> lk(mut);
+        data_cond.wait(lk,[this]{return !data_queue.empty();});
+        value=std::move(data_queue.front());
+        data_queue.pop();
+    }
+};
+
+struct scheduler_adaptor
+{
+    priority_scheduler<job> s;
+    explicit scheduler_adaptor(unsigned workers):
+        s(4*workers,std::chrono::milliseconds(50))
+    {}
+    void push(job j,unsigned cls)
+    {
+        s.push(j,cls);
+    }
+    void wait_and_pop(job& j)
+    {
+        s.wait_and_pop(j);
+    }
+};
+
+struct fifo_adaptor
+{
+    fifo_queue<job> q;
+    explicit fifo_adaptor(unsigned)
+    {}
+    void push(job j,unsigned cls)
+    {
+        q.push(j,cls);
+    }
+    void wait_and_pop(job& j)
+    {
+        q.wait_and_pop(j);
+    }
+};
+
+void spin_for(std::chrono::microseconds d)
+{
+    bench_clock::time_point const end=bench_clock::now()+d;
+    while(bench_clock::now()<end);
+}
+
+double percentile(std::vector<double>& v,double p)
+{
+    if(v.empty())
+        return 0;
+    std::sort(v.begin(),v.end());
+    return v[static_cast<std::size_t>(p*(v.size()-1))];
+}
+
+template<typename Queue>
+void run(char const* name,unsigned workers,unsigned batches)
+{
+    unsigned const batch_size=500;
+    unsigned const critical_per_batch=20;
+    std::chrono::microseconds const work(10);
+    // Offer ~80% of what the workers can actually run in parallel
+    unsigned const cores=std::max(1u,std::min(workers,std::thread::hardware_concurrency()));
+    std::chrono::microseconds const batch_gap=work*batch_size*5/4/cores;
+
+    Queue q(workers);
+    std::vector<std::vector<double> > latency[2];
+    latency[0].resize(workers);
+    latency[1].resize(workers);
+    unsigned const total=batches*(batch_size+critical_per_batch);
+    std::atomic<unsigned> remaining(total);
+
+    std::vector<std::thread> threads;
+    for(unsigned w=0;w<workers;++w)
+    {
+        threads.push_back(std::thread([&,w]{
+            job j;
+            for(;;)
+            {
+                q.wait_and_pop(j);
+                if(j.priority_class==stop)
+                    break;
+                double const us=std::chrono::duration<double,std::micro>(
+                    bench_clock::now()-j.enqueued).count();
+                latency[j.priority_class==critical?0:1][w].push_back(us);
+                spin_for(work);
+                if(remaining.fetch_sub(1)==1)
+                {
+                    for(unsigned i=0;i<workers;++i)
+                        q.push(job{stop,bench_clock::now()},bulk);
+                }
+            }
+        }));
+    }
+    std::thread bulk_producer([&]{
+        for(unsigned b=0;b<batches;++b)
+        {
+            for(unsigned i=0;i<batch_size;++i)
+                q.push(job{bulk,bench_clock::now()},bulk);
+            std::this_thread::sleep_for(batch_gap);
+        }
+    });
+    std::thread critical_producer([&]{
+        for(unsigned b=0;b<batches*critical_per_batch;++b)
+        {
+            q.push(job{critical,bench_clock::now()},critical);
+            std::this_thread::sleep_for(batch_gap/critical_per_batch);
+        }
+    });
+    bulk_producer.join();
+    critical_producer.join();
+    for(unsigned w=0;w<workers;++w)
+        threads[w].join();
+
+    std::cout << name << std::endl;
+    char const* const class_names[]={"critical","bulk    "};
+    for(unsigned c=0;c<2;++c)
+    {
+        std::vector<double> all;
+        for(unsigned w=0;w<workers;++w)
+            all.insert(all.end(),latency[c][w].begin(),latency[c][w].end());
+        std::cout << "  " << class_names[c] << "  p50 " << percentile(all,0.50)
+                  << " us   p99 " << percentile(all,0.99) << " us" << std::endl;
+    }
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const workers=argc>1?std::atoi(argv[1]):4;
+    unsigned const batches=argc>2?std::atoi(argv[2]):40;
+
+    std::cout << workers << " workers, " << batches << " batches" << std::endl;
+    run<scheduler_adaptor>("priority_scheduler (MultiQueue, EDF + aging)",workers,batches);
+    run<fifo_adaptor>("FIFO threadsafe_queue",workers,batches);
+    return 0;
+}
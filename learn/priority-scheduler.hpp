@@ -0,0 +1,235 @@
+#ifndef PRIORITY_SCHEDULER_HPP
+#define PRIORITY_SCHEDULER_HPP
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <functional>
+#include <cstdint>
+#include "cache-line.hpp"
+
+/**
+ * Priority-aware scheduler queue
+ * ==============================
+ *
+ * Every queue in chapter 6 is FIFO, so a latency-critical request that
+ * arrives behind a burst of bulk jobs waits for all of them. This queue
+ * orders work by priority class first and earliest deadline (EDF) within a
+ * class, and still hands it out through the familiar
+ * try_pop()/wait_and_pop() interface.
+ *
+ * Ordering key
+ * ------------
+ * Each entry gets a single key:
+ *
+ *     key = deadline + priority_class * aging_step
+ *
+ * Lower keys run first. Within a class this is plain EDF. Across classes a
+ * class-c entry beats a class-(c+1) entry unless the latter's deadline is
+ * more than aging_step earlier - which is exactly what aging means: a bulk
+ * job that has been waiting long enough eventually outranks fresh critical
+ * work, so nothing starves. aging_step bounds how late a lower class can be
+ * pushed past its deadline by higher ones.
+ *
+ * MultiQueue
+ * ----------
+ * One heap behind one mutex would serialise every push and pop. Instead there
+ * are several small heaps, each with its own mutex:
+ *  - push() puts the entry into a random heap (skipping ones that are locked).
+ *  - pop() picks two random heaps, compares their cached minimum keys and pops
+ *    from the better one.
+ * The result is only approximately ordered - the entry popped is among the
+ * best few rather than the very best - but contention is spread over all
+ * heaps and in exchange no thread ever waits for a global lock.
+*/
+template<typename T>
+class priority_scheduler
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+private:
+    struct entry
+    {
+        std::int64_t key;
+        T value;
+        entry(std::int64_t key_,T value_):
+            key(key_),value(std::move(value_))
+        {}
+        bool operator>(entry const& other) const
+        {
+            return key>other.key;
+        }
+    };
+
+    static std::int64_t const no_key=std::numeric_limits<std::int64_t>::max();
+
+    // Keep neighbouring heaps' locks off this one's cache lines
+    struct alignas(cache_line_size) sub_queue:
+        cache_aligned_new
+    {
+        std::mutex m;
+        std::priority_queue<entry,std::vector<entry>,std::greater<entry> > heap;
+        std::atomic<std::int64_t> top_key;
+        sub_queue():
+            top_key(no_key)
+        {}
+    };
+
+    std::vector<std::unique_ptr<sub_queue> > queues;
+    std::int64_t const aging_step;
+
+    alignas(cache_line_size) std::atomic<long> size;
+    std::atomic<unsigned> sleepers;
+    std::mutex sleep_mutex;
+    std::condition_variable data_cond;
+
+    static unsigned random_index(std::size_t n)
+    {
+        // xorshift: cheap and good enough for picking queues
+        static thread_local std::uint32_t state=
+            static_cast<std::uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()))|1;
+        state^=state<<13;
+        state^=state>>17;
+        state^=state<<5;
+        return state%n;
+    }
+
+    static std::int64_t to_ns(clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    bool pop_from(sub_queue& q,T& value)
+    {
+        std::unique_lock<std::mutex> lk(q.m,std::try_to_lock);
+        if(!lk.owns_lock() || q.heap.empty())
+            return false;
+        value=std::move(const_cast<entry&>(q.heap.top()).value);
+        q.heap.pop();
+        q.top_key.store(q.heap.empty()?no_key:q.heap.top().key,std::memory_order_relaxed);
+        lk.unlock();
+        size.fetch_sub(1,std::memory_order_relaxed);
+        return true;
+    }
+
+public:
+    /**
+     * queue_count should be a small multiple of the number of threads
+     * using the scheduler (2x-4x works well).
+    */
+    explicit priority_scheduler(unsigned queue_count,
+                                clock::duration aging_step_=std::chrono::milliseconds(10)):
+        aging_step(std::chrono::duration_cast<std::chrono::nanoseconds>(aging_step_).count()),
+        size(0),sleepers(0)
+    {
+        if(queue_count<2)
+            queue_count=2;
+        for(unsigned i=0;i<queue_count;++i)
+            queues.push_back(std::unique_ptr<sub_queue>(new sub_queue));
+    }
+
+    priority_scheduler(priority_scheduler const&)=delete;
+    priority_scheduler& operator=(priority_scheduler const&)=delete;
+
+    /**
+     * Class 0 is the most urgent.
+    */
+    void push(T new_value,unsigned priority_class,clock::time_point deadline)
+    {
+        std::int64_t const key=to_ns(deadline)+priority_class*aging_step;
+        for(;;)
+        {
+            sub_queue& q=*queues[random_index(queues.size())];
+            std::unique_lock<std::mutex> lk(q.m,std::try_to_lock);
+            if(!lk.owns_lock())
+                continue;
+            q.heap.push(entry(key,std::move(new_value)));
+            q.top_key.store(q.heap.top().key,std::memory_order_relaxed);
+            break;
+        }
+        size.fetch_add(1,std::memory_order_seq_cst);
+        if(sleepers.load(std::memory_order_seq_cst))
+        {
+            // Taking the mutex orders us after a waiter that has registered
+            // but not yet gone to sleep
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            data_cond.notify_one();
+        }
+    }
+
+    /**
+     * Deadline defaults to "now", i.e. FIFO within the class.
+    */
+    void push(T new_value,unsigned priority_class=0)
+    {
+        push(std::move(new_value),priority_class,clock::now());
+    }
+
+    bool try_pop(T& value)
+    {
+        std::size_t const n=queues.size();
+        while(size.load(std::memory_order_relaxed)>0)
+        {
+            // Two random choices, a handful of times...
+            for(unsigned attempt=0;attempt<4;++attempt)
+            {
+                sub_queue& a=*queues[random_index(n)];
+                sub_queue& b=*queues[random_index(n)];
+                std::int64_t const ka=a.top_key.load(std::memory_order_relaxed);
+                std::int64_t const kb=b.top_key.load(std::memory_order_relaxed);
+                if(ka==no_key && kb==no_key)
+                    continue;
+                if(pop_from(ka<=kb?a:b,value))
+                    return true;
+            }
+            // ...then a full sweep so a nearly empty scheduler can't be missed
+            for(std::size_t i=0;i<n;++i)
+            {
+                if(queues[i]->top_key.load(std::memory_order_relaxed)!=no_key &&
+                   pop_from(*queues[i],value))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        T value;
+        if(!try_pop(value))
+            return std::shared_ptr<T>();
+        return std::make_shared<T>(std::move(value));
+    }
+
+    void wait_and_pop(T& value)
+    {
+        while(!try_pop(value))
+        {
+            std::unique_lock<std::mutex> lk(sleep_mutex);
+            sleepers.fetch_add(1,std::memory_order_seq_cst);
+            data_cond.wait(lk,[this]{return size.load(std::memory_order_seq_cst)>0;});
+            sleepers.fetch_sub(1,std::memory_order_relaxed);
+        }
+    }
+
+    std::shared_ptr<T> wait_and_pop()
+    {
+        T value;
+        wait_and_pop(value);
+        return std::make_shared<T>(std::move(value));
+    }
+
+    bool empty() const
+    {
+        return size.load(std::memory_order_relaxed)==0;
+    }
+};
+
+#endif
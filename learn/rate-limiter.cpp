@@ -0,0 +1,229 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "rate-limiter.hpp"
+
+/**
+ * Rate limiter checks
+ * ===================
+ *
+ *  1. Accuracy: several threads hammer one token_bucket; the number of
+ *     grants should be burst + rate*elapsed and never more, also with more
+ *     threads than cores.
+ *  2. A rate_limiter sized for 256 keys grows to 256k while threads take
+ *     from every key; no key may grant more than its bucket allows.
+ *  3. Check cost at growing key counts, against one mutex around a std::map
+ *     of buckets (the add_to_list / list_contains way from chapter-3.cpp).
+ *     The table starts at the default size and grows to fit.
+ *  4. Idle keys disappear after the idle timeout.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * The baseline: every check takes the same mutex.
+*/
+class locked_rate_limiter
+{
+    token_bucket_math math;
+    std::map<std::uint64_t,std::uint64_t> buckets;
+    std::mutex m;
+public:
+    locked_rate_limiter(double rate,unsigned burst):
+        math(rate,burst)
+    {}
+
+    bool try_acquire(std::uint64_t key,unsigned n=1)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::uint64_t const now=token_bucket_math::now_us();
+        std::map<std::uint64_t,std::uint64_t>::iterator it=buckets.find(key);
+        if(it==buckets.end())
+            it=buckets.insert(std::make_pair(key,math.full(now))).first;
+        return math.take(it->second,now,n,it->second);
+    }
+};
+
+std::uint64_t next_random(std::uint64_t& x)
+{
+    x^=x<<13;
+    x^=x>>7;
+    x^=x<<17;
+    return x;
+}
+
+/**
+ * More threads than cores, so some are preempted between reading the clock
+ * and their compare_exchange. Grants may fall short of burst + rate*elapsed
+ * but must never exceed it by more than the coarse clock's resolution.
+*/
+void check_accuracy(unsigned threads)
+{
+    double const rate=20000;
+    unsigned const burst=500;
+    timespec res;
+    clock_getres(CLOCK_MONOTONIC_COARSE,&res);
+    double const tick=res.tv_sec+res.tv_nsec/1e9;
+    bench_clock::time_point const start=bench_clock::now();
+    token_bucket bucket(rate,burst);
+    std::atomic<unsigned long> granted(0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            unsigned long mine=0;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                if(bucket.try_acquire())
+                    ++mine;
+            }
+            granted+=mine;
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    done=true;
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    double const elapsed=std::chrono::duration<double>(bench_clock::now()-start).count();
+    unsigned long const limit=static_cast<unsigned long>(burst+rate*(elapsed+tick));
+    bool const ok=granted<=limit;
+    std::cout << "token_bucket, " << threads << " threads: granted " << granted
+              << ", at most " << limit << (ok?"":" FAILED") << std::endl;
+}
+
+/**
+ * The table doubles several times under the threads' feet. Buckets moved
+ * between tables must carry their grants with them.
+*/
+void check_growth(unsigned threads)
+{
+    double const rate=1;
+    unsigned const burst=2;
+    std::uint64_t const keys=1<<18;
+    bench_clock::time_point const start=bench_clock::now();
+    std::unique_ptr<std::atomic<unsigned>[]> granted(new std::atomic<unsigned>[keys]);
+    for(std::uint64_t k=0;k<keys;++k)
+        granted[k]=0;
+    std::size_t chains;
+    {
+        rate_limiter<std::uint64_t> limiter(rate,burst,256);
+        std::vector<std::thread> workers;
+        for(unsigned t=0;t<threads;++t)
+        {
+            workers.push_back(std::thread([&,t]{
+                // Each thread asks for every key burst+1 times, starting
+                // from a different place
+                for(unsigned pass=0;pass<=burst;++pass)
+                {
+                    for(std::uint64_t i=0;i<keys;++i)
+                    {
+                        std::uint64_t const k=(i+t*keys/threads)%keys;
+                        if(limiter.try_acquire(k))
+                            ++granted[k];
+                    }
+                }
+            }));
+        }
+        for(unsigned t=0;t<threads;++t)
+            workers[t].join();
+        chains=limiter.chain_count();
+    }
+    double const elapsed=std::chrono::duration<double>(bench_clock::now()-start).count();
+    unsigned const limit=static_cast<unsigned>(burst+rate*elapsed+1);
+    unsigned most=0;
+    for(std::uint64_t k=0;k<keys;++k)
+        most=std::max(most,granted[k].load());
+    bool const ok=most<=limit;
+    std::cout << "rate_limiter growth, " << threads << " threads: " << keys << " keys in "
+              << chains << " chains, at most " << most << " grants per key, limit "
+              << limit << (ok?"":" FAILED") << std::endl;
+}
+
+/**
+ * Touching the keys queues the table's growth; wait for it so the timed
+ * checks see the table the keys settle into.
+*/
+template<typename Key>
+void wait_for_growth(rate_limiter<Key>& limiter)
+{
+    while(limiter.size()>limiter.chain_count())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void wait_for_growth(locked_rate_limiter&)
+{}
+
+template<typename Limiter>
+double ns_per_check(Limiter& limiter,unsigned threads,std::uint64_t keys,unsigned long checks)
+{
+    // Touch every key once so we measure lookups, not first-time inserts
+    for(std::uint64_t k=0;k<keys;++k)
+        limiter.try_acquire(k);
+    wait_for_growth(limiter);
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> workers;
+    bench_clock::time_point start;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t x=0x9e3779b97f4a7c15ULL*(t+1);
+            while(!go.load())
+                std::this_thread::yield();
+            for(unsigned long i=0;i<checks;++i)
+                limiter.try_acquire(next_random(x)%keys);
+        }));
+    }
+    start=bench_clock::now();
+    go=true;
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/checks;
+}
+
+void check_eviction()
+{
+    rate_limiter<std::uint64_t> limiter(1000,10,1<<17,std::chrono::milliseconds(100),
+                                        std::chrono::milliseconds(50));
+    for(std::uint64_t k=0;k<100000;++k)
+        limiter.try_acquire(k);
+    std::cout << "eviction: " << limiter.size() << " keys live";
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    std::cout << ", after 400ms idle " << limiter.size() << " live, "
+              << limiter.evicted_count() << " evicted" << std::endl;
+}
+
+int main()
+{
+    unsigned const threads=std::thread::hardware_concurrency()?std::thread::hardware_concurrency():2;
+    check_accuracy(threads);
+    check_accuracy(4*threads);
+    check_growth(threads);
+    check_growth(4*threads);
+
+    unsigned long const checks=1000000;
+    std::cout << std::endl << threads << " threads, ns per check (wall time / checks per thread)"
+              << std::endl << "keys      rate_limiter  mutex+map" << std::endl;
+    std::uint64_t const key_counts[]={1000,10000,100000,1000000};
+    for(unsigned i=0;i<4;++i)
+    {
+        std::uint64_t const keys=key_counts[i];
+        // High rate so most checks are grants and do write
+        rate_limiter<std::uint64_t> limiter(1e6,1000);
+        locked_rate_limiter locked(1e6,1000);
+        double const lock_free=ns_per_check(limiter,threads,keys,checks);
+        double const with_mutex=ns_per_check(locked,threads,keys,checks);
+        std::cout << keys << "\t  " << lock_free << "\t" << with_mutex << std::endl;
+    }
+    std::cout << std::endl;
+    check_eviction();
+    return 0;
+}
@@ -0,0 +1,566 @@
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include <time.h>
+#include "hash-mix.hpp"
+#include "reclamation.hpp"
+
+/**
+ * Token-bucket rate limiting
+ * ==========================
+ *
+ * A bucket holds up to `burst` tokens and refills at `rate` tokens per
+ * second; a request takes a token or is refused. Refills are never done by a
+ * timer: each check works out how many tokens accrued since the bucket's
+ * timestamp and adds them on the spot.
+ *
+ * The whole bucket lives in one 64-bit word:
+ *
+ *   | timestamp: 40 bits, microseconds | tokens: 24 bits |
+ *
+ * so a check is load, compute, compare_exchange - no lock, and nothing to
+ * keep consistent between two fields. A refused request doesn't write at all,
+ * so a client hammering an empty bucket only reads its cache line.
+ *
+ * When a refill adds k whole tokens, the timestamp moves forward by exactly
+ * the time those k tokens took, not to now, so the fraction of a token
+ * accrued so far isn't thrown away. 40 bits of microseconds wrap after about
+ * 12 days; elapsed time is computed modulo that and capped at the time a
+ * full refill takes. That only works if the clock is read after the state
+ * it is compared with: a timestamp even slightly ahead of now would come
+ * out as nearly 12 days.
+*/
+
+class token_bucket_math
+{
+    static unsigned const token_bits=24;
+    static std::uint64_t const token_mask=(std::uint64_t(1)<<token_bits)-1;
+    static std::uint64_t const time_mask=(std::uint64_t(1)<<(64-token_bits))-1;
+
+    double tokens_per_us;
+    double us_per_token;
+    std::uint64_t fill_us;
+
+public:
+    static std::uint64_t const max_burst=token_mask-1;
+    // Mark a bucket that has been evicted from a rate_limiter table, or
+    // copied into its bigger replacement. No real bucket has token_mask
+    // tokens, so neither can be mistaken for one
+    static std::uint64_t const evicted=~std::uint64_t(0);
+    static std::uint64_t const moved=~std::uint64_t(0)^(token_mask+1);
+
+    static bool is_marker(std::uint64_t state)
+    {
+        return (state&token_mask)==token_mask;
+    }
+
+    unsigned const burst;
+
+    token_bucket_math(double rate,unsigned burst_):
+        tokens_per_us(rate/1e6),us_per_token(1e6/rate),burst(burst_)
+    {
+        if(!(rate>0) || burst_==0 || burst_>max_burst)
+            throw std::invalid_argument("token bucket: need rate>0 and 0<burst<2^24-1");
+        fill_us=static_cast<std::uint64_t>(burst_*us_per_token)+1;
+    }
+
+    /**
+     * CLOCK_MONOTONIC_COARSE only advances once per kernel tick (1-4ms), but
+     * reading it is a plain load from the vDSO page. steady_clock::now() has
+     * to read the TSC, which stops the core from overlapping the next
+     * lookup's cache misses with this one and on a 1M-key table made a check
+     * several times slower. A coarse clock just means tokens arrive in
+     * tick-sized batches; the long-run rate is unchanged.
+    */
+    static std::uint64_t now_us()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+        return (static_cast<std::uint64_t>(ts.tv_sec)*1000000+ts.tv_nsec/1000)&time_mask;
+    }
+
+    static std::uint64_t pack(std::uint64_t time,std::uint64_t tokens)
+    {
+        return ((time&time_mask)<<token_bits)|tokens;
+    }
+
+    static std::uint64_t tokens_of(std::uint64_t state)
+    {
+        return state&token_mask;
+    }
+
+    static std::uint64_t time_of(std::uint64_t state)
+    {
+        return state>>token_bits;
+    }
+
+    std::uint64_t full(std::uint64_t now) const
+    {
+        return pack(now,burst);
+    }
+
+    static std::uint64_t elapsed_us(std::uint64_t state,std::uint64_t now)
+    {
+        return (now-time_of(state))&time_mask;
+    }
+
+    std::uint64_t refill_time_us() const
+    {
+        return fill_us;
+    }
+
+    /**
+     * Refill state up to now and take n tokens. Returns false, leaving next
+     * untouched, if there aren't enough.
+    */
+    bool take(std::uint64_t state,std::uint64_t now,unsigned n,std::uint64_t& next) const
+    {
+        std::uint64_t tokens=tokens_of(state);
+        std::uint64_t time=time_of(state);
+        std::uint64_t elapsed=elapsed_us(state,now);
+        // Past a full refill more time makes no difference
+        if(elapsed>fill_us)
+            elapsed=fill_us;
+        std::uint64_t const accrued=static_cast<std::uint64_t>(elapsed*tokens_per_us);
+        if(tokens+accrued>=burst)
+        {
+            tokens=burst;
+            time=now;
+        }
+        else if(accrued)
+        {
+            tokens+=accrued;
+            time+=static_cast<std::uint64_t>(accrued*us_per_token);
+        }
+        if(tokens<n)
+            return false;
+        next=pack(time,tokens-n);
+        return true;
+    }
+
+    /**
+     * The CAS loop. Returns false if the bucket is short of tokens or has
+     * been marked evicted or moved; sets gone to tell which.
+    */
+    bool try_take(std::atomic<std::uint64_t>& state,unsigned n,bool& gone) const
+    {
+        std::uint64_t current=state.load(std::memory_order_acquire);
+        std::uint64_t next;
+        for(;;)
+        {
+            gone=is_marker(current);
+            // Read the clock after the state, and again on every retry: the
+            // thread that beat us may have stamped the state with a later
+            // time than ours, which would look like 12 days had passed
+            if(gone || !take(current,now_us(),n,next))
+                return false;
+            if(state.compare_exchange_weak(current,next,std::memory_order_relaxed,
+                                           std::memory_order_acquire))
+                return true;
+        }
+    }
+};
+
+/**
+ * A single bucket, e.g. a global limit across all clients.
+*/
+class token_bucket
+{
+    token_bucket_math math;
+    std::atomic<std::uint64_t> state;
+public:
+    token_bucket(double tokens_per_second,unsigned burst):
+        math(tokens_per_second,burst),state(math.full(token_bucket_math::now_us()))
+    {}
+
+    token_bucket(token_bucket const&)=delete;
+    token_bucket& operator=(token_bucket const&)=delete;
+
+    bool try_acquire(unsigned n=1)
+    {
+        bool ignored;
+        return math.try_take(state,n,ignored);
+    }
+
+    /**
+     * Tokens available right now, refill included.
+    */
+    unsigned available() const
+    {
+        std::uint64_t next;
+        std::uint64_t const s=state.load(std::memory_order_relaxed);
+        return math.take(s,token_bucket_math::now_us(),0,next)?
+            static_cast<unsigned>(token_bucket_math::tokens_of(next)):0;
+    }
+};
+
+/**
+ * Per-client buckets
+ * ==================
+ *
+ * One bucket per key in a chained hash table with a power-of-two number of
+ * chains, at least stripe_count of them.
+ *
+ *  - Lookups are lock-free: walk the chain under an epoch guard and CAS the
+ *    bucket's state word in place.
+ *  - A key's first request takes the lock of its chain's stripe, looks again
+ *    and links a new node at the head. Only new keys ever touch a mutex.
+ *  - A background thread sweeps the table every sweep_interval. A bucket idle
+ *    for idle_timeout is evicted: under the stripe lock its state is CASed to
+ *    `evicted` and the node unlinked and retired through epoch_reclaimer.
+ *  - When there are more keys than chains, the insert that notices wakes the
+ *    same thread to double the table. It publishes the bigger table next to
+ *    the old one, then moves the old chains over one at a time under their
+ *    stripe's lock: each node's state is swapped for `moved` and a copy holding
+ *    that state is linked into the new table. Chain c of any table belongs
+ *    to stripe c % stripe_count, so a key's old and new chains share a
+ *    lock. No request waits for more than one chain's move, and once every
+ *    chain has moved the old table and its nodes are retired.
+ *
+ * A thread that found a node just before it was evicted or moved fails its
+ * CAS on the marker and takes the slow path, which under the stripe lock
+ * finds the key's live node (or, after an eviction, inserts a fresh one).
+ * Eviction only happens once a bucket would have refilled completely anyway
+ * (idle_timeout is raised to at least the full refill time), so handing out
+ * a fresh full bucket never grants more than the old one would have.
+*/
+template<typename Key,typename Hash=std::hash<Key> >
+class rate_limiter
+{
+    struct node
+    {
+        std::atomic<std::uint64_t> state;
+        Key const key;
+        std::atomic<node*> next;
+
+        node(Key const& key_,std::uint64_t state_,node* next_):
+            state(state_),key(key_),next(next_)
+        {}
+    };
+
+    struct table
+    {
+        std::size_t const mask;
+        std::unique_ptr<std::atomic<node*>[]> chains;
+
+        explicit table(std::size_t size):
+            mask(size-1),chains(new std::atomic<node*>[size])
+        {
+            for(std::size_t i=0;i<size;++i)
+                chains[i].store(nullptr,std::memory_order_relaxed);
+        }
+
+        std::size_t size() const
+        {
+            return mask+1;
+        }
+    };
+
+    static unsigned const stripe_count=256;
+
+    token_bucket_math math;
+    Hash hasher;
+    // While the table grows, current is the new one and draining the old
+    std::atomic<table*> current;
+    std::atomic<table*> draining;
+    std::unique_ptr<std::mutex[]> stripes;
+    std::uint64_t idle_timeout_us;
+    std::atomic<std::size_t> live;
+    std::atomic<std::size_t> evictions;
+    std::atomic<bool> grow_requested;
+    // Sweeps and growth, whichever thread runs them, take turns
+    std::mutex maintenance;
+
+    std::chrono::milliseconds sweep_interval;
+    std::thread sweeper;
+    std::mutex sweeper_mutex;
+    std::condition_variable sweeper_cond;
+    bool stopping;
+    bool grow_wanted;
+
+    static std::size_t chains_for(std::size_t expected_keys)
+    {
+        std::size_t n=stripe_count;
+        while(n<expected_keys)
+            n<<=1;
+        return n;
+    }
+
+    std::uint64_t hash_of(Key const& key) const
+    {
+        return mix_hash(hasher(key));
+    }
+
+    std::mutex& stripe_of(std::uint64_t hash)
+    {
+        return stripes[hash%stripe_count];
+    }
+
+    static node* find(table const* t,std::uint64_t hash,Key const& key,epoch_reclaimer::guard& g)
+    {
+        for(node* n=g.protect(t->chains[hash&t->mask]);n;n=g.protect(n->next))
+        {
+            if(n->key==key)
+                return n;
+        }
+        return nullptr;
+    }
+
+    bool insert_and_take(std::uint64_t hash,Key const& key,unsigned n,epoch_reclaimer::guard& g)
+    {
+        std::size_t grown_past;
+        bool granted;
+        {
+            std::lock_guard<std::mutex> lk(stripe_of(hash));
+            // Tables and chains can't change under this lock, and another
+            // thread may have added the key while we waited. A key that
+            // hasn't moved yet is live in the old table, one that has is in
+            // the new one
+            table* const t=current.load(std::memory_order_acquire);
+            table* const old=draining.load(std::memory_order_acquire);
+            node* existing=old?find(old,hash,key,g):nullptr;
+            if(!existing || token_bucket_math::is_marker(existing->state.load(std::memory_order_relaxed)))
+                existing=find(t,hash,key,g);
+            if(existing)
+            {
+                bool gone;
+                // Evicted and moved nodes are unlinked or replaced under this
+                // lock, so existing is live
+                return math.try_take(existing->state,n,gone);
+            }
+            std::uint64_t const now=token_bucket_math::now_us();
+            std::uint64_t state;
+            granted=math.take(math.full(now),now,n,state);
+            if(!granted)
+                state=math.full(now);
+            std::atomic<node*>& chain=t->chains[hash&t->mask];
+            chain.store(new node(key,state,chain.load(std::memory_order_relaxed)),std::memory_order_release);
+            grown_past=t->size();
+        }
+        if(live.fetch_add(1,std::memory_order_relaxed)+1>grown_past &&
+           !grow_requested.exchange(true,std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lk(sweeper_mutex);
+            grow_wanted=true;
+            sweeper_cond.notify_all();
+        }
+        return granted;
+    }
+
+    bool try_evict(table* t,std::size_t chain,node* victim,std::uint64_t seen)
+    {
+        std::lock_guard<std::mutex> lk(stripes[chain%stripe_count]);
+        // Fails if a request refreshed the bucket since the sweep looked at it
+        if(!victim->state.compare_exchange_strong(seen,token_bucket_math::evicted,
+                                                 std::memory_order_relaxed))
+            return false;
+        std::atomic<node*>* link=&t->chains[chain];
+        while(link->load(std::memory_order_relaxed)!=victim)
+            link=&link->load(std::memory_order_relaxed)->next;
+        link->store(victim->next.load(std::memory_order_relaxed),std::memory_order_release);
+        epoch_reclaimer::retire(victim);
+        live.fetch_sub(1,std::memory_order_relaxed);
+        evictions.fetch_add(1,std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Doubles the table until there are at least as many chains as keys.
+     * Called with maintenance held.
+    */
+    void grow()
+    {
+        table* const old=current.load(std::memory_order_relaxed);
+        std::size_t size=old->size()*2;
+        while(size<live.load(std::memory_order_relaxed))
+            size<<=1;
+        table* const bigger=new table(size);
+        draining.store(old,std::memory_order_release);
+        current.store(bigger,std::memory_order_release);
+        for(std::size_t chain=0;chain<=old->mask;++chain)
+        {
+            std::lock_guard<std::mutex> lk(stripes[chain%stripe_count]);
+            for(node* n=old->chains[chain].load(std::memory_order_relaxed);n;
+                n=n->next.load(std::memory_order_relaxed))
+            {
+                // Takes every grant made up to now; later ones fail on the
+                // marker and find the copy
+                std::uint64_t const state=n->state.exchange(token_bucket_math::moved,
+                                                            std::memory_order_relaxed);
+                std::atomic<node*>& to=bigger->chains[hash_of(n->key)&bigger->mask];
+                to.store(new node(n->key,state,to.load(std::memory_order_relaxed)),
+                         std::memory_order_release);
+            }
+        }
+        draining.store(nullptr,std::memory_order_release);
+        for(std::size_t chain=0;chain<=old->mask;++chain)
+        {
+            node* n=old->chains[chain].load(std::memory_order_relaxed);
+            while(n)
+            {
+                node* const next=n->next.load(std::memory_order_relaxed);
+                epoch_reclaimer::retire(n);
+                n=next;
+            }
+        }
+        epoch_reclaimer::retire(old);
+        grow_requested.store(false,std::memory_order_relaxed);
+    }
+
+    static void delete_chains(table* t)
+    {
+        for(std::size_t i=0;i<=t->mask;++i)
+        {
+            node* n=t->chains[i].load(std::memory_order_relaxed);
+            while(n)
+            {
+                node* const next=n->next.load(std::memory_order_relaxed);
+                delete n;
+                n=next;
+            }
+        }
+        delete t;
+    }
+
+public:
+    rate_limiter(double tokens_per_second,unsigned burst,
+                 std::size_t expected_keys=1<<16,
+                 std::chrono::milliseconds idle_timeout=std::chrono::seconds(60),
+                 std::chrono::milliseconds sweep_interval_=std::chrono::seconds(1)):
+        math(tokens_per_second,burst),
+        current(new table(chains_for(expected_keys))),
+        draining(nullptr),
+        stripes(new std::mutex[stripe_count]),
+        idle_timeout_us(static_cast<std::uint64_t>(idle_timeout.count())*1000),
+        live(0),evictions(0),grow_requested(false),
+        sweep_interval(sweep_interval_),
+        stopping(false),grow_wanted(false)
+    {
+        if(idle_timeout_us<math.refill_time_us())
+            idle_timeout_us=math.refill_time_us();
+        sweeper=std::thread([this]{
+            std::unique_lock<std::mutex> lk(sweeper_mutex);
+            for(;;)
+            {
+                sweeper_cond.wait_for(lk,sweep_interval,[this]{return stopping || grow_wanted;});
+                if(stopping)
+                    break;
+                bool const growing=grow_wanted;
+                grow_wanted=false;
+                lk.unlock();
+                if(growing)
+                {
+                    std::lock_guard<std::mutex> m(maintenance);
+                    grow();
+                }
+                else
+                    evict_idle();
+                lk.lock();
+            }
+        });
+    }
+
+    ~rate_limiter()
+    {
+        {
+            std::lock_guard<std::mutex> lk(sweeper_mutex);
+            stopping=true;
+        }
+        sweeper_cond.notify_all();
+        sweeper.join();
+        // grow() only runs on the sweeper, so nothing is draining now
+        delete_chains(current.load(std::memory_order_relaxed));
+    }
+
+    rate_limiter(rate_limiter const&)=delete;
+    rate_limiter& operator=(rate_limiter const&)=delete;
+
+    /**
+     * Take n tokens from key's bucket. A key seen for the first time starts
+     * with a full bucket.
+    */
+    bool try_acquire(Key const& key,unsigned n=1)
+    {
+        std::uint64_t const hash=hash_of(key);
+        epoch_reclaimer::guard g;
+        // current before draining: a thread that sees the new table also
+        // sees the old one it replaced, until every chain has moved
+        table* const t=current.load(std::memory_order_acquire);
+        table* const old=draining.load(std::memory_order_acquire);
+        node* found=old?find(old,hash,key,g):nullptr;
+        if(!found)
+            found=find(t,hash,key,g);
+        if(found)
+        {
+            bool gone;
+            if(math.try_take(found->state,n,gone))
+                return true;
+            if(!gone)
+                return false;
+        }
+        return insert_and_take(hash,key,n,g);
+    }
+
+    /**
+     * One sweep over the table. The background thread calls this every
+     * sweep_interval; it is public so a caller can force one.
+    */
+    std::size_t evict_idle()
+    {
+        std::lock_guard<std::mutex> m(maintenance);
+        table* const t=current.load(std::memory_order_relaxed);
+        std::size_t evicted=0;
+        // One guard per batch of chains: short enough not to hold the epoch
+        // back, long enough that entering it isn't the cost of the sweep
+        std::size_t const batch=256;
+        for(std::size_t first=0;first<=t->mask;first+=batch)
+        {
+            epoch_reclaimer::guard g;
+            for(std::size_t chain=first;chain<first+batch && chain<=t->mask;++chain)
+            {
+                for(node* n=g.protect(t->chains[chain]);n;n=g.protect(n->next))
+                {
+                    // As in try_take: a clock read before the load could be
+                    // older than a request that just stamped the bucket
+                    std::uint64_t const s=n->state.load(std::memory_order_acquire);
+                    if(!token_bucket_math::is_marker(s) &&
+                       token_bucket_math::elapsed_us(s,token_bucket_math::now_us())>=idle_timeout_us &&
+                       try_evict(t,chain,n,s))
+                        ++evicted;
+                }
+            }
+        }
+        epoch_reclaimer::scan();
+        return evicted;
+    }
+
+    std::size_t size() const
+    {
+        return live.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Chains in the table; grows to at least size() shortly after size()
+     * passes it.
+    */
+    std::size_t chain_count() const
+    {
+        return current.load(std::memory_order_acquire)->size();
+    }
+
+    std::size_t evicted_count() const
+    {
+        return evictions.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,250 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include "reclamation.hpp"
+
+/**
+ * Lock-free stack on top of the reclamation module
+ * ================================================
+ *
+ * This is the threadsafe_stack from chapter 3 without the mutex. pop() is
+ * where the reclamation problem shows up: after the compare_exchange that
+ * unlinks old_head succeeds, another thread may still be inside its own
+ * pop() reading old_head->next. So old_head is retired, not deleted.
+*/
+template<typename T,typename Reclaimer>
+class lock_free_stack
+{
+private:
+    struct node
+    {
+        std::shared_ptr<T> data;
+        node* next;
+        node(T const& data_):
+            data(std::make_shared<T>(data_)),next(nullptr)
+        {}
+    };
+    std::atomic<node*> head;
+public:
+    lock_free_stack():
+        head(nullptr)
+    {}
+
+    ~lock_free_stack()
+    {
+        while(pop());
+    }
+
+    lock_free_stack(lock_free_stack const&)=delete;
+    lock_free_stack& operator=(lock_free_stack const&)=delete;
+
+    void push(T const& data)
+    {
+        node* const new_node=new node(data);
+        new_node->next=head.load(std::memory_order_relaxed);
+        while(!head.compare_exchange_weak(new_node->next,new_node));
+    }
+
+    std::shared_ptr<T> pop()
+    {
+        typename Reclaimer::guard g;
+        node* old_head=g.protect(head);
+        // old_head->next is safe to read: old_head can't be freed while protected
+        while(old_head && !head.compare_exchange_strong(old_head,old_head->next))
+        {
+            old_head=g.protect(head);
+        }
+        g.reset();
+        std::shared_ptr<T> res;
+        if(old_head)
+        {
+            res.swap(old_head->data);
+            Reclaimer::retire(old_head);
+        }
+        return res;
+    }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ns(bench_clock::time_point start)
+{
+    return std::chrono::duration<double,std::nano>(bench_clock::now()-start).count();
+}
+
+/**
+ * Correctness: several threads push and pop concurrently; every value
+ * pushed must be popped exactly once.
+*/
+template<typename Reclaimer>
+bool stack_check(unsigned threads,unsigned per_thread)
+{
+    lock_free_stack<unsigned,Reclaimer> s;
+    std::atomic<unsigned long long> popped_sum(0);
+    std::atomic<unsigned> popped_count(0);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            for(unsigned i=0;i<per_thread;++i)
+            {
+                s.push(t*per_thread+i);
+                std::shared_ptr<unsigned> v=s.pop();
+                if(v)
+                {
+                    popped_sum+=*v;
+                    ++popped_count;
+                }
+            }
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    while(std::shared_ptr<unsigned> v=s.pop())
+    {
+        popped_sum+=*v;
+        ++popped_count;
+    }
+    unsigned long long const n=static_cast<unsigned long long>(threads)*per_thread;
+    return popped_count==n && popped_sum==n*(n-1)/2;
+}
+
+struct payload
+{
+    unsigned long value;
+    explicit payload(unsigned long v):
+        value(v)
+    {}
+};
+
+/**
+ * Read-side overhead: readers repeatedly protect and dereference a shared
+ * pointer while one writer keeps replacing it and retiring the old one.
+*/
+struct raw_reader
+{
+    class guard
+    {
+    public:
+        template<typename T>
+        T* protect(std::atomic<T*> const& src)
+        {
+            return src.load(std::memory_order_acquire);
+        }
+    };
+};
+
+template<typename Reclaimer,typename Guard>
+double read_overhead_ns(unsigned readers,unsigned long reads,bool with_writer)
+{
+    std::atomic<payload*> shared(new payload(0));
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned r=0;r<readers;++r)
+    {
+        threads.push_back(std::thread([&]{
+            unsigned long sink=0;
+            for(unsigned long i=0;i<reads;++i)
+            {
+                Guard g;
+                sink+=g.protect(shared)->value;
+            }
+            if(sink==42)
+                std::cout << "";
+        }));
+    }
+    std::thread writer;
+    if(with_writer)
+    {
+        writer=std::thread([&]{
+            unsigned long v=1;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                payload* const old=shared.exchange(new payload(v++));
+                Reclaimer::retire(old);
+                std::this_thread::yield();
+            }
+        });
+    }
+    for(unsigned r=0;r<readers;++r)
+        threads[r].join();
+    double const ns=elapsed_ns(start)/reads;
+    done=true;
+    if(writer.joinable())
+        writer.join();
+    delete shared.load();
+    return ns;
+}
+
+/**
+ * Garbage under a stalled reader: one thread enters a guard and then sleeps
+ * while a writer retires `retires` objects. Hazard pointers can only keep
+ * the single object that reader announced; epochs can't free anything.
+*/
+template<typename Reclaimer>
+std::size_t garbage_under_stall(unsigned long retires)
+{
+    std::atomic<payload*> shared(new payload(0));
+    std::atomic<bool> reader_in(false);
+    std::atomic<bool> release(false);
+    std::size_t const before=Reclaimer::retired_count();
+
+    std::thread stalled([&]{
+        typename Reclaimer::guard g;
+        g.protect(shared);
+        reader_in=true;
+        while(!release)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    while(!reader_in)
+        std::this_thread::yield();
+
+    std::size_t held=0;
+    std::thread writer([&]{
+        for(unsigned long i=0;i<retires;++i)
+        {
+            payload* const old=shared.exchange(new payload(i));
+            Reclaimer::retire(old);
+        }
+        Reclaimer::scan();
+        held=Reclaimer::retired_count()-before;
+        release=true;
+    });
+    writer.join();
+    stalled.join();
+    delete shared.load();
+    return held;
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const readers=argc>1?std::atoi(argv[1]):4;
+    unsigned long const reads=argc>2?std::strtoul(argv[2],nullptr,10):2000000;
+    unsigned long const retires=argc>3?std::strtoul(argv[3],nullptr,10):1000000;
+
+    std::cout << "lock_free_stack check (hazard pointers): "
+              << (stack_check<hazard_pointer_reclaimer>(4,100000)?"ok":"FAILED") << std::endl;
+    std::cout << "lock_free_stack check (epochs):          "
+              << (stack_check<epoch_reclaimer>(4,100000)?"ok":"FAILED") << std::endl;
+
+    std::cout << std::endl << "Read-side overhead, " << readers << " readers, "
+              << reads << " reads each (ns/read)" << std::endl;
+    std::cout << "  raw load:        "
+              << read_overhead_ns<epoch_reclaimer,raw_reader::guard>(readers,reads,false) << std::endl;
+    std::cout << "  hazard pointers: "
+              << read_overhead_ns<hazard_pointer_reclaimer,hazard_pointer_reclaimer::guard>(readers,reads,true) << std::endl;
+    std::cout << "  epochs:          "
+              << read_overhead_ns<epoch_reclaimer,epoch_reclaimer::guard>(readers,reads,true) << std::endl;
+
+    std::cout << std::endl << "Garbage held with one stalled reader after "
+              << retires << " retires" << std::endl;
+    std::cout << "  hazard pointers: " << garbage_under_stall<hazard_pointer_reclaimer>(retires) << std::endl;
+    std::cout << "  epochs:          " << garbage_under_stall<epoch_reclaimer>(retires) << std::endl;
+    return 0;
+}
@@ -0,0 +1,581 @@
+#ifndef RECLAMATION_HPP
+#define RECLAMATION_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+
+/**
+ * Safe memory reclamation for lock-free containers
+ * ================================================
+ *
+ * A lock-based container can delete a node as soon as it is unlinked, because
+ * the mutex guarantees nobody else is looking at it. A lock-free container
+ * can't: another thread may have loaded the pointer just before it was
+ * unlinked and still be reading node->next. Deleting it then is a
+ * use-after-free.
+ *
+ * The fix is to *retire* the node instead of deleting it and only call the
+ * deleter once no thread can still hold a reference. Two schemes are provided
+ * with the same interface so a container can be written once and
+ * instantiated with either:
+ *
+ *   Reclaimer::guard g;              // RAII: marks this thread as a reader
+ *   node* n=g.protect(head);         // safe to dereference while g lives
+ *   ...
+ *   Reclaimer::retire(old_node);     // or retire(p, deleter)
+ *
+ * hazard_pointer_reclaimer:
+ *  - Each guard owns one "hazard pointer" slot that announces the pointer it
+ *    is about to dereference. A retired pointer is freed only if no slot
+ *    holds it.
+ *  - Costs a store + fence + re-load per protected pointer.
+ *  - Garbage is bounded: a stalled thread can pin at most its own slots.
+ *
+ * epoch_reclaimer:
+ *  - A guard pins the current global epoch. Retired pointers are tagged with
+ *    the epoch they were retired in and freed once every pinned thread has
+ *    moved two epochs past it.
+ *  - protect() is a plain acquire load, so reads are nearly free.
+ *  - Garbage is unbounded: a thread stalled inside a guard stops the epoch
+ *    from advancing and everything retired after that piles up.
+ *
+ * Both keep a per-thread retire list and only scan in batches, once the list
+ * reaches a threshold, so the cost of a scan is amortised over many retires.
+ * Whatever is still pending when a thread exits is handed to an orphan list
+ * that the next scanning thread adopts.
+*/
+
+/**
+ * A retired pointer plus the type-erased deleter that frees it.
+ * Stateless deleters (the default) don't allocate; stateful ones are
+ * copied to the heap and freed together with the pointer.
+*/
+class retired_ptr
+{
+    void* ptr;
+    void (*reclaim)(void*,void*);
+    void* deleter;
+public:
+    unsigned long epoch;
+
+    retired_ptr(void* ptr_,void (*reclaim_)(void*,void*),void* deleter_,
+                unsigned long epoch_=0):
+        ptr(ptr_),reclaim(reclaim_),deleter(deleter_),epoch(epoch_)
+    {}
+
+    void* get() const
+    {
+        return ptr;
+    }
+
+    void destroy()
+    {
+        reclaim(ptr,deleter);
+    }
+};
+
+template<typename T>
+void reclaim_with_delete(void* p,void*)
+{
+    delete static_cast<T*>(p);
+}
+
+template<typename T,typename Deleter>
+void reclaim_with_deleter(void* p,void* d)
+{
+    Deleter* const deleter=static_cast<Deleter*>(d);
+    (*deleter)(static_cast<T*>(p));
+    delete deleter;
+}
+
+/**
+ * Per-thread records
+ * ==================
+ *
+ * Each scheme keeps a lock-free list of per-thread records. Records are never
+ * freed: when a thread exits it just releases its record (in_use=false) so
+ * a later thread can take it over. That way a scanning thread can walk the
+ * list at any time without worrying about records disappearing under it.
+*/
+template<typename Record>
+class record_registry
+{
+    static std::atomic<Record*> head;
+    static std::atomic<unsigned> count;
+
+    struct owner
+    {
+        Record* record;
+        owner():
+            record(acquire())
+        {}
+        ~owner()
+        {
+            Record::thread_exit(*record);
+            record->in_use.store(false,std::memory_order_release);
+        }
+    };
+
+    static Record* acquire()
+    {
+        for(Record* r=head.load(std::memory_order_acquire);r;r=r->next)
+        {
+            bool expected=false;
+            if(!r->in_use.load(std::memory_order_relaxed) &&
+               r->in_use.compare_exchange_strong(expected,true))
+            {
+                return r;
+            }
+        }
+        Record* const r=new Record;
+        r->in_use.store(true,std::memory_order_relaxed);
+        r->next=head.load(std::memory_order_relaxed);
+        while(!head.compare_exchange_weak(r->next,r));
+        count.fetch_add(1,std::memory_order_relaxed);
+        return r;
+    }
+public:
+    static Record& local()
+    {
+        static thread_local owner this_thread;
+        return *this_thread.record;
+    }
+
+    static Record* first()
+    {
+        return head.load(std::memory_order_acquire);
+    }
+
+    static unsigned size()
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+template<typename Record>
+std::atomic<Record*> record_registry<Record>::head(nullptr);
+template<typename Record>
+std::atomic<unsigned> record_registry<Record>::count(0);
+
+/**
+ * Retired pointers left behind by exiting threads.
+*/
+class orphan_list
+{
+    std::mutex m;
+    std::vector<retired_ptr> data;
+    std::atomic<bool> non_empty;
+public:
+    orphan_list():
+        non_empty(false)
+    {}
+
+    void give(std::vector<retired_ptr>& retired)
+    {
+        if(retired.empty())
+            return;
+        std::lock_guard<std::mutex> lk(m);
+        data.insert(data.end(),retired.begin(),retired.end());
+        retired.clear();
+        non_empty.store(true,std::memory_order_release);
+    }
+
+    void adopt(std::vector<retired_ptr>& retired)
+    {
+        // Cheap check first so the common scan never touches the mutex
+        if(!non_empty.load(std::memory_order_acquire))
+            return;
+        std::lock_guard<std::mutex> lk(m);
+        retired.insert(retired.end(),data.begin(),data.end());
+        data.clear();
+        non_empty.store(false,std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Hazard pointers
+ * ===============
+*/
+class hazard_pointer_reclaimer
+{
+public:
+    static unsigned const slots_per_thread=4;
+    static std::size_t const min_scan_threshold=64;
+
+private:
+    struct record
+    {
+        std::atomic<bool> in_use;
+        record* next;
+        std::atomic<void*> hazard[slots_per_thread];
+        bool owned[slots_per_thread];
+        std::vector<retired_ptr> retired;
+
+        record():
+            in_use(false),next(nullptr)
+        {
+            for(unsigned i=0;i<slots_per_thread;++i)
+            {
+                hazard[i].store(nullptr,std::memory_order_relaxed);
+                owned[i]=false;
+            }
+        }
+
+        static void thread_exit(record& r)
+        {
+            scan(r);
+            orphans().give(r.retired);
+        }
+    };
+    typedef record_registry<record> registry;
+
+    // Leaked on purpose: a thread_local owner (in a pool held by a function
+    // static, say) can exit after static destructors have run, and it still
+    // hands its retired pointers over here
+    static orphan_list& orphans()
+    {
+        static orphan_list* const list=new orphan_list;
+        return *list;
+    }
+
+    static std::atomic<std::size_t>& pending()
+    {
+        static std::atomic<std::size_t> count(0);
+        return count;
+    }
+
+    /**
+     * Scanning is O(R log H): collect every live hazard pointer once, sort it,
+     * then binary-search for each retired pointer. Scanning only when the
+     * retire list is at least twice the number of hazard slots guarantees
+     * at least half of it is freed on every scan.
+    */
+    static std::size_t scan_threshold()
+    {
+        std::size_t const slots=registry::size()*slots_per_thread;
+        return std::max(min_scan_threshold,2*slots);
+    }
+
+    static void scan(record& self)
+    {
+        orphans().adopt(self.retired);
+        if(self.retired.empty())
+            return;
+
+        // Pairs with the fence in guard::protect(): either the reader sees the
+        // pointer already unlinked, or we see its hazard.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::vector<void*> hazards;
+        for(record* r=registry::first();r;r=r->next)
+        {
+            for(unsigned i=0;i<slots_per_thread;++i)
+            {
+                void* const p=r->hazard[i].load(std::memory_order_acquire);
+                if(p)
+                    hazards.push_back(p);
+            }
+        }
+        std::sort(hazards.begin(),hazards.end());
+
+        std::vector<retired_ptr> still_hazardous;
+        std::size_t freed=0;
+        for(std::size_t i=0;i<self.retired.size();++i)
+        {
+            if(std::binary_search(hazards.begin(),hazards.end(),self.retired[i].get()))
+            {
+                still_hazardous.push_back(self.retired[i]);
+            }
+            else
+            {
+                self.retired[i].destroy();
+                ++freed;
+            }
+        }
+        self.retired.swap(still_hazardous);
+        pending().fetch_sub(freed,std::memory_order_relaxed);
+    }
+
+    static void add_retired(retired_ptr const& p)
+    {
+        record& self=registry::local();
+        self.retired.push_back(p);
+        pending().fetch_add(1,std::memory_order_relaxed);
+        if(self.retired.size()>=scan_threshold())
+            scan(self);
+    }
+
+public:
+    /**
+     * Owns one hazard slot of the calling thread for its lifetime.
+     * A thread can hold at most slots_per_thread guards at once.
+    */
+    class guard
+    {
+        std::atomic<void*>* slot;
+        bool* owned;
+    public:
+        guard():
+            slot(nullptr),owned(nullptr)
+        {
+            record& self=registry::local();
+            for(unsigned i=0;i<slots_per_thread;++i)
+            {
+                if(!self.owned[i])
+                {
+                    self.owned[i]=true;
+                    slot=&self.hazard[i];
+                    owned=&self.owned[i];
+                    return;
+                }
+            }
+            throw std::runtime_error("No hazard pointers available");
+        }
+
+        ~guard()
+        {
+            slot->store(nullptr,std::memory_order_release);
+            *owned=false;
+        }
+
+        guard(guard const&)=delete;
+        guard& operator=(guard const&)=delete;
+
+        /**
+         * Announce the pointer, then re-read the source to check it wasn't
+         * unlinked (and possibly freed) between the first read and the
+         * announcement. Loop until the two agree.
+        */
+        template<typename T>
+        T* protect(std::atomic<T*> const& src)
+        {
+            T* p=src.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                slot->store(p,std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                T* const q=src.load(std::memory_order_acquire);
+                if(q==p)
+                    return p;
+                p=q;
+            }
+        }
+
+        void reset()
+        {
+            slot->store(nullptr,std::memory_order_release);
+        }
+    };
+
+    template<typename T>
+    static void retire(T* p)
+    {
+        add_retired(retired_ptr(p,&reclaim_with_delete<T>,nullptr));
+    }
+
+    template<typename T,typename Deleter>
+    static void retire(T* p,Deleter d)
+    {
+        add_retired(retired_ptr(p,&reclaim_with_deleter<T,Deleter>,new Deleter(d)));
+    }
+
+    /**
+     * Force a scan of this thread's retire list now.
+    */
+    static void scan()
+    {
+        scan(registry::local());
+    }
+
+    /**
+     * Number of retired but not yet freed pointers across all threads.
+    */
+    static std::size_t retired_count()
+    {
+        return pending().load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Epoch-based reclamation
+ * =======================
+ *
+ * state of each record is (epoch<<1)|active. The global epoch can only move
+ * from e to e+1 once every active thread has announced e, so anything retired
+ * in epoch e is unreachable by the time the global epoch reaches e+2.
+*/
+class epoch_reclaimer
+{
+public:
+    static std::size_t const scan_threshold=64;
+
+private:
+    struct record
+    {
+        std::atomic<bool> in_use;
+        record* next;
+        std::atomic<unsigned long> state;
+        unsigned nesting;
+        std::vector<retired_ptr> retired;
+        std::size_t scan_at;
+
+        record():
+            in_use(false),next(nullptr),state(0),nesting(0),
+            scan_at(scan_threshold)
+        {}
+
+        static void thread_exit(record& r)
+        {
+            scan(r);
+            orphans().give(r.retired);
+        }
+    };
+    typedef record_registry<record> registry;
+
+    static std::atomic<unsigned long>& global_epoch()
+    {
+        static std::atomic<unsigned long> epoch(0);
+        return epoch;
+    }
+
+    static orphan_list& orphans()
+    {
+        static orphan_list* const list=new orphan_list;
+        return *list;
+    }
+
+    static std::atomic<std::size_t>& pending()
+    {
+        static std::atomic<std::size_t> count(0);
+        return count;
+    }
+
+    static void enter()
+    {
+        record& self=registry::local();
+        if(self.nesting++==0)
+        {
+            unsigned long const e=global_epoch().load(std::memory_order_seq_cst);
+            self.state.store((e<<1)|1,std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    static void leave()
+    {
+        record& self=registry::local();
+        if(--self.nesting==0)
+            self.state.store(0,std::memory_order_release);
+    }
+
+    static bool try_advance()
+    {
+        unsigned long const e=global_epoch().load(std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(record* r=registry::first();r;r=r->next)
+        {
+            unsigned long const s=r->state.load(std::memory_order_acquire);
+            if((s&1) && (s>>1)!=e)
+                return false;
+        }
+        unsigned long expected=e;
+        return global_epoch().compare_exchange_strong(expected,e+1);
+    }
+
+    static void scan(record& self)
+    {
+        orphans().adopt(self.retired);
+        if(self.retired.empty())
+            return;
+        try_advance();
+        unsigned long const e=global_epoch().load(std::memory_order_seq_cst);
+
+        std::vector<retired_ptr> not_yet;
+        std::size_t freed=0;
+        for(std::size_t i=0;i<self.retired.size();++i)
+        {
+            if(self.retired[i].epoch+2<=e)
+            {
+                self.retired[i].destroy();
+                ++freed;
+            }
+            else
+            {
+                not_yet.push_back(self.retired[i]);
+            }
+        }
+        self.retired.swap(not_yet);
+        pending().fetch_sub(freed,std::memory_order_relaxed);
+        // If a stalled thread is holding the epoch back, don't rescan the
+        // whole list on every retire: wait until it has doubled.
+        self.scan_at=std::max(scan_threshold,2*self.retired.size());
+    }
+
+    static void add_retired(retired_ptr p)
+    {
+        record& self=registry::local();
+        p.epoch=global_epoch().load(std::memory_order_seq_cst);
+        self.retired.push_back(p);
+        pending().fetch_add(1,std::memory_order_relaxed);
+        if(self.retired.size()>=self.scan_at)
+            scan(self);
+    }
+
+public:
+    /**
+     * Pins the current epoch for its lifetime. Guards nest freely; only
+     * the outermost one touches shared state.
+    */
+    class guard
+    {
+    public:
+        guard()
+        {
+            enter();
+        }
+
+        ~guard()
+        {
+            leave();
+        }
+
+        guard(guard const&)=delete;
+        guard& operator=(guard const&)=delete;
+
+        template<typename T>
+        T* protect(std::atomic<T*> const& src)
+        {
+            return src.load(std::memory_order_acquire);
+        }
+
+        void reset()
+        {}
+    };
+
+    template<typename T>
+    static void retire(T* p)
+    {
+        add_retired(retired_ptr(p,&reclaim_with_delete<T>,nullptr));
+    }
+
+    template<typename T,typename Deleter>
+    static void retire(T* p,Deleter d)
+    {
+        add_retired(retired_ptr(p,&reclaim_with_deleter<T,Deleter>,new Deleter(d)));
+    }
+
+    static void scan()
+    {
+        scan(registry::local());
+    }
+
+    static std::size_t retired_count()
+    {
+        return pending().load(std::memory_order_relaxed);
+    }
+};
+
+#endif
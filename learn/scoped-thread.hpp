@@ -0,0 +1,32 @@
+#ifndef SCOPED_THREAD_HPP
+#define SCOPED_THREAD_HPP
+
+#include <thread>
+#include <stdexcept>
+
+/**
+ * scoped_thread from transfer-ownership.cpp, pulled into a header so other
+ * modules can use it: takes ownership of a std::thread and joins it in the
+ * destructor.
+*/
+class scoped_thread
+{
+    std::thread t;
+public:
+    explicit scoped_thread(std::thread t_):
+        t(std::move(t_))
+    {
+        if(!t.joinable())
+            throw std::logic_error("No thread");
+    }
+
+    ~scoped_thread()
+    {
+        t.join();
+    }
+
+    scoped_thread(scoped_thread const&)=delete;
+    scoped_thread& operator=(scoped_thread const&)=delete;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "sharded-counter.hpp"
+
+/**
+ * One shared atomic vs sharded counter
+ * ====================================
+ *
+ * Every thread increments the same logical counter as fast as it can.
+ * With a single std::atomic the cache line bounces between cores; with the
+ * sharded counter each thread stays on its own line.
+ *
+ * Before that, checks that totals stay exact with more threads alive than
+ * there are slots to own, and that the histogram's top bucket takes values
+ * up to 2^64-1.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct shared_atomic
+{
+    std::atomic<long long> value;
+    shared_atomic():
+        value(0)
+    {}
+    void add(long long n)
+    {
+        value.fetch_add(n,std::memory_order_relaxed);
+    }
+    long long total() const
+    {
+        return value.load();
+    }
+};
+
+struct sharded
+{
+    sharded_counter c;
+    void add(long long n)
+    {
+        c.add(n);
+    }
+    long long total() const
+    {
+        return c.value();
+    }
+};
+
+template<typename Counter>
+double ns_per_increment(unsigned threads,long long per_thread)
+{
+    Counter c;
+    std::vector<std::thread> workers;
+    bench_clock::time_point const start=bench_clock::now();
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            for(long long i=0;i<per_thread;++i)
+                c.add(1);
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    double const ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count();
+    if(c.total()!=threads*per_thread)
+        std::cout << "  WRONG TOTAL " << c.total() << std::endl;
+    return ns/per_thread;
+}
+
+/**
+ * All threads have claimed their slot before any of them counts, so the
+ * ones past stat_owned_shards share slots while the owners are writing
+*/
+void check_more_threads_than_slots(unsigned threads,long long per_thread)
+{
+    sharded_counter c;
+    std::atomic<unsigned> ready(0);
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&]{
+            c.add(0);
+            ++ready;
+            while(ready.load()<threads)
+                std::this_thread::yield();
+            for(long long i=0;i<per_thread;++i)
+                c.add(1);
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    std::cout << threads << " threads: counted " << c.value() << " of " << threads*per_thread
+              << (c.value()==threads*per_thread?"":" WRONG TOTAL") << std::endl;
+}
+
+void check_histogram_top_bucket()
+{
+    log_histogram h;
+    h.record(~0ULL);
+    h.record(1ULL<<63);
+    h.record(3);
+    log_histogram::snapshot const r=h.read();
+    bool const ok=r.count[log_histogram::buckets-1]==2 && r.count[2]==1 && r.total==3 &&
+        r.sum==static_cast<long long>(~0ULL+(1ULL<<63)+3) && r.quantile(1.0)==~0ULL;
+    std::cout << "histogram top bucket: " << (ok?"ok":"WRONG") << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    check_more_threads_than_slots(2*stat_shards,5000000);
+    check_histogram_top_bucket();
+
+    unsigned const max_threads=argc>1?std::atoi(argv[1]):8;
+    long long const per_thread=argc>2?std::atoll(argv[2]):10000000;
+
+    std::cout << "ns per increment (per thread)" << std::endl;
+    std::cout << "threads  shared atomic  sharded_counter" << std::endl;
+    for(unsigned t=1;t<=max_threads;t*=2)
+    {
+        std::cout << t << "\t " << ns_per_increment<shared_atomic>(t,per_thread)
+                  << "\t\t" << ns_per_increment<sharded>(t,per_thread) << std::endl;
+    }
+
+    // Registry with a snapshot thread computing rates
+    stats_registry stats;
+    sharded_counter& requests=stats.counter("requests");
+    sharded_gauge& in_flight=stats.gauge("in_flight");
+    log_histogram& latency=stats.histogram("latency_ns");
+    stats.start_reporting(std::chrono::milliseconds(200),[](std::vector<stats_registry::sample> const& s){
+        for(std::size_t i=0;i<s.size();++i)
+        {
+            std::cout << "  " << s[i].name << "=" << s[i].value;
+            if(s[i].kind==stats_registry::counter_kind)
+                std::cout << " (" << s[i].rate << "/s)";
+            if(s[i].kind==stats_registry::histogram_kind)
+                std::cout << " (p99 <= " << s[i].histogram.quantile(0.99) << ")";
+        }
+        std::cout << std::endl;
+    });
+    std::cout << std::endl << "snapshots every 200ms:" << std::endl;
+    std::vector<std::thread> workers;
+    for(unsigned t=0;t<4;++t)
+    {
+        workers.push_back(std::thread([&]{
+            bench_clock::time_point const end=bench_clock::now()+std::chrono::seconds(1);
+            while(bench_clock::now()<end)
+            {
+                bench_clock::time_point const start=bench_clock::now();
+                in_flight.add(1);
+                requests.add();
+                in_flight.add(-1);
+                latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    bench_clock::now()-start).count());
+            }
+        }));
+    }
+    for(unsigned t=0;t<4;++t)
+        workers[t].join();
+    stats.stop();
+    return 0;
+}
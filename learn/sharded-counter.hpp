@@ -0,0 +1,449 @@
+#ifndef SHARDED_COUNTER_HPP
+#define SHARDED_COUNTER_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include "cache-line.hpp"
+
+/**
+ * Sharded statistics
+ * ==================
+ *
+ * A single std::atomic<long> counter bumped by every queue operation is
+ * correct, but every increment has to pull the cache line into the
+ * incrementing core in exclusive state. With N threads the line ping-pongs
+ * between cores and the counter becomes the bottleneck of the container it
+ * is supposed to be measuring.
+ *
+ * Instead each thread gets its own slot, padded to a full cache line, and
+ * updates only that. The line stays in that core's cache; nothing crosses the
+ * interconnect on the write path. Readers pay instead: value() walks all
+ * slots and sums them. That's the right trade for statistics, which are
+ * written constantly and read rarely.
+ *
+ * Slot ownership
+ * --------------
+ * A thread claims a free slot index on first use and gives it back when it
+ * exits. While it owns the slot it is the only writer, so an update is a
+ * relaxed load and store - no lock prefix, about a nanosecond. If more than
+ * stat_owned_shards threads are alive at once, the extra ones go to a few
+ * more slots that nobody owns and update them with a relaxed fetch_add.
+ * They must never touch an owned slot: the owner's load and store would
+ * overwrite their increments.
+*/
+
+static unsigned const stat_owned_shards=64;
+static unsigned const stat_overflow_shards=8;
+static unsigned const stat_shards=stat_owned_shards+stat_overflow_shards;
+
+class shard_owner
+{
+    static_assert(stat_owned_shards==64,"free_slots() has one bit per owned slot");
+
+    static std::atomic<std::uint64_t>& free_slots()
+    {
+        static std::atomic<std::uint64_t> bits(~std::uint64_t(0));
+        return bits;
+    }
+public:
+    unsigned index;
+    bool exclusive;
+
+    shard_owner():
+        index(0),exclusive(false)
+    {
+        std::uint64_t bits=free_slots().load(std::memory_order_relaxed);
+        while(bits)
+        {
+            unsigned const i=__builtin_ctzll(bits);
+            if(free_slots().compare_exchange_weak(bits,bits&~(std::uint64_t(1)<<i),
+                                                  std::memory_order_acquire))
+            {
+                index=i;
+                exclusive=true;
+                return;
+            }
+        }
+        // Round-robin: thread ids are stack addresses with the same low bits
+        static std::atomic<unsigned> next_overflow(0);
+        index=stat_owned_shards+
+            next_overflow.fetch_add(1,std::memory_order_relaxed)%stat_overflow_shards;
+    }
+
+    ~shard_owner()
+    {
+        // The next owner's acquire pairs with this, so it sees our last store
+        if(exclusive)
+            free_slots().fetch_or(std::uint64_t(1)<<index,std::memory_order_release);
+    }
+};
+
+inline shard_owner const& this_thread_shard()
+{
+    static thread_local shard_owner owner;
+    return owner;
+}
+
+/**
+ * Add to this thread's slot: owned, or one of the shared overflow slots.
+*/
+template<typename T>
+inline void shard_add(std::atomic<T>& slot,T n,shard_owner const& owner)
+{
+    if(owner.exclusive)
+        slot.store(slot.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+    else
+        slot.fetch_add(n,std::memory_order_relaxed);
+}
+
+class sharded_counter
+{
+    struct slot
+    {
+        std::atomic<long long> value;
+        char padding[cache_line_size-sizeof(std::atomic<long long>)];
+        slot():
+            value(0)
+        {}
+    };
+    slot* const slots;
+public:
+    sharded_counter():
+        slots(allocate_cache_aligned<slot>(stat_shards))
+    {}
+
+    ~sharded_counter()
+    {
+        free_cache_aligned(slots,stat_shards);
+    }
+
+    sharded_counter(sharded_counter const&)=delete;
+    sharded_counter& operator=(sharded_counter const&)=delete;
+
+    void add(long long n=1)
+    {
+        shard_owner const& owner=this_thread_shard();
+        shard_add(slots[owner.index].value,n,owner);
+    }
+
+    long long value() const
+    {
+        long long sum=0;
+        for(unsigned i=0;i<stat_shards;++i)
+            sum+=slots[i].value.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+/**
+ * A gauge goes up and down (queue depth, threads alive). add() is sharded
+ * like a counter; set() overwrites the total and is meant for the rare
+ * "reset to known value" case, not the hot path.
+*/
+class sharded_gauge
+{
+    sharded_counter deltas;
+    std::atomic<long long> base;
+public:
+    sharded_gauge():
+        base(0)
+    {}
+
+    void add(long long n)
+    {
+        deltas.add(n);
+    }
+
+    void set(long long v)
+    {
+        base.store(v-deltas.value(),std::memory_order_relaxed);
+    }
+
+    long long value() const
+    {
+        return base.load(std::memory_order_relaxed)+deltas.value();
+    }
+};
+
+/**
+ * Histogram with power-of-two buckets: bucket b counts values in
+ * [2^(b-1), 2^b), bucket 0 counts zeros. 65 buckets cover any 64-bit value
+ * (bucket 64 is [2^63, 2^64)), which for nanosecond latencies is
+ * everything from 1ns to centuries.
+*/
+class log_histogram
+{
+public:
+    static unsigned const buckets=65;
+
+    struct snapshot
+    {
+        unsigned long long count[buckets];
+        unsigned long long total;
+        long long sum;
+
+        /**
+         * Upper bound of the bucket holding the q-th quantile.
+        */
+        unsigned long long quantile(double q) const
+        {
+            if(!total)
+                return 0;
+            unsigned long long const rank=static_cast<unsigned long long>(q*(total-1))+1;
+            unsigned long long seen=0;
+            for(unsigned b=0;b<buckets;++b)
+            {
+                seen+=count[b];
+                if(seen>=rank)
+                    return upper_bound(b);
+            }
+            return upper_bound(buckets-1);
+        }
+    };
+
+    static unsigned bucket_of(unsigned long long v)
+    {
+        return v?64-__builtin_clzll(v):0;
+    }
+
+    static unsigned long long upper_bound(unsigned b)
+    {
+        return b==0?0:(b>=64?~0ULL:(1ULL<<b)-1);
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<unsigned long long> count[buckets];
+        std::atomic<long long> sum;
+        char padding[cache_line_size-sizeof(std::atomic<long long>)];
+        slot():
+            sum(0)
+        {
+            for(unsigned b=0;b<buckets;++b)
+                count[b].store(0,std::memory_order_relaxed);
+        }
+    };
+    slot* const slots;
+
+public:
+    log_histogram():
+        slots(allocate_cache_aligned<slot>(stat_shards))
+    {}
+
+    ~log_histogram()
+    {
+        free_cache_aligned(slots,stat_shards);
+    }
+
+    log_histogram(log_histogram const&)=delete;
+    log_histogram& operator=(log_histogram const&)=delete;
+
+    void record(unsigned long long v)
+    {
+        shard_owner const& owner=this_thread_shard();
+        slot& s=slots[owner.index];
+        shard_add(s.count[bucket_of(v)],1ULL,owner);
+        shard_add(s.sum,static_cast<long long>(v),owner);
+    }
+
+    snapshot read() const
+    {
+        snapshot r;
+        r.total=0;
+        r.sum=0;
+        for(unsigned b=0;b<buckets;++b)
+            r.count[b]=0;
+        for(unsigned i=0;i<stat_shards;++i)
+        {
+            for(unsigned b=0;b<buckets;++b)
+                r.count[b]+=slots[i].count[b].load(std::memory_order_relaxed);
+            r.sum+=slots[i].sum.load(std::memory_order_relaxed);
+        }
+        for(unsigned b=0;b<buckets;++b)
+            r.total+=r.count[b];
+        return r;
+    }
+};
+
+/**
+ * Stats registry
+ * ==============
+ *
+ * Named counters, gauges and histograms. Registration takes a mutex, but it
+ * happens once: callers keep the returned reference and update it directly,
+ * so the hot path never sees the registry at all. Metrics live as long as
+ * the registry.
+ *
+ * start_reporting() launches a snapshot thread that wakes every interval,
+ * reads every metric and computes per-second rates for the counters.
+*/
+class stats_registry
+{
+public:
+    enum metric_kind { counter_kind, gauge_kind, histogram_kind };
+
+    struct sample
+    {
+        std::string name;
+        std::string help;
+        metric_kind kind;
+        long long value;
+        double rate;
+        log_histogram::snapshot histogram;
+    };
+
+private:
+    struct entry
+    {
+        metric_kind kind;
+        std::string help;
+        std::unique_ptr<sharded_counter> counter;
+        std::unique_ptr<sharded_gauge> level;
+        std::unique_ptr<log_histogram> histogram;
+        long long last_value;
+    };
+
+    mutable std::mutex m;
+    std::map<std::string,entry> metrics;
+
+    std::thread reporter;
+    std::mutex reporter_mutex;
+    std::condition_variable reporter_cond;
+    bool stop_reporting;
+
+    entry& find_or_add(std::string const& name,metric_kind kind,std::string const& help)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        std::map<std::string,entry>::iterator it=metrics.find(name);
+        if(it!=metrics.end())
+        {
+            if(it->second.kind!=kind)
+                throw std::logic_error("metric registered with a different kind: "+name);
+            return it->second;
+        }
+        entry& e=metrics[name];
+        e.kind=kind;
+        e.help=help;
+        e.last_value=0;
+        if(kind==counter_kind)
+            e.counter.reset(new sharded_counter);
+        else if(kind==gauge_kind)
+            e.level.reset(new sharded_gauge);
+        else
+            e.histogram.reset(new log_histogram);
+        return e;
+    }
+
+public:
+    stats_registry():
+        stop_reporting(false)
+    {}
+
+    ~stats_registry()
+    {
+        stop();
+    }
+
+    stats_registry(stats_registry const&)=delete;
+    stats_registry& operator=(stats_registry const&)=delete;
+
+    /**
+     * Registering the same name twice returns the same metric. A name may
+     * carry a label set, e.g. queue_depth{queue="requests"}.
+    */
+    sharded_counter& counter(std::string const& name,std::string const& help="")
+    {
+        return *find_or_add(name,counter_kind,help).counter;
+    }
+
+    sharded_gauge& gauge(std::string const& name,std::string const& help="")
+    {
+        return *find_or_add(name,gauge_kind,help).level;
+    }
+
+    log_histogram& histogram(std::string const& name,std::string const& help="")
+    {
+        return *find_or_add(name,histogram_kind,help).histogram;
+    }
+
+    /**
+     * Reads every metric. rate is per second since the previous snapshot
+     * taken with the given elapsed time (0 leaves rates at 0).
+    */
+    std::vector<sample> snapshot(double elapsed_seconds=0)
+    {
+        std::vector<sample> out;
+        std::lock_guard<std::mutex> lk(m);
+        for(std::map<std::string,entry>::iterator it=metrics.begin();it!=metrics.end();++it)
+        {
+            entry& e=it->second;
+            sample s;
+            s.name=it->first;
+            s.help=e.help;
+            s.kind=e.kind;
+            s.rate=0;
+            if(e.kind==counter_kind)
+                s.value=e.counter->value();
+            else if(e.kind==gauge_kind)
+                s.value=e.level->value();
+            else
+            {
+                s.histogram=e.histogram->read();
+                s.value=static_cast<long long>(s.histogram.total);
+            }
+            if(elapsed_seconds>0)
+            {
+                s.rate=(s.value-e.last_value)/elapsed_seconds;
+                e.last_value=s.value;
+            }
+            out.push_back(s);
+        }
+        return out;
+    }
+
+    void start_reporting(std::chrono::milliseconds interval,
+                         std::function<void(std::vector<sample> const&)> report)
+    {
+        stop();
+        stop_reporting=false;
+        snapshot(1);
+        reporter=std::thread([this,interval,report]{
+            typedef std::chrono::steady_clock clock;
+            clock::time_point last=clock::now();
+            std::unique_lock<std::mutex> lk(reporter_mutex);
+            while(!reporter_cond.wait_for(lk,interval,[this]{return stop_reporting;}))
+            {
+                clock::time_point const now=clock::now();
+                double const elapsed=std::chrono::duration<double>(now-last).count();
+                last=now;
+                lk.unlock();
+                report(snapshot(elapsed));
+                lk.lock();
+            }
+        });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(reporter_mutex);
+            stop_reporting=true;
+        }
+        reporter_cond.notify_all();
+        if(reporter.joinable())
+            reporter.join();
+    }
+};
+
+#endif
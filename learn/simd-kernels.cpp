@@ -0,0 +1,147 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include "simd-kernels.hpp"
+
+/**
+ * GB/s per kernel and instruction set
+ * ===================================
+ *
+ * For each element type, an array of 512MB (or the size in MB given as the
+ * first argument) is scanned by every kernel at every instruction set level
+ * the CPU supports: once on one thread, once chunked over a pool with one
+ * thread per core. The one-thread figure shows how much the wider vectors
+ * buy; the all-cores figure should end up at memory bandwidth whatever the
+ * level, since one core can't saturate it but all of them can.
+ *
+ * Before that, every level's results, and the chunked versions', are
+ * checked against the scalar ones on odd-sized arrays, so the tails get
+ * exercised.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+simd_isa const all_isas[]={simd_isa::scalar,simd_isa::sse2,simd_isa::avx2,simd_isa::avx512};
+
+template<typename T>
+void fill(std::vector<T>& v)
+{
+    std::uint64_t x=0x9e3779b97f4a7c15ULL;
+    for(std::size_t i=0;i<v.size();++i)
+    {
+        x^=x<<13;
+        x^=x>>7;
+        x^=x<<17;
+        v[i]=static_cast<T>(static_cast<std::int64_t>(x%2000001)-1000000);
+    }
+}
+
+template<typename T>
+bool check_type(thread_pool& pool)
+{
+    bool ok=true;
+    std::size_t const sizes[]={0,1,7,63,1000,100003};
+    for(std::size_t s=0;s<sizeof(sizes)/sizeof(sizes[0]);++s)
+    {
+        std::vector<T> v(sizes[s]);
+        fill(v);
+        std::size_t const n=v.size();
+        T const needle=n?v[n*2/3]:T();
+        T const sum=simd_sum(v.data(),n,simd_isa::scalar);
+        T const low=simd_min(v.data(),n,simd_isa::scalar);
+        T const high=simd_max(v.data(),n,simd_isa::scalar);
+        std::size_t const below=simd_count_if(v.data(),n,simd_less_than<T>(0),simd_isa::scalar);
+        std::size_t const at=simd_find(v.data(),n,needle,simd_isa::scalar);
+        for(std::size_t k=1;k<sizeof(all_isas)/sizeof(all_isas[0]);++k)
+        {
+            simd_isa const isa=all_isas[k];
+            if(!simd_supported(isa))
+                continue;
+            // Float sums add in another order; integers must match exactly
+            double const tolerance=std::is_integral<T>::value?0:1e-6*n*1000000;
+            ok=ok && std::fabs(static_cast<double>(simd_sum(v.data(),n,isa))-static_cast<double>(sum))<=tolerance;
+            ok=ok && simd_min(v.data(),n,isa)==low && simd_max(v.data(),n,isa)==high;
+            ok=ok && simd_count_if(v.data(),n,simd_less_than<T>(0),isa)==below;
+            ok=ok && simd_find(v.data(),n,needle,isa)==at;
+        }
+        ok=ok && parallel_simd_min(pool,v.data(),n)==low && parallel_simd_max(pool,v.data(),n)==high;
+        ok=ok && parallel_simd_count_if(pool,v.data(),n,simd_less_than<T>(0))==below;
+        ok=ok && parallel_simd_find(pool,v.data(),n,needle)==at;
+    }
+    return ok;
+}
+
+template<typename Function>
+double gigabytes_per_second(std::size_t bytes,Function f)
+{
+    double best=0;
+    for(int run=0;run<3;++run)
+    {
+        bench_clock::time_point const start=bench_clock::now();
+        f();
+        double const s=std::chrono::duration<double>(bench_clock::now()-start).count();
+        best=std::max(best,bytes/s/1e9);
+    }
+    return best;
+}
+
+template<typename T>
+void bench_type(char const* name,std::size_t bytes,thread_pool& pool)
+{
+    std::vector<T> v(bytes/sizeof(T));
+    fill(v);
+    T const* const p=v.data();
+    std::size_t const n=v.size();
+    std::size_t const size=n*sizeof(T);
+    // Keeps the results alive; never actually read
+    volatile double sink=0;
+
+    for(std::size_t k=0;k<sizeof(all_isas)/sizeof(all_isas[0]);++k)
+    {
+        simd_isa const isa=all_isas[k];
+        if(!simd_supported(isa))
+            continue;
+        double const rates[]={
+            gigabytes_per_second(size,[&]{ sink=simd_sum(p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=parallel_simd_sum(pool,p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=simd_min(p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=parallel_simd_min(pool,p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=simd_max(p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=parallel_simd_max(pool,p,n,isa); }),
+            gigabytes_per_second(size,[&]{ sink=simd_count_if(p,n,simd_less_than<T>(0),isa); }),
+            gigabytes_per_second(size,[&]{ sink=parallel_simd_count_if(pool,p,n,simd_less_than<T>(0),isa); }),
+            // Not in the array, so the whole array is scanned
+            gigabytes_per_second(size,[&]{ sink=simd_find(p,n,T(5000000),isa); }),
+            gigabytes_per_second(size,[&]{ sink=parallel_simd_find(pool,p,n,T(5000000),isa); })
+        };
+        std::cout << name << "\t" << simd_isa_name(isa);
+        for(std::size_t r=0;r<sizeof(rates)/sizeof(rates[0]);r+=2)
+            std::cout << "\t" << rates[r] << " / " << rates[r+1];
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc,char* argv[])
+{
+    std::size_t const megabytes=argc>1?std::strtoul(argv[1],nullptr,10):512;
+    unsigned const cores=std::thread::hardware_concurrency()?std::thread::hardware_concurrency():2;
+    thread_pool pool(cores);
+
+    std::cout << "best instruction set: " << simd_isa_name(simd_best_isa()) << std::endl;
+    bool const ok=check_type<std::int32_t>(pool) && check_type<std::int64_t>(pool) &&
+        check_type<float>(pool) && check_type<double>(pool);
+    std::cout << "all levels match scalar: " << (ok?"yes":"NO") << std::endl << std::endl;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "GB/s on 1 thread / on " << cores << " threads, " << megabytes << " MB arrays" << std::endl
+              << "type\tisa\tsum\t\tmin\t\tmax\t\tcount_if\tfind" << std::endl;
+    bench_type<std::int32_t>("int32",megabytes<<20,pool);
+    bench_type<std::int64_t>("int64",megabytes<<20,pool);
+    bench_type<float>("float",megabytes<<20,pool);
+    bench_type<double>("double",megabytes<<20,pool);
+    return 0;
+}
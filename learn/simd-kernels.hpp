@@ -0,0 +1,619 @@
+#ifndef SIMD_KERNELS_HPP
+#define SIMD_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "parallel-algorithms.hpp"
+
+/**
+ * Vectorized kernels over contiguous arrays
+ * =========================================
+ *
+ * sum, min, max, count_if and find over int32_t, int64_t, float and double
+ * arrays, each written once as a loop over GCC vector-extension types and
+ * compiled three times with different target attributes: 16-byte vectors
+ * for SSE2, 32-byte for AVX2 and 64-byte for AVX-512. Which one runs is
+ * picked at run time from CPUID (__builtin_cpu_supports), so the binary
+ * still runs on a CPU without AVX. The scalar versions are plain loops with
+ * the auto-vectorizer switched off, as the baseline.
+ *
+ * Each kernel keeps several independent vector accumulators so the loop is
+ * limited by loads, not by the latency of one chain of adds.
+ *
+ * Semantics:
+ *  - sum of integers wraps like the scalar loop does; sum of floats adds in
+ *    a different order than the scalar loop, so the last bits can differ.
+ *  - min/max of an empty array is the identity (max() for min, lowest()
+ *    for max). NaNs are not handled.
+ *  - count_if takes one of simd_equal_to, simd_less_than or
+ *    simd_greater_than, which work on both scalars and vectors. The vector
+ *    form writes its mask through a reference: a function returning a
+ *    vector has a different calling convention under each ISA, and GCC
+ *    warns about it even when the call is inlined.
+ *  - find returns the index of the first element equal to value, or n.
+ *
+ * parallel_simd_*() split the array into chunks on a thread_pool and run
+ * the kernel on each, which is what it takes to reach memory bandwidth
+ * rather than one core's load bandwidth.
+*/
+
+enum class simd_isa
+{
+    scalar,
+    sse2,
+    avx2,
+    avx512
+};
+
+inline char const* simd_isa_name(simd_isa isa)
+{
+    switch(isa)
+    {
+    case simd_isa::scalar:
+        return "scalar";
+    case simd_isa::sse2:
+        return "sse2";
+    case simd_isa::avx2:
+        return "avx2";
+    case simd_isa::avx512:
+        return "avx512";
+    }
+    return "?";
+}
+
+inline bool simd_supported(simd_isa isa)
+{
+    __builtin_cpu_init();
+    switch(isa)
+    {
+    case simd_isa::scalar:
+        return true;
+    case simd_isa::sse2:
+        return __builtin_cpu_supports("sse2");
+    case simd_isa::avx2:
+        return __builtin_cpu_supports("avx2");
+    case simd_isa::avx512:
+        return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+}
+
+inline simd_isa simd_best_isa()
+{
+    static simd_isa const best=
+        simd_supported(simd_isa::avx512)?simd_isa::avx512:
+        simd_supported(simd_isa::avx2)?simd_isa::avx2:
+        simd_supported(simd_isa::sse2)?simd_isa::sse2:simd_isa::scalar;
+    return best;
+}
+
+template<typename T>
+struct simd_equal_to
+{
+    T value;
+    explicit simd_equal_to(T value_):
+        value(value_)
+    {}
+    bool operator()(T x) const
+    {
+        return x==value;
+    }
+
+    template<typename V,typename Mask>
+    __attribute__((always_inline)) void operator()(V const& x,Mask& mask) const
+    {
+        mask=x==value;
+    }
+};
+
+template<typename T>
+struct simd_less_than
+{
+    T value;
+    explicit simd_less_than(T value_):
+        value(value_)
+    {}
+    bool operator()(T x) const
+    {
+        return x<value;
+    }
+
+    template<typename V,typename Mask>
+    __attribute__((always_inline)) void operator()(V const& x,Mask& mask) const
+    {
+        mask=x<value;
+    }
+};
+
+template<typename T>
+struct simd_greater_than
+{
+    T value;
+    explicit simd_greater_than(T value_):
+        value(value_)
+    {}
+    bool operator()(T x) const
+    {
+        return x>value;
+    }
+
+    template<typename V,typename Mask>
+    __attribute__((always_inline)) void operator()(V const& x,Mask& mask) const
+    {
+        mask=x>value;
+    }
+};
+
+namespace simd_detail
+{
+    template<typename T,std::size_t Bytes>
+    struct vector_of
+    {
+        static_assert(std::is_same<T,std::int32_t>::value || std::is_same<T,std::int64_t>::value ||
+                      std::is_same<T,float>::value || std::is_same<T,double>::value,
+                      "simd kernels take int32_t, int64_t, float or double");
+        typedef T type __attribute__((vector_size(Bytes)));
+        typedef std::uint64_t bits __attribute__((vector_size(Bytes)));
+        static std::size_t const lanes=Bytes/sizeof(T);
+    };
+
+    /**
+     * The bodies are always_inline so they get compiled with the target
+     * attribute of the per-ISA function they're inlined into.
+    */
+    template<typename V,typename T>
+    inline __attribute__((always_inline)) V const& load(V& v,T const* p)
+    {
+        __builtin_memcpy(&v,p,sizeof(V));
+        return v;
+    }
+
+    template<std::size_t Bytes,typename T>
+    inline __attribute__((always_inline)) T sum_body(T const* p,std::size_t n)
+    {
+        typedef typename vector_of<T,Bytes>::type V;
+        std::size_t const lanes=vector_of<T,Bytes>::lanes;
+        V a0={},a1={},a2={},a3={};
+        V x;
+        std::size_t i=0;
+        for(;i+4*lanes<=n;i+=4*lanes)
+        {
+            a0+=load(x,p+i);
+            a1+=load(x,p+i+lanes);
+            a2+=load(x,p+i+2*lanes);
+            a3+=load(x,p+i+3*lanes);
+        }
+        a0+=a1;
+        a2+=a3;
+        a0+=a2;
+        T sum=T();
+        for(std::size_t j=0;j<lanes;++j)
+            sum+=a0[j];
+        for(;i<n;++i)
+            sum+=p[i];
+        return sum;
+    }
+
+    template<std::size_t Bytes,typename T,typename Less>
+    inline __attribute__((always_inline)) T select_body(T const* p,std::size_t n,T identity,Less less)
+    {
+        typedef typename vector_of<T,Bytes>::type V;
+        std::size_t const lanes=vector_of<T,Bytes>::lanes;
+        V a0=V{}+identity;
+        V a1=a0;
+        std::size_t i=0;
+        V x0,x1;
+        for(;i+2*lanes<=n;i+=2*lanes)
+        {
+            load(x0,p+i);
+            load(x1,p+i+lanes);
+            less.keep(a0,x0);
+            less.keep(a1,x1);
+        }
+        less.keep(a0,a1);
+        T best=identity;
+        for(std::size_t j=0;j<lanes;++j)
+            less.keep(best,static_cast<T>(a0[j]));
+        for(;i<n;++i)
+            less.keep(best,p[i]);
+        return best;
+    }
+
+    struct less
+    {
+        template<typename V>
+        __attribute__((always_inline)) void keep(V& best,V const& x) const
+        {
+            best=x<best?x:best;
+        }
+    };
+
+    struct greater
+    {
+        template<typename V>
+        __attribute__((always_inline)) void keep(V& best,V const& x) const
+        {
+            best=x>best?x:best;
+        }
+    };
+
+    template<std::size_t Bytes,typename T,typename Predicate>
+    inline __attribute__((always_inline)) std::size_t count_body(T const* p,std::size_t n,Predicate pred)
+    {
+        typedef typename vector_of<T,Bytes>::type V;
+        typedef decltype(V{}==T()) mask;
+        std::size_t const lanes=vector_of<T,Bytes>::lanes;
+        // A true lane is -1, so subtracting masks counts. Flush the lane
+        // counters to size_t well before a 32-bit lane could overflow
+        std::size_t const block=std::size_t(1)<<30;
+        std::size_t count=0;
+        std::size_t i=0;
+        while(i+2*lanes<=n)
+        {
+            std::size_t const end=std::min(n,i+block);
+            mask c0={},c1={},m;
+            V x;
+            for(;i+2*lanes<=end;i+=2*lanes)
+            {
+                pred(load(x,p+i),m);
+                c0-=m;
+                pred(load(x,p+i+lanes),m);
+                c1-=m;
+            }
+            c0+=c1;
+            for(std::size_t j=0;j<lanes;++j)
+                count+=static_cast<std::size_t>(c0[j]);
+        }
+        for(;i<n;++i)
+            count+=pred(p[i])?1:0;
+        return count;
+    }
+
+    template<std::size_t Bytes,typename T>
+    inline __attribute__((always_inline)) std::size_t find_body(T const* p,std::size_t n,T value)
+    {
+        typedef typename vector_of<T,Bytes>::type V;
+        typedef typename vector_of<T,Bytes>::bits bits;
+        std::size_t const lanes=vector_of<T,Bytes>::lanes;
+        std::size_t const words=Bytes/sizeof(std::uint64_t);
+        // Testing "any lane set" is a horizontal operation and costs more
+        // than the compares, so OR the masks of a whole block together and
+        // test once per block
+        std::size_t const block=16*lanes;
+        V x;
+        std::size_t i=0;
+        for(;i+block<=n;i+=block)
+        {
+            bits hit={};
+            for(std::size_t j=0;j<block;j+=4*lanes)
+            {
+                hit|=(bits)(load(x,p+i+j)==value);
+                hit|=(bits)(load(x,p+i+j+lanes)==value);
+                hit|=(bits)(load(x,p+i+j+2*lanes)==value);
+                hit|=(bits)(load(x,p+i+j+3*lanes)==value);
+            }
+            std::uint64_t any=0;
+            for(std::size_t j=0;j<words;++j)
+                any|=hit[j];
+            if(any)
+                break;
+        }
+        for(;i<n;++i)
+        {
+            if(p[i]==value)
+                return i;
+        }
+        return n;
+    }
+
+    /**
+     * The scalar baseline; without the optimize attribute -O2 would
+     * vectorize some of these loops on its own.
+    */
+    struct scalar_kernels
+    {
+        template<typename T>
+        __attribute__((optimize("no-tree-vectorize")))
+        static T sum(T const* p,std::size_t n)
+        {
+            T sum=T();
+            for(std::size_t i=0;i<n;++i)
+                sum+=p[i];
+            return sum;
+        }
+
+        template<typename T,typename Less>
+        __attribute__((optimize("no-tree-vectorize")))
+        static T select(T const* p,std::size_t n,T identity,Less less)
+        {
+            T best=identity;
+            for(std::size_t i=0;i<n;++i)
+                less.keep(best,p[i]);
+            return best;
+        }
+
+        template<typename T,typename Predicate>
+        __attribute__((optimize("no-tree-vectorize")))
+        static std::size_t count(T const* p,std::size_t n,Predicate pred)
+        {
+            std::size_t count=0;
+            for(std::size_t i=0;i<n;++i)
+                count+=pred(p[i])?1:0;
+            return count;
+        }
+
+        template<typename T>
+        static std::size_t find(T const* p,std::size_t n,T value)
+        {
+            for(std::size_t i=0;i<n;++i)
+            {
+                if(p[i]==value)
+                    return i;
+            }
+            return n;
+        }
+    };
+
+    struct sse2_kernels
+    {
+        template<typename T>
+        __attribute__((target("sse2")))
+        static T sum(T const* p,std::size_t n)
+        {
+            return sum_body<16>(p,n);
+        }
+
+        template<typename T,typename Less>
+        __attribute__((target("sse2")))
+        static T select(T const* p,std::size_t n,T identity,Less less)
+        {
+            return select_body<16>(p,n,identity,less);
+        }
+
+        template<typename T,typename Predicate>
+        __attribute__((target("sse2")))
+        static std::size_t count(T const* p,std::size_t n,Predicate pred)
+        {
+            return count_body<16>(p,n,pred);
+        }
+
+        template<typename T>
+        __attribute__((target("sse2")))
+        static std::size_t find(T const* p,std::size_t n,T value)
+        {
+            return find_body<16>(p,n,value);
+        }
+    };
+
+    struct avx2_kernels
+    {
+        template<typename T>
+        __attribute__((target("avx2")))
+        static T sum(T const* p,std::size_t n)
+        {
+            return sum_body<32>(p,n);
+        }
+
+        template<typename T,typename Less>
+        __attribute__((target("avx2")))
+        static T select(T const* p,std::size_t n,T identity,Less less)
+        {
+            return select_body<32>(p,n,identity,less);
+        }
+
+        template<typename T,typename Predicate>
+        __attribute__((target("avx2")))
+        static std::size_t count(T const* p,std::size_t n,Predicate pred)
+        {
+            return count_body<32>(p,n,pred);
+        }
+
+        template<typename T>
+        __attribute__((target("avx2")))
+        static std::size_t find(T const* p,std::size_t n,T value)
+        {
+            return find_body<32>(p,n,value);
+        }
+    };
+
+    struct avx512_kernels
+    {
+        template<typename T>
+        __attribute__((target("avx512f")))
+        static T sum(T const* p,std::size_t n)
+        {
+            return sum_body<64>(p,n);
+        }
+
+        template<typename T,typename Less>
+        __attribute__((target("avx512f")))
+        static T select(T const* p,std::size_t n,T identity,Less less)
+        {
+            return select_body<64>(p,n,identity,less);
+        }
+
+        template<typename T,typename Predicate>
+        __attribute__((target("avx512f")))
+        static std::size_t count(T const* p,std::size_t n,Predicate pred)
+        {
+            return count_body<64>(p,n,pred);
+        }
+
+        template<typename T>
+        __attribute__((target("avx512f")))
+        static std::size_t find(T const* p,std::size_t n,T value)
+        {
+            return find_body<64>(p,n,value);
+        }
+    };
+}
+
+template<typename T>
+T simd_sum(T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    switch(isa)
+    {
+    case simd_isa::avx512:
+        return simd_detail::avx512_kernels::sum(p,n);
+    case simd_isa::avx2:
+        return simd_detail::avx2_kernels::sum(p,n);
+    case simd_isa::sse2:
+        return simd_detail::sse2_kernels::sum(p,n);
+    default:
+        return simd_detail::scalar_kernels::sum(p,n);
+    }
+}
+
+namespace simd_detail
+{
+    template<typename T,typename Less>
+    T select(T const* p,std::size_t n,T identity,Less less,simd_isa isa)
+    {
+        switch(isa)
+        {
+        case simd_isa::avx512:
+            return avx512_kernels::select(p,n,identity,less);
+        case simd_isa::avx2:
+            return avx2_kernels::select(p,n,identity,less);
+        case simd_isa::sse2:
+            return sse2_kernels::select(p,n,identity,less);
+        default:
+            return scalar_kernels::select(p,n,identity,less);
+        }
+    }
+}
+
+template<typename T>
+T simd_min(T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    return simd_detail::select(p,n,std::numeric_limits<T>::max(),simd_detail::less(),isa);
+}
+
+template<typename T>
+T simd_max(T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    return simd_detail::select(p,n,std::numeric_limits<T>::lowest(),simd_detail::greater(),isa);
+}
+
+template<typename T,typename Predicate>
+std::size_t simd_count_if(T const* p,std::size_t n,Predicate pred,simd_isa isa=simd_best_isa())
+{
+    switch(isa)
+    {
+    case simd_isa::avx512:
+        return simd_detail::avx512_kernels::count(p,n,pred);
+    case simd_isa::avx2:
+        return simd_detail::avx2_kernels::count(p,n,pred);
+    case simd_isa::sse2:
+        return simd_detail::sse2_kernels::count(p,n,pred);
+    default:
+        return simd_detail::scalar_kernels::count(p,n,pred);
+    }
+}
+
+template<typename T>
+std::size_t simd_find(T const* p,std::size_t n,T value,simd_isa isa=simd_best_isa())
+{
+    switch(isa)
+    {
+    case simd_isa::avx512:
+        return simd_detail::avx512_kernels::find(p,n,value);
+    case simd_isa::avx2:
+        return simd_detail::avx2_kernels::find(p,n,value);
+    case simd_isa::sse2:
+        return simd_detail::sse2_kernels::find(p,n,value);
+    default:
+        return simd_detail::scalar_kernels::find(p,n,value);
+    }
+}
+
+namespace simd_detail
+{
+    // Big enough that a chunk streams for a while, small enough to balance
+    static std::size_t const grain=1<<16;
+
+    template<typename R,typename Kernel,typename Combine>
+    R chunked(thread_pool& pool,std::size_t n,R identity,Kernel kernel,Combine combine)
+    {
+        if(!n)
+            return identity;
+        std::size_t const chunk=parallel_detail::chunk_size(n,grain,pool);
+        std::size_t const chunks=parallel_detail::chunk_count(n,chunk);
+        std::vector<R> partial(chunks);
+        parallel_detail::for_each_chunk(pool,chunks,[&](std::size_t c){
+            std::size_t const b=c*chunk;
+            partial[c]=kernel(b,std::min(n,b+chunk)-b);
+        });
+        R result=identity;
+        for(std::size_t c=0;c<chunks;++c)
+            result=combine(result,partial[c]);
+        return result;
+    }
+}
+
+template<typename T>
+T parallel_simd_sum(thread_pool& pool,T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    return simd_detail::chunked(pool,n,T(),
+        [=](std::size_t b,std::size_t len){ return simd_sum(p+b,len,isa); },
+        [](T a,T b){ return a+b; });
+}
+
+template<typename T>
+T parallel_simd_min(thread_pool& pool,T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    return simd_detail::chunked(pool,n,std::numeric_limits<T>::max(),
+        [=](std::size_t b,std::size_t len){ return simd_min(p+b,len,isa); },
+        [](T a,T b){ return b<a?b:a; });
+}
+
+template<typename T>
+T parallel_simd_max(thread_pool& pool,T const* p,std::size_t n,simd_isa isa=simd_best_isa())
+{
+    return simd_detail::chunked(pool,n,std::numeric_limits<T>::lowest(),
+        [=](std::size_t b,std::size_t len){ return simd_max(p+b,len,isa); },
+        [](T a,T b){ return b>a?b:a; });
+}
+
+template<typename T,typename Predicate>
+std::size_t parallel_simd_count_if(thread_pool& pool,T const* p,std::size_t n,Predicate pred,
+                                   simd_isa isa=simd_best_isa())
+{
+    return simd_detail::chunked(pool,n,std::size_t(0),
+        [=](std::size_t b,std::size_t len){ return simd_count_if(p+b,len,pred,isa); },
+        [](std::size_t a,std::size_t b){ return a+b; });
+}
+
+/**
+ * Chunks past one that has already found value are skipped, as in
+ * parallel_find_if.
+*/
+template<typename T>
+std::size_t parallel_simd_find(thread_pool& pool,T const* p,std::size_t n,T value,
+                               simd_isa isa=simd_best_isa())
+{
+    if(!n)
+        return n;
+    std::size_t const chunk=parallel_detail::chunk_size(n,simd_detail::grain,pool);
+    std::atomic<std::size_t> found(n);
+    parallel_detail::for_each_chunk(pool,parallel_detail::chunk_count(n,chunk),[&](std::size_t c){
+        std::size_t const b=c*chunk;
+        if(b>=found.load(std::memory_order_relaxed))
+            return;
+        std::size_t const len=std::min(n,b+chunk)-b;
+        std::size_t const i=simd_find(p+b,len,value,isa);
+        if(i==len)
+            return;
+        std::size_t seen=found.load(std::memory_order_relaxed);
+        while(b+i<seen && !found.compare_exchange_weak(seen,b+i,std::memory_order_relaxed))
+            ;
+    });
+    return found.load(std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "slab-allocator.hpp"
+
+/**
+ * Producer/consumer allocation traffic
+ * ====================================
+ *
+ * Producers allocate what a chapter-6 queue push allocates - a node and a
+ * shared_ptr<message> (control block + message in one block via
+ * allocate_shared) - and hand them over a ring to a consumer, which frees
+ * both. Every free is a cross-thread free.
+ *
+ * Each allocator runs in its own forked process so one run's heap doesn't
+ * show up in the other's RSS.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct message
+{
+    unsigned long id;
+    char body[40];
+};
+
+struct malloc_node
+{
+    std::shared_ptr<message> data;
+    malloc_node* next;
+};
+
+struct slab_node: slab_allocated
+{
+    std::shared_ptr<message> data;
+    slab_node* next;
+};
+
+/**
+ * Single-producer single-consumer ring of pointers; it doesn't allocate, so
+ * only the allocator under test does.
+*/
+template<typename T>
+class spsc_ring
+{
+    static std::size_t const size=4096;
+    T* slots[size];
+    std::atomic<std::size_t> head;
+    char padding[64];
+    std::atomic<std::size_t> tail;
+public:
+    spsc_ring():
+        head(0),tail(0)
+    {}
+
+    void push(T* p)
+    {
+        std::size_t const t=tail.load(std::memory_order_relaxed);
+        while(t-head.load(std::memory_order_acquire)==size)
+            std::this_thread::yield();
+        slots[t%size]=p;
+        tail.store(t+1,std::memory_order_release);
+    }
+
+    T* pop()
+    {
+        std::size_t const h=head.load(std::memory_order_relaxed);
+        while(tail.load(std::memory_order_acquire)==h)
+            std::this_thread::yield();
+        T* const p=slots[h%size];
+        head.store(h+1,std::memory_order_release);
+        return p;
+    }
+};
+
+long resident_kb()
+{
+    std::ifstream statm("/proc/self/statm");
+    long pages=0,resident=0;
+    statm >> pages >> resident;
+    return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+long peak_resident_kb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status,line))
+    {
+        if(line.compare(0,6,"VmHWM:")==0)
+        {
+            std::istringstream in(line.substr(6));
+            long kb=0;
+            in >> kb;
+            return kb;
+        }
+    }
+    return 0;
+}
+
+struct use_malloc
+{
+    typedef malloc_node node;
+    static std::shared_ptr<message> make()
+    {
+        return std::make_shared<message>();
+    }
+};
+
+struct use_slab
+{
+    typedef slab_node node;
+    static std::shared_ptr<message> make()
+    {
+        return std::allocate_shared<message>(slab_allocator<message>());
+    }
+};
+
+template<typename Use>
+void run(char const* name,unsigned pairs,unsigned long items)
+{
+    typedef typename Use::node node;
+    std::vector<std::unique_ptr<spsc_ring<node> > > rings;
+    for(unsigned i=0;i<pairs;++i)
+        rings.push_back(std::unique_ptr<spsc_ring<node> >(new spsc_ring<node>));
+
+    bench_clock::time_point const start=bench_clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned i=0;i<pairs;++i)
+    {
+        spsc_ring<node>& ring=*rings[i];
+        threads.push_back(std::thread([&ring,items]{
+            for(unsigned long n=0;n<items;++n)
+            {
+                node* const p=new node;
+                p->data=Use::make();
+                p->data->id=n;
+                p->next=nullptr;
+                ring.push(p);
+            }
+        }));
+        threads.push_back(std::thread([&ring,items]{
+            for(unsigned long n=0;n<items;++n)
+                delete ring.pop();
+        }));
+    }
+    for(std::size_t i=0;i<threads.size();++i)
+        threads[i].join();
+    double const ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count();
+    // Two allocations and two frees per item
+    std::cout << name << "\t" << ns/(pairs*items*2) << " ns per alloc+free\t"
+              << "RSS " << resident_kb() << " KB, peak " << peak_resident_kb() << " KB" << std::endl;
+}
+
+template<typename Use>
+void in_child(char const* name,unsigned pairs,unsigned long items)
+{
+    std::cout.flush();
+    pid_t const pid=fork();
+    if(pid==0)
+    {
+        run<Use>(name,pairs,items);
+        std::cout.flush();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid,&status,0);
+}
+
+int main()
+{
+    unsigned const cores=std::thread::hardware_concurrency()?std::thread::hardware_concurrency():2;
+    unsigned long const items=2000000;
+    unsigned const pair_counts[]={1,cores>2?cores:2,4*cores};
+    for(unsigned i=0;i<3;++i)
+    {
+        std::cout << pair_counts[i] << " producer/consumer pairs, " << items << " items each" << std::endl;
+        in_child<use_malloc>("glibc",pair_counts[i],items);
+        in_child<use_slab>("slab",pair_counts[i],items);
+    }
+    return 0;
+}
@@ -0,0 +1,404 @@
+#ifndef SLAB_ALLOCATOR_HPP
+#define SLAB_ALLOCATOR_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include "reclamation.hpp"
+
+/**
+ * Thread-caching slab allocator
+ * =============================
+ *
+ * The containers in chapter-6.cpp allocate the same few sizes over and over:
+ * a node, a shared_ptr control block, a T. Often the thread that frees an
+ * object isn't the one that allocated it - a queue's producer allocates, its
+ * consumer frees. glibc malloc puts that block back into the consumer's
+ * arena, so memory drifts from producers to consumers and RSS creeps up,
+ * and the arena locks get contended.
+ *
+ * Layout:
+ *  - Requests up to 512 bytes are rounded up to one of 16 size classes.
+ *    Larger ones go straight to ::operator new.
+ *  - Memory comes in 64KB slabs aligned to 64KB, each holding blocks of one
+ *    class. The slab header sits at the start, so the slab of any block is
+ *    its address with the low 16 bits cleared - no lookup table.
+ *  - Every thread has its own heap: per class a current slab to carve from
+ *    and a list of partially free slabs. Allocating and freeing your own
+ *    blocks touches nothing shared.
+ *  - Freeing a block another thread's heap owns pushes it onto that heap's
+ *    remote stack with one CAS. The owner takes the whole stack with one
+ *    exchange when it runs out of local blocks and frees them as its own.
+ *    So blocks always go home and a producer reuses what its consumer freed.
+ *  - A slab whose blocks are all free again goes to a small global pool,
+ *    and from there back to the OS once the pool is full.
+ *  - Heaps are records in a record_registry (reclamation.hpp): when a thread
+ *    exits, its heap and slabs are adopted by the next thread that starts
+ *    instead of leaking. Remote frees into a heap with no thread wait there
+ *    until then.
+ *
+ * Frees are sized, as with std::allocator::deallocate: the caller passes the
+ * size it allocated, which tells small blocks from large ones.
+*/
+
+static std::size_t const slab_bytes=64*1024;
+static std::size_t const slab_max_small=512;
+static unsigned const slab_class_count=16;
+
+inline unsigned slab_class_of(std::size_t n)
+{
+    // 16-byte steps up to 128, then 32 up to 256, then 64 up to 512
+    if(n<=128)
+        return n?static_cast<unsigned>((n-1)>>4):0;
+    if(n<=256)
+        return 8+static_cast<unsigned>((n-129)>>5);
+    return 12+static_cast<unsigned>((n-257)>>6);
+}
+
+inline std::size_t slab_block_size(unsigned size_class)
+{
+    static std::size_t const sizes[slab_class_count]=
+        {16,32,48,64,80,96,112,128,160,192,224,256,320,384,448,512};
+    return sizes[size_class];
+}
+
+class slab_heap;
+
+struct slab_header
+{
+    slab_heap* owner;
+    void* free;
+    char* bump;
+    char* end;
+    unsigned used;
+    unsigned size_class;
+    slab_header* prev;
+    slab_header* next;
+    bool listed;
+};
+
+static std::size_t const slab_header_bytes=64;
+static_assert(sizeof(slab_header)<=slab_header_bytes,"slab header must fit in front of the blocks");
+
+inline slab_header* slab_of(void* p)
+{
+    return reinterpret_cast<slab_header*>(reinterpret_cast<std::uintptr_t>(p)&~(slab_bytes-1));
+}
+
+/**
+ * Empty slabs waiting to be reused. Taken once per 64KB, so a mutex is fine.
+*/
+class slab_pool
+{
+    static std::size_t const max_cached=64;
+    std::mutex m;
+    std::vector<void*> slabs;
+public:
+    static slab_pool& instance()
+    {
+        static slab_pool* const pool=new slab_pool;
+        return *pool;
+    }
+
+    void* take()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if(!slabs.empty())
+            {
+                void* const s=slabs.back();
+                slabs.pop_back();
+                return s;
+            }
+        }
+        void* s=nullptr;
+        if(posix_memalign(&s,slab_bytes,slab_bytes))
+            throw std::bad_alloc();
+        return s;
+    }
+
+    void give(void* s)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if(slabs.size()<max_cached)
+            {
+                slabs.push_back(s);
+                return;
+            }
+        }
+        std::free(s);
+    }
+};
+
+class slab_heap
+{
+    // Blocks on free lists and the remote stack link through their first word
+    static void*& link(void* block)
+    {
+        return *static_cast<void**>(block);
+    }
+
+    slab_header* current[slab_class_count];
+    slab_header* partial[slab_class_count];
+    std::atomic<void*> remote;
+
+    void list_partial(slab_header* s)
+    {
+        s->prev=nullptr;
+        s->next=partial[s->size_class];
+        if(s->next)
+            s->next->prev=s;
+        partial[s->size_class]=s;
+        s->listed=true;
+    }
+
+    void unlist_partial(slab_header* s)
+    {
+        if(s->prev)
+            s->prev->next=s->next;
+        else
+            partial[s->size_class]=s->next;
+        if(s->next)
+            s->next->prev=s->prev;
+        s->listed=false;
+    }
+
+    slab_header* new_slab(unsigned size_class)
+    {
+        slab_header* const s=static_cast<slab_header*>(slab_pool::instance().take());
+        s->owner=this;
+        s->free=nullptr;
+        s->bump=reinterpret_cast<char*>(s)+slab_header_bytes;
+        std::size_t const block=slab_block_size(size_class);
+        s->end=s->bump+(slab_bytes-slab_header_bytes)/block*block;
+        s->used=0;
+        s->size_class=size_class;
+        s->prev=s->next=nullptr;
+        s->listed=false;
+        return s;
+    }
+
+    static void* carve(slab_header* s)
+    {
+        if(void* const p=s->free)
+        {
+            s->free=link(p);
+            ++s->used;
+            return p;
+        }
+        if(s->bump<s->end)
+        {
+            void* const p=s->bump;
+            s->bump+=slab_block_size(s->size_class);
+            ++s->used;
+            return p;
+        }
+        return nullptr;
+    }
+
+    void drain_remote()
+    {
+        void* p=remote.exchange(nullptr,std::memory_order_acquire);
+        while(p)
+        {
+            void* const next=link(p);
+            free_local(p);
+            p=next;
+        }
+    }
+
+    void* allocate_slow(unsigned size_class)
+    {
+        drain_remote();
+        if(current[size_class])
+        {
+            if(void* const p=carve(current[size_class]))
+                return p;
+        }
+        // The full current slab isn't listed anywhere; the first block freed
+        // back into it lists it as partial
+        if(slab_header* const s=partial[size_class])
+        {
+            unlist_partial(s);
+            current[size_class]=s;
+        }
+        else
+        {
+            current[size_class]=new_slab(size_class);
+        }
+        return carve(current[size_class]);
+    }
+
+    void free_local(void* p)
+    {
+        slab_header* const s=slab_of(p);
+        link(p)=s->free;
+        s->free=p;
+        --s->used;
+        if(s==current[s->size_class])
+            return;
+        if(!s->used)
+        {
+            if(s->listed)
+                unlist_partial(s);
+            slab_pool::instance().give(s);
+        }
+        else if(!s->listed)
+        {
+            list_partial(s);
+        }
+    }
+
+public:
+    std::atomic<bool> in_use;
+    slab_heap* next;
+
+    slab_heap():
+        remote(nullptr),in_use(false),next(nullptr)
+    {
+        for(unsigned c=0;c<slab_class_count;++c)
+            current[c]=partial[c]=nullptr;
+    }
+
+    static void thread_exit(slab_heap& h)
+    {
+        h.drain_remote();
+    }
+
+    static slab_heap& local()
+    {
+        return record_registry<slab_heap>::local();
+    }
+
+    void* allocate(unsigned size_class)
+    {
+        if(slab_header* const s=current[size_class])
+        {
+            if(void* const p=carve(s))
+                return p;
+        }
+        return allocate_slow(size_class);
+    }
+
+    void deallocate(void* p)
+    {
+        slab_heap* const owner=slab_of(p)->owner;
+        if(owner==this)
+        {
+            free_local(p);
+            return;
+        }
+        void* head=owner->remote.load(std::memory_order_relaxed);
+        do
+        {
+            link(p)=head;
+        }
+        while(!owner->remote.compare_exchange_weak(head,p,std::memory_order_release,
+                                                   std::memory_order_relaxed));
+    }
+};
+
+inline void* slab_alloc(std::size_t n)
+{
+    if(n>slab_max_small)
+        return ::operator new(n);
+    return slab_heap::local().allocate(slab_class_of(n));
+}
+
+inline void slab_free(void* p,std::size_t n)
+{
+    if(!p)
+        return;
+    if(n>slab_max_small)
+    {
+        ::operator delete(p);
+        return;
+    }
+    slab_heap::local().deallocate(p);
+}
+
+/**
+ * STL allocator on top of slab_alloc/slab_free, for containers and
+ * std::allocate_shared:
+ *
+ *   std::allocate_shared<T>(slab_allocator<T>(),args...)
+ *
+ * puts the control block and the T in one block from the slabs. Blocks are
+ * 16-byte aligned; over-aligned types fall back to ::operator new.
+*/
+template<typename T>
+class slab_allocator
+{
+    static bool small(std::size_t n)
+    {
+        return alignof(T)<=16 && n<=slab_max_small/sizeof(T);
+    }
+public:
+    typedef T value_type;
+
+    slab_allocator()
+    {}
+
+    template<typename U>
+    slab_allocator(slab_allocator<U> const&)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        if(!small(n))
+            return static_cast<T*>(::operator new(n*sizeof(T)));
+        return static_cast<T*>(slab_heap::local().allocate(slab_class_of(n*sizeof(T))));
+    }
+
+    void deallocate(T* p,std::size_t n)
+    {
+        if(!small(n))
+            ::operator delete(p);
+        else
+            slab_heap::local().deallocate(p);
+    }
+};
+
+template<typename T,typename U>
+bool operator==(slab_allocator<T> const&,slab_allocator<U> const&)
+{
+    return true;
+}
+
+template<typename T,typename U>
+bool operator!=(slab_allocator<T> const&,slab_allocator<U> const&)
+{
+    return false;
+}
+
+/**
+ * Base for node types that are created with plain new/delete, like the
+ * std::unique_ptr<node> lists in chapter-6.cpp:
+ *
+ *   struct node: slab_allocated
+ *   {
+ *       ...
+ *   };
+ *
+ * Relies on sized delete, so don't delete a derived node through a base
+ * pointer without a virtual destructor.
+*/
+struct slab_allocated
+{
+    static void* operator new(std::size_t n)
+    {
+        return slab_alloc(n);
+    }
+
+    static void operator delete(void* p,std::size_t n)
+    {
+        slab_free(p,n);
+    }
+};
+
+#endif
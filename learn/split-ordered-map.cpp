@@ -0,0 +1,246 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include <malloc.h>
+#include "split-ordered-map.hpp"
+#include "striped-hash-map.hpp"
+
+/**
+ * Growing without stalls
+ * ======================
+ *
+ * 1. Checks: random operations against std::unordered_map, from 2
+ *    buckets up; four threads inserting overlapping keys, where each key
+ *    must be inserted exactly once; four threads erasing them again while
+ *    others look up keys that are never erased.
+ *
+ * 2. A table that starts with 1K entries and 1K buckets grows to 50M
+ *    entries (fewer if that won't fit in half the RAM), for
+ *    split_ordered_map and for striped_hash_map, which doubles by
+ *    migrating a few buckets per write. One thread inserts and times every
+ *    insert; another looks up keys already inserted and times those.
+ *    Percentiles come from a log-linear histogram (1/64 of a power of two
+ *    per bucket). Each map is also run "steady", created with enough
+ *    buckets that it never grows, as the baseline for the growing run.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+class latency_histogram
+{
+    static unsigned const sub_buckets=64;
+    std::vector<std::uint64_t> counts;
+    std::uint64_t total;
+    std::uint64_t largest;
+
+    static unsigned bucket_of(std::uint64_t ns)
+    {
+        if(ns<sub_buckets)
+            return static_cast<unsigned>(ns);
+        unsigned const top=63-__builtin_clzll(ns);
+        return (top-5)*sub_buckets+static_cast<unsigned>((ns>>(top-6))&(sub_buckets-1));
+    }
+
+    static std::uint64_t lower_bound_of(unsigned b)
+    {
+        if(b<sub_buckets)
+            return b;
+        unsigned const top=b/sub_buckets+5;
+        return (std::uint64_t(sub_buckets)+b%sub_buckets)<<(top-6);
+    }
+
+public:
+    latency_histogram():
+        counts(64*sub_buckets,0),total(0),largest(0)
+    {}
+
+    void record(std::uint64_t ns)
+    {
+        ++counts[bucket_of(ns)];
+        ++total;
+        if(ns>largest)
+            largest=ns;
+    }
+
+    double percentile_us(double p) const
+    {
+        std::uint64_t const rank=static_cast<std::uint64_t>(p*total);
+        std::uint64_t seen=0;
+        for(unsigned b=0;b<counts.size();++b)
+        {
+            seen+=counts[b];
+            if(seen>rank)
+                return lower_bound_of(b)/1000.0;
+        }
+        return largest/1000.0;
+    }
+
+    double max_us() const
+    {
+        return largest/1000.0;
+    }
+
+    std::uint64_t count() const
+    {
+        return total;
+    }
+};
+
+bool check_against_unordered_map()
+{
+    split_ordered_map<std::uint64_t,std::uint64_t> map(2);
+    std::unordered_map<std::uint64_t,std::uint64_t> model;
+    std::uint64_t x=1;
+    for(unsigned i=0;i<300000;++i)
+    {
+        x=x*6364136223846793005ULL+1442695040888963407ULL;
+        std::uint64_t const key=(x>>33)%5000;
+        std::uint64_t value=0;
+        switch((x>>20)%3)
+        {
+        case 0:
+            if(map.insert(key,i)!=(model.count(key)==0))
+                return false;
+            model.insert(std::make_pair(key,std::uint64_t(i)));
+            break;
+        case 1:
+            if(map.erase(key)!=(model.erase(key)==1))
+                return false;
+            break;
+        default:
+            if(map.find(key,value)!=(model.count(key)==1) || (model.count(key) && value!=model[key]))
+                return false;
+        }
+    }
+    return map.size()==model.size() && map.buckets()>2;
+}
+
+bool check_concurrent(unsigned threads,std::uint64_t keys)
+{
+    split_ordered_map<std::uint64_t,std::uint64_t> map(2);
+    std::atomic<std::uint64_t> inserted(0),erased(0);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    // Everyone inserts every key; exactly one insert of each must win
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t wins=0;
+            for(std::uint64_t i=0;i<keys;++i)
+                wins+=map.insert((i*(t+1))%keys,((i*(t+1))%keys)*7);
+            inserted+=wins;
+        }));
+    }
+    for(unsigned t=0;t<threads;++t)
+        workers[t].join();
+    workers.clear();
+    // Erase the even keys while readers check the odd ones stay
+    for(unsigned t=0;t<threads;++t)
+    {
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t n=0;
+            for(std::uint64_t k=2*t;k<keys;k+=2*threads)
+                n+=map.erase(k);
+            erased+=n;
+        }));
+        workers.push_back(std::thread([&,t]{
+            std::uint64_t v;
+            for(std::uint64_t k=2*t+1;k<keys;k+=2)
+            {
+                if(!map.find(k,v) || v!=k*7)
+                    ok=false;
+            }
+        }));
+    }
+    for(std::size_t i=0;i<workers.size();++i)
+        workers[i].join();
+    return ok && inserted==keys && erased==(keys+1)/2 && map.size()==keys/2;
+}
+
+struct striped_map:
+    striped_hash_map<std::uint64_t,std::uint64_t>
+{
+    explicit striped_map(std::size_t buckets):
+        striped_hash_map<std::uint64_t,std::uint64_t>(buckets)
+    {}
+
+    bool insert(std::uint64_t key,std::uint64_t value)
+    {
+        return insert_or_assign(key,value);
+    }
+};
+
+template<typename Map>
+void growth(char const* name,std::uint64_t entries,std::size_t buckets)
+{
+    Map map(buckets);
+    std::uint64_t const start_entries=1024;
+    for(std::uint64_t k=0;k<start_entries;++k)
+        map.insert(k,k);
+    std::atomic<std::uint64_t> published(start_entries);
+    std::atomic<bool> done(false);
+    latency_histogram inserts,lookups;
+    bench_clock::time_point const start=bench_clock::now();
+    std::thread reader([&]{
+        std::uint64_t x=1,v;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            x=x*6364136223846793005ULL+1442695040888963407ULL;
+            std::uint64_t const key=(x>>33)%published.load(std::memory_order_relaxed);
+            bench_clock::time_point const t0=bench_clock::now();
+            map.find(key,v);
+            lookups.record(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now()-t0).count());
+        }
+    });
+    for(std::uint64_t k=start_entries;k<entries;++k)
+    {
+        bench_clock::time_point const t0=bench_clock::now();
+        map.insert(k,k);
+        inserts.record(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now()-t0).count());
+        if(!(k&1023))
+            published.store(k,std::memory_order_relaxed);
+    }
+    done=true;
+    reader.join();
+    double const seconds=std::chrono::duration<double>(bench_clock::now()-start).count();
+    std::cout << name << "\tinsert\t" << inserts.percentile_us(0.5) << "\t" << inserts.percentile_us(0.99) << "\t"
+              << inserts.percentile_us(0.999) << "\t" << inserts.percentile_us(0.99999) << "\t" << inserts.max_us()
+              << "\t" << seconds << std::endl
+              << "\tlookup\t" << lookups.percentile_us(0.5) << "\t" << lookups.percentile_us(0.99) << "\t"
+              << lookups.percentile_us(0.999) << "\t" << lookups.percentile_us(0.99999) << "\t" << lookups.max_us()
+              << "\t(" << lookups.count() << " lookups)" << std::endl;
+    struct mallinfo2 const m=mallinfo2();
+    std::cout << "\t" << (m.uordblks+m.hblkhd)/entries << " bytes per entry" << std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+    std::cout << "random operations match std::unordered_map: " << (check_against_unordered_map()?"yes":"NO") << std::endl
+              << "concurrent inserts win once, erases don't disturb others: "
+              << (check_concurrent(4,200000)?"yes":"NO") << std::endl;
+
+    // About 100 bytes an entry for the bigger of the two, counting malloc's
+    // overhead and the old bucket array while the striped map doubles
+    std::size_t const memory=static_cast<std::size_t>(sysconf(_SC_PHYS_PAGES))*sysconf(_SC_PAGESIZE);
+    std::uint64_t entries=argc>1?std::strtoull(argv[1],nullptr,10):50000000;
+    if(entries>memory/2/100)
+    {
+        std::cout << entries << " entries need " << entries*100/(1<<20) << " MB; using " << memory/2/100 << std::endl;
+        entries=memory/2/100;
+    }
+
+    std::cout << std::endl << std::thread::hardware_concurrency() << " CPUs, growing from 1K to " << entries
+              << " entries, latencies in us" << std::endl
+              << "map\t\tp50\tp99\tp99.9\tp99.999\tmax\tseconds" << std::endl;
+    growth<split_ordered_map<std::uint64_t,std::uint64_t> >("split-ordered",entries,1024);
+    growth<split_ordered_map<std::uint64_t,std::uint64_t> >("  steady",entries,entries);
+    growth<striped_map>("striped",entries,1024);
+    growth<striped_map>("  steady",entries,entries);
+    return 0;
+}
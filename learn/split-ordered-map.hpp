@@ -0,0 +1,369 @@
+#ifndef SPLIT_ORDERED_MAP_HPP
+#define SPLIT_ORDERED_MAP_HPP
+
+#include <atomic>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include "hash-mix.hpp"
+#include "reclamation.hpp"
+#include "sharded-counter.hpp"
+
+/**
+ * Split-ordered hash map
+ * ======================
+ *
+ * striped_hash_map grows by having its writers relink the old table's
+ * nodes into a new one a few buckets per operation, and until a bucket has
+ * moved its lookups still go to the old table. Shalev and Shavit's
+ * split-ordered list grows without moving anything, so there is no second
+ * table to keep track of.
+ *
+ * All entries live in one lock-free sorted linked list (Michael's
+ * algorithm: a node is erased by first marking the low bit of its next
+ * pointer, then unlinking it). The sort key is the hash with its bits
+ * reversed. Sorted that way, the entries of bucket b, for any power-of-two
+ * bucket count, are one contiguous run of the list, and when the count
+ * doubles bucket b's run splits in place into the runs of b and
+ * b + old count. A bucket is then just a pointer to a dummy node at the
+ * start of its run, and doubling the table means doubling a number: the
+ * new buckets' dummies are spliced into the list lazily, by the first
+ * operation that needs each one, starting from its parent bucket (b with
+ * its top bit cleared).
+ *
+ *  - Regular nodes get the reversed hash with the lowest bit set, dummies
+ *    the reversed bucket number, so a bucket's dummy sorts before all its
+ *    entries.
+ *  - The bucket array is a table of segments allocated on first use, like
+ *    concurrent_vector's, so it grows without being copied either.
+ *  - find() only reads: it walks past marked nodes without unlinking
+ *    them. Writers unlink the marked nodes they meet and retire them
+ *    through epoch_reclaimer, so a reader can always finish its walk.
+ *  - The bucket count doubles when the entries exceed max_load per
+ *    bucket. That is checked on one insert in 64, picked by hash, since
+ *    summing the sharded entry count costs a pass over its slots.
+ *
+ * Values are fixed once inserted; insert() of a key that is already there
+ * returns false and leaves it.
+*/
+
+namespace split_ordered_detail
+{
+    inline std::uint64_t reverse_bits(std::uint64_t x)
+    {
+        x=((x>>1)&0x5555555555555555ULL)|((x&0x5555555555555555ULL)<<1);
+        x=((x>>2)&0x3333333333333333ULL)|((x&0x3333333333333333ULL)<<2);
+        x=((x>>4)&0x0f0f0f0f0f0f0f0fULL)|((x&0x0f0f0f0f0f0f0f0fULL)<<4);
+        return __builtin_bswap64(x);
+    }
+}
+
+template<typename Key,typename Value,typename Hash=std::hash<Key> >
+class split_ordered_map
+{
+    struct list_node
+    {
+        std::uint64_t const order;
+        // Low bit set: this node is erased
+        std::atomic<std::uintptr_t> next;
+
+        explicit list_node(std::uint64_t order_):
+            order(order_),next(0)
+        {}
+    };
+
+    struct entry_node:
+        list_node
+    {
+        Key const key;
+        Value const value;
+
+        entry_node(std::uint64_t order_,Key const& key_,Value const& value_):
+            list_node(order_),key(key_),value(value_)
+        {}
+    };
+
+    typedef std::atomic<list_node*> bucket;
+
+    static unsigned const first_segment_bits=10;
+    static std::size_t const first_segment_size=std::size_t(1)<<first_segment_bits;
+    static unsigned const max_segments=64-first_segment_bits;
+
+    std::atomic<bucket*> segments[max_segments];
+    std::atomic<std::size_t> bucket_count;
+    float const max_load;
+    sharded_counter entries;
+    Hash hasher;
+
+    static list_node* pointer_of(std::uintptr_t link)
+    {
+        return reinterpret_cast<list_node*>(link&~std::uintptr_t(1));
+    }
+
+    static bool is_marked(std::uintptr_t link)
+    {
+        return link&1;
+    }
+
+    static bool is_entry(list_node const* n)
+    {
+        return n->order&1;
+    }
+
+    static std::uint64_t entry_order(std::uint64_t hash)
+    {
+        return split_ordered_detail::reverse_bits(hash|(std::uint64_t(1)<<63));
+    }
+
+    static std::uint64_t dummy_order(std::size_t b)
+    {
+        return split_ordered_detail::reverse_bits(b);
+    }
+
+    static unsigned segment_of(std::size_t b)
+    {
+        return b<first_segment_size?0:64-__builtin_clzll(b>>first_segment_bits);
+    }
+
+    static std::size_t segment_base(unsigned s)
+    {
+        return s==0?0:first_segment_size<<(s-1);
+    }
+
+    static std::size_t segment_size(unsigned s)
+    {
+        return s==0?first_segment_size:first_segment_size<<(s-1);
+    }
+
+    bucket& bucket_slot(std::size_t b)
+    {
+        unsigned const s=segment_of(b);
+        bucket* seg=segments[s].load(std::memory_order_acquire);
+        if(!seg)
+        {
+            bucket* const fresh=allocate_zeroed<bucket>(segment_size(s));
+            if(segments[s].compare_exchange_strong(seg,fresh,std::memory_order_acq_rel))
+                seg=fresh;
+            else
+                std::free(fresh);
+        }
+        return seg[b-segment_base(s)];
+    }
+
+    struct position
+    {
+        std::atomic<std::uintptr_t>* prev;
+        list_node* curr;
+    };
+
+    /**
+     * Finds where order (and key, for an entry) is or would go in the list
+     * after start, unlinking marked nodes on the way. True if found.
+    */
+    bool search(list_node* start,std::uint64_t order,Key const* key,position& pos)
+    {
+    retry:
+        pos.prev=&start->next;
+        pos.curr=pointer_of(pos.prev->load(std::memory_order_acquire));
+        for(;;)
+        {
+            if(!pos.curr)
+                return false;
+            std::uintptr_t const next=pos.curr->next.load(std::memory_order_acquire);
+            if(is_marked(next))
+            {
+                std::uintptr_t expected=reinterpret_cast<std::uintptr_t>(pos.curr);
+                if(!pos.prev->compare_exchange_strong(expected,next&~std::uintptr_t(1),
+                                                     std::memory_order_acq_rel))
+                    goto retry;
+                retire(pos.curr);
+                pos.curr=pointer_of(next);
+                continue;
+            }
+            if(pos.curr->order>order)
+                return false;
+            if(pos.curr->order==order && (!key || static_cast<entry_node*>(pos.curr)->key==*key))
+                return true;
+            pos.prev=&pos.curr->next;
+            pos.curr=pointer_of(next);
+        }
+    }
+
+    static void retire(list_node* n)
+    {
+        // Only entries are ever erased; dummies stay until the map goes
+        epoch_reclaimer::retire(static_cast<entry_node*>(n));
+    }
+
+    list_node* bucket_head(std::size_t b)
+    {
+        bucket& slot=bucket_slot(b);
+        list_node* const head=slot.load(std::memory_order_acquire);
+        if(head)
+            return head;
+        return initialise_bucket(b,slot);
+    }
+
+    list_node* initialise_bucket(std::size_t b,bucket& slot)
+    {
+        std::size_t const parent=b&~(std::size_t(1)<<(63-__builtin_clzll(b)));
+        list_node* const start=bucket_head(parent);
+        std::uint64_t const order=dummy_order(b);
+        list_node* dummy=new list_node(order);
+        position pos;
+        for(;;)
+        {
+            if(search(start,order,nullptr,pos))
+            {
+                // Another thread spliced it in first
+                delete dummy;
+                dummy=pos.curr;
+                break;
+            }
+            dummy->next.store(reinterpret_cast<std::uintptr_t>(pos.curr),std::memory_order_relaxed);
+            std::uintptr_t expected=reinterpret_cast<std::uintptr_t>(pos.curr);
+            if(pos.prev->compare_exchange_weak(expected,reinterpret_cast<std::uintptr_t>(dummy),
+                                               std::memory_order_acq_rel))
+                break;
+        }
+        slot.store(dummy,std::memory_order_release);
+        return dummy;
+    }
+
+    void maybe_grow(std::uint64_t hash)
+    {
+        if(hash&63)
+            return;
+        std::size_t n=bucket_count.load(std::memory_order_relaxed);
+        if(entries.value()>max_load*n && n<(std::size_t(1)<<62))
+            bucket_count.compare_exchange_strong(n,2*n,std::memory_order_relaxed);
+    }
+
+public:
+    explicit split_ordered_map(std::size_t initial_buckets=1024,float max_load_=2.0f):
+        bucket_count(2),max_load(max_load_)
+    {
+        for(unsigned s=0;s<max_segments;++s)
+            segments[s].store(nullptr,std::memory_order_relaxed);
+        std::size_t n=2;
+        while(n<initial_buckets)
+            n<<=1;
+        bucket_count.store(n,std::memory_order_relaxed);
+        bucket_slot(0).store(new list_node(dummy_order(0)),std::memory_order_relaxed);
+    }
+
+    ~split_ordered_map()
+    {
+        list_node* n=bucket_slot(0).load(std::memory_order_relaxed);
+        while(n)
+        {
+            list_node* const next=pointer_of(n->next.load(std::memory_order_relaxed));
+            if(is_entry(n))
+                delete static_cast<entry_node*>(n);
+            else
+                delete n;
+            n=next;
+        }
+        for(unsigned s=0;s<max_segments;++s)
+            std::free(segments[s].load(std::memory_order_relaxed));
+    }
+
+    split_ordered_map(split_ordered_map const&)=delete;
+    split_ordered_map& operator=(split_ordered_map const&)=delete;
+
+    bool find(Key const& key,Value& value)
+    {
+        std::uint64_t const hash=mix_hash(hasher(key));
+        std::uint64_t const order=entry_order(hash);
+        epoch_reclaimer::guard g;
+        list_node* n=bucket_head(hash&(bucket_count.load(std::memory_order_acquire)-1));
+        while(n && n->order<=order)
+        {
+            std::uintptr_t const next=n->next.load(std::memory_order_acquire);
+            if(n->order==order && !is_marked(next) && static_cast<entry_node*>(n)->key==key)
+            {
+                value=static_cast<entry_node*>(n)->value;
+                return true;
+            }
+            n=pointer_of(next);
+        }
+        return false;
+    }
+
+    bool contains(Key const& key)
+    {
+        Value ignored;
+        return find(key,ignored);
+    }
+
+    /**
+     * False, leaving the map as it was, if key is already there.
+    */
+    bool insert(Key const& key,Value const& value)
+    {
+        std::uint64_t const hash=mix_hash(hasher(key));
+        std::uint64_t const order=entry_order(hash);
+        epoch_reclaimer::guard g;
+        list_node* const start=bucket_head(hash&(bucket_count.load(std::memory_order_acquire)-1));
+        entry_node* fresh=nullptr;
+        position pos;
+        for(;;)
+        {
+            if(search(start,order,&key,pos))
+            {
+                delete fresh;
+                return false;
+            }
+            if(!fresh)
+                fresh=new entry_node(order,key,value);
+            fresh->next.store(reinterpret_cast<std::uintptr_t>(pos.curr),std::memory_order_relaxed);
+            std::uintptr_t expected=reinterpret_cast<std::uintptr_t>(pos.curr);
+            if(pos.prev->compare_exchange_weak(expected,reinterpret_cast<std::uintptr_t>(fresh),
+                                               std::memory_order_acq_rel))
+                break;
+        }
+        entries.add(1);
+        maybe_grow(hash);
+        return true;
+    }
+
+    bool erase(Key const& key)
+    {
+        std::uint64_t const hash=mix_hash(hasher(key));
+        std::uint64_t const order=entry_order(hash);
+        epoch_reclaimer::guard g;
+        list_node* const start=bucket_head(hash&(bucket_count.load(std::memory_order_acquire)-1));
+        position pos;
+        for(;;)
+        {
+            if(!search(start,order,&key,pos))
+                return false;
+            std::uintptr_t next=pos.curr->next.load(std::memory_order_acquire);
+            if(is_marked(next))
+                continue;
+            // Marking is the erase; unlinking is tidying up
+            if(!pos.curr->next.compare_exchange_weak(next,next|1,std::memory_order_acq_rel))
+                continue;
+            std::uintptr_t expected=reinterpret_cast<std::uintptr_t>(pos.curr);
+            if(pos.prev->compare_exchange_strong(expected,next,std::memory_order_acq_rel))
+                retire(pos.curr);
+            else
+                search(start,order,&key,pos);
+            entries.add(-1);
+            return true;
+        }
+    }
+
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(entries.value());
+    }
+
+    std::size_t buckets() const
+    {
+        return bucket_count.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef STOP_TOKEN_HPP
+#define STOP_TOKEN_HPP
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+#include <climits>
+#include "futex.hpp"
+
+/**
+ * Stop tokens
+ * ===========
+ *
+ * stop_source / stop_token in the spirit of C++20's: a stop_source asks
+ * for a stop, any number of stop_tokens copied from it see the request.
+ *
+ * Checking stop_requested() between pieces of work is the easy part. The
+ * point of this one is that a thread *blocked* in one of our futex-based
+ * waits wakes up too. Before it sleeps, a blocking wait registers the
+ * futex word it's about to sleep on with the token's shared state
+ * (futex_wait_unless_stopped() does that). request_stop() sets the flag,
+ * then for every registered word bumps its value and wakes it:
+ *
+ *  - if the request took the state's mutex before the waiter registered,
+ *    the waiter sees the flag right after registering and doesn't sleep;
+ *  - otherwise the word was bumped after the waiter read the value it
+ *    expects, so its futex_wait() either fails at once or is woken.
+ *
+ * Bumping the word of an eventcount or a condition variable is just a
+ * spurious wake-up for any other thread waiting on it, which both already
+ * have to handle. It does mean that stopping one of many threads asleep
+ * on the same word wakes them all, so a group of threads that is shut
+ * down together should share one stop_source: one request, one wake.
+ *
+ * Registrations are nodes on the waiters' stacks in an intrusive list, so
+ * registering costs a mutex round trip and no allocation, and only on the
+ * path that is about to sleep anyway.
+*/
+
+class stop_state
+{
+public:
+    struct registration
+    {
+        std::atomic<std::uint32_t>* word;
+        registration* prev;
+        registration* next;
+    };
+
+private:
+    std::atomic<bool> stopped;
+    std::mutex m;
+    registration head;
+
+public:
+    stop_state():
+        stopped(false)
+    {
+        head.word=nullptr;
+        head.prev=&head;
+        head.next=&head;
+    }
+
+    stop_state(stop_state const&)=delete;
+    stop_state& operator=(stop_state const&)=delete;
+
+    bool stop_requested() const
+    {
+        return stopped.load(std::memory_order_seq_cst);
+    }
+
+    bool request_stop()
+    {
+        if(stopped.exchange(true,std::memory_order_seq_cst))
+            return false;
+        std::lock_guard<std::mutex> lk(m);
+        std::atomic<std::uint32_t>* last=nullptr;
+        for(registration* r=head.next;r!=&head;r=r->next)
+        {
+            // Threads of a group stopped together tend to wait on the same
+            // word, one after another on the list; one bump covers them all
+            if(r->word==last)
+                continue;
+            last=r->word;
+            last->fetch_add(1,std::memory_order_seq_cst);
+            futex_wake(*last,INT_MAX);
+        }
+        return true;
+    }
+
+    void add(registration& r)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        r.prev=&head;
+        r.next=head.next;
+        head.next->prev=&r;
+        head.next=&r;
+    }
+
+    void remove(registration& r)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        r.prev->next=r.next;
+        r.next->prev=r.prev;
+    }
+};
+
+class stop_token
+{
+    friend class stop_source;
+    std::shared_ptr<stop_state> state;
+
+    explicit stop_token(std::shared_ptr<stop_state> const& state_):
+        state(state_)
+    {}
+
+public:
+    /**
+     * A token that can never be stopped.
+    */
+    stop_token()
+    {}
+
+    bool stop_possible() const
+    {
+        return static_cast<bool>(state);
+    }
+
+    bool stop_requested() const
+    {
+        return state && state->stop_requested();
+    }
+
+    stop_state* get_state() const
+    {
+        return state.get();
+    }
+};
+
+class stop_source
+{
+    std::shared_ptr<stop_state> state;
+public:
+    stop_source():
+        state(std::make_shared<stop_state>())
+    {}
+
+    stop_token get_token() const
+    {
+        return stop_token(state);
+    }
+
+    bool stop_requested() const
+    {
+        return state->stop_requested();
+    }
+
+    /**
+     * Returns false if a stop had already been requested.
+    */
+    bool request_stop()
+    {
+        return state->request_stop();
+    }
+};
+
+/**
+ * futex_wait(word, expected, timeout), except that it doesn't sleep, or
+ * stops sleeping, once a stop is requested on token. expected must have
+ * been read before the call. Returns false if a stop was requested.
+*/
+inline bool futex_wait_unless_stopped(std::atomic<std::uint32_t>& word,std::uint32_t expected,
+                                      stop_token const& token,timespec const* timeout=nullptr)
+{
+    stop_state* const state=token.get_state();
+    if(!state)
+    {
+        futex_wait(word,expected,timeout);
+        return true;
+    }
+    stop_state::registration r;
+    r.word=&word;
+    state->add(r);
+    if(!state->stop_requested())
+        futex_wait(word,expected,timeout);
+    state->remove(r);
+    return !state->stop_requested();
+}
+
+#endif
@@ -0,0 +1,418 @@
+#ifndef STRIPED_HASH_MAP_HPP
+#define STRIPED_HASH_MAP_HPP
+
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include "cache-line.hpp"
+#include "hash-mix.hpp"
+
+/**
+ * Striped hash map
+ * ================
+ *
+ * The usual lock-based concurrent hash table: an array of buckets, each a
+ * singly linked chain of nodes, and a fixed set of mutexes ("stripes")
+ * with bucket b guarded by stripe b % stripes. Every operation locks one
+ * stripe and walks one chain, so operations on different stripes run in
+ * parallel; a lookup costs a lock and a pointer chase per node.
+ *
+ * The stripe count is a power of two and the bucket count a multiple of
+ * it, so doubling the buckets splits bucket b into b and b + old count,
+ * both still under the same stripe.
+ *
+ * Each stripe counts the entries in its buckets. When an insert takes one
+ * stripe over max_load entries per bucket the table doubles, incrementally:
+ *
+ *  - The inserter allocates a table twice the size next to the old one
+ *    and publishes both, taking no stripe lock. The old table is now
+ *    draining.
+ *  - Every insert or erase then first moves the next migrate_batch old
+ *    buckets of its own stripe into the new table, under the lock it holds
+ *    anyway. Each stripe moves its old buckets in order, so its count of
+ *    moved buckets says which table any of its keys is in: lookups consult
+ *    the old bucket until it has moved and the new one after.
+ *  - Whoever moves the last old bucket takes every stripe lock once,
+ *    without touching any bucket, to retire the old table; no operation can
+ *    still be reading it after that.
+ *
+ * So no operation does more than a few buckets' worth of rehashing, rather
+ * than one of them relinking every node while the others wait. Lookups
+ * never migrate; a stripe that only gets lookups keeps its old buckets,
+ * and the old table, until a write comes along.
+ *
+ * Stripes are padded to a cache line each, so the stripes of neighbouring
+ * buckets don't false-share.
+*/
+
+template<typename Key,typename Value,typename Hash=std::hash<Key> >
+class striped_hash_map
+{
+    struct node
+    {
+        node* next;
+        std::size_t hash;
+        Key key;
+        Value value;
+
+        node(std::size_t hash_,Key const& key_,Value const& value_):
+            next(nullptr),hash(hash_),key(key_),value(value_)
+        {}
+    };
+
+    struct stripe
+    {
+        std::mutex m;
+        std::size_t count;
+        // Old buckets of this stripe already moved, while a table drains
+        std::size_t migrated;
+
+        stripe():
+            count(0),migrated(0)
+        {}
+    };
+
+    struct table
+    {
+        std::size_t const mask;
+        node** const heads;
+
+        explicit table(std::size_t size):
+            mask(size-1),heads(allocate_zeroed<node*>(size))
+        {}
+
+        ~table()
+        {
+            std::free(heads);
+        }
+
+        std::size_t size() const
+        {
+            return mask+1;
+        }
+    };
+
+    // What an operation sees under its stripe lock: the table to use and
+    // the one still draining into it, if any
+    struct tables
+    {
+        table* current;
+        table* old;
+    };
+
+    static unsigned const migrate_batch=2;
+
+    unsigned const stripe_count;
+    unsigned const stripe_bits;
+    float const max_load;
+    cache_padded<stripe>* const stripes;
+    std::atomic<table*> current;
+    std::atomic<table*> draining;
+    std::atomic<bool> resizing;
+    std::atomic<unsigned> stripes_migrated;
+    Hash hasher;
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t c=1;
+        while(c<n)
+            c<<=1;
+        return c;
+    }
+
+    static void delete_chain(node* n)
+    {
+        while(n)
+        {
+            node* const next=n->next;
+            delete n;
+            n=next;
+        }
+    }
+
+    std::size_t hash_of(Key const& key) const
+    {
+        return static_cast<std::size_t>(mix_hash(hasher(key)));
+    }
+
+    unsigned stripe_of(std::size_t hash) const
+    {
+        return static_cast<unsigned>(hash&(stripe_count-1));
+    }
+
+    // Called with a stripe locked. A resize publishes draining before
+    // current, so seeing the new table means seeing the old one too, and
+    // the old one can't be retired while the caller holds its lock.
+    tables tables_locked() const
+    {
+        tables t;
+        t.current=current.load(std::memory_order_acquire);
+        t.old=draining.load(std::memory_order_acquire);
+        if(t.old==t.current)
+            t.old=nullptr;
+        return t;
+    }
+
+    node** head_of(tables const& t,stripe const& s,std::size_t hash) const
+    {
+        if(t.old)
+        {
+            std::size_t const old_bucket=hash&t.old->mask;
+            if((old_bucket>>stripe_bits)>=s.migrated)
+                return &t.old->heads[old_bucket];
+        }
+        return &t.current->heads[hash&t.current->mask];
+    }
+
+    node** link_to(node** link,Key const& key,std::size_t hash)
+    {
+        while(*link && !((*link)->hash==hash && (*link)->key==key))
+            link=&(*link)->next;
+        return link;
+    }
+
+    static node* find_node(node* n,Key const& key,std::size_t hash)
+    {
+        while(n && !(n->hash==hash && n->key==key))
+            n=n->next;
+        return n;
+    }
+
+    bool over_loaded(stripe const& s,table const& t) const
+    {
+        return s.count>max_load*(t.size()>>stripe_bits);
+    }
+
+    /**
+     * Called with stripe index locked: moves its next few old buckets to
+     * the new table. True if that moved the last old bucket of all, and the
+     * caller should retire the old table once it has dropped its lock.
+    */
+    bool migrate_some(stripe& s,unsigned index,tables const& t)
+    {
+        if(!t.old)
+            return false;
+        std::size_t const per_stripe=t.old->size()>>stripe_bits;
+        if(s.migrated==per_stripe)
+            return false;
+        for(unsigned i=0;i<migrate_batch && s.migrated<per_stripe;++i,++s.migrated)
+        {
+            std::size_t const old_bucket=index+(s.migrated<<stripe_bits);
+            // The old bucket's two halves in the new table are still empty:
+            // until now its keys went to it
+            node* n=t.old->heads[old_bucket];
+            t.old->heads[old_bucket]=nullptr;
+            while(n)
+            {
+                node* const next=n->next;
+                node*& head=t.current->heads[n->hash&t.current->mask];
+                n->next=head;
+                head=n;
+                n=next;
+            }
+        }
+        return s.migrated==per_stripe &&
+            stripes_migrated.fetch_add(1,std::memory_order_acq_rel)+1==stripe_count;
+    }
+
+    void start_resize(table* seen)
+    {
+        if(resizing.exchange(true,std::memory_order_acquire))
+            return;
+        // Someone else may have grown it since the caller looked
+        if(current.load(std::memory_order_acquire)!=seen)
+        {
+            resizing.store(false,std::memory_order_release);
+            return;
+        }
+        table* const bigger=new table(2*seen->size());
+        draining.store(seen,std::memory_order_release);
+        current.store(bigger,std::memory_order_release);
+    }
+
+    void finish_resize()
+    {
+        // Every old bucket has moved; this just waits out anyone who might
+        // still hold a pointer to the old table
+        for(unsigned i=0;i<stripe_count;++i)
+            stripes[i]->m.lock();
+        table* const old=draining.load(std::memory_order_relaxed);
+        draining.store(nullptr,std::memory_order_release);
+        for(unsigned i=0;i<stripe_count;++i)
+            stripes[i]->migrated=0;
+        stripes_migrated.store(0,std::memory_order_relaxed);
+        for(unsigned i=stripe_count;i--;)
+            stripes[i]->m.unlock();
+        delete old;
+        resizing.store(false,std::memory_order_release);
+    }
+
+    template<typename F>
+    bool upsert_hashed(Key const& key,std::size_t hash,F& fn)
+    {
+        unsigned const index=stripe_of(hash);
+        stripe& s=*stripes[index];
+        bool inserted=false;
+        bool last_migrated=false;
+        table* grow_from=nullptr;
+        {
+            std::lock_guard<std::mutex> lk(s.m);
+            tables const t=tables_locked();
+            last_migrated=migrate_some(s,index,t);
+            node** const link=link_to(head_of(t,s,hash),key,hash);
+            if(*link)
+                fn((*link)->value);
+            else
+            {
+                Value value=Value();
+                fn(value);
+                *link=new node(hash,key,value);
+                ++s.count;
+                inserted=true;
+                // One resize at a time: while a table drains, the new one
+                // takes the load
+                if(!t.old && over_loaded(s,*t.current))
+                    grow_from=t.current;
+            }
+        }
+        if(last_migrated)
+            finish_resize();
+        if(grow_from)
+            start_resize(grow_from);
+        return inserted;
+    }
+
+    struct assign
+    {
+        Value const& value;
+
+        void operator()(Value& v) const
+        {
+            v=value;
+        }
+    };
+
+public:
+    explicit striped_hash_map(std::size_t bucket_count=1024,float max_load_=1.0f,unsigned stripes_=256):
+        stripe_count(static_cast<unsigned>(round_up(stripes_))),
+        stripe_bits(static_cast<unsigned>(__builtin_ctz(stripe_count))),
+        max_load(max_load_),
+        stripes(allocate_cache_aligned<cache_padded<stripe> >(stripe_count)),
+        current(new table(round_up(bucket_count<stripe_count?stripe_count:bucket_count))),
+        draining(nullptr),resizing(false),stripes_migrated(0)
+    {}
+
+    ~striped_hash_map()
+    {
+        table* const t=current.load(std::memory_order_relaxed);
+        table* const old=draining.load(std::memory_order_relaxed);
+        for(std::size_t b=0;b<t->size();++b)
+            delete_chain(t->heads[b]);
+        if(old && old!=t)
+        {
+            for(unsigned i=0;i<stripe_count;++i)
+                for(std::size_t k=stripes[i]->migrated;k<(old->size()>>stripe_bits);++k)
+                    delete_chain(old->heads[i+(k<<stripe_bits)]);
+            delete old;
+        }
+        delete t;
+        free_cache_aligned(stripes,stripe_count);
+    }
+
+    striped_hash_map(striped_hash_map const&)=delete;
+    striped_hash_map& operator=(striped_hash_map const&)=delete;
+
+    bool find(Key const& key,Value& value) const
+    {
+        std::size_t const hash=hash_of(key);
+        stripe& s=*stripes[stripe_of(hash)];
+        std::lock_guard<std::mutex> lk(s.m);
+        node const* const n=find_node(*head_of(tables_locked(),s,hash),key,hash);
+        if(!n)
+            return false;
+        value=n->value;
+        return true;
+    }
+
+    bool contains(Key const& key) const
+    {
+        std::size_t const hash=hash_of(key);
+        stripe& s=*stripes[stripe_of(hash)];
+        std::lock_guard<std::mutex> lk(s.m);
+        return find_node(*head_of(tables_locked(),s,hash),key,hash)!=nullptr;
+    }
+
+    /**
+     * True if key was new.
+    */
+    bool insert_or_assign(Key const& key,Value const& value)
+    {
+        assign a={value};
+        return upsert_hashed(key,hash_of(key),a);
+    }
+
+    /**
+     * Calls fn(Value&) on key's value, or on a value-initialised one that
+     * is then inserted, under the stripe's lock. True if key was new.
+    */
+    template<typename F>
+    bool upsert(Key const& key,F fn)
+    {
+        return upsert_hashed(key,hash_of(key),fn);
+    }
+
+    bool erase(Key const& key)
+    {
+        std::size_t const hash=hash_of(key);
+        unsigned const index=stripe_of(hash);
+        stripe& s=*stripes[index];
+        node* n;
+        bool last_migrated;
+        {
+            std::lock_guard<std::mutex> lk(s.m);
+            tables const t=tables_locked();
+            last_migrated=migrate_some(s,index,t);
+            node** const link=link_to(head_of(t,s,hash),key,hash);
+            n=*link;
+            if(n)
+            {
+                *link=n->next;
+                --s.count;
+            }
+        }
+        if(last_migrated)
+            finish_resize();
+        delete n;
+        return n!=nullptr;
+    }
+
+    /**
+     * Sums the stripes' counts one lock at a time, so it's exact only
+     * when nothing is changing the map.
+    */
+    std::size_t size() const
+    {
+        std::size_t n=0;
+        for(unsigned i=0;i<stripe_count;++i)
+        {
+            std::lock_guard<std::mutex> lk(stripes[i]->m);
+            n+=stripes[i]->count;
+        }
+        return n;
+    }
+
+    /**
+     * The current table's buckets; while it is still filling from the old
+     * one, some of the entries are in that.
+    */
+    std::size_t bucket_count() const
+    {
+        std::lock_guard<std::mutex> lk(stripes[0]->m);
+        return current.load(std::memory_order_acquire)->size();
+    }
+};
+
+#endif
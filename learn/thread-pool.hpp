@@ -0,0 +1,275 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include "work-stealing-deque.hpp"
+#include "eventcount.hpp"
+#include "cache-line.hpp"
+
+/**
+ * Work-stealing thread pool
+ * =========================
+ *
+ * The chapter 9 design: every worker has its own deque of tasks, plus there
+ * is one global queue for tasks submitted from outside the pool.
+ *
+ *  - A task submitted by a worker goes to the bottom of that worker's
+ *    work_stealing_deque - no lock, and the most recently spawned (and so
+ *    cache-hot) task is the next one it runs.
+ *  - A task submitted from any other thread goes to the global queue,
+ *    behind a mutex. That's the rare path.
+ *  - An idle worker takes from its own deque, then the global queue, then
+ *    steals from the top of the other workers' deques, i.e. the oldest and
+ *    usually biggest pieces of work.
+ *  - A worker that finds nothing after a round of stealing sleeps on an
+ *    eventcount. A submitter's notify is a fence and a load unless some
+ *    worker has announced it is about to sleep.
+ *
+ * A thread waiting for tasks it spawned should call run_pending_task() in
+ * its wait loop instead of blocking, so a worker waiting on its own subtasks
+ * keeps the pool busy rather than deadlocking it.
+*/
+
+class pool_task
+{
+public:
+    virtual ~pool_task()
+    {}
+    virtual void run()=0;
+};
+
+template<typename Function>
+class pool_function_task: public pool_task
+{
+    Function f;
+public:
+    explicit pool_function_task(Function&& f_):
+        f(std::move(f_))
+    {}
+
+    void run()
+    {
+        f();
+    }
+};
+
+class thread_pool
+{
+    struct worker_queue:
+        cache_aligned_new
+    {
+        work_stealing_deque<pool_task*> tasks;
+    };
+
+    struct worker_identity
+    {
+        thread_pool* pool;
+        unsigned index;
+    };
+
+    static worker_identity& this_worker()
+    {
+        static thread_local worker_identity id={nullptr,0};
+        return id;
+    }
+
+    std::vector<std::unique_ptr<worker_queue> > queues;
+    std::vector<std::thread> threads;
+
+    std::mutex global_mutex;
+    std::deque<pool_task*> global_queue;
+    std::atomic<std::size_t> global_size;
+
+    eventcount idle;
+    std::atomic<bool> done;
+
+    bool pop_global(pool_task*& task)
+    {
+        // Skip the mutex when there is obviously nothing there
+        if(!global_size.load(std::memory_order_acquire))
+            return false;
+        std::lock_guard<std::mutex> lk(global_mutex);
+        if(global_queue.empty())
+            return false;
+        task=global_queue.front();
+        global_queue.pop_front();
+        global_size.fetch_sub(1,std::memory_order_relaxed);
+        return true;
+    }
+
+    bool steal(unsigned thief,pool_task*& task)
+    {
+        unsigned const n=static_cast<unsigned>(queues.size());
+        for(unsigned i=1;i<=n;++i)
+        {
+            unsigned const victim=(thief+i)%n;
+            if(victim!=thief && queues[victim]->tasks.steal(task))
+                return true;
+        }
+        return false;
+    }
+
+    bool find_task(pool_task*& task)
+    {
+        worker_identity const& me=this_worker();
+        if(me.pool==this)
+        {
+            if(queues[me.index]->tasks.pop_bottom(task))
+                return true;
+            return pop_global(task) || steal(me.index,task);
+        }
+        // Not a worker: a thief index past the end makes steal() try all
+        // n queues, where 0 would have skipped worker 0's
+        return pop_global(task) || steal(static_cast<unsigned>(queues.size()),task);
+    }
+
+    void worker_thread(unsigned index)
+    {
+        this_worker().pool=this;
+        this_worker().index=index;
+        while(!done.load(std::memory_order_acquire))
+        {
+            if(run_pending_task())
+                continue;
+            // Announce we're going to sleep, then look once more: a task
+            // submitted after this is seen either here or by commit_wait()
+            eventcount::key const k=idle.prepare_wait();
+            pool_task* task;
+            if(find_task(task))
+            {
+                idle.cancel_wait();
+                std::unique_ptr<pool_task> owned(task);
+                owned->run();
+                continue;
+            }
+            if(done.load(std::memory_order_seq_cst))
+            {
+                idle.cancel_wait();
+                break;
+            }
+            idle.commit_wait(k);
+        }
+    }
+
+public:
+    explicit thread_pool(unsigned thread_count=std::thread::hardware_concurrency()):
+        global_size(0),done(false)
+    {
+        if(!thread_count)
+            thread_count=2;
+        for(unsigned i=0;i<thread_count;++i)
+            queues.push_back(std::unique_ptr<worker_queue>(new worker_queue));
+        try
+        {
+            for(unsigned i=0;i<thread_count;++i)
+                threads.push_back(std::thread(&thread_pool::worker_thread,this,i));
+        }
+        catch(...)
+        {
+            shutdown();
+            throw;
+        }
+    }
+
+    ~thread_pool()
+    {
+        shutdown();
+    }
+
+    thread_pool(thread_pool const&)=delete;
+    thread_pool& operator=(thread_pool const&)=delete;
+
+    /**
+     * The pool the parallel algorithms use unless given another one.
+    */
+    static thread_pool& shared()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(threads.size());
+    }
+
+    /**
+     * Run f on the pool, fire and forget. f must not throw; wrap it (as
+     * submit() and task_group do) if it can.
+    */
+    template<typename Function>
+    void spawn(Function f)
+    {
+        // Owned here until a queue has taken it, since queueing allocates too
+        std::unique_ptr<pool_task> task(new pool_function_task<Function>(std::move(f)));
+        worker_identity const& me=this_worker();
+        if(me.pool==this)
+        {
+            queues[me.index]->tasks.push_bottom(task.get());
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            global_queue.push_back(task.get());
+            global_size.fetch_add(1,std::memory_order_release);
+        }
+        task.release();
+        idle.notify();
+    }
+
+    template<typename Function>
+    std::future<typename std::result_of<Function()>::type> submit(Function f)
+    {
+        typedef typename std::result_of<Function()>::type result_type;
+        std::shared_ptr<std::packaged_task<result_type()> > task=
+            std::make_shared<std::packaged_task<result_type()> >(std::move(f));
+        std::future<result_type> res(task->get_future());
+        spawn([task]{ (*task)(); });
+        return res;
+    }
+
+    /**
+     * Run one queued task on the calling thread, if there is one. For wait
+     * loops; returns false if there was nothing to do.
+    */
+    bool run_pending_task()
+    {
+        pool_task* task;
+        if(!find_task(task))
+            return false;
+        std::unique_ptr<pool_task> owned(task);
+        owned->run();
+        return true;
+    }
+
+private:
+    void shutdown()
+    {
+        done.store(true,std::memory_order_release);
+        idle.notify_all();
+        for(std::size_t i=0;i<threads.size();++i)
+        {
+            if(threads[i].joinable())
+                threads[i].join();
+        }
+        pool_task* task;
+        for(std::size_t i=0;i<queues.size();++i)
+        {
+            while(queues[i]->tasks.pop_bottom(task))
+                delete task;
+        }
+        for(std::size_t i=0;i<global_queue.size();++i)
+            delete global_queue[i];
+        global_queue.clear();
+    }
+};
+
+#endif
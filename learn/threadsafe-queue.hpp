@@ -0,0 +1,166 @@
+#ifndef THREADSAFE_QUEUE_HPP
+#define THREADSAFE_QUEUE_HPP
+
+#include <mutex>
+#include <queue>
+#include <memory>
+#include "sharded-counter.hpp"
+#include "eventcount.hpp"
+#include "cache-line.hpp"
+
+/**
+ * threadsafe_queue from chapter 6 (the version that stores std::shared_ptr<T>
+ * so the allocation happens outside the lock in push()), pulled into a header
+ * so other modules can use it.
+ *
+ * A queue can optionally report its depth into a sharded_gauge. The hook is a
+ * plain pointer: when it isn't set, push/pop pay one predictable branch; when
+ * it is, one uncontended update of this thread's own slot.
+ *
+ * The values are created with std::allocate_shared, so passing e.g.
+ * slab_allocator<T> moves the control block + T allocation off malloc.
+ *
+ * Waiting consumers sleep on an eventcount rather than a condition
+ * variable, and push() notifies after releasing the mutex: with no
+ * consumer waiting, push makes no syscall, and a woken consumer doesn't
+ * find the mutex still held by the producer that woke it.
+ *
+ * The mutex and the deque it guards share a line, since they are always
+ * used together. data_ready gets a line of its own: a consumer going to
+ * sleep writes it, and that shouldn't steal the mutex's line from the
+ * producer about to lock it.
+*/
+template<typename T,typename Allocator=std::allocator<T> >
+class threadsafe_queue:
+    public cache_aligned_new
+{
+private:
+    sharded_gauge* depth;
+    Allocator alloc;
+    alignas(cache_line_size) mutable std::mutex mut;
+    std::queue<std::shared_ptr<T> > data_queue;
+    alignas(cache_line_size) eventcount data_ready;
+
+    void popped()
+    {
+        if(depth)
+            depth->add(-1);
+    }
+public:
+    explicit threadsafe_queue(Allocator const& alloc_=Allocator()):
+        depth(nullptr),alloc(alloc_)
+    {
+        static_assert(on_separate_cache_lines(offsetof(threadsafe_queue,mut),
+                                              offsetof(threadsafe_queue,data_ready)-offsetof(threadsafe_queue,mut),
+                                              offsetof(threadsafe_queue,data_ready),sizeof(data_ready)),
+                      "threadsafe_queue: data_ready shares a cache line with the mutex");
+    }
+
+    threadsafe_queue(threadsafe_queue const&)=delete;
+    threadsafe_queue& operator=(threadsafe_queue const&)=delete;
+
+    /**
+     * Report the queue depth into g from now on. Call before the queue is
+     * shared between threads.
+    */
+    void set_depth_gauge(sharded_gauge& g)
+    {
+        depth=&g;
+    }
+
+    void wait_and_pop(T& value)
+    {
+        while(!try_pop(value))
+        {
+            eventcount::key const k=data_ready.prepare_wait();
+            if(try_pop(value))
+            {
+                data_ready.cancel_wait();
+                return;
+            }
+            data_ready.commit_wait(k);
+        }
+    }
+
+    /**
+     * wait_and_pop() that gives up, returning false, once a stop is
+     * requested on token.
+    */
+    bool wait_and_pop(T& value,stop_token const& token)
+    {
+        while(!try_pop(value))
+        {
+            eventcount::key const k=data_ready.prepare_wait();
+            if(try_pop(value))
+            {
+                data_ready.cancel_wait();
+                return true;
+            }
+            if(!data_ready.commit_wait(k,token))
+                return false;
+        }
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        std::unique_lock<std::mutex> lk(mut);
+        if(data_queue.empty())
+            return false;
+        value=std::move(*data_queue.front());
+        data_queue.pop();
+        lk.unlock();
+        popped();
+        return true;
+    }
+
+    std::shared_ptr<T> wait_and_pop()
+    {
+        for(;;)
+        {
+            if(std::shared_ptr<T> res=try_pop())
+                return res;
+            eventcount::key const k=data_ready.prepare_wait();
+            if(std::shared_ptr<T> res=try_pop())
+            {
+                data_ready.cancel_wait();
+                return res;
+            }
+            data_ready.commit_wait(k);
+        }
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        std::unique_lock<std::mutex> lk(mut);
+        if(data_queue.empty())
+            return std::shared_ptr<T>();
+        std::shared_ptr<T> res=data_queue.front();
+        data_queue.pop();
+        lk.unlock();
+        popped();
+        return res;
+    }
+
+    void push(T new_value)
+    {
+        std::shared_ptr<T> data(
+            std::allocate_shared<T>(alloc,std::move(new_value)));
+        // Count it before it becomes visible so depth never goes negative
+        if(depth)
+            depth->add(1);
+        {
+            std::lock_guard<std::mutex> lk(mut);
+            data_queue.push(data);
+        }
+        data_ready.notify();
+    }
+
+    bool empty() const
+    {
+        std::lock_guard<std::mutex> lk(mut);
+        return data_queue.empty();
+    }
+};
+
+#endif
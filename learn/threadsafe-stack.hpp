@@ -0,0 +1,90 @@
+#ifndef THREADSAFE_STACK_HPP
+#define THREADSAFE_STACK_HPP
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stack>
+#include "cache-line.hpp"
+
+/**
+ * threadsafe_stack from chapter 3, pulled into a header.
+ *
+ * m and data are only ever used together, under m, so splitting them onto
+ * two lines would just cost a second miss per operation. The false sharing
+ * is between stacks instead: a std::stack is 80 bytes and a mutex 40, so
+ * in an array of per-thread stacks each one's mutex shares a line with its
+ * neighbour's data. With cache_layout::padded (the default) the pair is a
+ * cache_padded and every stack starts on a line of its own and ends on a
+ * line boundary; cache_layout::packed is the listing's layout.
+*/
+
+struct empty_stack: std::exception
+{
+    char const* what() const throw()
+    {
+        return "empty stack";
+    }
+};
+
+template<typename T,cache_layout Layout=cache_layout::padded>
+class threadsafe_stack:
+    public cache_aligned_new
+{
+    struct state
+    {
+        mutable std::mutex m;
+        std::stack<T> data;
+    };
+
+    cache_slot<state,Layout> s;
+
+public:
+    threadsafe_stack()
+    {
+        static_assert(Layout==cache_layout::packed ||
+                      (sizeof(s)%cache_line_size==0 && alignof(threadsafe_stack)==cache_line_size),
+                      "threadsafe_stack: not padded to whole cache lines");
+    }
+
+    threadsafe_stack(threadsafe_stack const& other)
+    {
+        std::lock_guard<std::mutex> lock(other.s->m);
+        s->data=other.s->data;
+    }
+
+    threadsafe_stack& operator=(threadsafe_stack const&)=delete;
+
+    void push(T new_value)
+    {
+        std::lock_guard<std::mutex> lock(s->m);
+        s->data.push(std::move(new_value));
+    }
+
+    std::shared_ptr<T> pop()
+    {
+        std::lock_guard<std::mutex> lock(s->m);
+        if(s->data.empty())
+            throw empty_stack();
+        std::shared_ptr<T> const res(std::make_shared<T>(std::move(s->data.top())));
+        s->data.pop();
+        return res;
+    }
+
+    void pop(T& value)
+    {
+        std::lock_guard<std::mutex> lock(s->m);
+        if(s->data.empty())
+            throw empty_stack();
+        value=std::move(s->data.top());
+        s->data.pop();
+    }
+
+    bool empty() const
+    {
+        std::lock_guard<std::mutex> lock(s->m);
+        return s->data.empty();
+    }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <stack>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include "work-stealing-deque.hpp"
+
+/**
+ * Owner pushes and pops, thieves steal
+ * ====================================
+ *
+ * Checks that every item comes out exactly once, whether the owner or a
+ * thief got it, and compares the owner's cost per push+pop with the
+ * mutex-protected stack from chapter 3.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * threadsafe_stack from chapter 3 with the same interface as the deque
+*/
+template<typename T>
+class locked_stack
+{
+    std::stack<T> data;
+    std::mutex m;
+public:
+    void push_bottom(T x)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        data.push(x);
+    }
+    bool pop_bottom(T& x)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if(data.empty())
+            return false;
+        x=data.top();
+        data.pop();
+        return true;
+    }
+    bool steal(T& x)
+    {
+        return pop_bottom(x);
+    }
+};
+
+template<typename Deque>
+bool exactly_once(unsigned thieves,long items)
+{
+    Deque d;
+    std::vector<std::atomic<int> > seen(items);
+    for(long i=0;i<items;++i)
+        seen[i]=0;
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for(unsigned t=0;t<thieves;++t)
+    {
+        threads.push_back(std::thread([&]{
+            long x;
+            while(!done.load())
+            {
+                if(d.steal(x))
+                    ++seen[x];
+            }
+            while(d.steal(x))
+                ++seen[x];
+        }));
+    }
+    long x;
+    for(long i=0;i<items;++i)
+    {
+        d.push_bottom(i);
+        // Pop roughly every other item so the deque grows and shrinks
+        if(i%3==0 && d.pop_bottom(x))
+            ++seen[x];
+    }
+    while(d.pop_bottom(x))
+        ++seen[x];
+    done=true;
+    for(unsigned t=0;t<thieves;++t)
+        threads[t].join();
+    for(long i=0;i<items;++i)
+    {
+        if(seen[i]!=1)
+            return false;
+    }
+    return true;
+}
+
+template<typename Deque>
+double owner_ns_per_op(unsigned thieves,long ops)
+{
+    Deque d;
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for(unsigned t=0;t<thieves;++t)
+    {
+        threads.push_back(std::thread([&]{
+            long x;
+            while(!done.load(std::memory_order_relaxed))
+            {
+                // Occasional steals only
+                d.steal(x);
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }));
+    }
+    bench_clock::time_point const start=bench_clock::now();
+    long x;
+    for(long i=0;i<ops;++i)
+    {
+        d.push_bottom(i);
+        d.push_bottom(i);
+        d.pop_bottom(x);
+    }
+    while(d.pop_bottom(x));
+    double const ns=std::chrono::duration<double,std::nano>(bench_clock::now()-start).count();
+    done=true;
+    for(unsigned t=0;t<thieves;++t)
+        threads[t].join();
+    return ns/(3*ops);
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned const thieves=argc>1?std::atoi(argv[1]):3;
+    long const items=argc>2?std::atol(argv[2]):1000000;
+
+    std::cout << "every item taken exactly once: "
+              << (exactly_once<work_stealing_deque<long> >(thieves,items)?"ok":"FAILED") << std::endl;
+
+    std::cout << std::endl << "Owner cost with " << thieves << " occasional thieves (ns/op)" << std::endl;
+    std::cout << "  work_stealing_deque: " << owner_ns_per_op<work_stealing_deque<long> >(thieves,items) << std::endl;
+    std::cout << "  mutex stack:         " << owner_ns_per_op<locked_stack<long> >(thieves,items) << std::endl;
+    return 0;
+}
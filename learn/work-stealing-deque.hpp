@@ -0,0 +1,221 @@
+#ifndef WORK_STEALING_DEQUE_HPP
+#define WORK_STEALING_DEQUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include "reclamation.hpp"
+#include "cache-line.hpp"
+
+/**
+ * Chase-Lev work-stealing deque
+ * =============================
+ *
+ * threadsafe_stack<T> locks its mutex on every push and pop. In a
+ * work-stealing scheduler almost all traffic comes from one thread - the
+ * owner pushes and pops at the bottom - while other threads only
+ * occasionally steal from the top. Chase and Lev's deque makes the owner's
+ * side nearly free:
+ *
+ *  - push_bottom(): write the item, then publish it by bumping bottom.
+ *    No atomic read-modify-write at all.
+ *  - pop_bottom(): decrement bottom, then check top. Only when a single item
+ *    is left can the owner race a thief for it, and only then does it need
+ *    a compare_exchange on top.
+ *  - steal(): read top, read bottom, read the item, then claim it with a
+ *    compare_exchange on top. A failed CAS means another thread made
+ *    progress, so steal() is lock-free.
+ *
+ * The buffer is a circular array indexed by the ever-increasing top/bottom
+ * counters. When it fills up the owner copies the live range into one twice
+ * the size; when it drops below an eighth full it is shrunk again. A thief
+ * may still be reading the old array, so it is retired through
+ * epoch_reclaimer rather than deleted, and steal() runs inside an epoch
+ * guard.
+ *
+ * Memory orderings follow Le, Pop, Cohen and Zappa Nardelli, "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP'13), which proves
+ * this exact placement of fences correct for the C11 model, so it holds on
+ * ARM/POWER and not just x86.
+ *
+ * Items are copied in and out of std::atomic<T> slots, so T must be
+ * trivially copyable - typically a pointer to a task.
+*/
+template<typename T>
+class work_stealing_deque
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "work_stealing_deque<T> needs a trivially copyable T");
+
+    class circular_array
+    {
+        std::size_t const mask;
+        std::atomic<T>* const items;
+    public:
+        explicit circular_array(std::size_t capacity_):
+            mask(capacity_-1),items(new std::atomic<T>[capacity_])
+        {}
+
+        ~circular_array()
+        {
+            delete[] items;
+        }
+
+        circular_array(circular_array const&)=delete;
+        circular_array& operator=(circular_array const&)=delete;
+
+        std::size_t capacity() const
+        {
+            return mask+1;
+        }
+
+        T get(long i) const
+        {
+            return items[i&mask].load(std::memory_order_relaxed);
+        }
+
+        void put(long i,T x)
+        {
+            items[i&mask].store(x,std::memory_order_relaxed);
+        }
+
+        circular_array* resize(std::size_t new_capacity,long bottom,long top) const
+        {
+            circular_array* const a=new circular_array(new_capacity);
+            for(long i=top;i!=bottom;++i)
+                a->put(i,get(i));
+            return a;
+        }
+    };
+
+    // top is written by thieves, bottom only by the owner: keep them on
+    // separate cache lines so pushes don't invalidate the thieves' line.
+    alignas(cache_line_size) std::atomic<long> top;
+    alignas(cache_line_size) std::atomic<long> bottom;
+    std::atomic<circular_array*> array;
+    std::size_t const min_capacity;
+
+    void replace_array(circular_array* old_array,circular_array* new_array)
+    {
+        array.store(new_array,std::memory_order_release);
+        epoch_reclaimer::retire(old_array);
+    }
+
+public:
+    /**
+     * capacity is rounded up to a power of two.
+    */
+    explicit work_stealing_deque(std::size_t capacity=64):
+        top(0),bottom(0),min_capacity(round_up(capacity))
+    {
+        array.store(new circular_array(min_capacity),std::memory_order_relaxed);
+    }
+
+    ~work_stealing_deque()
+    {
+        delete array.load(std::memory_order_relaxed);
+    }
+
+    work_stealing_deque(work_stealing_deque const&)=delete;
+    work_stealing_deque& operator=(work_stealing_deque const&)=delete;
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t c=2;
+        while(c<n)
+            c<<=1;
+        return c;
+    }
+
+    /**
+     * Owner thread only.
+    */
+    void push_bottom(T x)
+    {
+        long const b=bottom.load(std::memory_order_relaxed);
+        long const t=top.load(std::memory_order_acquire);
+        circular_array* a=array.load(std::memory_order_relaxed);
+        if(b-t>static_cast<long>(a->capacity())-1)
+        {
+            circular_array* const bigger=a->resize(a->capacity()*2,b,t);
+            replace_array(a,bigger);
+            a=bigger;
+        }
+        a->put(b,x);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b+1,std::memory_order_relaxed);
+    }
+
+    /**
+     * Owner thread only. Returns false if the deque was empty
+     * (or a thief took the last item first).
+    */
+    bool pop_bottom(T& x)
+    {
+        long const b=bottom.load(std::memory_order_relaxed)-1;
+        circular_array* const a=array.load(std::memory_order_relaxed);
+        bottom.store(b,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t=top.load(std::memory_order_relaxed);
+        if(t>b)
+        {
+            // Empty: restore bottom
+            bottom.store(b+1,std::memory_order_relaxed);
+            return false;
+        }
+        x=a->get(b);
+        if(t==b)
+        {
+            // Last item: race the thieves for it
+            bool const won=top.compare_exchange_strong(t,t+1,std::memory_order_seq_cst,
+                                                       std::memory_order_relaxed);
+            bottom.store(b+1,std::memory_order_relaxed);
+            return won;
+        }
+        if(a->capacity()>min_capacity && static_cast<std::size_t>(b-t)<a->capacity()/8)
+            replace_array(a,a->resize(a->capacity()/2,b,t));
+        return true;
+    }
+
+    /**
+     * Any thread. Returns false only if the deque was seen empty;
+     * a lost race with another thief or the owner is retried.
+    */
+    bool steal(T& x)
+    {
+        epoch_reclaimer::guard g;
+        for(;;)
+        {
+            long t=top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long const b=bottom.load(std::memory_order_acquire);
+            if(t>=b)
+                return false;
+            circular_array* const a=g.protect(array);
+            T const item=a->get(t);
+            if(top.compare_exchange_strong(t,t+1,std::memory_order_seq_cst,
+                                           std::memory_order_relaxed))
+            {
+                x=item;
+                return true;
+            }
+        }
+    }
+
+    /**
+     * Approximate; exact only when called from the owner with no thieves.
+    */
+    bool empty() const
+    {
+        long const b=bottom.load(std::memory_order_relaxed);
+        long const t=top.load(std::memory_order_relaxed);
+        return b<=t;
+    }
+
+    std::size_t capacity() const
+    {
+        return array.load(std::memory_order_relaxed)->capacity();
+    }
+};
+
+#endif